@@ -44,12 +44,7 @@ public:
 
     void freeBit(int idx)
     {
-        BitmapTy bit = static_cast<BitmapTy>(1) << idx;
-        while (true) {
-            BitmapTy origin = bitmap.load();
-            if (bitmap.compare_exchange_weak(origin, origin | bit))
-                return;
-        }
+        bitmap.fetch_or(static_cast<BitmapTy>(1) << idx);
     }
     
     using BitmapTy = typename Bits2Type<NBits>::type;
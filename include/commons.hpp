@@ -14,6 +14,7 @@
 #include <cstring>
 #include <errno.h>
 #include <unistd.h>
+#include <immintrin.h>
 
 // C++ makes me happy
 #include <vector>
@@ -30,21 +31,27 @@
 
 #include "debug.hpp"
 
-#define MAX_NODES               32              /* Maximum of number of nodes in cluster */ 
+#define MAX_NODES               4096            /* Node IDs are below; peer tables are sized to the cluster */
 
 #define MAX_HOSTNAME_LEN        128             /* Maximum of host name length of all nodes */
 
 #define ADDR_RESOLVE_TIMEOUT    3000            /* rdma_resolve_addr timeout in ms */
 #define EC_POLL_TIMEOUT         10              /* rdma_event_channel poll timeout in ms */
+#define CONNECT_TIMEOUT         5000            /* Wait for a peer connection on first use in ms */
+#define CONNECT_RETRY_INTERVAL  1000            /* Min interval of connections to a failed peer in ms */
 #define MAX_REQS                16              /* rdma_accept initiator_depth */
 #define MAX_QP_DEPTH            2048            /* Maximum QPEs/CQEs in QPs/CQs */
 #define MAX_CQS                 2               /* Maximum of CQs held by a single node */
 #define CQ_SEND                 0               /* # of CQ for ibv_post_send's */
 #define CQ_RECV                 1               /* # of CQ for ibv_post_recv's */
 
-#define WRITE_LOG_SIZE          50000           /* Max size of write log when degraded */
 
 #define RDMA_BUF_SIZE           4096            /* RDMA send/recv memory buffer size */
+#define RDMA_MSG_SLOTS          16              /* Send/recv buffers per peer (messages in flight) */
+#define MAX_STAGING_SLOTS       4096            /* Max read/write staging buffers per peer */
+#define RDMA_ATOMIC_RESULTS     512             /* Max RDMA atomics in flight (result words) */
+#define RDMA_STATS_SAMPLING     8               /* One in this many RDMA operations is timed */
+#define MAX_STRIPE_UNIT         (1 << 20)       /* Max file block size (ECAL extent) in bytes */
 #define ALLOC_TABLE_MAGIC       0xAB71E514      /* Allocation table magic number */
 
 #define MAX_PATH_LEN            255             /* Max path length */ 
@@ -57,6 +64,51 @@
         : "+m"((addr))                      \
     )
 
+/* Write back the cache lines of [addr, addr + len) to memory, without waiting for them. */
+static inline void writeBackRange(const void *addr, size_t len)
+{
+    uintptr_t end = reinterpret_cast<uintptr_t>(addr) + len;
+    for (uintptr_t line = reinterpret_cast<uintptr_t>(addr) & ~63UL; line < end; line += 64) {
+#if defined(__CLWB__)
+        _mm_clwb(reinterpret_cast<void *>(line));
+#elif defined(__CLFLUSHOPT__)
+        _mm_clflushopt(reinterpret_cast<void *>(line));
+#else
+        _mm_clflush(reinterpret_cast<void *>(line));
+#endif
+    }
+}
+
+/* Write back the cache lines of [addr, addr + len) to memory (persistent on NVM), then fence. */
+static inline void persistRange(const void *addr, size_t len)
+{
+    writeBackRange(addr, len);
+    _mm_sfence();
+}
+
+/*
+ * Copy `len` bytes (a multiple of 64) with non-temporal stores, which do not pollute CPU caches
+ * with data that is not read back soon. Falls back to memcpy if `dst` is not 16-byte aligned.
+ * The copy is only ordered (and persistent, on NVM) after an _mm_sfence.
+ */
+static inline void streamCopy(void *dst, const void *src, size_t len)
+{
+    if (reinterpret_cast<uintptr_t>(dst) & 15) {
+        memcpy(dst, src, len);
+        return;
+    }
+    auto *d = reinterpret_cast<__m128i *>(dst);
+    auto *s = reinterpret_cast<const __m128i *>(src);
+    for (size_t i = 0; i < len / 16; i += 4) {
+        __m128i a = _mm_loadu_si128(s + i), b = _mm_loadu_si128(s + i + 1);
+        __m128i c = _mm_loadu_si128(s + i + 2), e = _mm_loadu_si128(s + i + 3);
+        _mm_stream_si128(d + i, a);
+        _mm_stream_si128(d + i + 1, b);
+        _mm_stream_si128(d + i + 2, c);
+        _mm_stream_si128(d + i + 3, e);
+    }
+}
+
 #define Likely(x)               __builtin_expect(!!(x), 1)
 #define Unlikely(x)             __builtin_expect(!!(x), 0)
 
@@ -31,6 +31,27 @@ struct CmdLineConfig
     int udpPort;                        /* ERPC management port */
     uint64_t pmemSize;                  /* Data pool size in blocks */
     bool recover;                       /* Indicate whether this is a recovery */
+    bool recoverFull;                   /* Rebuild all rows on recovery, not only dirty ones */
+    int rebuildThreads;                 /* Decoding threads of the rebuild on recovery */
+    int rebuildDepth;                   /* Chunks of rows in flight during the rebuild */
+    int rebuildBandwidth;               /* Rebuild budget in MB/s fetched (0: no limit) */
+    int qosP99Us;                       /* Foreground p99 latency that background I/O backs off at (0: off) */
+    int qosEpochMs;                     /* Interval of background rate adjustments */
+    bool lazyConnect;                   /* Connect to RDMA peers on first use only */
+    int readaheadWindow;                /* Max client readahead window in blocks (0: off) */
+    int stripeUnit;                     /* Block size of files created by clients, in bytes */
+    int scrubBandwidth;                 /* Parity scrubber budget in MB/s fetched (0: off) */
+    int scrubIops;                      /* Parity scrubber budget in fragment reads/s (0: no limit) */
+    int pollSpinUs;                     /* Spin budget of completion polling before blocking (<0: spin) */
+    int slabChunkMB;                    /* Chunk size of registered RDMA staging memory in MiB */
+    int stagingSlots;                   /* 4 KiB read (and write) staging buffers per peer */
+    bool stripeLocks;                   /* Lock stripes with RDMA atomics on ECAL writes */
+    bool durableWrites;                 /* ECAL writes return once persistent on all nodes */
+    bool dirtyMaps;                     /* Track rows written while their nodes are dead */
+    bool rdmaStats;                     /* Time one-sided RDMA operations per peer */
+    int rdmaStatsDumpSec;               /* Interval of RDMA stats dumps in seconds (0: off) */
+    int heartbeatUs;                    /* Interval of heartbeat reads of peers */
+    int heartbeatLeaseUs;               /* Peers missing heartbeats for this long are dead (0: off) */
 
     int _N;
     int _Size;
@@ -69,6 +90,8 @@ public:
     __always_inline int getClusterSize() const { return nodeCount; }
     __always_inline int getCMId() const { return cmId; }
     __always_inline NodeConfig operator[](int index) const { return nodeConf[index]; }
+    /* Node IDs are in [0, getNodeIdBound()), for tables indexed by node ID */
+    __always_inline int getNodeIdBound() const { return idIndex.size(); }
     NodeConfig findConfById(int id) const;
     NodeConfig findConfByHostname(const std::string &hostname) const;
     NodeConfig findConfByIPStr(const std::string &ipAddrStr) const;
@@ -76,7 +99,8 @@ public:
     __always_inline std::set<int> getNodeIdSet() const { return nodeIds; }
 
 private:
-    NodeConfig nodeConf[MAX_NODES];
+    std::vector<NodeConfig> nodeConf;                   /* In order of the config file */
+    std::vector<int> idIndex;                           /* Node ID to index in nodeConf, or -1 */
     std::set<int> nodeIds;
     std::unordered_map<std::string, int> ip2id;         /* IP address string to nodeId */
     std::unordered_map<std::string, int> host2id;       /* Hostname to nodeId */
@@ -11,6 +11,7 @@
 #include "commons.hpp"
 #include "config.hpp"
 #include "debug.hpp"
+#include "dirtymap.hpp"
 
 /* Wraps a byte array into a block. */
 template <int BlkSize>
@@ -29,6 +30,11 @@ using Block4K = DataBlock<4096>;
 /**
  * Manages a memory area as a block pool.
  * Does not manage any metadata since that is MDS's job.
+ *
+ * If `tagSize` is non-zero, the tail of the area holds a compact array of per-block tags
+ * (e.g. checksums), so that the layout is [block 0 .. block n-1][tag 0 .. tag n-1].
+ * With `lockWords`, it is followed by an 8-byte aligned array of per-block 64-bit words,
+ * e.g. targets of RDMA atomics, and then by `dirtyMaps` DirtyMaps of all blocks.
  */
 template <typename Ty>
 class BlockPool
@@ -36,7 +42,7 @@ class BlockPool
 public:
     static const size_t valueSize = sizeof(Ty);
 
-    explicit BlockPool()
+    explicit BlockPool(size_t tagSize = 0, bool lockWords = false, int dirtyMaps = 0) : tagSize(tagSize)
     {
         if (memConf == nullptr) {
             d_err("memConf should have been initialized!");
@@ -45,7 +51,20 @@ public:
 
         area = reinterpret_cast<uint8_t *>(memConf->getMemory());
         uint64_t areaSize = memConf->getCapacity();
-        length = areaSize / valueSize;
+        size_t itemSize = valueSize + tagSize + (lockWords ? sizeof(uint64_t) : 0);
+        uint64_t reserved = (lockWords || dirtyMaps) ? sizeof(uint64_t) : 0;        /* Alignment */
+        reserved += dirtyMaps * DirtyMap::mapWords(areaSize / itemSize) * sizeof(uint64_t);
+        length = (areaSize - reserved) / itemSize;
+        tags = area + length * valueSize;
+
+        uint64_t tailAddr = (uint64_t)(tags + length * tagSize);
+        auto *tail = reinterpret_cast<uint64_t *>((tailAddr + sizeof(uint64_t) - 1) & ~(sizeof(uint64_t) - 1));
+        if (lockWords) {
+            locks = tail;
+            tail += length;
+        }
+        if (dirtyMaps)
+            maps = tail;
     }
     ~BlockPool() = default;
 
@@ -61,11 +80,39 @@ public:
         return (uint64_t)at(index) - (uint64_t)area;
     }
 
+    /* Returns the pointer to the tag of the item with the designated index. */
+    __always_inline uint8_t *tagAt(uint64_t index) const { return tags + index * tagSize; }
+
+    /* Returns the tag shift related to the beginning of the area */
+    __always_inline uint64_t getTagShift(uint64_t index) const
+    {
+        return (uint64_t)tagAt(index) - (uint64_t)area;
+    }
+
+    /* Returns the lock word of the item with the designated index (needs `lockWords`). */
+    __always_inline uint64_t *lockAt(uint64_t index) const { return locks + index; }
+
+    /* Returns the lock word shift related to the beginning of the area */
+    __always_inline uint64_t getLockShift(uint64_t index) const
+    {
+        return (uint64_t)lockAt(index) - (uint64_t)area;
+    }
+
+    /* Returns the words of the dirty maps (needs `dirtyMaps`). */
+    __always_inline uint64_t *dirtyMapArea() const { return maps; }
+
+    /* Returns the shift of a word of the dirty maps related to the beginning of the area */
+    __always_inline uint64_t getShift(const uint64_t *word) const { return (uint64_t)word - (uint64_t)area; }
+
     /* Returns the capacity of the allocation table */
     __always_inline uint64_t getCapacity() const { return length; }
 
 private:
     uint8_t *area = nullptr;          /* Base pointer */
+    uint8_t *tags = nullptr;          /* Tag array, after the last block */
+    uint64_t *locks = nullptr;        /* Lock word array, after the last tag */
+    uint64_t *maps = nullptr;         /* Dirty maps, after the last lock word */
+    size_t tagSize = 0;               /* Bytes per tag */
     uint64_t length = 0;              /* # of usable blocks */
 };
 
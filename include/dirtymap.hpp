@@ -0,0 +1,113 @@
+/******************************************************************
+ * This file is part of Galois.                                   *
+ *                                                                *
+ * Galois: Highly-available NVM Distributed File System           *
+ * Copyright (c) 2020 Storage Research Group, Tsinghua University *
+ ******************************************************************/
+
+#if !defined(DIRTYMAP_HPP)
+#define DIRTYMAP_HPP
+
+#include "commons.hpp"
+
+/**
+ * Persistent bitmaps of dirty rows, one per stripe node: bit `row` of map `node` is set when
+ * this node wrote the row while `node` was dead, so that `node` only has to rebuild those rows.
+ *
+ * A map is made of summary words (a bit per leaf word) followed by leaf words (a bit per row),
+ * in the NVM pool: it survives restarts of this node, and peers fetch it with RDMA reads,
+ * reading only the leaf words under set summary bits. Marking a clean row costs two atomic
+ * ORs and their cache line write-backs, and a fence (persist) before the write goes out.
+ *
+ * Marks and tidy() must be serialized. Leaf words may be cleared concurrently by peers that
+ * rebuild their rows, and set again if that fails, leaf bits first. Summary bits are only
+ * cleared by tidy(), which restores those whose leaves were set again meanwhile, so that a set
+ * leaf bit always has its summary bit set.
+ */
+class DirtyMap
+{
+public:
+    static inline uint64_t leafWords(uint64_t rows) { return (rows + 63) / 64; }
+    static inline uint64_t summaryWords(uint64_t rows) { return (leafWords(rows) + 63) / 64; }
+    static inline uint64_t mapWords(uint64_t rows) { return summaryWords(rows) + leafWords(rows); }
+
+    DirtyMap(uint64_t *words, uint64_t rows, int nMaps) : words(words), rows(rows), nMaps(nMaps) { }
+    DirtyMap(const DirtyMap &) = delete;
+    DirtyMap &operator=(const DirtyMap &) = delete;
+
+    /* Mark a row dirty in the map of `node`. Not persistent until persist(). False if already dirty. */
+    __always_inline bool mark(int node, uint64_t row)
+    {
+        uint64_t *leaf = leafOf(node) + row / 64, bit = 1ULL << row % 64;
+        if (__atomic_load_n(leaf, __ATOMIC_RELAXED) & bit)
+            return false;
+        uint64_t *summary = summaryOf(node) + row / 4096, summaryBit = 1ULL << row / 64 % 64;
+        if (!(__atomic_load_n(summary, __ATOMIC_RELAXED) & summaryBit)) {
+            __atomic_fetch_or(summary, summaryBit, __ATOMIC_RELAXED);
+            writeBackRange(summary, sizeof(uint64_t));
+        }
+        __atomic_fetch_or(leaf, bit, __ATOMIC_RELAXED);
+        writeBackRange(leaf, sizeof(uint64_t));
+        ++marked;
+        return true;
+    }
+
+    /* Make the marks so far persistent */
+    static inline void persist() { _mm_sfence(); }
+
+    /* Clear summary bits of leaf words that peers have cleared since. Returns dirty rows left. */
+    uint64_t tidy(int node)
+    {
+        uint64_t *summary = summaryOf(node), *leaf = leafOf(node), dirty = 0;
+        for (uint64_t s = 0; s < summaryWords(rows); ++s) {
+            uint64_t bits = summary[s], clean = 0;
+            for (; bits; bits &= bits - 1) {
+                uint64_t w = s * 64 + __builtin_ctzll(bits);
+                uint64_t n = __builtin_popcountll(__atomic_load_n(leaf + w, __ATOMIC_RELAXED));
+                dirty += n;
+                if (!n)
+                    clean |= bits & -bits;
+            }
+            if (clean) {
+                __atomic_fetch_and(summary + s, ~clean, __ATOMIC_SEQ_CST);
+                uint64_t marked = 0;
+                for (uint64_t bits = clean; bits; bits &= bits - 1)
+                    if (__atomic_load_n(leaf + s * 64 + __builtin_ctzll(bits), __ATOMIC_SEQ_CST))
+                        marked |= bits & -bits;
+                if (marked)
+                    __atomic_fetch_or(summary + s, marked, __ATOMIC_RELAXED);
+                writeBackRange(summary + s, sizeof(uint64_t));
+            }
+        }
+        persist();
+        return dirty;
+    }
+
+    /* Number of dirty rows in the map of `node` */
+    uint64_t count(int node) const
+    {
+        const uint64_t *summary = summaryOf(node), *leaf = leafOf(node);
+        uint64_t dirty = 0;
+        for (uint64_t s = 0; s < summaryWords(rows); ++s)
+            for (uint64_t bits = summary[s]; bits; bits &= bits - 1)
+                dirty += __builtin_popcountll(leaf[s * 64 + __builtin_ctzll(bits)]);
+        return dirty;
+    }
+
+    /* Words of the map of `node`, e.g. to locate it in the pool of a peer */
+    inline uint64_t *mapOf(int node) const { return words + node * mapWords(rows); }
+    inline uint64_t getRows() const { return rows; }
+    inline int getMaps() const { return nMaps; }
+    inline uint64_t getMarked() const { return marked; }
+
+private:
+    inline uint64_t *summaryOf(int node) const { return mapOf(node); }
+    inline uint64_t *leafOf(int node) const { return mapOf(node) + summaryWords(rows); }
+
+    uint64_t *words;
+    uint64_t rows;
+    int nMaps;
+    uint64_t marked = 0;                        /* Rows newly marked since startup */
+};
+
+#endif // DIRTYMAP_HPP
@@ -0,0 +1,39 @@
+#if !defined(CHECKSUM_HPP)
+#define CHECKSUM_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <isa-l.h>
+
+/**
+ * CRC32C (iSCSI polynomial) of a fragment, as stored next to it in the block pool.
+ *
+ * The CRC is seeded with 0 and not inverted, so that a never-written (zeroed) fragment
+ * matches its never-written (zeroed) checksum.
+ */
+inline uint32_t fragmentChecksum(const uint8_t *frag, size_t len)
+{
+    return crc32_iscsi(const_cast<uint8_t *>(frag), static_cast<int>(len), 0);
+}
+
+/**
+ * @brief Encode parities of a stripe and checksum all its fragments in the same pass.
+ *
+ * Each fragment is checksummed right after it was read (data) or written (parity) by the
+ * encoder, while it is still cache-resident.
+ *
+ * @param srcData       An (K * Len) 2d-array containing original data.
+ * @param outputData    An (P * Len) 2d-array allocated space.
+ * @param checksums     An 1d-array of K + P entries to fill, data fragments first.
+ */
+template <typename Code, unsigned K, unsigned P, unsigned Len>
+inline void encodeChecksummed(uint8_t **srcData, uint8_t **outputData, uint32_t *checksums)
+{
+    Code::encode(srcData, outputData);
+    for (unsigned i = 0; i < K; ++i)
+        checksums[i] = fragmentChecksum(srcData[i], Len);
+    for (unsigned i = 0; i < P; ++i)
+        checksums[K + i] = fragmentChecksum(outputData[i], Len);
+}
+
+#endif // CHECKSUM_HPP
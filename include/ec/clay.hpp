@@ -2,11 +2,369 @@
 #define CLAY_HPP
 
 #include "ec.hpp"
+#include <cstring>
+#include <vector>
 #include <isa-l.h>
 
+constexpr unsigned clayPow(unsigned base, unsigned exp)
+{
+    return exp ? base * clayPow(base, exp - 1) : 1;
+}
+
+/**
+ * Clay (coupled-layer) code with d = N - 1 helpers [Vajha et al., FAST '18].
+ *
+ * Nodes are laid out on a Q x T grid (Q = P), padded with NU all-zero virtual data nodes when
+ * Q does not divide N. Each fragment is split into Alpha = Q^T sub-chunks (layers). Node (x, y)
+ * in layer z is paired with node (z_y, y) in layer z' = z with z_y replaced by x; the uncoupled
+ * symbols U of a layer form a systematic [NT, KT] Cauchy RS codeword, and
+ *     U_A = C_A + gamma * C_B,   U_B = gamma * C_A + C_B
+ * couple the stored symbols C of a pair. An unpaired node (z_y = x) has U = C.
+ *
+ * Repairing one fragment reads only Alpha / Q sub-chunks from each of the N - 1 helpers, i.e.
+ * (N - 1) / P fragments in total instead of K for RS.
+ */
 template <unsigned K, unsigned P, unsigned Len>
 class ClayCode : public ErasureCodingBase
 {
+public:
+    static const unsigned N = K + P;
+    static const unsigned Q = P;                        /* d - k + 1 */
+    static const unsigned T = (N + Q - 1) / Q;
+    static const unsigned NT = Q * T;                   /* Nodes including virtual ones */
+    static const unsigned NU = NT - N;                  /* Virtual (all-zero) data nodes */
+    static const unsigned KT = K + NU;
+    static const unsigned Alpha = clayPow(Q, T);        /* Sub-packetization */
+    static const unsigned SubLen = Len / Alpha;
+    static const unsigned RepairSubChunks = Alpha / Q;  /* Sub-chunks read from each helper */
+
+    static_assert(P >= 1 && Len % Alpha == 0, "Len must be a multiple of the sub-packetization");
+
+    /**
+     * @brief Encode parity block from original data.
+     *
+     * @param srcData       An (K * Len) 2d-array containing original data.
+     * @param outputData    An (P * Len) 2d-array allocated space.
+     */
+    static void encode(uint8_t **srcData, uint8_t **outputData)
+    {
+        auto *inst = instance();
+        uint8_t *C[NT];
+        for (unsigned i = 0; i < K; ++i)
+            C[i] = srcData[i];
+        for (unsigned i = K; i < KT; ++i)
+            C[i] = inst->zero;
+        for (unsigned i = 0; i < P; ++i)
+            C[KT + i] = outputData[i];
+        inst->decodeLayers(inst->parityNodes, inst->gfTables, C);
+    }
+
+    /**
+     * @brief Decode original data from provided data blocks.
+     *
+     * @param srcId         An 1d-array containing IDs of K fetched data blocks.
+     * @param data          An ((K + P) * Len) 2d-array, whose lines with IDs in `srcId` are
+     *                      filled with fetched data blocks.
+     * @return              Fills all empty lines (ID not in `srcId`) of data. False if `srcId`
+     *                      are not K distinct IDs.
+     */
+    static bool decode(int *srcId, uint8_t **data)
+    {
+        if (!validSources<K, N>(srcId))
+            return false;
+        auto *inst = instance();
+        bool live[N] = { false };
+        for (unsigned i = 0; i < K; ++i)
+            live[srcId[i]] = true;
+
+        int erased[Q], errs = 0;
+        uint8_t *C[NT];
+        for (unsigned i = 0; i < N; ++i) {
+            C[internalId(i)] = data[i];
+            if (!live[i])
+                erased[errs++] = internalId(i);
+        }
+        for (unsigned i = K; i < KT; ++i)
+            C[i] = inst->zero;
+
+        uint8_t gfTbls[KT * Q * 32];
+        if (!inst->buildDecodeTables(erased, gfTbls))
+            return false;
+        inst->decodeLayers(erased, gfTbls, C);
+        return true;
+    }
+
+    /**
+     * @brief Pick K fetchable blocks to decode from; any K blocks will do (MDS).
+     *
+     * @param alive         An 1d-array of N liveness flags.
+     * @param srcId         An 1d-array of K entries to fill.
+     * @return              False if less than K blocks are alive.
+     */
+    static bool selectSources(const bool *alive, int *srcId)
+    {
+        unsigned cnt = 0;
+        for (unsigned i = 0; i < N && cnt < K; ++i)
+            if (alive[i])
+                srcId[cnt++] = i;
+        return cnt == K;
+    }
+
+    /**
+     * @brief Get the layers (sub-chunk indexes) helpers must send to repair a fragment.
+     *
+     * @param lostId        ID of the lost fragment.
+     * @param layers        An 1d-array of RepairSubChunks entries, filled in ascending order.
+     */
+    static void repairLayers(int lostId, int *layers)
+    {
+        unsigned f = internalId(lostId);
+        unsigned x0 = f % Q, y0 = f / Q;
+        for (unsigned z = 0, p = 0; z < Alpha; ++z)
+            if (digit(z, y0) == x0)
+                layers[p++] = z;
+    }
+
+    /**
+     * @brief Repair a single lost fragment from all other fragments.
+     *
+     * @param lostId        ID of the lost fragment.
+     * @param helperData    An (N * (RepairSubChunks * SubLen)) 2d-array; line i (i != lostId)
+     *                      holds sub-chunks `repairLayers(lostId)` of fragment i, in order.
+     * @param output        Len bytes of space for the repaired fragment.
+     */
+    static void repair(int lostId, uint8_t **helperData, uint8_t *output)
+    {
+        auto *inst = instance();
+        unsigned f = internalId(lostId);
+        unsigned x0 = f % Q, y0 = f / Q;
+
+        int layers[RepairSubChunks];
+        int pos[Alpha];
+        repairLayers(lostId, layers);
+        for (unsigned p = 0; p < RepairSubChunks; ++p)
+            pos[layers[p]] = p;
+
+        uint8_t *H[NT];
+        for (unsigned i = 0; i < N; ++i)
+            H[internalId(i)] = helperData[i];
+        for (unsigned i = K; i < KT; ++i)
+            H[i] = inst->zero;
+
+        /* The column of the lost node is erased in every repair layer */
+        int erased[Q];
+        for (unsigned x = 0; x < Q; ++x)
+            erased[x] = y0 * Q + x;
+        uint8_t gfTbls[KT * Q * 32];
+        inst->buildDecodeTables(erased, gfTbls);
+
+        uint8_t *tmp = scratch(KT * SubLen + Q * SubLen);
+        uint8_t *ucol = tmp + KT * SubLen;
+        for (unsigned p = 0; p < RepairSubChunks; ++p) {
+            unsigned z = layers[p];
+            uint8_t *src[KT], *out[Q];
+            for (unsigned a = 0, i = 0; a < NT; ++a) {
+                unsigned x = a % Q, y = a / Q;
+                if (y == y0)
+                    continue;
+                uint8_t *cA = H[a] + p * SubLen;
+                unsigned zy = digit(z, y);
+                if (zy == x)
+                    src[i] = cA;
+                else {
+                    unsigned b = y * Q + zy;
+                    unsigned z2 = companionLayer(z, y, x);
+                    src[i] = tmp + i * SubLen;
+                    inst->combine(inst->tblUncouple, cA, H[b] + pos[z2] * SubLen, src[i]);
+                }
+                ++i;
+            }
+            for (unsigned x = 0; x < Q; ++x)
+                out[x] = ucol + x * SubLen;
+            ec_encode_data(SubLen, KT, Q, gfTbls, src, out);
+
+            /* The lost node is unpaired in z, and paired with its column in the other layers */
+            memcpy(output + z * SubLen, ucol + x0 * SubLen, SubLen);
+            for (unsigned x = 0; x < Q; ++x) {
+                if (x == x0)
+                    continue;
+                unsigned z2 = companionLayer(z, y0, x);
+                inst->combine(inst->tblRepair, ucol + x * SubLen, H[y0 * Q + x] + p * SubLen,
+                              output + z2 * SubLen);
+            }
+        }
+    }
+
+    static std::string desc()
+    {
+        using std::to_string;
+        return "Clay(" + to_string(K) + ", " + to_string(P) + "), Len = " + to_string(Len) +
+               ", alpha = " + to_string(Alpha);
+    }
+
+private:
+    static const uint8_t Gamma = 2;
+
+    explicit ClayCode()
+    {
+        gf_gen_cauchy1_matrix(encodeMatrix, NT, KT);
+        ec_init_tables(KT, Q, &encodeMatrix[KT * KT], gfTables);
+        for (unsigned i = 0; i < Q; ++i)
+            parityNodes[i] = KT + i;
+        memset(zero, 0, Len);
+
+        uint8_t gamma2 = gf_mul(Gamma, Gamma);
+        uint8_t inv = gf_inv(1 ^ gamma2);
+        uint8_t invGamma = gf_inv(Gamma);
+        uint8_t uncouple[2] = { 1, Gamma };                     /* U_A = C_A + g C_B */
+        uint8_t uncoupleErased[2] = { (uint8_t)(1 ^ gamma2), Gamma };   /* U_A = (1 + g^2) C_A + g U_B */
+        uint8_t couple[2] = { inv, gf_mul(inv, Gamma) };        /* C_A = (U_A + g U_B) / (1 + g^2) */
+        uint8_t repair[2] = { invGamma, invGamma };             /* C_B = (U_A + C_A) / g */
+        ec_init_tables(2, 1, uncouple, tblUncouple);
+        ec_init_tables(2, 1, uncoupleErased, tblUncoupleErased);
+        ec_init_tables(2, 1, couple, tblCouple);
+        ec_init_tables(2, 1, repair, tblRepair);
+    }
+    ~ClayCode() { }
+
+    static inline ClayCode<K, P, Len> *instance()
+    {
+        static auto *inst = new ClayCode<K, P, Len>;
+        return inst;
+    }
+
+    static inline unsigned internalId(unsigned id) { return id < K ? id : id + NU; }
+    static inline unsigned digit(unsigned z, unsigned y) { return z / clayPow(Q, y) % Q; }
+    static inline unsigned companionLayer(unsigned z, unsigned y, unsigned x)
+    {
+        return z - digit(z, y) * clayPow(Q, y) + x * clayPow(Q, y);
+    }
+
+    /* Per-thread scratch space */
+    static uint8_t *scratch(size_t size)
+    {
+        static thread_local std::vector<uint8_t> buf;
+        if (buf.size() < size)
+            buf.resize(size);
+        return buf.data();
+    }
+
+    /* dst = c0 * a + c1 * b, with tables of [c0, c1] */
+    inline void combine(uint8_t *tbl, uint8_t *a, uint8_t *b, uint8_t *dst)
+    {
+        uint8_t *src[2] = { a, b };
+        ec_encode_data(SubLen, 2, 1, tbl, src, &dst);
+    }
+
+    /* Tables recovering the Q `erased` nodes of a layer from the other KT (ascending), if invertible */
+    bool buildDecodeTables(const int *erased, uint8_t *gfTbls)
+    {
+        bool isErased[NT] = { false };
+        for (unsigned i = 0; i < Q; ++i)
+            isErased[erased[i]] = true;
+
+        uint8_t b[KT * KT], invertMatrix[KT * KT], decodeMatrix[Q * KT];
+        for (unsigned a = 0, i = 0; a < NT; ++a)
+            if (!isErased[a])
+                memcpy(&b[KT * i++], &encodeMatrix[KT * a], KT);
+        if (gf_invert_matrix(b, invertMatrix, KT) != 0)
+            return false;
+
+        for (unsigned r = 0; r < Q; ++r) {
+            unsigned e = erased[r];
+            if (e < KT)
+                memcpy(&decodeMatrix[KT * r], &invertMatrix[KT * e], KT);
+            else
+                for (unsigned j = 0; j < KT; ++j) {
+                    uint8_t s = 0;
+                    for (unsigned l = 0; l < KT; ++l)
+                        s ^= gf_mul(invertMatrix[l * KT + j], encodeMatrix[KT * e + l]);
+                    decodeMatrix[KT * r + j] = s;
+                }
+        }
+        ec_init_tables(KT, Q, decodeMatrix, gfTbls);
+        return true;
+    }
+
+    /**
+     * Recover C of the Q `erased` nodes.
+     * Layers are processed in ascending number of erased unpaired nodes, so that the
+     * uncoupled symbol of an erased companion is always decoded before it is needed.
+     */
+    void decodeLayers(const int *erased, uint8_t *gfTbls, uint8_t **C)
+    {
+        bool isErased[NT] = { false };
+        int eIdx[NT];
+        for (unsigned i = 0; i < Q; ++i) {
+            isErased[erased[i]] = true;
+            eIdx[erased[i]] = i;
+        }
+
+        std::vector<unsigned> order;
+        order.reserve(Alpha);
+        for (unsigned score = 0; score <= Q; ++score)
+            for (unsigned z = 0; z < Alpha; ++z) {
+                unsigned s = 0;
+                for (unsigned i = 0; i < Q; ++i)
+                    s += (digit(z, erased[i] / Q) == erased[i] % Q);
+                if (s == score)
+                    order.push_back(z);
+            }
+
+        uint8_t *U = scratch(Q * Len + KT * SubLen);
+        uint8_t *tmp = U + Q * Len;
+        for (unsigned z : order) {
+            uint8_t *src[KT], *out[Q];
+            for (unsigned a = 0, i = 0; a < NT; ++a) {
+                if (isErased[a])
+                    continue;
+                unsigned x = a % Q, y = a / Q, zy = digit(z, y);
+                uint8_t *cA = C[a] + z * SubLen;
+                if (zy == x)
+                    src[i] = cA;
+                else {
+                    unsigned b = y * Q + zy;
+                    unsigned z2 = companionLayer(z, y, x);
+                    src[i] = tmp + i * SubLen;
+                    if (!isErased[b])
+                        combine(tblUncouple, cA, C[b] + z2 * SubLen, src[i]);
+                    else
+                        combine(tblUncoupleErased, cA, U + eIdx[b] * Len + z2 * SubLen, src[i]);
+                }
+                ++i;
+            }
+            for (unsigned r = 0; r < Q; ++r)
+                out[r] = U + r * Len + z * SubLen;
+            ec_encode_data(SubLen, KT, Q, gfTbls, src, out);
+        }
+
+        for (unsigned r = 0; r < Q; ++r) {
+            unsigned a = erased[r], x = a % Q, y = a / Q;
+            for (unsigned z = 0; z < Alpha; ++z) {
+                uint8_t *cA = C[a] + z * SubLen, *uA = U + r * Len + z * SubLen;
+                unsigned zy = digit(z, y);
+                if (zy == x) {
+                    memcpy(cA, uA, SubLen);
+                    continue;
+                }
+                unsigned b = y * Q + zy;
+                unsigned z2 = companionLayer(z, y, x);
+                if (!isErased[b])
+                    combine(tblUncouple, uA, C[b] + z2 * SubLen, cA);
+                else
+                    combine(tblCouple, uA, U + eIdx[b] * Len + z2 * SubLen, cA);
+            }
+        }
+    }
+
+    uint8_t encodeMatrix[NT * KT];
+    uint8_t gfTables[KT * Q * 32];
+    int parityNodes[Q];
+    uint8_t zero[Len];
+    uint8_t tblUncouple[2 * 32];
+    uint8_t tblUncoupleErased[2 * 32];
+    uint8_t tblCouple[2 * 32];
+    uint8_t tblRepair[2 * 32];
 };
 
 #endif // CLAY_HPP
@@ -0,0 +1,121 @@
+#if !defined(DECODE_CACHE_HPP)
+#define DECODE_CACHE_HPP
+
+#include <atomic>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
+#include <unordered_map>
+#include <isa-l.h>
+
+/**
+ * Concurrent cache of decode tables of a linear (K, N) code with a systematic N x K generator
+ * matrix, keyed by the bitmask of the K fragments decoded from.
+ *
+ * There are at most C(N, K) entries, which are never evicted nor modified once inserted, so
+ * lookups only take a shared lock and returned entries stay valid.
+ */
+template <unsigned K, unsigned N>
+class DecodeTableCache
+{
+public:
+    struct Entry
+    {
+        bool valid;                             /* False if the sources are dependent */
+        int srcId[K];                           /* Sources in ascending order */
+        int errs;                               /* Number of fragments not in sources */
+        int dataErrs;                           /* ... of which data ones, listed first */
+        int errIndex[N - K];
+        uint8_t gfTbls[K * (N - K) * 32];       /* Row `i` recovers `errIndex[i]` */
+    };
+
+    /* Must be called before the first lookup */
+    inline void setGenMatrix(const uint8_t *genMatrix) { memcpy(this->genMatrix, genMatrix, N * K); }
+
+    static uint64_t maskOf(const int *srcId)
+    {
+        uint64_t mask = 0;
+        for (unsigned i = 0; i < K; ++i)
+            mask |= 1ull << srcId[i];
+        return mask;
+    }
+
+    /**
+     * @brief Get tables decoding from the fragments in `srcMask`.
+     *
+     * @param scratch       Built in place (and returned) if the cache is disabled.
+     */
+    Entry *get(uint64_t srcMask, Entry &scratch)
+    {
+        if (!enabled) {
+            build(srcMask, scratch);
+            return &scratch;
+        }
+        {
+            std::shared_lock<std::shared_timed_mutex> lock(mutex);
+            auto it = entries.find(srcMask);
+            if (it != entries.end()) {
+                ++hits;
+                return it->second.get();
+            }
+        }
+
+        ++misses;
+        std::unique_ptr<Entry> entry(new Entry);
+        build(srcMask, *entry);
+        std::unique_lock<std::shared_timed_mutex> lock(mutex);
+        return entries.emplace(srcMask, std::move(entry)).first->second.get();
+    }
+
+    inline void setEnabled(bool enabled) { this->enabled = enabled; }
+    inline uint64_t getHits() const { return hits; }
+    inline uint64_t getMisses() const { return misses; }
+
+private:
+    void build(uint64_t srcMask, Entry &entry)
+    {
+        uint8_t b[K * K], invertMatrix[K * K], decodeMatrix[(N - K) * K];
+        int cnt = 0;
+
+        entry.errs = entry.dataErrs = 0;
+        for (unsigned i = 0; i < N; ++i) {
+            if (srcMask >> i & 1) {
+                memcpy(&b[K * cnt], &genMatrix[K * i], K);
+                entry.srcId[cnt++] = i;
+            }
+            else {
+                entry.errIndex[entry.errs++] = i;
+                entry.dataErrs += (i < K);
+            }
+        }
+        entry.valid = (gf_invert_matrix(b, invertMatrix, K) == 0);
+        if (!entry.valid)
+            return;
+
+        /* Parity rows are re-encoded from the recovered data */
+        for (int r = 0; r < entry.errs; ++r) {
+            unsigned e = entry.errIndex[r];
+            if (e < K) {
+                memcpy(&decodeMatrix[K * r], &invertMatrix[K * e], K);
+                continue;
+            }
+            for (unsigned j = 0; j < K; ++j) {
+                uint8_t s = 0;
+                for (unsigned l = 0; l < K; ++l)
+                    s ^= gf_mul(invertMatrix[K * l + j], genMatrix[K * e + l]);
+                decodeMatrix[K * r + j] = s;
+            }
+        }
+        ec_init_tables(K, entry.errs, decodeMatrix, entry.gfTbls);
+    }
+
+    uint8_t genMatrix[N * K];
+    std::unordered_map<uint64_t, std::unique_ptr<Entry>> entries;
+    std::shared_timed_mutex mutex;
+    bool enabled = true;
+    std::atomic<uint64_t> hits { 0 };
+    std::atomic<uint64_t> misses { 0 };
+};
+
+#endif // DECODE_CACHE_HPP
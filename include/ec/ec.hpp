@@ -8,10 +8,23 @@ class ErasureCodingBase
 {
 public:
     static void encode(uint8_t **srcData, uint8_t **outputData) { }
-    static void decode(int *srcId, uint8_t **data) { }
+    static bool decode(int *srcId, uint8_t **data) { return false; }
     static std::string desc() { return "False EC Strategy"; }
 
 protected:
+    /* Whether `srcId` holds K distinct fragment IDs below N, as decode expects */
+    template <unsigned K, unsigned N>
+    static bool validSources(const int *srcId)
+    {
+        bool seen[N] = { false };
+        for (unsigned i = 0; i < K; ++i) {
+            if (srcId[i] < 0 || (unsigned)srcId[i] >= N || seen[srcId[i]])
+                return false;
+            seen[srcId[i]] = true;
+        }
+        return true;
+    }
+
     ErasureCodingBase() = default;
     ~ErasureCodingBase() = default;
 };
@@ -0,0 +1,259 @@
+#if !defined(LRC_HPP)
+#define LRC_HPP
+
+#include "ec.hpp"
+#include "decode_cache.hpp"
+#include "xor.hpp"
+#include <cstring>
+#include <isa-l.h>
+
+/**
+ * Azure-style Locally Repairable Code LRC(K, L, G).
+ *
+ * The K data fragments are split into L local groups of K / L fragments. Each group has a
+ * local parity (XOR of the group), and G global parities cover all data (Cauchy rows).
+ * Fragment IDs: [0, K) data, [K, K + L) local parities (group order), [K + L, N) global ones.
+ *
+ * A single lost data or local parity fragment is rebuilt from the K / L other members of its
+ * group; other patterns fall back to solving with K independent fragments.
+ */
+template <unsigned K, unsigned L, unsigned G, unsigned Len>
+class LrcCode : public ErasureCodingBase
+{
+public:
+    static const unsigned P = L + G;
+    static const unsigned N = K + P;
+    static const unsigned GroupSize = K / L;
+
+    static_assert(L >= 1 && K % L == 0, "K must be a multiple of L");
+
+    /**
+     * @brief Encode parity block from original data.
+     *
+     * @param srcData       An (K * Len) 2d-array containing original data.
+     * @param outputData    An (P * Len) 2d-array allocated space, local parities first.
+     */
+    static void encode(uint8_t **srcData, uint8_t **outputData)
+    {
+        auto *inst = instance();
+        ec_encode_data(Len, K, P, inst->gfTables, srcData, outputData);
+    }
+
+    /**
+     * @brief Decode original data from provided data blocks.
+     *
+     * @param srcId         An 1d-array containing IDs of K fetched blocks (e.g. by `selectSources`).
+     * @param data          An ((K + P) * Len) 2d-array, whose lines with IDs in `srcId` are
+     *                      filled with fetched data blocks.
+     * @return              Fills empty lines of data[0 .. K-1]. False if `srcId` are not K
+     *                      distinct IDs, or are dependent.
+     */
+    static bool decode(int *srcId, uint8_t **data)
+    {
+        if (!validSources<K, N>(srcId))
+            return false;
+        auto *inst = instance();
+        bool live[N] = { false };
+        for (unsigned i = 0; i < K; ++i)
+            live[srcId[i]] = true;
+
+        /* Local repair if every lost data fragment is alone in its group */
+        int localSrc[K][GroupSize];
+        bool local = true;
+        for (unsigned i = 0; i < K && local; ++i)
+            local = live[i] || inst->localSources(i, live, localSrc[i]);
+        if (local) {
+            for (unsigned i = 0; i < K; ++i)
+                if (!live[i])
+                    inst->repairLocal(localSrc[i], data, data[i]);
+            return true;
+        }
+
+        typename DecodeTables::Entry scratch;
+        auto *entry = inst->decodeTables.get(DecodeTables::maskOf(srcId), scratch);
+        if (!entry->valid)
+            return false;
+        uint8_t *recoverSrc[K], *recoverOutput[K];
+        for (unsigned i = 0; i < K; ++i)
+            recoverSrc[i] = data[entry->srcId[i]];
+        for (int i = 0; i < entry->dataErrs; ++i)
+            recoverOutput[i] = data[entry->errIndex[i]];
+        ec_encode_data(Len, K, entry->dataErrs, entry->gfTbls, recoverSrc, recoverOutput);
+        return true;
+    }
+
+    /**
+     * @brief Pick K fetchable fragments that can decode all data, preferring data fragments,
+     *        then local parities (so that local repair applies), then global parities.
+     *
+     * @param alive         An 1d-array of N liveness flags.
+     * @param srcId         An 1d-array of K entries to fill.
+     * @return              False if the alive fragments cannot recover the data.
+     */
+    static bool selectSources(const bool *alive, int *srcId)
+    {
+        auto *inst = instance();
+        uint8_t basis[K * K];                   /* Row-echelon rows of chosen fragments */
+        int pivot[K];
+        unsigned rank = 0;
+
+        for (unsigned id = 0; id < N && rank < K; ++id) {
+            if (!alive[id])
+                continue;
+            uint8_t row[K];
+            memcpy(row, &inst->genMatrix[K * id], K);
+            for (unsigned r = 0; r < rank; ++r) {
+                uint8_t c = row[pivot[r]];
+                if (c)
+                    for (unsigned j = 0; j < K; ++j)
+                        row[j] ^= gf_mul(c, basis[K * r + j]);
+            }
+            unsigned p = 0;
+            while (p < K && !row[p])
+                ++p;
+            if (p == K)
+                continue;
+            uint8_t inv = gf_inv(row[p]);
+            for (unsigned j = 0; j < K; ++j)
+                basis[K * rank + j] = gf_mul(inv, row[j]);
+            pivot[rank] = p;
+            srcId[rank++] = id;
+        }
+        return rank == K;
+    }
+
+    /**
+     * @brief Pick the fragments to read to rebuild a single fragment.
+     *
+     * @param lostId        ID of the lost fragment.
+     * @param alive         An 1d-array of N liveness flags (`lostId` is treated as dead).
+     * @param srcId         An 1d-array of at least K entries to fill.
+     * @return              Number of sources (GroupSize for local repair, otherwise K),
+     *                      or 0 if the fragment cannot be rebuilt.
+     */
+    static int repairSources(int lostId, const bool *alive, int *srcId)
+    {
+        bool live[N];
+        memcpy(live, alive, sizeof(live));
+        live[lostId] = false;
+        if (instance()->localSources(lostId, live, srcId))
+            return GroupSize;
+        return selectSources(live, srcId) ? K : 0;
+    }
+
+    /**
+     * @brief Rebuild a single fragment from the sources picked by `repairSources`.
+     *
+     * @param lostId        ID of the lost fragment.
+     * @param srcId         Sources returned by `repairSources`.
+     * @param count         Return value of `repairSources`.
+     * @param data          An ((K + P) * Len) 2d-array, whose lines in `srcId` are filled.
+     * @return              Fills data[lostId]. False if the sources are dependent.
+     */
+    static bool repair(int lostId, int *srcId, int count, uint8_t **data)
+    {
+        auto *inst = instance();
+        if (count == (int)GroupSize) {
+            inst->repairLocal(srcId, data, data[lostId]);
+            return true;
+        }
+
+        typename DecodeTables::Entry scratch;
+        auto *entry = inst->decodeTables.get(DecodeTables::maskOf(srcId), scratch);
+        if (!entry->valid)
+            return false;
+        int row = 0;
+        while (entry->errIndex[row] != lostId)
+            ++row;
+
+        uint8_t *recoverSrc[K];
+        for (unsigned i = 0; i < K; ++i)
+            recoverSrc[i] = data[entry->srcId[i]];
+        ec_encode_data(Len, K, 1, entry->gfTbls + row * K * 32, recoverSrc, &data[lostId]);
+        return true;
+    }
+
+    /** Build the decode tables for `srcId` ahead of time, e.g. when a peer fails. */
+    static void prepareDecode(const int *srcId)
+    {
+        typename DecodeTables::Entry scratch;
+        instance()->decodeTables.get(DecodeTables::maskOf(srcId), scratch);
+    }
+
+    /** Enable or disable caching of decode tables (enabled by default). */
+    static void setDecodeCache(bool enabled) { instance()->decodeTables.setEnabled(enabled); }
+
+    static std::string desc()
+    {
+        using std::to_string;
+        return "LRC(" + to_string(K) + ", " + to_string(L) + ", " + to_string(G) +
+               "), Len = " + to_string(Len);
+    }
+
+private:
+    using DecodeTables = DecodeTableCache<K, N>;
+
+    explicit LrcCode()
+    {
+        uint8_t cauchy[(K + G) * K];
+        gf_gen_cauchy1_matrix(cauchy, K + G, K);
+
+        memset(genMatrix, 0, sizeof(genMatrix));
+        for (unsigned i = 0; i < K; ++i)
+            genMatrix[K * i + i] = 1;
+        for (unsigned g = 0; g < L; ++g)
+            for (unsigned i = 0; i < GroupSize; ++i)
+                genMatrix[K * (K + g) + g * GroupSize + i] = 1;
+        memcpy(&genMatrix[K * (K + L)], &cauchy[K * K], G * K);
+        ec_init_tables(K, P, &genMatrix[K * K], gfTables);
+        decodeTables.setGenMatrix(genMatrix);
+
+    }
+    ~LrcCode() { }
+
+    static inline LrcCode<K, L, G, Len> *instance()
+    {
+        static auto *inst = new LrcCode<K, L, G, Len>;
+        return inst;
+    }
+
+    /* Other members of the local group of `id`, if they are all live */
+    bool localSources(unsigned id, const bool *live, int *srcId)
+    {
+        unsigned group;
+        if (id < K)
+            group = id / GroupSize;
+        else if (id < K + L)
+            group = id - K;
+        else
+            return false;
+
+        int cnt = 0;
+        for (unsigned i = 0; i < GroupSize; ++i) {
+            unsigned member = group * GroupSize + i;
+            if (member != id)
+                srcId[cnt++] = member;
+        }
+        if (id != K + group)
+            srcId[cnt++] = K + group;
+        for (int i = 0; i < cnt; ++i)
+            if (!live[srcId[i]])
+                return false;
+        return true;
+    }
+
+    /* Any member of a local group is the XOR of the other members */
+    void repairLocal(const int *srcId, uint8_t **data, uint8_t *output)
+    {
+        uint8_t *recoverSrc[GroupSize];
+        for (unsigned i = 0; i < GroupSize; ++i)
+            recoverSrc[i] = data[srcId[i]];
+        xorBlocks(recoverSrc, GroupSize, output, Len);
+    }
+
+    uint8_t genMatrix[N * K];
+    uint8_t gfTables[K * P * 32];
+    DecodeTables decodeTables;
+};
+
+#endif // LRC_HPP
@@ -2,6 +2,9 @@
 #define RS_HPP
 
 #include "ec.hpp"
+#include "decode_cache.hpp"
+#include "xor.hpp"
+#include <cstring>
 #include <isa-l.h>
 
 template <unsigned K, unsigned P, unsigned Len>
@@ -26,44 +29,62 @@ public:
      * @param srcId         An 1d-array containing IDs of fetched data blocks.
      * @param data          An ((K + P) * Len) 2d-array, whose lines with IDs in `srcId` are
      *                      filled with fetched data blocks.
-     * @return              Fills empty lines (ID not in `srcId`) of data[0 .. K-1].
+     * @return              Fills empty lines (ID not in `srcId`) of data, except null ones.
+     *                      False if `srcId` are not K distinct IDs, or are dependent.
      */
-    static void decode(int *srcId, uint8_t **data)
+    static bool decode(int *srcId, uint8_t **data)
     {
-        uint8_t decodeMatrix[N * K];            /* Decode matrix */
-        uint8_t invertMatrix[K * K];            /* Inversion of `b` */
-        uint8_t b[K * K];                       /* Extracted lines from encode matrix */
+        if (!validSources<K, N>(srcId))
+            return false;
+        typename DecodeTables::Entry scratch;
+        auto *entry = instance()->decodeTables.get(DecodeTables::maskOf(srcId), scratch);
+        if (!entry->valid)
+            return false;
         uint8_t *recoverSrc[K];                 /* Points to source data */
+        for (unsigned i = 0; i < K; ++i)
+            recoverSrc[i] = data[entry->srcId[i]];
+
+        /* Usually only (leading) data rows are wanted, which is a single call */
+        int rows = 0;
+        while (rows < entry->errs && data[entry->errIndex[rows]])
+            ++rows;
         uint8_t *recoverOutput[P];              /* Points to recovered data */
-        int errs = 0;                           /* Number of corrupted sources */
-        int errIndex[P];                        /* Indexes of corrupted sources */
-        bool live[N];                           /* Liveness bitmap */
+        for (int i = 0; i < rows; ++i)
+            recoverOutput[i] = data[entry->errIndex[i]];
+        if (rows)
+            ec_encode_data(Len, K, rows, entry->gfTbls, recoverSrc, recoverOutput);
 
-        auto *inst = instance();
+        for (int i = rows + 1; i < entry->errs; ++i)
+            if (data[entry->errIndex[i]])
+                ec_encode_data(Len, K, 1, entry->gfTbls + i * K * 32,
+                               recoverSrc, &data[entry->errIndex[i]]);
+        return true;
+    }
 
-        for (int i = 0; i < N; ++i)
-            live[i] = 0;
-        for (int i = 0; i < K; ++i) {
-            live[srcId[i]] = 1;
-            recoverSrc[i] = data[srcId[i]];
-        }
-        for (int i = 0; i < N; ++i)
-            if (!live[i]) {
-                errIndex[errs] = i;
-                recoverOutput[errs++] = data[srcId[i]]; 
-            }
-
-        for (int i = 0; i < K; ++i)
-            for (int j = 0; j < K; ++j)
-                b[K * i + j] = inst->encodeMatrix[K * srcId[i] + j];
-        gf_invert_matrix(b, invertMatrix, K);
-
-        for (int i = 0; i < errs; ++i)
-            memcpy(&decodeMatrix[K * i], &invertMatrix[K * errIndex[i]], K);
-    
-        uint8_t gfTbls[K * P * 32];
-        ec_init_tables(K, errs, decodeMatrix, gfTbls);
-        ec_encode_data(Len, K, errs, gfTbls, recoverSrc, recoverOutput);
+    /** Build the decode tables for `srcId` ahead of time, e.g. when a peer fails. */
+    static void prepareDecode(const int *srcId)
+    {
+        typename DecodeTables::Entry scratch;
+        instance()->decodeTables.get(DecodeTables::maskOf(srcId), scratch);
+    }
+
+    /** Enable or disable caching of decode tables (enabled by default). */
+    static void setDecodeCache(bool enabled) { instance()->decodeTables.setEnabled(enabled); }
+
+    /**
+     * @brief Pick K fetchable blocks to decode from; any K blocks will do for RS.
+     *
+     * @param alive         An 1d-array of N liveness flags.
+     * @param srcId         An 1d-array of K entries to fill.
+     * @return              False if less than K blocks are alive.
+     */
+    static bool selectSources(const bool *alive, int *srcId)
+    {
+        unsigned cnt = 0;
+        for (unsigned i = 0; i < N && cnt < K; ++i)
+            if (alive[i])
+                srcId[cnt++] = i;
+        return cnt == K;
     }
 
     static std::string desc()
@@ -74,24 +95,86 @@ public:
 
 private:
     static const unsigned N = K + P;
+    using DecodeTables = DecodeTableCache<K, N>;
 
     explicit ReedSolomonCode()
     {
         gf_gen_cauchy1_matrix(encodeMatrix, N, K);
         ec_init_tables(K, P, &encodeMatrix[K * K], gfTables);
+        decodeTables.setGenMatrix(encodeMatrix);
     }
     ~ReedSolomonCode() { }
 
     static inline ReedSolomonCode<K, P, Len> *instance()
     {
-        static ReedSolomonCode<K, P, Len> *inst = nullptr;
-        if (!inst)
-            inst = new ReedSolomonCode<K, P, Len>;
+        static auto *inst = new ReedSolomonCode<K, P, Len>;
         return inst;
     }
 
     uint8_t encodeMatrix[N * K];
     uint8_t gfTables[K * P * 32];
+    DecodeTables decodeTables;
+};
+
+/**
+ * Single parity with an all-ones parity row (any K of the N blocks still decode), so encoding
+ * and recovering the only erasure are plain XORs instead of GF table lookups.
+ * The parity differs from the Cauchy one of the generic ReedSolomonCode: the two cannot read
+ * each other's stripes.
+ */
+template <unsigned K, unsigned Len>
+class XorParityCode : public ErasureCodingBase
+{
+public:
+    static void encode(uint8_t **srcData, uint8_t **outputData)
+    {
+        xorBlocks(srcData, K, outputData[0], Len);
+    }
+
+    /* False if `srcId` are not K distinct IDs */
+    static bool decode(int *srcId, uint8_t **data)
+    {
+        if (!validSources<K, N>(srcId))
+            return false;
+        bool live[N] = { false };
+        uint8_t *recoverSrc[K];
+        for (unsigned i = 0; i < K; ++i) {
+            live[srcId[i]] = true;
+            recoverSrc[i] = data[srcId[i]];
+        }
+        for (unsigned i = 0; i < N; ++i)
+            if (!live[i] && data[i])
+                xorBlocks(recoverSrc, K, data[i], Len);
+        return true;
+    }
+
+    static bool selectSources(const bool *alive, int *srcId)
+    {
+        unsigned cnt = 0;
+        for (unsigned i = 0; i < N && cnt < K; ++i)
+            if (alive[i])
+                srcId[cnt++] = i;
+        return cnt == K;
+    }
+
+    /* Nothing to precompute */
+    static void prepareDecode(const int *srcId) { }
+    static void setDecodeCache(bool enabled) { }
+
+    static std::string desc()
+    {
+        using std::to_string;
+        return "XOR(" + to_string(K) + ", 1), Len = " + to_string(Len);
+    }
+
+private:
+    static const unsigned N = K + 1;
 };
 
+#if !defined(ECAL_CAUCHY_PARITY)
+/* RS(K, 1) is the XOR parity code, unless built for the Cauchy parity of older pools */
+template <unsigned K, unsigned Len>
+class ReedSolomonCode<K, 1, Len> : public XorParityCode<K, Len> { };
+#endif
+
 #endif // RS_HPP
@@ -0,0 +1,128 @@
+#if !defined(XOR_HPP)
+#define XOR_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <immintrin.h>
+
+/**
+ * XOR kernels for single-parity stripes: dst = src[0] ^ src[1] ^ ... ^ src[count - 1].
+ *
+ * The AVX2 and AVX-512 kernels are compiled with target attributes, so that they exist
+ * regardless of -march; the fastest one the CPU supports is picked at runtime.
+ * `dst` must not overlap any source.
+ */
+using XorKernel = void (*)(uint8_t **src, int count, uint8_t *dst, size_t len);
+
+enum class XorTier
+{
+    Scalar = 0,
+    AVX2,
+    AVX512,
+    NTiers
+};
+
+/* XOR bytes [begin, len) */
+inline void xorScalarRange(uint8_t **src, int count, uint8_t *dst, size_t begin, size_t len)
+{
+    size_t i = begin;
+    for (; i + 8 <= len; i += 8) {
+        uint64_t acc, v;
+        memcpy(&acc, src[0] + i, 8);
+        for (int j = 1; j < count; ++j) {
+            memcpy(&v, src[j] + i, 8);
+            acc ^= v;
+        }
+        memcpy(dst + i, &acc, 8);
+    }
+    for (; i < len; ++i) {
+        uint8_t acc = src[0][i];
+        for (int j = 1; j < count; ++j)
+            acc ^= src[j][i];
+        dst[i] = acc;
+    }
+}
+
+inline void xorScalar(uint8_t **src, int count, uint8_t *dst, size_t len)
+{
+    xorScalarRange(src, count, dst, 0, len);
+}
+
+__attribute__((target("avx2")))
+inline void xorAvx2(uint8_t **src, int count, uint8_t *dst, size_t len)
+{
+    size_t i = 0;
+    for (; i + 64 <= len; i += 64) {
+        __m256i a0 = _mm256_loadu_si256((const __m256i *)(src[0] + i));
+        __m256i a1 = _mm256_loadu_si256((const __m256i *)(src[0] + i + 32));
+        for (int j = 1; j < count; ++j) {
+            a0 = _mm256_xor_si256(a0, _mm256_loadu_si256((const __m256i *)(src[j] + i)));
+            a1 = _mm256_xor_si256(a1, _mm256_loadu_si256((const __m256i *)(src[j] + i + 32)));
+        }
+        _mm256_storeu_si256((__m256i *)(dst + i), a0);
+        _mm256_storeu_si256((__m256i *)(dst + i + 32), a1);
+    }
+    xorScalarRange(src, count, dst, i, len);
+}
+
+__attribute__((target("avx512f")))
+inline void xorAvx512(uint8_t **src, int count, uint8_t *dst, size_t len)
+{
+    size_t i = 0;
+    for (; i + 128 <= len; i += 128) {
+        __m512i a0 = _mm512_loadu_si512((const void *)(src[0] + i));
+        __m512i a1 = _mm512_loadu_si512((const void *)(src[0] + i + 64));
+        for (int j = 1; j < count; ++j) {
+            a0 = _mm512_xor_si512(a0, _mm512_loadu_si512((const void *)(src[j] + i)));
+            a1 = _mm512_xor_si512(a1, _mm512_loadu_si512((const void *)(src[j] + i + 64)));
+        }
+        _mm512_storeu_si512((void *)(dst + i), a0);
+        _mm512_storeu_si512((void *)(dst + i + 64), a1);
+    }
+    xorScalarRange(src, count, dst, i, len);
+}
+
+inline bool xorTierSupported(XorTier tier)
+{
+    switch (tier) {
+    case XorTier::Scalar:
+        return true;
+    case XorTier::AVX2:
+        return __builtin_cpu_supports("avx2");
+    case XorTier::AVX512:
+        return __builtin_cpu_supports("avx512f");
+    default:
+        return false;
+    }
+}
+
+inline XorKernel xorKernelOf(XorTier tier)
+{
+    static const XorKernel kernels[] = { xorScalar, xorAvx2, xorAvx512 };
+    return kernels[static_cast<int>(tier)];
+}
+
+inline const char *xorTierName(XorTier tier)
+{
+    static const char *names[] = { "scalar", "avx2", "avx512" };
+    return names[static_cast<int>(tier)];
+}
+
+inline XorTier bestXorTier()
+{
+    if (xorTierSupported(XorTier::AVX512))
+        return XorTier::AVX512;
+    if (xorTierSupported(XorTier::AVX2))
+        return XorTier::AVX2;
+    return XorTier::Scalar;
+}
+
+/** XOR `count` blocks of `len` bytes into `dst` with the best kernel of this CPU. */
+inline void xorBlocks(uint8_t **src, int count, uint8_t *dst, size_t len)
+{
+    static const XorKernel kernel = xorKernelOf(bestXorTier());
+    kernel(src, count, dst, len);
+}
+
+#endif // XOR_HPP
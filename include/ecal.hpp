@@ -12,11 +12,18 @@
 
 #include "config.hpp"
 #include "datablock.hpp"
+#include "ec/rs.hpp"
+#include "ec/lrc.hpp"
+#include "ec/checksum.hpp"
+#include "stripelock.hpp"
+#include "qos.hpp"
 #include "network/rdma.hpp"
 #include "network/netif.hpp"
 
 class ECAL
 {
+    friend class Rebuilder;
+
 public:
     struct Page
     {
@@ -26,26 +33,80 @@ public:
         Page(uint64_t index = 0) : index(index) { }
     };
 
+#if defined(ECAL_LRC)
+    /* LRC(4, 2, 1): two local groups of 2 data fragments, and 1 global parity */
+    static const int K = 4;
+    static const int L = 2;
+    static const int P = L + 1;
+#else
     static const int K = 2;
     static const int P = 1;
+#endif
     static const int N = K + P;
 
+    /* Max pages in flight in one readBlocks/writeBlocks round (bounded by per-peer regions) */
+    static const int MaxReadBatch = RDMAConnection::NConcurrency;
+    static const int MaxWriteBatch = RDMAConnection::NConcurrency;
+
+    /* Max pages of an extent (readExtent/writeExtent) */
+    static const int MaxExtentPages = MAX_STRIPE_UNIT / Block4K::capacity;
+
+    /* Outcome of scrubbing a row */
+    enum class ScrubResult
+    {
+        Clean,
+        Repaired,
+        Unrepairable,                               /* Too many corrupt fragments */
+        Skipped,                                    /* Degraded, or written while scrubbed */
+    };
+
     using BlockTy = DataBlock<Block4K::capacity / K>;
+#if defined(ECAL_LRC)
+    using CodeTy = LrcCode<K, L, P - L, BlockTy::size>;
+#else
+    using CodeTy = ReedSolomonCode<K, P, BlockTy::size>;
+#endif
 
 public:
     explicit ECAL();
     ~ECAL();
     
     void readBlock(uint64_t index, Page &page);
+    void readBlocks(const uint64_t *indexes, Page **pages, int count);
     void writeBlock(Page &page);
+    void writeBlocks(Page **pages, int count);
+    void readExtent(uint64_t index, Page **pages, int count);
+    void writeExtent(Page **pages, int count);
+    ScrubResult scrubRow(uint64_t row, int &repaired);
 
     inline RDMASocket *getRDMASocket() const { return rdma; }
 
     /* Returns the cluster's capacity in 4kB blocks */
     inline uint64_t getClusterCapacity() const { return capacity; }
 
+    /* Returns the number of rows (stripes) in each node's block pool */
+    inline uint64_t getRowCount() const { return allocTable->getCapacity(); }
+
     inline void regNetif(NetworkInterface *netif) { this->netif = netif; }
 
+    /* Returns the number of fetched fragments that failed their checksum */
+    inline uint64_t getChecksumErrors() const { return checksumErrors; }
+
+    /* Returns the stripe locks of writes, nullptr if STRIPE_LOCKS is off */
+    inline const StripeLocks *getStripeLocks() const { return stripeLocks; }
+    /* Returns the number of rows left unlocked as their lock home was unreachable */
+    inline uint64_t getUnlockedRows() const { return unlockedRows; }
+
+    /* Returns the number of persistence fences posted to peers (DURABLE_WRITES) */
+    inline uint64_t getPersistFences() const { return persistFences; }
+
+    /* Returns the maps of rows this node wrote while some of their nodes were dead */
+    inline const DirtyMap *getDirtyMap() const { return dirtyMap; }
+    uint64_t tidyDirtyMaps();
+
+    /* Returns the traffic class scheduler of this node's I/O */
+    inline QoS *getQoS() const { return qos; }
+
 private:
     struct DataPosition
     {
@@ -56,14 +117,68 @@ private:
         DataPosition(const DataPosition &b) : row(b.row), startNodeId(b.startNodeId) { }
     };
 
+    /* State of a single page read while its fragment reads are in flight */
+    struct ReadTask
+    {
+        Page *page;
+        DataPosition pos;
+        int errs;                                   /* Lost data fragments, -1 if unreadable */
+        uint32_t corrupt;                           /* Bitmask of fragments failing their checksum */
+        int decodeIndex[K];
+        uint8_t *recoverSrc[K];
+    };
+
+    /* Each fragment (or extent stripe unit) is followed by its CRC32C(s) in the staging regions */
+    static_assert(BlockTy::size + sizeof(uint32_t) <= Block4K::capacity,
+                  "no room for checksums in staging regions");
+    static_assert(MaxExtentPages * (BlockTy::size + sizeof(uint32_t)) <= RDMAConnection::ExtentRegionSize,
+                  "no room for extents in staging regions");
+    static_assert(MaxWriteBatch <= StripeLocks::MaxBatch && MaxExtentPages <= StripeLocks::MaxBatch,
+                  "too many rows per write to lock them at once");
+
+    /* Accounts a foreground operation to QoS as it ends, with ioMutex still held */
+    struct ForegroundIo
+    {
+        ECAL *ecal;
+        uint64_t start;
+        uint64_t bytes;
+
+        ForegroundIo(ECAL *ecal, uint64_t start, uint64_t bytes) : ecal(ecal), start(start), bytes(bytes)
+        {
+            ecal->degradedIo = false;
+        }
+        ~ForegroundIo()
+        {
+            ecal->qos->record(ecal->degradedIo ? TrafficClass::Degraded : TrafficClass::Foreground, start, bytes);
+        }
+    };
+
+    bool admitPeer(int peerId, bool full);
+    void prewarmDecodeTables();
+    int postReadTask(ReadTask &task, uint64_t index, Page &page);
+    int postFragmentReads(ReadTask &task);
+    bool refetchFragment(ReadTask &task, int i);
+    bool verifyReadTask(ReadTask &task);
+    void releaseReadTask(ReadTask &task);
+    void finishReadTask(ReadTask &task);
+    void pollReads(ibv_wc *wc, int count);
+    bool fetchStripe(const DataPosition &pos, uint8_t **frags, uint32_t *checksums);
+    void releaseStripe(const DataPosition &pos, uint8_t **frags);
+    void writeFragments(const DataPosition &pos, uint8_t **lines, const uint32_t *checksums, uint32_t mask);
+    int postPersistFences(const int *peerIds, const uint64_t *shifts, int count);
+    int lockRows(uint64_t *rows, int count, int *homes, uint64_t *held);
+    void unlockRows(const uint64_t *rows, int count, const int *homes, const uint64_t *held);
+
     BlockPool<BlockTy> *allocTable = nullptr;
     RDMASocket *rdma = nullptr;
+    StripeLocks *stripeLocks = nullptr;
+    DirtyMap *dirtyMap = nullptr;
+    QoS *qos = nullptr;
     uint64_t capacity = 0;
 
-    uint8_t encodeMatrix[N * K];
-    uint8_t gfTables[K * P * 32];
     uint8_t encodeBuffer[P * BlockTy::capacity];
     uint8_t *parity[P];                             /* Points to encodeBuffer */
+    uint8_t *extentParity = nullptr;                /* Parity units of extents for dead nodes */
 
     inline DataPosition getDataPos(uint64_t index)
     {
@@ -74,8 +189,35 @@ private:
     {
         return allocTable->getShift(index);
     }
+    inline uint64_t getChecksumShift(uint64_t index)
+    {
+        return allocTable->getTagShift(index);
+    }
+    inline uint32_t *getLocalChecksum(uint64_t index)
+    {
+        return reinterpret_cast<uint32_t *>(allocTable->tagAt(index));
+    }
+    /* Flush the local fragments (and checksums) of rows [row, row + count) to NVM */
+    inline void persistLocal(uint64_t row, int count = 1)
+    {
+        persistRange(allocTable->at(row), count * BlockTy::size);
+        persistRange(getLocalChecksum(row), count * sizeof(uint32_t));
+    }
+
+    /* Byte `off` of an extent made of 4kB pages (fragments never straddle pages) */
+    static inline uint8_t *extentAt(Page **pages, size_t off)
+    {
+        return pages[off / Block4K::capacity]->page.data + off % Block4K::capacity;
+    }
+    void readExtentRow(uint64_t index, const DataPosition &pos, uint32_t corrupt, uint8_t **units);
 
     NetworkInterface *netif;
+    std::mutex ioMutex;                             /* Serializes users of the shared send CQ */
+    std::atomic<uint64_t> checksumErrors { 0 };
+    std::atomic<uint64_t> persistFences { 0 };
+    std::atomic<uint64_t> unlockedRows { 0 };
+    std::vector<bool> failedPeers;                  /* Peers with failed reads, since the I/O began; indexed by node ID */
+    bool degradedIo = false;                        /* The foreground operation missed some fragments */
 };
 
 #endif // ECAL_HPP
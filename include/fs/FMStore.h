@@ -72,7 +72,7 @@ public:
          */
         //data_trans.push_back(*new DataServerRpc("127.0.0.1", 3334));
     }
-    int32_t create(const std::string &Key, const FileAccessInode &fa);
+    int32_t create(const std::string &Key, const FileAccessInode &fa, int64_t blockSize = 4096);
     int32_t access(const std::string &Key, const FileAccessInode &fa);
     int32_t chown(const std::string &Key, const FileAccessInode &fa);
     int32_t chmod(const std::string &Key, const FileAccessInode &fa);
@@ -84,6 +84,8 @@ public:
     void readdir(std::string &_return, const int64_t uuid);
     int32_t utimens(const std::string &Key, const FileContentInode &fc);
     void open(FileInode &_return, const std::string &Key, const FileAccessInode &fa);
+    int32_t openOrCreate(FileInode &_return, const std::string &Key, const FileAccessInode &fa, int32_t flags,
+                         int64_t blockSize = 4096);
     int32_t rename(const std::string &old_path, const std::string &new_path);
 };
 #endif  // LocoFS_FMStore_H
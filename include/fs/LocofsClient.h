@@ -4,31 +4,64 @@
 #include <sys/stat.h>
 #include <sys/statvfs.h>
 #include <sys/types.h>
+#include <unistd.h>
 #include <functional>
 #include <string>
 #include <vector>
+#include <deque>
+#include <condition_variable>
+#include <memory>
+#include <thread>
 
 #include "lru_cache.h"
+#include "PageCache.h"
 #include "inode.hpp"
 #include "../ecal.hpp"
 #include "../network/netif.hpp"
 
+/* Readahead counters, in blocks */
+struct ReadaheadStats
+{
+    std::atomic<uint64_t> hits{0};          /* Blocks served from the page cache */
+    std::atomic<uint64_t> misses{0};        /* Blocks read synchronously */
+    std::atomic<uint64_t> prefetched{0};    /* Blocks read by the prefetcher */
+
+    inline double hitRate() const
+    {
+        uint64_t total = hits + misses;
+        return total ? (double)hits / total : 0;
+    }
+};
+
 class LocofsClient
 {
 public:
-    LocofsClient() : netif(std::unordered_map<int, erpc::erpc_req_func_t>()) { }
+    LocofsClient() : netif(std::unordered_map<int, erpc::erpc_req_func_t>()) { mainWorker.netif = &netif; }
     ~LocofsClient() = default;
 
     bool mount(const std::string &conf);
     ECAL *getECAL() { return &ecal; }
-    void stop() { ecal.getRDMASocket()->stopListenerAndJoin(); }
+    void stop();
+
+    inline void setReadaheadWindow(int maxBlocks) { raMaxWindow = maxBlocks; }
+    inline const ReadaheadStats &getReadaheadStats() const { return raStats; }
+    inline uint64_t getReadaheadWasted() const { return pageCache.getWasted(); }
+
+    /* Block size of files created from now on, see isValidBlockSize */
+    inline void setStripeUnit(int64_t bytes) { stripeUnit = bytes; }
+    inline int64_t getStripeUnit() const { return stripeUnit; }
+
+    inline void setLazySizeUpdate(bool lazy) { lazySize = lazy; }
+    inline uint64_t getSizeUpdateCount() const { return sizeUpdates; }
+    bool flushSizes();
 
     bool write(const std::string &path, const char *buf, int64_t len, int64_t off);
     int64_t read(const std::string &path, char *buf, int64_t len, int64_t off);
 
     bool mkdir(const std::string &path, int32_t mode);
-    bool open(const std::string &path, int32_t flags);
-    bool create(const std::string &path, int32_t mode);
+    bool open(const std::string &path, int32_t flags, int32_t mode = 0644,
+              uid_t uid = getuid(), gid_t gid = getgid());
+    bool create(const std::string &path, int32_t mode, int64_t blockSize = 0);
     bool close(const std::string &path);
 
     bool unlink(const std::string &path);
@@ -46,10 +79,69 @@ private:
     bool parseConfig();
     bool _get_uuid(const std::string &path, uint64_t &uuid, const bool IS_SetCache);
     bool _get_file_key(const std ::string &path, std ::string &Key_File);
-    bool _get_file_stat(const std::string &path, struct loco_file_stat &loco_st);
+    bool _get_file_stat(const std::string &path, struct loco_file_stat &loco_st,
+                        std::string *Key_File = nullptr);
     bool _get_object_key(const std::string &path, int64_t oid, std::string &Key_Obj);
     bool _set_ContentInode(const struct loco_file_stat &loco_st, FileContentInode &fci);
     bool _check_path(const std::string &path, std::string &p);
+    uint64_t _block_index(const struct loco_file_stat &loco_st, int64_t block_num);
+    void _write_extent(uint64_t index, int count, const char *buf, int64_t off, int64_t len);
+    void _readahead(const std::string &path, const struct loco_file_stat &loco_st,
+                    int64_t first, int64_t last);
+    void prefetchWorker();
+    bool _flush_size(const std::string &path, bool async);
+    void _flush_due_sizes();
+
+    /*
+     * State of a thread using the client. Its metadata RPCs go through an eRPC endpoint of
+     * its own, as an endpoint is single-threaded: the thread that created the client uses
+     * `netif`, others get an endpoint on first use, released when they exit.
+     */
+    struct Worker
+    {
+        LocofsClient *client = nullptr;
+        uint8_t rpcId = 0;                  /* 0: the creating thread, whose endpoint is `netif` */
+        NetworkInterface *netif = nullptr;
+        std::unique_ptr<NetworkInterface> ownNetif;
+        std::vector<ECAL::Page> missPages;  /* Scratch pages of synchronous reads */
+        std::vector<ECAL::Page> writePages; /* Scratch pages of batched full-page writes, or extents */
+
+        ~Worker();
+    };
+    Worker &worker();
+    inline NetworkInterface &endpoint() { return *worker().netif; }
+
+    /* Per-open-file sequential access detection state, in blocks */
+    struct ReadaheadState
+    {
+        int64_t nextBlock = 0;              /* Expected first block of the next sequential read */
+        int64_t window = 0;                 /* Current window, 0 if access is not sequential */
+        int64_t prefetchedUpTo = 0;         /* First block not yet handed to the prefetcher */
+    };
+    static const int RA_INIT_WINDOW = 4;
+
+    /* Page (count = 1) or extent (file block of count pages) waiting to be prefetched */
+    struct PrefetchItem
+    {
+        uint64_t index;
+        int count;
+    };
+
+    /* Size of a file grown by this client, not yet sent to its FMS */
+    struct PendingSize
+    {
+        std::string key;
+        int64_t size = 0;
+        std::chrono::steady_clock::time_point since;
+    };
+    static const int SIZE_FLUSH_INTERVAL_MS = 100;  /* Age at which a pending size is sent */
+
+    /* File opened by this client; its stat is valid until close (close-to-open) */
+    struct OpenFile
+    {
+        std::string key;
+        struct loco_file_stat stat;
+    };
 
     int directory_trans;
     std::vector<int> file_trans;
@@ -61,5 +153,27 @@ private:
 
     ECAL ecal;
     NetworkInterface netif;
+    std::thread::id owner = std::this_thread::get_id();
+    Worker mainWorker;
+    std::vector<uint8_t> freeRpcIds;        /* Endpoint IDs released by exited threads */
+    int nextRpcId = 1;
+
+    PageCache pageCache;
+    std::unordered_map<std::string, ReadaheadState> raState;
+    ReadaheadStats raStats;
+    int raMaxWindow = 0;
+    int64_t stripeUnit = 4096;              /* Block size of created files */
+
+    std::thread prefetcher;
+    std::deque<PrefetchItem> raQueue;       /* Reserved pages waiting to be prefetched */
+    std::mutex raMutex;
+    std::condition_variable raCond;
+    bool raRunning = false;
+
+    std::mutex stateMutex;                  /* Guards openFiles, pendingSizes, raState and RPC IDs */
+    std::unordered_map<std::string, OpenFile> openFiles;
+    std::unordered_map<std::string, PendingSize> pendingSizes;
+    bool lazySize = true;
+    std::atomic<uint64_t> sizeUpdates{0};   /* ERPC_CSIZE RPCs sent */
 };
 #endif  // LocoFS_LocofsClient_H
@@ -0,0 +1,57 @@
+#ifndef LocoFS_PageCache_H
+#define LocoFS_PageCache_H
+
+#include <list>
+#include <condition_variable>
+
+#include "../ecal.hpp"
+
+/**
+ * Client-side cache of ECAL pages, keyed by ECAL block number.
+ *
+ * An entry is either pending (reserved by the prefetcher, RDMA reads in flight) or ready.
+ * Readers of a pending entry wait for it instead of reading the block again.
+ * Ready entries are evicted in LRU order when the cache is full; pending ones are pinned.
+ *
+ * @note The cache is not coherent with writes of other clients: the pages of a file are only
+ *       dropped when it is opened again (close-to-open consistency).
+ */
+class PageCache
+{
+public:
+    explicit PageCache(size_t capacity = 4096) : capacity(capacity) { }
+    ~PageCache() = default;
+
+    bool read(uint64_t blkno, char *dst, int64_t off, int64_t len);
+    bool reserve(uint64_t blkno, uint64_t file);
+    void fill(uint64_t blkno, const ECAL::Page &page);
+    void invalidate(uint64_t blkno);
+    void invalidateFile(uint64_t file);
+    void clear();
+
+    /* Prefetched pages evicted or invalidated before anyone read them */
+    inline uint64_t getWasted() const { return wasted; }
+
+private:
+    struct Entry
+    {
+        ECAL::Page page;
+        bool ready = false;
+        bool stale = false;                 /* Written while pending, drop on fill */
+        bool referenced = false;
+        uint64_t file = 0;                  /* Tag of the file the block was prefetched for */
+        std::list<uint64_t>::iterator lruPos;
+    };
+
+    void evict();
+    void erase(std::unordered_map<uint64_t, Entry>::iterator it);
+
+    size_t capacity;
+    std::unordered_map<uint64_t, Entry> entries;
+    std::list<uint64_t> lru;                /* Front is the most recently used */
+    std::mutex mutex;
+    std::condition_variable filled;
+    uint64_t wasted = 0;
+};
+
+#endif  // LocoFS_PageCache_H
@@ -5,6 +5,14 @@
 #include <string>
 #include <sys/stat.h>
 
+#include "../commons.hpp"
+
+/* File block sizes, which are also ECAL extents: 4kB << i, up to MAX_STRIPE_UNIT */
+inline bool isValidBlockSize(int64_t size)
+{
+    return size >= 4096 && size <= MAX_STRIPE_UNIT && !(size & (size - 1));
+}
+
 struct ReadData
 {
     std::string buf;
@@ -21,6 +21,9 @@ enum SpecialWRType
     SP_REMOTE_MR_RECV = 1,
     SP_REMOTE_WRLOG_READ,
     SP_SYNC_RECV,
+    SP_MESSAGE_SEND,                /* Two-sided message, completion handled by RDMASocket */
+    SP_CREDIT_WRITE,                /* Receive credits returned to a peer */
+    SP_HEARTBEAT_READ,              /* Heartbeat words of a peer, read by the failure detector */
     SP_TYPES
 };
 
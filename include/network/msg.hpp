@@ -6,12 +6,14 @@
 
 struct PureValueRequest { int64_t value; };
 struct ValueWithPathRequest { int64_t value; int len; char path[MAX_PATH_LEN + 1]; };
+struct CreateRequest { int64_t value; int64_t blockSize; int64_t uid; int64_t gid; char path[MAX_PATH_LEN + 1]; };
 struct RawRequest { int len; char raw[4090]; static const size_t RAW_SIZE = 4089; };
 struct MemRequest { uintptr_t addr; uint8_t data[2048]; };
 union GeneralRequest
 {
     PureValueRequest pvReq;
     ValueWithPathRequest vwpReq;
+    CreateRequest createReq;
     RawRequest rawReq;
 };
 
@@ -40,6 +40,7 @@ void memWriteHandler(erpc::ReqHandle *reqHandle, void *context);
 class NetworkInterface
 {
     static const int NLockers = 32;
+    static const int MaxIdleSleepUs = 200;
 
     friend void smHandler(int, erpc::SmEventType, erpc::SmErrType, void *);
     friend void contFunc(void *, void *);
@@ -51,7 +52,7 @@ public:
         d_info("Debugging.");
         std::string serverURI = myNodeConf->ipAddrStr + ":" + std::to_string(cmdConf->udpPort);
         d_info("listening RPC at %s", serverURI.c_str());
-        nexus = std::make_unique<erpc::Nexus>(serverURI, 0, 0);
+        nexus = std::make_shared<erpc::Nexus>(serverURI, 0, 0);
 
         if (myNodeConf->type == NODE_DMS) {
             nexus->register_req_func(2, dummyHandler);
@@ -75,7 +76,8 @@ public:
     explicit NetworkInterface(const std::unordered_map<int, erpc::erpc_req_func_t> &rpcProcessors)
     {
         std::string serverURI = myNodeConf->hostname + ":" + std::to_string(cmdConf->udpPort);
-        nexus = std::make_unique<erpc::Nexus>(serverURI, 0, 0);
+        nexus = std::make_shared<erpc::Nexus>(serverURI, 0, 0);
+        sessions.assign(clusterConf->getNodeIdBound(), -1);
         if (static_cast<int>(myNodeConf->type) & NODE_SERVER) {
             for (auto v : rpcProcessors)
                 nexus->register_req_func(v.first, v.second);
@@ -87,30 +89,34 @@ public:
         /* Clients connect to servers */
         if ((static_cast<int>(myNodeConf->type) & NODE_SERVER) == 0) {
             std::this_thread::sleep_for(std::chrono::milliseconds(100));
-            for (int i = 0; i < clusterConf->getClusterSize(); ++i) {
-                NodeConfig conf = (*clusterConf)[i];
-                if ((static_cast<int>(conf.type) & NODE_SERVER) == 0)
-                    continue;
-                if ((!cmdConf->recover && conf.id < myNodeConf->id) || cmdConf->recover) {
-                    std::string uri = conf.hostname + ":" + std::to_string(cmdConf->udpPort);
-                    int sess = sessions[conf.id] = rpc->create_session(uri, 0);
-                    sess2id[sess] = conf.id;
-                    while (!rpc->is_connected(sessions[conf.id]))
-                        rpc->run_event_loop_once();
-                }
-            }
+            connectServers();
         }
 
         for (int i = 0; i < NLockers; ++i)
             locks[i].respBuf = rpc->alloc_msg_buffer_or_die(sizeof(GeneralResponse));
     }
+    /**
+     * Another client endpoint of this process, sharing the Nexus of `primary`, for a thread
+     * of its own: an eRPC endpoint is only used by the thread that created it.
+     * @param rpcId     Unique in the process, within 1 .. erpc::kMaxRpcId.
+     */
+    explicit NetworkInterface(const NetworkInterface &primary, uint8_t rpcId) : nexus(primary.nexus)
+    {
+        sessions.assign(clusterConf->getNodeIdBound(), -1);
+        rpc = std::make_unique<erpc::Rpc<erpc::CTransport>>(nexus.get(), this, rpcId, smHandler);
+        connectServers();
+        for (int i = 0; i < NLockers; ++i)
+            locks[i].respBuf = rpc->alloc_msg_buffer_or_die(sizeof(GeneralResponse));
+    }
     ~NetworkInterface()
     {
+        drainAsync();
         for (int i = 0; i < NLockers; ++i)
             rpc->free_msg_buffer(locks[i].respBuf);
     }
 
     inline erpc::Rpc<erpc::CTransport> *getRPC() { return rpc.get(); }
+    inline void onResponse() { ++responses; }
 
     template <typename ReqTy, typename RespTy>
     bool rpcCall(int peerId, ErpcType type, const ReqTy &req, RespTy &resp)
@@ -135,11 +141,63 @@ public:
         return true;
     }
 
-    void startServer(int checkInterval = 1000)
+    /**
+     * Enqueue a request without waiting for its response.
+     * The request is sent and completed by event loops of later RPC calls (or drainAsync).
+     * Its response must be a PureValueResponse, whose non-zero value is only logged.
+     * @return false if all lockers are in use.
+     */
+    template <typename ReqTy>
+    bool rpcCallAsync(int peerId, ErpcType type, const ReqTy &req)
+    {
+        int idx = bitmap.allocBit();
+        if (idx == -1)
+            return false;
+
+        locks[idx].reqBuf = rpc->alloc_msg_buffer_or_die(sizeof(ReqTy));
+        memcpy(locks[idx].reqBuf.buf, &req, sizeof(ReqTy));
+        locks[idx].completed = false;
+        locks[idx].async = true;
+        ++asyncInflight;
+        rpc->enqueue_request(sessions[peerId], static_cast<int>(type), &locks[idx].reqBuf,
+                             &locks[idx].respBuf, contFunc, reinterpret_cast<void *>(idx));
+        rpc->run_event_loop_once();
+        return true;
+    }
+
+    /* Wait until all requests issued by rpcCallAsync have completed */
+    void drainAsync()
     {
+        while (asyncInflight)
+            rpc->run_event_loop_once();
+    }
+
+    /**
+     * Run the event loop until stopServer.
+     * eRPC cannot block on its queues, so once no request has been served for the spin budget
+     * (POLL_SPIN_US), the loop sleeps between polls, doubling the sleep up to MaxIdleSleepUs.
+     */
+    void startServer()
+    {
+        using namespace std::chrono;
+        auto spinBudget = microseconds(cmdConf->pollSpinUs);
+        auto lastServed = steady_clock::now();
+        uint64_t served = responses;
+        int sleepUs = 1;
+
         shouldRun = true;
-        while (shouldRun)
-            rpc->run_event_loop(checkInterval);
+        while (shouldRun) {
+            rpc->run_event_loop_once();
+            if (responses != served || spinBudget.count() < 0) {
+                served = responses;
+                lastServed = steady_clock::now();
+                sleepUs = 1;
+            }
+            else if (steady_clock::now() - lastServed >= spinBudget) {
+                std::this_thread::sleep_for(microseconds(sleepUs));
+                sleepUs = std::min(sleepUs * 2, MaxIdleSleepUs);
+            }
+        }
     }
 
     /* Once started, it is impossible to stop without something like signals */
@@ -149,27 +207,47 @@ public:
     }
 
 private:
+    void connectServers()
+    {
+        for (int i = 0; i < clusterConf->getClusterSize(); ++i) {
+            NodeConfig conf = (*clusterConf)[i];
+            if ((static_cast<int>(conf.type) & NODE_SERVER) == 0)
+                continue;
+            if ((!cmdConf->recover && conf.id < myNodeConf->id) || cmdConf->recover) {
+                std::string uri = conf.hostname + ":" + std::to_string(cmdConf->udpPort);
+                int sess = sessions[conf.id] = rpc->create_session(uri, 0);
+                sess2id[sess] = conf.id;
+                while (!rpc->is_connected(sessions[conf.id]))
+                    rpc->run_event_loop_once();
+            }
+        }
+    }
+
     using BitmapTy = typename Bits2Type<NLockers>::type;
     struct Locker
     {
         volatile bool completed;
+        bool async = false;                 /* Request buffer and locker freed on completion */
+        erpc::MsgBuffer reqBuf;
         erpc::MsgBuffer respBuf; 
 
         explicit Locker() = default;
         inline void complete() { completed = true; }
     };
 
-    std::unique_ptr<erpc::Nexus> nexus;
+    std::shared_ptr<erpc::Nexus> nexus;     /* Shared by the endpoints of a process */
     std::unique_ptr<erpc::Rpc<erpc::CTransport>> rpc;
 
     volatile bool shouldRun;
     std::thread listener;
 
-    int sessions[MAX_NODES];
+    std::vector<int> sessions;          /* Indexed by node ID */
     std::unordered_map<int, int> sess2id;
 
     Locker locks[NLockers];
     Bitmap<NLockers> bitmap;
+    int asyncInflight = 0;
+    uint64_t responses = 0;             /* Responses sent, to tell idle event loops */
 };
 
 template <typename Ty>
@@ -17,39 +17,141 @@
 #include <sys/socket.h>
 #include <netdb.h>
 #include <condition_variable>
+#include <functional>
+#include <deque>
 
 #include <infiniband/verbs.h>
 #include <rdma/rdma_cma.h>
 
 #include "../config.hpp"
 #include "../bitmap.hpp"
+#include "../slotpool.hpp"
 #include "../datablock.hpp"
 #include "message.hpp"
+#include "slab.hpp"
+#include "rdmastats.hpp"
+
+/* WR IDs: [63..48] connection generation (one-sided WRs only, 0 otherwise) | [47..32] peer | [31..0] task */
+#define WRID(p, t)              COMBINE_I32(p, t)
+#define WRID_GEN(p, g, t)       COMBINE_I32((uint32_t)(g) << 16 | (p), t)
+#define WRID_PEER(id)           (EXTRACT_X(id) & 0xFFFF)
+#define WRID_GENERATION(id)     (EXTRACT_X(id) >> 16)
+#define WRID_TASK(id)           EXTRACT_Y(id)
+static_assert(MAX_NODES <= 0x10000, "node IDs do not fit in WR IDs");
+
+/*
+ * Connection state of a peer.
+ * Idle -> Connecting -> Connected -> (disconnection) Failed -> (retry) Connecting ...
+ */
+enum class PeerState
+{
+    Idle,                               /* Never connected */
+    Connecting,                         /* CM handshake in progress, either way */
+    Connected,
+    Failed                              /* Disconnected or unreachable, retried after a while */
+};
+
+/*
+ * Whether a connected peer is in the I/O path. A peer whose connection is lost has missed
+ * writes, so it is fenced, and only readmitted once it has been rebuilt:
+ * Fenced -> (it catches up) WritesOnly -> (it is in sync, and nothing it missed is left) Admitted
+ */
+enum class PeerAdmission
+{
+    Fenced,                             /* Neither read from nor written to */
+    WritesOnly,                         /* Written to, not read from */
+    Admitted
+};
+
+/* Recovery phase of a node, in the low bits of its status word (incarnation | phase) */
+enum class NodePhase : uint64_t
+{
+    Recovering = 1,                     /* Rebuilding while fenced (RECOVER) */
+    CatchingUp = 2,                     /* Rebuilding what was written meanwhile, written to */
+    Synced = 3
+};
+
+/* Sent in the private data of CM connection requests and replies */
+struct ConnPrivateData
+{
+    uint32_t nodeId;
+    uint32_t rkey;                      /* Major MR */
+    uint64_t addr;
+    uint64_t creditAddr;                /* Where to return receive credits */
+    uint32_t creditRkey;
+    uint32_t heartbeatRkey;
+    uint64_t heartbeatAddr;             /* Heartbeat words, read by the failure detector */
+    uint64_t status;                    /* Incarnation | NodePhase */
+};
 
 /* Store necessary information for a connection with a peer. */
 struct RDMAConnection
 {
+    /* Read/write regions: STAGING_SLOTS (at least NConcurrency) 4kB slots, then one for ECAL extents */
     static const int NConcurrency = 32;
+    static const size_t ExtentRegionSize = MAX_STRIPE_UNIT;
+    /* Send/recv regions: rings of NMsgSlots message buffers */
+    static const int NMsgSlots = RDMA_MSG_SLOTS;
 
     int peerId;
-    bool connected;
+    std::atomic<PeerState> state;
+    bool outgoing;                      /* `cmId` was created by me */
+    bool retrying;                      /* Reconnecting after a failure, which nobody waits for */
+    std::chrono::steady_clock::time_point retryAt;
     int forcedConnStat;
 
-    rdma_cm_id *cmId;                   /* CM: allocated */
+    rdma_cm_id *cmId;                   /* CM: allocated, current connection (attempt) */
     ibv_qp *qp;                         /* QP: allocated */
 
-    ibv_mr *sendMR;                     /* Send Region MR */
-    ibv_mr *recvMR;                     /* Recv Region MR */
-    ibv_mr *writeMR;                    /* Write Region MR */
-    ibv_mr *readMR;                     /* Read Region MR */
+    ibv_mr *regionMR;                   /* MR of the slab chunk holding all 4 regions */
     ibv_mr peerMR;                      /* MR of peer */
     
-    uint8_t *sendRegion;                /* Send Region: allocated */
-    uint8_t *recvRegion;                /* Recv Region: allocated */
-    uint8_t *writeRegion;               /* Write Region: allocated */
-    uint8_t *readRegion;                /* Read Region: allocated */
-    Bitmap<NConcurrency> readBitmap;
-    Bitmap<NConcurrency> writeBitmap;
+    uint8_t *sendRegion;                /* Send Region: carved out of the slab */
+    uint8_t *recvRegion;                /* Recv Region: carved out of the slab */
+    uint8_t *writeRegion;               /* Write Region: carved out of the slab */
+    uint8_t *readRegion;                /* Read Region: carved out of the slab */
+    std::unique_ptr<SlotPool> readSlots;
+    std::unique_ptr<SlotPool> writeSlots;
+
+    /*
+     * Credit-based flow control of messages: the peer keeps NMsgSlots receives posted, and
+     * RDMA-writes the count of messages it has released to `peerReleased`.
+     * A message can be sent while fewer than NMsgSlots are unreleased, which also guarantees
+     * that its buffer in the send ring is no longer in use.
+     */
+    std::mutex sendMutex;
+    uint64_t sendSeq;                   /* Messages sent to the peer */
+    volatile uint64_t *peerReleased;    /* Messages released by the peer */
+    uint64_t recvReleased;              /* Messages from the peer released (reposted) by me */
+    uint64_t recvReported;              /* Last recvReleased written to the peer */
+    uint64_t creditAddr;                /* Peer's `peerReleased` word for me */
+    uint32_t creditRkey;
+
+    /*
+     * One-sided WRs are tagged with the generation of the connection. When the peer is declared
+     * dead, the generation is bumped and the WRs in flight are completed with flush errors at
+     * once, while their actual completions (if any) are dropped.
+     */
+    std::atomic<uint64_t> inflight;     /* [63..48] generation (never 0) | [47..0] one-sided WRs in flight */
+    uint64_t heartbeatAddr;             /* Peer's heartbeat words */
+    uint32_t heartbeatRkey;
+    std::atomic<int> wordReads;         /* Reads of heartbeat words in flight */
+
+    std::atomic<PeerAdmission> admission;
+    uint64_t fencedIncarnation;         /* Last incarnation fenced, 0 if never */
+    std::atomic<bool> missedWrites;     /* Skipped by a write while never admitted yet */
+
+    RDMAOpStats opStats[(int)RDMAOp::Count];
+};
+
+/* Completion polling counters of a CQ */
+struct PollStats
+{
+    std::atomic<uint64_t> waits { 0 };          /* Waits for CQEs */
+    std::atomic<uint64_t> spinHits { 0 };       /* Waits that ended within the spin budget */
+    std::atomic<uint64_t> blocks { 0 };         /* Waits that blocked on the completion channel */
+    std::atomic<uint64_t> spinNs { 0 };         /* Time spent spinning, i.e. CPU burnt */
+    std::atomic<uint64_t> blockNs { 0 };        /* Time spent blocked until CQEs were found */
 };
 
 /* Predeclaration for RDMASocket to befriend it */
@@ -72,56 +174,122 @@ public:
     RDMASocket &operator=(const RDMASocket &) = delete;
 
     inline void __markAsAlive(int peerId) { peers[peerId].forcedConnStat = 1; }
-    inline void __markAsDead(int peerId) { peers[peerId].forcedConnStat = -1; }
+    void declareDead(int peerId);
+    inline void __markAsDead(int peerId)
+    {
+        peers[peerId].forcedConnStat = -1;
+        if (onPeerDeath)
+            onPeerDeath(peerId);
+    }
     inline void __cancelMarking(int peerId) { peers[peerId].forcedConnStat = 0; }
 
+    /* Called when a peer disconnects (from the RDMA CM thread), or is declared or marked as dead */
+    inline void setPeerDeathHandler(std::function<void(int)> handler) { onPeerDeath = handler; }
+    /*
+     * Called before readmitting a fenced peer, without locks held: to writes (`full` false),
+     * as a barrier with writes in progress, or to reads and writes. The peer stays fenced if
+     * it returns false. No handler admits peers.
+     */
+    inline void setPeerAdmitHandler(std::function<bool(int, bool)> handler) { onPeerAdmit = handler; }
+
+    /* Publish my recovery phase to peers */
+    void setPhase(NodePhase phase);
+    inline NodePhase getPhase() const
+    {
+        return (NodePhase)(__atomic_load_n(heartbeatArea + HbStatus, __ATOMIC_RELAXED) & PhaseMask);
+    }
+    /* Whether every connected peer writes to me, as I am catching up */
+    bool isWrittenByPeers();
+    /* Source of my foreground p99 in ns, published to peers while one of them is not admitted */
+    inline void setP99Source(std::function<uint64_t()> source) { p99Source = source; }
+    /* Max foreground p99 that connected peers publish, while I am not in sync (0 otherwise) */
+    uint64_t getPeersP99();
+
     void verboseQP(int peerId);
+    /* Whether a peer may be read from and written to: connected and admitted (myself: in sync) */
     bool isPeerAlive(int peerId);
+    /* Whether a peer must be written to: connected and not fenced */
+    bool acceptsWrites(int peerId);
+    /* Whether a peer is connected, whatever its admission (e.g. to hold stripe locks) */
+    bool isPeerConnected(int peerId);
     void stopListenerAndJoin();
 
-    void postSend(int peerId, uint64_t length);
-    void postReceive(int peerId, uint64_t length, int specialTaskId = 0);
+    bool sendMessage(int peerId, const void *msg, uint32_t length);
+    void releaseReceive(const ibv_wc *wc);
     void postWrite(int peerId, uint64_t remoteDstShift, uint64_t localSrc, uint64_t length, int imm = -1);
     void postRead(int peerId, uint64_t remoteSrcShift, uint64_t localDst, uint64_t length, uint32_t taskId = 0);
+    /* As above, into memory the caller registered with allocMR */
+    void postRead(int peerId, uint64_t remoteSrcShift, void *localDst, uint64_t length, ibv_mr *localMR);
 
+    void postCompareSwap(int peerId, uint64_t remoteShift, uint64_t *result, uint64_t expected, uint64_t desired);
+    void postPersistFence(int peerId, uint64_t remoteShift);
     void postSpecialSend(int peerId, ibv_send_wr *wr);
     void postSpecialReceive(int peerId, ibv_recv_wr *wr);
 
-    inline uint8_t *getSendRegion(int peerId) { return peers[peerId].sendRegion; }
-    inline uint8_t *getRecvRegion(int peerId) { return peers[peerId].recvRegion; }
+    /* Message received with `wc`, valid until releaseReceive(wc) */
+    inline const uint8_t *getRecvMessage(const ibv_wc *wc)
+    {
+        return peers[WRID_PEER(wc->wr_id)].recvRegion + WRID_TASK(wc->wr_id) * RDMA_BUF_SIZE;
+    }
+    /* Staging slots of a connected peer; waits until a slot is freed if all are taken */
     inline uint8_t *getWriteRegion(int peerId)
     {
-        int idx = peers[peerId].writeBitmap.allocBit();
-        while (idx == -1) {
-            std::this_thread::yield();
-            idx = peers[peerId].writeBitmap.allocBit();
-        }
-        return peers[peerId].writeRegion + idx * Block4K::capacity;
+        return peers[peerId].writeRegion + peers[peerId].writeSlots->get() * Block4K::capacity;
     }
     inline uint8_t *getReadRegion(int peerId)
     {
-        int idx = peers[peerId].readBitmap.allocBit();
-        while (idx == -1) {
-            std::this_thread::yield();
-            idx = peers[peerId].readBitmap.allocBit();
-        }
-        return peers[peerId].readRegion + idx * Block4K::capacity;
+        return peers[peerId].readRegion + peers[peerId].readSlots->get() * Block4K::capacity;
+    }
+    /* As above, but nullptr if all slots are taken */
+    inline uint8_t *tryGetWriteRegion(int peerId)
+    {
+        int idx = peers[peerId].writeSlots->tryGet();
+        return idx < 0 ? nullptr : peers[peerId].writeRegion + idx * Block4K::capacity;
+    }
+    inline uint8_t *tryGetReadRegion(int peerId)
+    {
+        int idx = peers[peerId].readSlots->tryGet();
+        return idx < 0 ? nullptr : peers[peerId].readRegion + idx * Block4K::capacity;
+    }
+    /* Extent slots are not allocated: their only user (ECAL) serializes accesses */
+    inline uint8_t *getExtentWriteRegion(int peerId)
+    {
+        return peers[peerId].writeRegion + Block4K::capacity * stagingSlots;
+    }
+    inline uint8_t *getExtentReadRegion(int peerId)
+    {
+        return peers[peerId].readRegion + Block4K::capacity * stagingSlots;
     }
     inline void freeWriteRegion(int peerId, uint8_t *addr)
     {
-        int idx = (addr - peers[peerId].writeRegion) / Block4K::capacity;
-        peers[peerId].writeBitmap.freeBit(idx);
+        peers[peerId].writeSlots->put((addr - peers[peerId].writeRegion) / Block4K::capacity);
     }
     inline void freeReadRegion(int peerId, uint8_t *addr)
     {
-        int idx = (addr - peers[peerId].readRegion) / Block4K::capacity;
-        peers[peerId].readBitmap.freeBit(idx);
+        peers[peerId].readSlots->put((addr - peers[peerId].readRegion) / Block4K::capacity);
     }
+    /* RDMA_ATOMIC_RESULTS result words of atomics, not allocated: their only user (ECAL) serializes accesses */
+    inline uint64_t *getAtomicResults() { return atomicResults; }
+    /* Whether RDMA atomics are atomic with CPU atomics on the same words */
+    inline bool hasGlobalAtomics() const { return globalAtomics; }
+    inline const SlotPool::Stats &getWriteSlotStats(int peerId) { return peers[peerId].writeSlots->getStats(); }
+    inline const SlotPool::Stats &getReadSlotStats(int peerId) { return peers[peerId].readSlots->getStats(); }
 
     int pollSendCompletion(ibv_wc *wc);
     int pollSendCompletion(ibv_wc *wc, int numEntries);
+    int pollSendCompletionAny(ibv_wc *wc, int maxEntries);
     int pollRecvCompletion(ibv_wc *wc);
     inline ibv_mr *allocMR(void *addr, size_t length, int acc) { return ibv_reg_mr(pd, addr, length, acc); }
+    inline RegisteredSlab::Stats getSlabStats() { return slab->getStats(); }
+
+    /* Spin for `us` microseconds before blocking for completions (<0: spin forever) */
+    inline void setPollSpinBudget(int us) { spinBudget = std::chrono::microseconds(us); }
+    inline const PollStats &getPollStats(int cqIndex) const { return pollStats[cqIndex]; }
+
+    /* Latencies and counters of one-sided operations with a peer, unless RDMA_STATS is off */
+    inline const RDMAOpStats &getOpStats(int peerId, RDMAOp op) const { return peers[peerId].opStats[(int)op]; }
+    inline void setStatsEnabled(bool enabled) { statsEnabled = enabled; }
+    void dumpStats(FILE *out);
 
 private:
     void listenRDMAEvents();
@@ -129,44 +297,97 @@ private:
     void onRouteResolved(rdma_cm_event *event);
     void onConnectionRequest(rdma_cm_event *event);
     void onConnectionEstablished(rdma_cm_event *event);
+    void onConnectionFailed(rdma_cm_event *event);
     void onDisconnected(rdma_cm_event *event);
     void onSendCompletion(ibv_wc *wc);
 
+    bool ensureConnected(int peerId);
+    void connect(int peerId);
+    int findPeer(rdma_cm_id *cmId);
+    void dropStaleId(rdma_cm_id *cmId);
     void buildResources(ibv_context *ctx);
     void buildConnection(rdma_cm_id *cmId);
-    void buildConnParam(rdma_conn_param *param);
-    void destroyConnection(rdma_cm_id *cmId);
+    void buildConnParam(rdma_conn_param *param, ConnPrivateData *data, int peerId);
+    void setRemote(int peerId, const ConnPrivateData *data);
+    void abandonConnection(int peerId);
+    void destroyConnection(int peerId);
 
-    void processRecvWriteWithImm(ibv_wc *wc);
+    void postReceive(int peerId, int slot);
+    void returnCredits(int peerId);
+    int pollSendCQ(ibv_wc *wc, int numEntries);
+    void drainSendCQ();
+    template <typename PollFn> int hybridPoll(int cqIndex, PollFn poll);
+
+    uint64_t startOp(int peerId, RDMAOp op);
+    void failOp(int peerId, RDMAOp op, uint64_t wrId);
+    void recordCompletion(const ibv_wc *wc);
+    bool acceptCompletion(const ibv_wc *wc);
+    void flushPeer(int peerId);
+    void fencePeer(int peerId);
+    void runHeartbeats();
+    struct Admission
+    {
+        int peerId;
+        uint64_t incarnation;
+        bool full;                          /* To reads and writes, not writes only */
+    };
+    void admitPeers(const std::vector<Admission> &admits);
 
     ibv_context *ctx = nullptr;
     ibv_pd *pd = nullptr;                   /* Common protection domain */
     ibv_mr *mr = nullptr;                   /* Common memory region */
+    std::unique_ptr<RegisteredSlab> slab;   /* Staging regions of all peers */
+    uint64_t *atomicResults = nullptr;      /* Carved out of the slab */
+    ibv_mr *atomicMR = nullptr;
+    uint64_t *fenceSink = nullptr;          /* Destination of persistence fences, carved out of the slab */
+    ibv_mr *fenceMR = nullptr;
+    bool globalAtomics = false;
+    int stagingSlots;                       /* 4kB slots of read/write regions */
+    size_t regionSize;                      /* Of read/write regions */
     ibv_cq *cq[MAX_CQS];                    /* [0]: send CQ; [1]: recv CQ */
-    ibv_comp_channel *compChannel[MAX_CQS]; /* [0]: send channel; [1]: recv channel (NOT USED) */
+    ibv_comp_channel *compChannel[MAX_CQS]; /* [0]: send channel; [1]: recv channel */
+    std::chrono::nanoseconds spinBudget;    /* Of hybridPoll, negative to spin forever */
+    PollStats pollStats[MAX_CQS];
+    volatile bool statsEnabled;             /* Time one-sided operations (RDMA_STATS) */
+    double nsPerTick;                       /* Of TscClock */
+    std::chrono::steady_clock::time_point nextDump;
 
     rdma_event_channel *ec = nullptr;       /* Common RDMA event channel */
     rdma_cm_id *listener = nullptr;         /* RDMA listener */
     std::thread ecPoller;                   /* listenRDMAEvents thread */
 
-    RDMAConnection peers[MAX_NODES];        /* Peer connections */
-    std::map<uint64_t, int> cm2id;          /* Map rdma_cm_id pointer to peer */
-    uint32_t nodeIDBuf;                     /* Send my node ID on connection */
+    std::vector<RDMAConnection> peers;      /* Indexed by node ID, the context of their CM IDs */
+    std::mutex connMutex;                   /* Connection states and cmIds */
+    std::condition_variable connCondVar;    /* Notified when a connection attempt ends */
+    std::vector<rdma_cm_id *> doomedIds;    /* Destroyed once the current CM event is acked */
+
+    uint64_t *creditArea = nullptr;         /* [peer]: released by peer; [#peers + peer]: by me */
+    ibv_mr *creditMR = nullptr;
+    /*
+     * Heartbeat words peers read: [HbBeat]: my heartbeat counter; [HbStatus]: incarnation | phase;
+     * [HbP99]: my foreground p99 in ns; [HbWords + peer]: incarnation of the peer I write to,
+     * 0 if fenced
+     */
+    static const int HbBeat = 0, HbStatus = 1, HbP99 = 2, HbWords = 3;
+    static const uint64_t PhaseMask = 3;
+    uint64_t *heartbeatArea = nullptr;
+    ibv_mr *heartbeatMR = nullptr;
+    uint64_t myIncarnation;
+    /* [peer * PeerWords]: copy of its heartbeat words, then of its word for me */
+    static const int PeerWords = HbWords + 1;
+    uint64_t *peerWords = nullptr;
+    ibv_mr *peerWordsMR = nullptr;
+    std::thread heartbeater;                /* runHeartbeats thread */
+    std::mutex sendCQMutex;                 /* Message completions are filtered out of the send CQ */
+    std::deque<ibv_wc> stashedWCs;          /* Other completions polled while draining it */
+    std::atomic<int> pendingMessageWCs { 0 };
 
     volatile bool shouldRun;                /* Stop threads if false */
     bool initialized = false;               /* Indicate whether the ctor has finished */
-    int incomingConns = 0;                  /* Incoming successful connections count */
 
-    std::mutex stopSpinMutex;               /* To stop ctor from spinning */
-    std::condition_variable ssmCondVar;     /* To stop ctor from spinning */
-
-    int degraded = 0;                       /* Indicate whether the EC group is degraded */
-    std::vector<uint64_t> writeLog;         /* In-DRAM write log for degradation write */
-    ibv_mr *logMR[MAX_NODES];               /* Write log MR for remote recovery */
+    std::function<void(int)> onPeerDeath;
+    std::function<bool(int, bool)> onPeerAdmit;
+    std::function<uint64_t()> p99Source;
 };
 
-#define WRID(p, t)      COMBINE_I32(p, t)
-#define WRID_PEER(id)   EXTRACT_X(id)
-#define WRID_TASK(id)   EXTRACT_Y(id)
-
 #endif // RDMA_HPP
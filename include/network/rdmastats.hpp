@@ -0,0 +1,141 @@
+/******************************************************************
+ * This file is part of Galois.                                   *
+ *                                                                *
+ * Galois: Highly-available NVM Distributed File System           *
+ * Copyright (c) 2020 Storage Research Group, Tsinghua University *
+ ******************************************************************/
+
+#if !defined(RDMASTATS_HPP)
+#define RDMASTATS_HPP
+
+#include <cstdint>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <x86intrin.h>
+
+/* One-sided operations RDMASocket times, per peer */
+enum class RDMAOp
+{
+    Write,
+    Read,
+    Atomic,
+    Fence,                                  /* Persistence fence (an 8-byte read) */
+    Count
+};
+
+static inline const char *rdmaOpName(RDMAOp op)
+{
+    static const char *names[] = { "write", "read", "atomic", "fence" };
+    return names[(int)op];
+}
+
+/* Time stamp counter, calibrated once against steady_clock */
+class TscClock
+{
+public:
+    static __always_inline uint64_t now() { return __rdtsc(); }
+    static double nsPerTick()
+    {
+        static double ratio = calibrate();
+        return ratio;
+    }
+
+private:
+    static double calibrate()
+    {
+        using namespace std::chrono;
+        auto start = steady_clock::now();
+        uint64_t tsc = __rdtsc();
+        while (steady_clock::now() - start < milliseconds(10));
+        double ns = duration_cast<nanoseconds>(steady_clock::now() - start).count();
+        return ns / (__rdtsc() - tsc);
+    }
+};
+
+/**
+ * Log-linear histogram of latencies in ns, as HDR histograms: 2^SubBits buckets per power of
+ * two, i.e. values are known within 1/16, up to 2^MaxBits ns (17 s, longer ones are clamped).
+ * Recording is not atomic, but lock-free for readers: writers must be serialized.
+ */
+class LatencyHistogram
+{
+public:
+    static const int SubBits = 4;
+    static const int MaxBits = 34;
+    static const int NBuckets = (MaxBits - SubBits + 1) << SubBits;
+
+    __always_inline void record(uint64_t ns)
+    {
+        bump(buckets[bucketOf(ns)], 1);
+        bump(count, 1);
+        bump(sum, ns);
+    }
+
+    inline uint64_t getCount() const { return count.load(std::memory_order_relaxed); }
+    inline double mean() const { return getCount() ? (double)sum.load(std::memory_order_relaxed) / getCount() : 0; }
+
+    /* Latency at percentile `p` (0 - 100], as the middle of its bucket; 0 if empty */
+    uint64_t percentile(double p) const
+    {
+        uint64_t total = getCount();
+        if (!total)
+            return 0;
+        uint64_t rank = std::max<uint64_t>(1, (uint64_t)(p / 100 * total + 0.5)), seen = 0;
+        for (int i = 0; i < NBuckets - 1; ++i) {
+            seen += buckets[i].load(std::memory_order_relaxed);
+            if (seen >= rank)
+                return (lowerBound(i) + lowerBound(i + 1) - 1) / 2;
+        }
+        return lowerBound(NBuckets - 1);
+    }
+
+    void reset()
+    {
+        for (auto &bucket : buckets)
+            bucket = 0;
+        count = 0;
+        sum = 0;
+    }
+
+private:
+    static __always_inline void bump(std::atomic<uint64_t> &x, uint64_t n)
+    {
+        x.store(x.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+    }
+    static __always_inline int bucketOf(uint64_t ns)
+    {
+        if (ns < (1UL << SubBits))
+            return ns;
+        int msb = 63 - __builtin_clzll(ns);
+        if (msb >= MaxBits)
+            return NBuckets - 1;
+        int shift = msb - SubBits;
+        return ((shift + 1) << SubBits) + (int)((ns >> shift) - (1UL << SubBits));
+    }
+    static uint64_t lowerBound(int bucket)
+    {
+        if (bucket < (1 << SubBits))
+            return bucket;
+        int shift = (bucket >> SubBits) - 1;
+        return ((1UL << SubBits) + (bucket & ((1 << SubBits) - 1))) << shift;
+    }
+
+    std::atomic<uint64_t> buckets[NBuckets] = { };
+    std::atomic<uint64_t> count { 0 };
+    std::atomic<uint64_t> sum { 0 };
+};
+
+/* Counters of one operation with one peer. Completions are accounted by a single poller at a time. */
+struct RDMAOpStats
+{
+    LatencyHistogram latency;                   /* From post to completion polled, of sampled ones, modulo 2^31 TSC ticks */
+    std::atomic<uint64_t> posted { 0 };
+    std::atomic<uint64_t> completed { 0 };      /* Including failed ones */
+    std::atomic<uint64_t> errors { 0 };         /* Failed completions */
+    std::atomic<uint64_t> postErrors { 0 };     /* Failed posts, not counted as posted */
+
+    inline uint64_t outstanding() const { return posted - completed; }
+};
+
+#endif // RDMASTATS_HPP
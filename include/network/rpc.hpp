@@ -17,7 +17,7 @@ struct ReqBuf
     ibv_wc wc;
     Message msg;
     explicit ReqBuf() = default;
-    ReqBuf(const ibv_wc &wc, Message *msg) : wc(wc), msg(*msg) { }
+    ReqBuf(const ibv_wc &wc, const Message *msg) : wc(wc), msg(*msg) { }
 };
 
 /**
@@ -63,7 +63,7 @@ private:
     std::thread rpcListener;            /* Poll distributed CQEs */
     void (*rpcProcessor)(const RPCMessage *request, RPCMessage *response) = nullptr;
 
-    short peerAliveStatus[MAX_NODES];
+    std::vector<short> peerAliveStatus;     /* Indexed by node ID */
     std::atomic<bool> shouldRun;
     Queue sq;                           /* Responses of sent (outbound) RPCs */
     Queue rq;                           /* Received (inbound) RPC requests */
@@ -0,0 +1,76 @@
+/******************************************************************
+ * This file is part of Galois.                                   *
+ *                                                                *
+ * Galois: Highly-available NVM Distributed File System           *
+ * Copyright (c) 2020 Storage Research Group, Tsinghua University *
+ ******************************************************************/
+
+#if !defined(SLAB_HPP)
+#define SLAB_HPP
+
+#include <infiniband/verbs.h>
+
+#include "../commons.hpp"
+
+/**
+ * Registered memory for RDMA staging buffers.
+ *
+ * Buffers are carved out of large chunks, each registered as a single MR, so that the number
+ * of MRs (and of pinned mappings) does not grow with the number of peers.
+ * Chunks are backed by 1 GiB or 2 MiB hugepages when available (transparent hugepages
+ * otherwise), on the NUMA node of the NIC. Buffers are never freed before the slab.
+ */
+class RegisteredSlab
+{
+public:
+    struct Block
+    {
+        uint8_t *addr;
+        ibv_mr *mr;                             /* MR of the chunk holding the block */
+    };
+
+    struct Stats
+    {
+        uint64_t chunks;                        /* Also the number of MRs */
+        uint64_t registeredBytes;
+        uint64_t hugepageBytes;                 /* Registered bytes on explicit hugepages */
+        uint64_t usedBytes;                     /* Carved out as blocks */
+        int numaNode;                           /* Of the chunks, -1 if unknown */
+    };
+
+    /**
+     * @param chunkBytes    Size of chunks, rounded up to hugepages (larger blocks get their own).
+     * @param access        Access flags of the MRs.
+     */
+    RegisteredSlab(ibv_pd *pd, size_t chunkBytes, int access);
+    ~RegisteredSlab();
+    RegisteredSlab(const RegisteredSlab &) = delete;
+    RegisteredSlab &operator=(const RegisteredSlab &) = delete;
+
+    /* Page-aligned block of `length` bytes, or { nullptr, nullptr } if out of memory */
+    Block alloc(size_t length);
+    Stats getStats();
+
+private:
+    struct Chunk
+    {
+        uint8_t *base;
+        size_t length;
+        size_t used;
+        size_t pageSize;
+        ibv_mr *mr;
+    };
+
+    bool addChunk(size_t length);
+
+    ibv_pd *pd;
+    size_t chunkBytes;
+    int access;
+    int numaNode = -1;
+
+    std::mutex mutex;
+    std::vector<Chunk> chunks;                  /* Blocks are carved out of the last one */
+    uint64_t usedBytes = 0;
+};
+
+#endif // SLAB_HPP
@@ -0,0 +1,124 @@
+/******************************************************************
+ * This file is part of Galois.                                   *
+ *                                                                *
+ * Galois: Highly-available NVM Distributed File System           *
+ * Copyright (c) 2020 Storage Research Group, Tsinghua University *
+ ******************************************************************/
+
+#if !defined(QOS_HPP)
+#define QOS_HPP
+
+#include <cmath>
+#include <functional>
+#include <mutex>
+
+#include "network/rdmastats.hpp"
+
+/* Classes of ECAL I/O the QoS scheduler tells apart */
+enum class TrafficClass
+{
+    Foreground,                             /* Client reads and writes */
+    Degraded,                               /* Client reads and writes missing some fragments */
+    Rebuild,
+    Scrub,
+    Count
+};
+
+static inline const char *trafficClassName(TrafficClass cls)
+{
+    static const char *names[] = { "foreground", "degraded", "rebuild", "scrub" };
+    return names[(int)cls];
+}
+
+/**
+ * Traffic class scheduler of the ECAL I/O of a node.
+ *
+ * Foreground classes are never delayed: their latencies, from the call to the return of the
+ * ECAL operation (waiting for ioMutex included), are recorded. Background classes take tokens
+ * (bytes to fetch) from a token bucket of their own before issuing I/O, and wait while it is
+ * in debt. A bucket refills at the rate of its class, and holds at most an epoch of it.
+ *
+ * With a p99 target, the rates of background classes are adjusted every epoch on the p99 of
+ * foreground latencies during the epoch (AIMD): cut to half of what the class used if above
+ * the target, raised by a quarter if below it, and doubled if there was no foreground I/O,
+ * between MinRate and the ceiling of the class. Degraded operations are slow by nature and
+ * do not count, or a degraded workload would starve the rebuild that ends it.
+ * A recovering node serves little foreground I/O of its own while its rebuild loads its peers:
+ * the p99 of peers (see setRemoteP99) counts as well, and the epoch is idle only if both are.
+ */
+class QoS
+{
+public:
+    static constexpr double MinRate = 4e6;          /* Bytes/s, so that background I/O progresses */
+    static constexpr double Unlimited = INFINITY;
+
+    struct ClassStats
+    {
+        uint64_t ops;
+        uint64_t bytes;
+        uint64_t p50Ns;                             /* Foreground classes only */
+        uint64_t p99Ns;
+        double rate;                                /* Bytes/s of background classes, Unlimited if not throttled */
+        double throttledSec;                        /* Time background I/O was told to wait */
+    };
+
+    /**
+     * @param targetP99Ns   Foreground p99 latency that background classes back off at (0: none,
+     *                      their rates stay at their ceilings).
+     * @param epochNs       Interval of rate adjustments.
+     */
+    explicit QoS(uint64_t targetP99Ns, uint64_t epochNs);
+    QoS(const QoS &) = delete;
+    QoS &operator=(const QoS &) = delete;
+
+    /* Max rate of a background class in bytes/s (Unlimited by default); resets its rate to it */
+    void setCeiling(TrafficClass cls, double bytesPerSec);
+    void setTarget(uint64_t targetP99Ns);
+    /* Source of the foreground p99 of other nodes to back off on too, 0 if none */
+    void setRemoteP99(std::function<uint64_t()> source);
+
+    /* Whether I/O of `cls` may have to wait */
+    bool throttles(TrafficClass cls) const;
+
+    /* Account a foreground operation of `bytes` started at TSC `start` */
+    void record(TrafficClass cls, uint64_t start, uint64_t bytes);
+
+    /* Take `bytes` of tokens of a background class. Returns when the I/O may be issued. */
+    std::chrono::steady_clock::time_point reserve(TrafficClass cls, uint64_t bytes);
+
+    ClassStats getStats(TrafficClass cls) const;
+    inline uint64_t getBackoffs() const { return backoffs; }
+    inline uint64_t getLastP99() const { return lastP99Ns; }
+    /* Foreground p99 of the last epoch of this node, 0 without foreground I/O, whatever the target */
+    uint64_t getForegroundP99();
+
+private:
+    struct Bucket
+    {
+        double ceiling = Unlimited;
+        double rate = Unlimited;
+        double tokens = 0;
+        std::chrono::steady_clock::time_point last;
+        uint64_t ops = 0;
+        uint64_t bytes = 0;
+        uint64_t epochBytes = 0;
+        double throttledSec = 0;
+    };
+
+    void adjust(std::chrono::steady_clock::time_point now);
+
+    mutable std::mutex mutex;
+    uint64_t targetP99Ns;
+    std::chrono::nanoseconds epoch;
+    std::chrono::steady_clock::time_point epochStart;
+    Bucket buckets[(int)TrafficClass::Count];
+    LatencyHistogram latency[(int)TrafficClass::Count];
+    LatencyHistogram epochLatency;                  /* Of Foreground, since epochStart */
+    uint64_t lastP99Ns = 0;                         /* That the last adjustment was made on */
+    uint64_t foregroundP99Ns = 0;
+    std::function<uint64_t()> remoteP99;
+    uint64_t backoffs = 0;
+    bool backingOff = false;                        /* The last epoch was over the target */
+};
+
+#endif // QOS_HPP
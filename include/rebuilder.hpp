@@ -0,0 +1,146 @@
+/******************************************************************
+ * This file is part of Galois.                                   *
+ *                                                                *
+ * Galois: Highly-available NVM Distributed File System           *
+ * Copyright (c) 2020 Storage Research Group, Tsinghua University *
+ ******************************************************************/
+
+#if !defined(REBUILDER_HPP)
+#define REBUILDER_HPP
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+
+#include "ecal.hpp"
+
+/**
+ * Node rebuild engine: reconstructs this node's fragments of a range of rows from the
+ * surviving nodes of their stripes, e.g. after its NVM was lost.
+ *
+ * Rows are rebuilt in chunks of ChunkRows consecutive rows, whose fragments (and checksums)
+ * are fetched with a single RDMA read per source. Up to `depth` chunks are in flight, while
+ * `threads` workers verify the fetched ones, decode them with cached decode tables, and store
+ * the rebuilt fragments into the local pool with non-temporal stores.
+ *
+ * rebuildDirty() only rebuilds the rows that other nodes wrote while this node was dead, as
+ * their dirty maps (see DirtyMap) tell. Their marks are cleared before the rows are rebuilt,
+ * and set again for the rows that could not be.
+ *
+ * The rebuild owns the send CQ (it holds ECAL's ioMutex) until it is done, or between pauses
+ * if QoS throttles it (see run()). It does not lock rows: stripes written meanwhile may be
+ * rebuilt from fragments older than their write. On recovery, that is harmless while peers
+ * fence this node, as they mark the rows they write dirty; catchUp() then rebuilds those, row
+ * locks held, while peers write to this node again.
+ */
+class Rebuilder
+{
+public:
+    static const int ChunkRows = 32;
+    static const int MaxAttempts = 2;           /* Of fetching a chunk, if reads fail */
+    static const int MaxRounds = 4;             /* Of rebuildDirty() and catchUp(), while rows are marked meanwhile */
+    static const int AdmitTimeoutMs = 10000;    /* Of waiting for peers to write to this node */
+    static const int DirtyBatch = RDMA_ATOMIC_RESULTS;
+
+    struct Stats
+    {
+        uint64_t rowsRebuilt;
+        uint64_t rowsFailed;                    /* Too many lost or corrupt fragments */
+        uint64_t chunksRetried;
+        uint64_t bytesRead;
+        uint64_t bytesWritten;                  /* Rebuilt fragments */
+        double seconds;
+        double gbPerSec;                        /* Of rebuilt fragments */
+    };
+
+    explicit Rebuilder(ECAL *ecal, int threads, int depth);
+    ~Rebuilder();
+    Rebuilder(const Rebuilder &) = delete;
+    Rebuilder &operator=(const Rebuilder &) = delete;
+
+    /* Rebuild this node's fragments of rows [first, first + count). False if some rows failed. */
+    bool rebuild(uint64_t first, uint64_t count);
+    /* Rebuild the rows that the dirty maps of live nodes have marked for this node, and clear them */
+    bool rebuildDirty();
+    /* Have peers write to this node, then rebuild the rows they marked meanwhile, rows locked */
+    bool catchUp();
+    Stats getStats() const;
+
+private:
+    using BlockTy = ECAL::BlockTy;
+    static const int K = ECAL::K;
+    static const int N = ECAL::N;
+
+    /* Staging buffers of a chunk in flight */
+    struct Chunk
+    {
+        uint64_t row;
+        int rows;
+        int attempts;
+        int pending;                            /* Reads in flight */
+        bool failed;                            /* One of them failed */
+        int srcId[K];
+        uint8_t *frags[K];                      /* ChunkRows fragments of each source, */
+        uint32_t *checksums[K];                 /* ... then their checksums */
+    };
+
+    /* A leaf word of the dirty map of this node on `node` */
+    struct DirtyWord
+    {
+        int node;
+        uint64_t index;
+        uint64_t value;                         /* As read, then as cleared */
+    };
+
+    /* Bits to set in a word of a peer, with a CAS from `expected` */
+    struct WordOr
+    {
+        int node;
+        uint64_t shift;
+        uint64_t bits;
+        uint64_t expected;
+    };
+
+    void begin();
+    bool report();
+    void run(const std::function<bool(uint64_t &row, int &rows)> &nextChunk);
+    uint64_t fetchDirty(uint64_t *merged);
+    void clearDirty(uint64_t *merged);
+    void remarkFailed();
+    void orWords(std::vector<WordOr> &ors);
+    void failRows(uint64_t row, int rows);
+    bool postChunk(Chunk &chunk);
+    void catchUpChunk(Chunk &chunk, uint8_t *scratch);
+    void finishChunk(Chunk &chunk, uint8_t *scratch);
+    void work();
+
+    ECAL *ecal;
+    int threads;
+    int self;                                   /* Fragment index of this node */
+    std::vector<Chunk> chunks;
+    uint8_t *buffer = nullptr;
+    ibv_mr *bufferMR = nullptr;
+    uint64_t *dirtyBuffer = nullptr;            /* Maps of this node fetched from each node */
+    ibv_mr *dirtyMR = nullptr;
+    std::vector<DirtyWord> dirtyWords;
+    std::mutex failedMutex;
+    std::vector<uint64_t> failedRows;           /* Of the current run() */
+
+    std::vector<std::thread> workers;
+    std::mutex queueMutex;
+    std::condition_variable readyCondVar;       /* A chunk has been fetched, or the rebuild ends */
+    std::condition_variable freeCondVar;        /* A chunk has been stored */
+    std::deque<Chunk *> readyChunks;
+    std::vector<Chunk *> freeChunks;
+    bool finished = false;
+
+    std::chrono::steady_clock::time_point startTime;
+    std::chrono::steady_clock::time_point endTime;
+    std::atomic<uint64_t> rowsRebuilt { 0 };
+    std::atomic<uint64_t> rowsFailed { 0 };
+    uint64_t chunksRetried = 0;
+    uint64_t bytesRead = 0;
+    uint64_t mapsLost = 0;                      /* Dirty maps that could not be fetched */
+};
+
+#endif // REBUILDER_HPP
@@ -0,0 +1,78 @@
+/******************************************************************
+ * This file is part of Galois.                                   *
+ *                                                                *
+ * Galois: Highly-available NVM Distributed File System           *
+ * Copyright (c) 2020 Storage Research Group, Tsinghua University *
+ ******************************************************************/
+
+#if !defined(SCRUBBER_HPP)
+#define SCRUBBER_HPP
+
+#include <condition_variable>
+
+#include "ecal.hpp"
+
+/**
+ * Background parity scrubber.
+ *
+ * Walks the rows of the block pool this node is responsible for (row % N equals its
+ * position in the stripe), and has ECAL verify and repair each of them, over and over.
+ * The scrubber is paced by QoS (as its scrub class) so that fetched fragments stay within a
+ * bandwidth and an IOPS budget, or below if foreground I/O needs it.
+ */
+class Scrubber
+{
+public:
+    struct Stats
+    {
+        uint64_t passes;                        /* Completed passes over the pool */
+        uint64_t passProgress;                  /* Rows done in the current pass */
+        uint64_t passRows;                      /* Rows per pass */
+        uint64_t rowsScrubbed;
+        uint64_t rowsRepaired;
+        uint64_t rowsUnrepairable;
+        uint64_t rowsSkipped;
+        uint64_t fragmentsRepaired;
+        uint64_t bytesRead;
+        double rowsPerSec;                      /* Averaged since start */
+        double mbPerSec;
+    };
+
+    /**
+     * @param mbps          Budget in MB/s of fetched fragments (must be positive).
+     * @param iops          Budget in fragment reads per second (0: none).
+     */
+    explicit Scrubber(ECAL *ecal, int mbps, int iops = 0);
+    ~Scrubber();
+    Scrubber(const Scrubber &) = delete;
+    Scrubber &operator=(const Scrubber &) = delete;
+
+    void start();
+    void stop();
+    Stats getStats() const;
+
+private:
+    void run();
+    void scrub(uint64_t row);
+
+    ECAL *ecal;
+    double budget;                              /* Bytes/s of fetched fragments */
+    std::chrono::steady_clock::time_point startTime;
+
+    std::thread worker;
+    volatile bool shouldRun = false;
+    std::mutex stopMutex;                       /* To wake the worker from pacing sleeps */
+    std::condition_variable stopCondVar;
+
+    std::atomic<uint64_t> passes { 0 };
+    std::atomic<uint64_t> passProgress { 0 };
+    uint64_t passRows = 0;
+    std::atomic<uint64_t> rowsScrubbed { 0 };
+    std::atomic<uint64_t> rowsRepaired { 0 };
+    std::atomic<uint64_t> rowsUnrepairable { 0 };
+    std::atomic<uint64_t> rowsSkipped { 0 };
+    std::atomic<uint64_t> fragmentsRepaired { 0 };
+    std::atomic<uint64_t> bytesRead { 0 };
+};
+
+#endif // SCRUBBER_HPP
@@ -0,0 +1,185 @@
+/******************************************************************
+ * This file is part of Galois.                                   *
+ *                                                                *
+ * Galois: Highly-available NVM Distributed File System           *
+ * Copyright (c) 2020 Storage Research Group, Tsinghua University *
+ ******************************************************************/
+
+#if !defined(SLOTPOOL_HPP)
+#define SLOTPOOL_HPP
+
+#include <cstdint>
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+
+/**
+ * Pool of slot indices [0, size), e.g. of staging buffers.
+ *
+ * Each thread takes slots from, and returns them to, a small cache of its own, and refills
+ * it from the global free bitmap by taking a whole 64-bit word with a single exchange. All
+ * paths are a bounded number of atomic operations, without CAS loops.
+ * When the pool is exhausted, get() parks the caller until put() returns a slot, and
+ * tryGet() returns -1 so that the caller can back off on its own.
+ */
+class SlotPool
+{
+public:
+    static const int NCaches = 32;              /* Threads beyond share caches */
+    static const int CacheSlots = 8;
+
+    struct Stats
+    {
+        std::atomic<uint64_t> refills { 0 };    /* Cache misses served by the bitmap */
+        std::atomic<uint64_t> steals { 0 };     /* Slots taken from other threads' caches */
+        std::atomic<uint64_t> parks { 0 };      /* get() calls that had to wait */
+    };
+
+    explicit SlotPool(int size) : size(size), nWords((size + 63) / 64)
+    {
+        words.reset(new std::atomic<uint64_t>[nWords]);
+        for (int i = 0; i < nWords; ++i)
+            words[i] = i < size / 64 ? ~0ULL : (1ULL << (size % 64)) - 1;
+        caches.reset(new Cache[NCaches]);
+        for (int i = 0; i < NCaches; ++i)
+            for (auto &entry : caches[i].slots)
+                entry = -1;
+    }
+    SlotPool(const SlotPool &) = delete;
+    SlotPool &operator=(const SlotPool &) = delete;
+
+    __always_inline int getSize() const { return size; }
+    __always_inline const Stats &getStats() const { return stats; }
+
+    int tryGet()
+    {
+        Cache &cache = myCache();
+        for (auto &entry : cache.slots)
+            if (entry.load(std::memory_order_relaxed) >= 0) {
+                int slot = entry.exchange(-1);
+                if (slot >= 0)
+                    return slot;
+            }
+
+        int slot = refill(cache);
+        return slot >= 0 ? slot : steal();
+    }
+
+    int get()
+    {
+        int slot = tryGet();
+        if (slot >= 0)
+            return slot;
+
+        /*
+         * Waiters are counted before looking for slots again, and put() checks for them after
+         * publishing its slot (both behind a full fence): either this tryGet() finds the slot,
+         * or put() sees the waiter and notifies it, which it cannot do before we wait.
+         */
+        std::unique_lock<std::mutex> lock(waitMutex);
+        ++waiters;
+        ++stats.parks;
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        while ((slot = tryGet()) < 0)
+            waitCondVar.wait(lock);
+        --waiters;
+        return slot;
+    }
+
+    /* Return a slot to my cache, or to the global bitmap if others wait */
+    void put(int slot)
+    {
+        bool cached = false;
+        if (!waiters.load()) {
+            for (auto &entry : myCache().slots) {
+                int empty = -1;
+                if (entry.load(std::memory_order_relaxed) < 0 && entry.compare_exchange_strong(empty, slot)) {
+                    cached = true;
+                    break;
+                }
+            }
+        }
+        if (!cached)
+            words[slot / 64].fetch_or(1ULL << (slot % 64));
+
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (waiters.load()) {
+            std::lock_guard<std::mutex> lock(waitMutex);
+            waitCondVar.notify_one();
+        }
+    }
+
+private:
+    struct Cache
+    {
+        std::atomic<int> slots[CacheSlots];
+        char padding[64 - CacheSlots * sizeof(int) % 64];
+    };
+
+    static int threadIndex()
+    {
+        static std::atomic<int> nextIndex { 0 };
+        static thread_local int index = nextIndex++;
+        return index;
+    }
+
+    __always_inline Cache &myCache() { return caches[threadIndex() % NCaches]; }
+
+    /* Take a word of free slots, keep one, cache some unless others wait, and return the rest */
+    int refill(Cache &cache)
+    {
+        int start = threadIndex() % nWords;
+        for (int i = 0; i < nWords; ++i) {
+            int w = (start + i) % nWords;
+            if (!words[w].load(std::memory_order_relaxed))
+                continue;
+            uint64_t bits = words[w].exchange(0);
+            if (!bits)
+                continue;
+
+            ++stats.refills;
+            int slot = w * 64 + __builtin_ctzll(bits);
+            bits &= bits - 1;
+            if (!waiters.load()) {
+                for (auto &entry : cache.slots) {
+                    int empty = -1;
+                    if (!bits)
+                        break;
+                    if (entry.compare_exchange_strong(empty, w * 64 + __builtin_ctzll(bits)))
+                        bits &= bits - 1;
+                }
+            }
+            if (bits)
+                words[w].fetch_or(bits);
+            return slot;
+        }
+        return -1;
+    }
+
+    int steal()
+    {
+        for (int i = 0; i < NCaches; ++i)
+            for (auto &entry : caches[i].slots)
+                if (entry.load(std::memory_order_relaxed) >= 0) {
+                    int slot = entry.exchange(-1);
+                    if (slot >= 0) {
+                        ++stats.steals;
+                        return slot;
+                    }
+                }
+        return -1;
+    }
+
+    int size;
+    int nWords;
+    std::unique_ptr<std::atomic<uint64_t>[]> words;     /* Free slots not in any cache */
+    std::unique_ptr<Cache[]> caches;
+    Stats stats;
+
+    std::atomic<int> waiters { 0 };
+    std::mutex waitMutex;
+    std::condition_variable waitCondVar;
+};
+
+#endif // SLOTPOOL_HPP
@@ -0,0 +1,93 @@
+/******************************************************************
+ * This file is part of Galois.                                   *
+ *                                                                *
+ * Galois: Highly-available NVM Distributed File System           *
+ * Copyright (c) 2020 Storage Research Group, Tsinghua University *
+ ******************************************************************/
+
+#if !defined(STRIPELOCK_HPP)
+#define STRIPELOCK_HPP
+
+#include <vector>
+
+#include "network/rdma.hpp"
+
+/**
+ * Stripe locks taken with RDMA compare-and-swap, without involving the CPU of lock homes.
+ *
+ * Each row (stripe) has a 64-bit word in the pool of its home node:
+ *     [63..16] version (bumped by every unlock) | [15..1] holder node ID | [0] locked
+ * Words homed on this node are CAS'ed locally, which is only atomic with RDMA atomics on
+ * devices with IBV_ATOMIC_GLOB.
+ *
+ * A batch of rows is locked in row order: all CASes of a round are in flight together, then
+ * locks above the first one still taken are dropped, and the rest are retried. As a row is
+ * only waited for while holding smaller rows, writers cannot deadlock. The lock of a dead
+ * holder is broken. Not thread-safe: its user (ECAL) serializes accesses.
+ */
+class StripeLocks
+{
+public:
+    static const int MaxBatch = RDMA_ATOMIC_RESULTS;
+
+    struct Stats
+    {
+        std::atomic<uint64_t> acquired { 0 };       /* Rows locked */
+        std::atomic<uint64_t> rounds { 0 };         /* Rounds of CASes in flight */
+        std::atomic<uint64_t> conflicts { 0 };      /* CASes that found the row locked by others */
+        std::atomic<uint64_t> staleVersions { 0 };  /* CASes that failed on an outdated version */
+        std::atomic<uint64_t> broken { 0 };         /* Locks of dead holders broken */
+        std::atomic<uint64_t> failedCas { 0 };      /* CASes that did not complete */
+        std::atomic<uint64_t> waitNs { 0 };         /* Time spent backing off */
+    };
+
+    /**
+     * @param localWords    Lock word of row 0 in this node's pool (others follow).
+     * @param wordShift     Shift of that word in the major MR of every node.
+     */
+    StripeLocks(RDMASocket *rdma, uint64_t *localWords, uint64_t wordShift);
+
+    /**
+     * Lock `count` (up to MaxBatch) distinct rows, sorted ascendingly, whose words live on
+     * `homes`. Rows whose CAS failed are dropped from `rows` and `homes`; the words as locked
+     * are returned in `held`, to be passed to unlock(). Returns the count of rows locked.
+     */
+    int lock(uint64_t *rows, int *homes, int count, uint64_t *held);
+    void unlock(const uint64_t *rows, const int *homes, int count, const uint64_t *held);
+
+    inline const Stats &getStats() const { return stats; }
+
+private:
+    static const int NHints = 4096;
+
+    static inline bool isLocked(uint64_t word) { return word & 1; }
+    static inline int holderOf(uint64_t word) { return word >> 1 & 0x7fff; }
+    static inline uint64_t versionOf(uint64_t word) { return word >> 16; }
+    /* Word after a successful CAS from `word` by `node`, or after an unlock if node < 0 */
+    static inline uint64_t nextWord(uint64_t word, int node)
+    {
+        uint64_t version = versionOf(word) + isLocked(word);
+        return version << 16 | (node >= 0 ? (uint64_t)node << 1 | 1 : 0);
+    }
+
+    void compareSwap(const uint64_t *rows, const int *homes, const int *idx, int n,
+                     const uint64_t *expected, const uint64_t *desired, uint64_t *old, bool *ok);
+    void leave(const uint64_t *rows, const int *homes, int i, uint64_t word);
+    void releaseLeftovers();
+
+    struct Held
+    {
+        uint64_t row;
+        int home;
+        uint64_t word;
+    };
+
+    RDMASocket *rdma;
+    uint64_t *localWords;
+    uint64_t wordShift;
+    uint64_t hints[NHints] = { 0 };                 /* Last unlocked word per row hash, to CAS against */
+    std::vector<Held> unreleased;                   /* Words maybe left locked by failed CASes */
+    Stats stats;
+};
+
+#endif // STRIPELOCK_HPP
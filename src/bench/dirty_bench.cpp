@@ -0,0 +1,98 @@
+/**
+ * Cost of dirty maps (DIRTY_MAPS) on degraded writes.
+ *
+ * First times DirtyMap::mark() alone, on a map in DRAM: marking clean rows (two atomic ORs and
+ * their write-backs), rows already dirty, and a fence per batch of marks. Then, on a cluster
+ * (run on every node at about the same time), the writing node marks `victim` as dead, and
+ * writes pages with writeBlocks for `seconds`, with dirty maps off then on, and reports the
+ * throughput of both, and the rows marked dirty for the victim. Other nodes only serve RDMA
+ * writes.
+ *
+ * Usage: dirty_bench [writing node (default 0)] [victim node (default: the last stripe node)]
+ *                    [seconds (default 5)]
+ */
+#include <cstdio>
+#include <cstdlib>
+#include <chrono>
+#include <thread>
+#include <vector>
+
+#include <ecal.hpp>
+
+using namespace std;
+using namespace std::chrono;
+
+DEFINE_MAIN_INFO();
+
+static void benchMark()
+{
+    const uint64_t rows = 1 << 22, marks = 1 << 22;
+    vector<uint64_t> words(DirtyMap::mapWords(rows) + 8);
+    uint64_t *aligned = reinterpret_cast<uint64_t *>((reinterpret_cast<uintptr_t>(words.data()) + 63) & ~63ULL);
+    DirtyMap map(aligned, rows, 1);
+
+    for (int pass = 0; pass < 2; ++pass) {
+        auto start = steady_clock::now();
+        for (uint64_t i = 0; i < marks; ++i) {
+            map.mark(0, i * 7919 % rows);
+            if (i % ECAL::MaxWriteBatch == ECAL::MaxWriteBatch - 1)
+                DirtyMap::persist();
+        }
+        double ns = duration_cast<duration<double, nano>>(steady_clock::now() - start).count() / marks;
+        printf("mark, %s rows: %6.1f ns\n", pass ? "dirty" : "clean", ns);
+    }
+    printf("%lu rows dirty, %lu left after tidy\n", map.count(0), map.tidy(0));
+}
+
+static double writePages(ECAL &ecal, int seconds)
+{
+    vector<ECAL::Page> pages(ECAL::MaxWriteBatch);
+    vector<ECAL::Page *> pagePtrs;
+    for (auto &page : pages) {
+        memset(page.page.data, 0x5a, Block4K::capacity);
+        pagePtrs.push_back(&page);
+    }
+    uint64_t index = 0, written = 0;
+    auto start = steady_clock::now(), end = start + std::chrono::seconds(seconds);
+    while (steady_clock::now() < end) {
+        for (auto &page : pages)
+            page.index = index++ % ecal.getClusterCapacity();
+        ecal.writeBlocks(pagePtrs.data(), ECAL::MaxWriteBatch);
+        written += ECAL::MaxWriteBatch;
+    }
+    return written / duration_cast<duration<double>>(steady_clock::now() - start).count();
+}
+
+int main(int argc, char **argv)
+{
+    COLLECT_MAIN_INFO();
+    benchMark();
+
+    cmdConf = new CmdLineConfig();
+    int node = argc > 1 ? atoi(argv[1]) : 0;
+    int victim = argc > 2 ? atoi(argv[2]) : ECAL::N - 1;
+    int seconds = argc > 3 ? atoi(argv[3]) : 5;
+    if (node < 0 || node >= clusterConf->getClusterSize() || victim < 0 || victim >= ECAL::N ||
+        victim == node || seconds <= 0) {
+        fprintf(stderr, "Usage: %s [writing node] [victim node, below %d] [seconds]\n", argv[0], ECAL::N);
+        return -1;
+    }
+
+    ECAL ecal;
+    if (myNodeConf->id != node) {
+        this_thread::sleep_for(std::chrono::seconds(4 * seconds + 10));
+        return 0;
+    }
+    printf("%d nodes, %s, node %d dead\n", clusterConf->getClusterSize(), ECAL::CodeTy::desc().c_str(), victim);
+    ecal.getRDMASocket()->__markAsDead(victim);
+
+    cmdConf->dirtyMaps = false;
+    double off = writePages(ecal, seconds);
+    cmdConf->dirtyMaps = true;
+    double on = writePages(ecal, seconds);
+    printf("degraded writes: %.0f pages/s without dirty maps, %.0f pages/s with (%+.1f%%)\n", off, on,
+           (on / off - 1) * 100);
+    printf("%lu rows marked, %lu dirty for node %d\n", ecal.getDirtyMap()->getMarked(),
+           ecal.getDirtyMap()->count(victim), victim);
+    return 0;
+}
@@ -0,0 +1,73 @@
+/**
+ * Latency and throughput of durable (DURABLE_WRITES) vs. non-durable ECAL writes.
+ *
+ * Writes batches of random pages with writeBlocks for `seconds` per point, without and with
+ * persistence fences, for batches of 1 up to ECAL::MaxWriteBatch pages: a single fence per
+ * peer covers a whole batch. Reports pages per second, average / p99 latency of a batch,
+ * and fences per page. Can run on a single node of the cluster while others are idle.
+ *
+ * Usage: durable_bench [seconds per point (default 5)]
+ */
+#include <cstdio>
+#include <cstdlib>
+#include <algorithm>
+#include <chrono>
+#include <random>
+#include <vector>
+
+#include <ecal.hpp>
+
+using namespace std;
+using namespace std::chrono;
+
+DEFINE_MAIN_INFO();
+
+int main(int argc, char **argv)
+{
+    COLLECT_MAIN_INFO();
+    int seconds = argc > 1 ? atoi(argv[1]) : 5;
+    if (seconds <= 0) {
+        fprintf(stderr, "Usage: %s [seconds per point]\n", argv[0]);
+        return -1;
+    }
+
+    cmdConf = new CmdLineConfig();
+    ECAL ecal;
+    vector<ECAL::Page> pages(ECAL::MaxWriteBatch);
+    vector<ECAL::Page *> pagePtrs;
+    for (auto &page : pages) {
+        memset(page.page.data, myNodeConf->id, Block4K::capacity);
+        pagePtrs.push_back(&page);
+    }
+    mt19937_64 rng(myNodeConf->id);
+    uniform_int_distribution<uint64_t> indexDist(0, ecal.getClusterCapacity() - 1);
+
+    printf("%d nodes, %s\n", clusterConf->getClusterSize(), ECAL::CodeTy::desc().c_str());
+    for (bool durable : { false, true }) {
+        cmdConf->durableWrites = durable;
+        for (int batch = 1; batch <= ECAL::MaxWriteBatch; batch *= 2) {
+            vector<double> latencies;
+            uint64_t fences = ecal.getPersistFences();
+            auto start = steady_clock::now(), end = start + std::chrono::seconds(seconds);
+            while (steady_clock::now() < end) {
+                for (int i = 0; i < batch; ++i)
+                    pages[i].index = indexDist(rng);
+                auto t = steady_clock::now();
+                ecal.writeBlocks(pagePtrs.data(), batch);
+                latencies.push_back(duration_cast<duration<double, micro>>(steady_clock::now() - t).count());
+            }
+            double elapsed = duration_cast<duration<double>>(steady_clock::now() - start).count();
+            fences = ecal.getPersistFences() - fences;
+
+            uint64_t n = latencies.size();
+            sort(latencies.begin(), latencies.end());
+            double sum = 0;
+            for (double l : latencies)
+                sum += l;
+            printf("%-11s batch %2d: %9.0f pages/s, avg %8.2f us, p99 %8.2f us, %5.3f fences/page\n",
+                   durable ? "durable" : "non-durable", batch, n * batch / elapsed, sum / n,
+                   latencies[n * 99 / 100], (double)fences / (n * batch));
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,353 @@
+/**
+ * Erasure coding microbenchmark.
+ *
+ * Sweeps codec x K x P x fragment length x erasure count x thread count over the compiled
+ * grid (K in 2..12 step 2, P in 1..4, Len in 512, 2048, 4096, 65536), filtered by the flags below.
+ * For every point it reports encode / decode throughput (GB/s of the K source fragments
+ * per call, summed over threads) and mean per-call latency in TSC cycles, together with the
+ * SIMD tier ISA-L dispatches to on this CPU. Results can be written as JSON (--json).
+ *
+ * With --checksum, each point is also measured with the per-fragment CRC32C ECAL stores:
+ * encode+crc checksums all N fragments, decode+crc verifies the K sources before decoding.
+ *
+ * Codecs: rs (ReedSolomonCode, which is also what ECAL's inline encode runs for RS(2, 1); XOR
+ * when P = 1, unless built with ECAL_CAUCHY_PARITY), xor (XorParityCode, P = 1 only), lrc
+ * (LrcCode with L = 2, G = P - 2), clay (ClayCode where Len is a multiple of its
+ * sub-packetization).
+ */
+#include <cstdio>
+#include <atomic>
+#include <chrono>
+#include <random>
+#include <set>
+#include <sstream>
+#include <thread>
+#include <vector>
+#include <x86intrin.h>
+#include <gflags/gflags.h>
+
+#include <ec/rs.hpp>
+#include <ec/lrc.hpp>
+#include <ec/clay.hpp>
+#include <ec/checksum.hpp>
+
+using namespace std;
+using namespace std::chrono;
+
+DEFINE_string(codecs, "rs,xor,lrc,clay", "Codecs to run (rs, xor, lrc, clay)");
+DEFINE_string(k, "2,4,6,8,10,12", "Data fragment counts, within 2..12 step 2");
+DEFINE_string(p, "1,2,3,4", "Parity fragment counts, within 1..4");
+DEFINE_string(len, "512,4096,65536", "Fragment lengths, among 512, 2048, 4096, 65536");
+DEFINE_string(erasures, "1,2,3,4", "Erased data fragments for decode (capped at P)");
+DEFINE_string(threads, "1", "Thread counts");
+DEFINE_int32(volume_mb, 64, "Source MiB each thread processes per measurement");
+DEFINE_bool(checksum, true, "Also measure encode / decode with CRC32C of every fragment");
+DEFINE_string(json, "", "Write results as JSON to this file ('-' for stdout)");
+
+struct Result
+{
+    string codec;
+    unsigned k, p, len;
+    string op;
+    int erasures;
+    int threads;
+    double gbps;
+    double cycles;
+};
+
+static vector<Result> results;
+static set<string> codecs;
+static set<int> ks, ps, lens, erasureCounts, threadCounts;
+
+static set<string> splitList(const string &list)
+{
+    set<string> items;
+    stringstream ss(list);
+    string item;
+    while (getline(ss, item, ','))
+        if (!item.empty())
+            items.insert(item);
+    return items;
+}
+
+static set<int> splitIntList(const string &list)
+{
+    set<int> items;
+    for (auto &item : splitList(list))
+        items.insert(stoi(item));
+    return items;
+}
+
+/* Tier ISA-L's multibinary dispatcher picks for ec_encode_data on this CPU */
+static const char *isalTier()
+{
+    if (__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw") &&
+        __builtin_cpu_supports("avx512vl"))
+        return "avx512";
+    if (__builtin_cpu_supports("avx2"))
+        return "avx2";
+    if (__builtin_cpu_supports("avx"))
+        return "avx";
+    if (__builtin_cpu_supports("sse4.1"))
+        return "sse";
+    return "base";
+}
+
+/**
+ * Run `op` (given a thread's stripe) `calls` times on each of `threads` threads.
+ * @return aggregate GB/s of `bytesPerCall`, and mean cycles per call.
+ */
+template <typename Stripe, typename Op>
+static void measure(int threads, size_t calls, size_t bytesPerCall, vector<Stripe> &stripes, Op op,
+                    double &gbps, double &cycles)
+{
+    vector<thread> workers;
+    vector<uint64_t> threadCycles(threads);
+    atomic<int> ready { 0 };
+    atomic<bool> go { false };
+
+    for (int t = 0; t < threads; ++t)
+        workers.emplace_back([&, t] {
+            Stripe &s = stripes[t];
+            op(s);                              /* Warm up (tables, caches) */
+            ++ready;
+            while (!go)
+                ;
+            uint64_t start = __rdtsc();
+            for (size_t i = 0; i < calls; ++i)
+                op(s);
+            threadCycles[t] = __rdtsc() - start;
+        });
+    while (ready != threads)
+        ;
+    auto start = steady_clock::now();
+    go = true;
+    for (auto &w : workers)
+        w.join();
+    double seconds = duration_cast<duration<double>>(steady_clock::now() - start).count();
+
+    gbps = (double)bytesPerCall * calls * threads / seconds / 1e9;
+    cycles = 0;
+    for (auto c : threadCycles)
+        cycles += (double)c / calls;
+    cycles /= threads;
+}
+
+template <typename Code, unsigned K, unsigned P, unsigned Len>
+static void benchCodec(const string &codec, bool allLines)
+{
+    const unsigned N = K + P;
+    struct Stripe
+    {
+        vector<uint8_t> buf;
+        uint8_t *frag[N];
+        uint8_t *data[N];
+        int srcId[K];
+        uint32_t checksums[N];
+        unsigned mismatches;
+    };
+
+    size_t calls = max<size_t>(((size_t)FLAGS_volume_mb << 20) / (K * Len), 16);
+    for (int threads : threadCounts) {
+        vector<Stripe> stripes(threads);
+        mt19937 rng(K * 31 + P);
+        for (auto &s : stripes) {
+            s.buf.resize((size_t)N * Len);
+            for (unsigned i = 0; i < N; ++i)
+                s.frag[i] = s.buf.data() + (size_t)i * Len;
+            for (unsigned i = 0; i < K * Len; ++i)
+                s.buf[i] = rng();
+            encodeChecksummed<Code, K, P, Len>(s.frag, s.frag + K, s.checksums);
+            s.mismatches = 0;
+        }
+
+        Result r { codec, K, P, Len, "encode", 0, threads, 0, 0 };
+        measure(threads, calls, K * Len, stripes, [](Stripe &s) { Code::encode(s.frag, s.frag + K); },
+                r.gbps, r.cycles);
+        results.push_back(r);
+        printf("%-5s K=%-2u P=%u Len=%-6u encode            threads=%-2d %8.2f GB/s %10.0f cycles\n",
+               codec.c_str(), K, P, Len, threads, r.gbps, r.cycles);
+        if (FLAGS_checksum) {
+            Result c = r;
+            c.op = "encode+crc";
+            measure(threads, calls, K * Len, stripes,
+                    [](Stripe &s) { encodeChecksummed<Code, K, P, Len>(s.frag, s.frag + K, s.checksums); },
+                    c.gbps, c.cycles);
+            results.push_back(c);
+            printf("%-5s K=%-2u P=%u Len=%-6u encode+crc        threads=%-2d %8.2f GB/s %10.0f cycles"
+                   " (%+.1f%%)\n", codec.c_str(), K, P, Len, threads, c.gbps, c.cycles,
+                   (c.cycles / r.cycles - 1) * 100);
+        }
+
+        for (int e : erasureCounts) {
+            if (e < 1 || e > (int)P || e > (int)K)
+                continue;
+            bool alive[N];
+            for (unsigned i = 0; i < N; ++i)
+                alive[i] = (i >= (unsigned)e);
+            bool decodable = true;
+            for (auto &s : stripes) {
+                decodable &= Code::selectSources(alive, s.srcId);
+                /* Lines neither fetched nor lost are only decoded by codes that need them */
+                for (unsigned i = 0; i < N; ++i)
+                    s.data[i] = (allLines || i < (unsigned)e) ? s.frag[i] : nullptr;
+                for (unsigned i = 0; i < K; ++i)
+                    s.data[s.srcId[i]] = s.frag[s.srcId[i]];
+            }
+            if (!decodable)
+                continue;
+
+            r.op = "decode";
+            r.erasures = e;
+            measure(threads, calls, K * Len, stripes, [](Stripe &s) { Code::decode(s.srcId, s.data); },
+                    r.gbps, r.cycles);
+            results.push_back(r);
+            printf("%-5s K=%-2u P=%u Len=%-6u decode erasures=%d threads=%-2d %8.2f GB/s %10.0f cycles\n",
+                   codec.c_str(), K, P, Len, e, threads, r.gbps, r.cycles);
+            if (!FLAGS_checksum)
+                continue;
+
+            /* Verify the fetched sources as ECAL's degraded reads do */
+            Result c = r;
+            c.op = "decode+crc";
+            measure(threads, calls, K * Len, stripes, [](Stripe &s) {
+                        for (unsigned i = 0; i < K; ++i) {
+                            int id = s.srcId[i];
+                            s.mismatches += (fragmentChecksum(s.frag[id], Len) != s.checksums[id]);
+                        }
+                        Code::decode(s.srcId, s.data);
+                    }, c.gbps, c.cycles);
+            results.push_back(c);
+            printf("%-5s K=%-2u P=%u Len=%-6u decode+crc erasures=%d threads=%-2d %8.2f GB/s %10.0f cycles"
+                   " (%+.1f%%)\n", codec.c_str(), K, P, Len, e, threads, c.gbps, c.cycles,
+                   (c.cycles / r.cycles - 1) * 100);
+            for (auto &s : stripes)
+                if (s.mismatches)
+                    printf("  checksum mismatches: %u\n", s.mismatches);
+        }
+    }
+}
+
+/* XOR parity, P = 1 */
+template <unsigned K, unsigned P, unsigned Len, bool Valid = (P == 1)>
+struct XorRunner
+{
+    static void run() { }
+};
+
+template <unsigned K, unsigned P, unsigned Len>
+struct XorRunner<K, P, Len, true>
+{
+    static void run() { benchCodec<XorParityCode<K, Len>, K, P, Len>("xor", false); }
+};
+
+/* LRC(K, 2, P - 2) */
+template <unsigned K, unsigned P, unsigned Len, bool Valid = (P >= 3 && K % 2 == 0)>
+struct LrcRunner
+{
+    static void run() { }
+};
+
+template <unsigned K, unsigned P, unsigned Len>
+struct LrcRunner<K, P, Len, true>
+{
+    static void run() { benchCodec<LrcCode<K, 2, P - 2, Len>, K, P, Len>("lrc", false); }
+};
+
+/* Clay needs Len to be a multiple of P ^ ceil((K + P) / P) */
+template <unsigned K, unsigned P, unsigned Len,
+          bool Valid = (Len % clayPow(P, (K + 2 * P - 1) / P) == 0)>
+struct ClayRunner
+{
+    static void run() { }
+};
+
+template <unsigned K, unsigned P, unsigned Len>
+struct ClayRunner<K, P, Len, true>
+{
+    static void run() { benchCodec<ClayCode<K, P, Len>, K, P, Len>("clay", true); }
+};
+
+template <unsigned K, unsigned P, unsigned Len>
+static void runGeometry()
+{
+    if (!ks.count(K) || !ps.count(P) || !lens.count(Len))
+        return;
+    if (codecs.count("rs"))
+        benchCodec<ReedSolomonCode<K, P, Len>, K, P, Len>("rs", false);
+    if (codecs.count("xor"))
+        XorRunner<K, P, Len>::run();
+    if (codecs.count("lrc"))
+        LrcRunner<K, P, Len>::run();
+    if (codecs.count("clay"))
+        ClayRunner<K, P, Len>::run();
+}
+
+template <unsigned K, unsigned P>
+static void runLens()
+{
+    runGeometry<K, P, 512>();
+    runGeometry<K, P, 2048>();
+    runGeometry<K, P, 4096>();
+    runGeometry<K, P, 65536>();
+}
+
+template <unsigned K>
+static void runPs()
+{
+    runLens<K, 1>();
+    runLens<K, 2>();
+    runLens<K, 3>();
+    runLens<K, 4>();
+}
+
+static void writeJson(FILE *fp)
+{
+    fprintf(fp, "{\n  \"isal_tier\": \"%s\",\n  \"xor_tier\": \"%s\",\n  \"results\": [\n",
+            isalTier(), xorTierName(bestXorTier()));
+    for (size_t i = 0; i < results.size(); ++i) {
+        auto &r = results[i];
+        fprintf(fp, "    {\"codec\": \"%s\", \"k\": %u, \"p\": %u, \"len\": %u, \"op\": \"%s\", "
+                    "\"erasures\": %d, \"threads\": %d, \"gbps\": %.3f, \"cycles_per_call\": %.0f}%s\n",
+                r.codec.c_str(), r.k, r.p, r.len, r.op.c_str(), r.erasures, r.threads, r.gbps,
+                r.cycles, i + 1 < results.size() ? "," : "");
+    }
+    fprintf(fp, "  ]\n}\n");
+}
+
+int main(int argc, char **argv)
+{
+    gflags::SetUsageMessage("Erasure coding microbenchmark");
+    gflags::ParseCommandLineFlags(&argc, &argv, true);
+
+    codecs = splitList(FLAGS_codecs);
+    ks = splitIntList(FLAGS_k);
+    ps = splitIntList(FLAGS_p);
+    lens = splitIntList(FLAGS_len);
+    erasureCounts = splitIntList(FLAGS_erasures);
+    threadCounts = splitIntList(FLAGS_threads);
+    if (FLAGS_volume_mb <= 0 || threadCounts.empty() || *threadCounts.begin() <= 0) {
+        fprintf(stderr, "invalid --volume_mb or --threads\n");
+        return -1;
+    }
+
+    printf("ISA-L tier: %s, XOR tier: %s\n", isalTier(), xorTierName(bestXorTier()));
+    runPs<2>();
+    runPs<4>();
+    runPs<6>();
+    runPs<8>();
+    runPs<10>();
+    runPs<12>();
+
+    if (!FLAGS_json.empty()) {
+        FILE *fp = FLAGS_json == "-" ? stdout : fopen(FLAGS_json.c_str(), "w");
+        if (!fp) {
+            perror("fopen");
+            return -1;
+        }
+        writeJson(fp);
+        if (fp != stdout)
+            fclose(fp);
+    }
+    return 0;
+}
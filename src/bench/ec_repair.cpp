@@ -0,0 +1,295 @@
+/**
+ * Single-fragment repair: RS vs Clay, and degraded reads: RS vs LRC.
+ *
+ * For every fragment of a stripe, repairs it from the surviving fragments and reports
+ * the fan-in (fragments read), bytes read from helpers, latency and repair throughput
+ * (GB/s of repaired data). Each code is checked against the original stripe before it is timed.
+ * Also reports the CPU time of a degraded RS decode with and without cached decode tables.
+ *
+ * Usage: ec_repair [iterations]
+ */
+#include <cstdio>
+#include <cstdlib>
+#include <chrono>
+#include <random>
+#include <vector>
+
+#include <ec/rs.hpp>
+#include <ec/clay.hpp>
+#include <ec/lrc.hpp>
+
+using namespace std;
+using namespace std::chrono;
+
+static int iterations = 2000;
+
+struct Stripe
+{
+    vector<vector<uint8_t>> frag;
+    vector<uint8_t *> ptr;
+
+    Stripe(unsigned n, unsigned len) : frag(n, vector<uint8_t>(len)), ptr(n)
+    {
+        for (unsigned i = 0; i < n; ++i)
+            ptr[i] = frag[i].data();
+    }
+};
+
+static void report(const string &desc, double fanIn, double bytesRead, unsigned len, double seconds)
+{
+    double repaired = (double)len * iterations;
+    printf("  %-40s fan-in %5.2f, read %7.2f KiB (%5.2fx), %8.2f us, %7.3f GB/s\n", desc.c_str(),
+           fanIn, bytesRead / 1024.0, bytesRead / len, seconds * 1e6 / iterations,
+           repaired / seconds / 1e9);
+}
+
+template <unsigned K, unsigned P, unsigned Len>
+static bool benchRepair()
+{
+    using RS = ReedSolomonCode<K, P, Len>;
+    using Clay = ClayCode<K, P, Len>;
+    const unsigned N = K + P;
+
+    mt19937 rng(K * 131 + P);
+    Stripe orig(N, Len), rs(N, Len), clay(N, Len);
+    for (unsigned i = 0; i < K; ++i)
+        for (auto &c : orig.frag[i])
+            c = rng();
+    for (unsigned i = 0; i < K; ++i)
+        clay.frag[i] = rs.frag[i] = orig.frag[i];
+    RS::encode(rs.ptr.data(), rs.ptr.data() + K);
+    Clay::encode(clay.ptr.data(), clay.ptr.data() + K);
+
+    printf("(K, P) = (%u, %u), Len = %u\n", K, P, Len);
+
+    /* Full decode of the last P fragments */
+    {
+        Stripe s(N, Len);
+        int srcId[K];
+        for (unsigned i = 0; i < K; ++i) {
+            srcId[i] = P + i;
+            s.frag[P + i] = clay.frag[P + i];
+        }
+        Clay::decode(srcId, s.ptr.data());
+        for (unsigned i = 0; i < N; ++i)
+            if (s.frag[i] != clay.frag[i]) {
+                printf("  Clay decode mismatch on fragment %u\n", i);
+                return false;
+            }
+    }
+
+    /* RS: decode from the next K fragments */
+    Stripe work(N, Len);
+    uint8_t *out = work.ptr[0];
+    double rsTime = 0;
+    for (unsigned lost = 0; lost < N; ++lost) {
+        int srcId[K];
+        uint8_t *data[N];
+        for (unsigned i = 0; i < K; ++i)
+            srcId[i] = (lost + 1 + i) % N;
+        for (unsigned i = 0; i < N; ++i)
+            data[i] = rs.ptr[i];
+        data[lost] = out;
+
+        RS::decode(srcId, data);
+        if (memcmp(out, rs.ptr[lost], Len)) {
+            printf("  RS repair mismatch on fragment %u\n", lost);
+            return false;
+        }
+        auto start = steady_clock::now();
+        for (int it = 0; it < iterations / (int)N; ++it)
+            RS::decode(srcId, data);
+        rsTime += duration_cast<duration<double>>(steady_clock::now() - start).count();
+    }
+    rsTime = rsTime * iterations / (iterations / N * N);
+    report(RS::desc(), K, (double)K * Len, Len, rsTime);
+
+    /* Clay: sub-chunks of all N - 1 helpers */
+    const unsigned helperLen = Clay::RepairSubChunks * Clay::SubLen;
+    Stripe helpers(N, helperLen);
+    double clayTime = 0;
+    for (unsigned lost = 0; lost < N; ++lost) {
+        int layers[Clay::RepairSubChunks];
+        Clay::repairLayers(lost, layers);
+        for (unsigned i = 0; i < N; ++i)
+            for (unsigned p = 0; p < Clay::RepairSubChunks; ++p)
+                memcpy(helpers.ptr[i] + p * Clay::SubLen, clay.ptr[i] + layers[p] * Clay::SubLen,
+                       Clay::SubLen);
+
+        Clay::repair(lost, helpers.ptr.data(), out);
+        if (memcmp(out, clay.ptr[lost], Len)) {
+            printf("  Clay repair mismatch on fragment %u\n", lost);
+            return false;
+        }
+        auto start = steady_clock::now();
+        for (int it = 0; it < iterations / (int)N; ++it)
+            Clay::repair(lost, helpers.ptr.data(), out);
+        clayTime += duration_cast<duration<double>>(steady_clock::now() - start).count();
+    }
+    clayTime = clayTime * iterations / (iterations / N * N);
+    report(Clay::desc(), N - 1, (double)(N - 1) * helperLen, Len, clayTime);
+    return true;
+}
+
+/* Degraded read of each data fragment with a single failure, at the same parity count */
+template <unsigned K, unsigned L, unsigned G, unsigned Len>
+static bool benchLrc()
+{
+    using RS = ReedSolomonCode<K, L + G, Len>;
+    using LRC = LrcCode<K, L, G, Len>;
+    const unsigned N = K + L + G;
+
+    mt19937 rng(K * 257 + L * 17 + G);
+    Stripe orig(N, Len), rs(N, Len), lrc(N, Len);
+    for (unsigned i = 0; i < K; ++i)
+        for (auto &c : orig.frag[i])
+            c = rng();
+    for (unsigned i = 0; i < K; ++i)
+        lrc.frag[i] = rs.frag[i] = orig.frag[i];
+    RS::encode(rs.ptr.data(), rs.ptr.data() + K);
+    LRC::encode(lrc.ptr.data(), lrc.ptr.data() + K);
+
+    printf("(K, L, G) = (%u, %u, %u), Len = %u, storage overhead %.2fx\n", K, L, G, Len,
+           (double)N / K);
+
+    /* Full decode with G + 1 lost data fragments */
+    {
+        bool alive[N];
+        int srcId[K];
+        for (unsigned i = 0; i < N; ++i)
+            alive[i] = (i > G);
+        Stripe s(N, Len);
+        for (unsigned i = 0; i < N; ++i)
+            if (alive[i])
+                s.frag[i] = lrc.frag[i];
+        if (!LRC::selectSources(alive, srcId) || !LRC::decode(srcId, s.ptr.data())) {
+            printf("  LRC cannot decode %u lost data fragments\n", G + 1);
+            return false;
+        }
+        for (unsigned i = 0; i < K; ++i)
+            if (s.frag[i] != lrc.frag[i]) {
+                printf("  LRC decode mismatch on fragment %u\n", i);
+                return false;
+            }
+    }
+
+    Stripe work(N, Len);
+    uint8_t *out = work.ptr[0];
+    bool alive[N];
+    for (unsigned i = 0; i < N; ++i)
+        alive[i] = true;
+
+    double rsTime = 0, lrcTime = 0, lrcFanIn = 0;
+    for (unsigned lost = 0; lost < K; ++lost) {
+        int srcId[K];
+        uint8_t *data[N];
+
+        /* RS, only the lost fragment is decoded */
+        for (unsigned i = 0; i < N; ++i)
+            data[i] = i < K ? rs.ptr[i] : nullptr;
+        data[lost] = out;
+        alive[lost] = false;
+        RS::selectSources(alive, srcId);
+        for (unsigned i = 0; i < K; ++i)
+            data[srcId[i]] = rs.ptr[srcId[i]];
+        RS::decode(srcId, data);
+        if (memcmp(out, rs.ptr[lost], Len)) {
+            printf("  RS degraded read mismatch on fragment %u\n", lost);
+            return false;
+        }
+        auto start = steady_clock::now();
+        for (int it = 0; it < iterations / (int)K; ++it)
+            RS::decode(srcId, data);
+        rsTime += duration_cast<duration<double>>(steady_clock::now() - start).count();
+
+        /* LRC */
+        for (unsigned i = 0; i < N; ++i)
+            data[i] = lrc.ptr[i];
+        data[lost] = out;
+        int count = LRC::repairSources(lost, alive, srcId);
+        alive[lost] = true;
+        if (!count || !LRC::repair(lost, srcId, count, data) || memcmp(out, lrc.ptr[lost], Len)) {
+            printf("  LRC degraded read mismatch on fragment %u\n", lost);
+            return false;
+        }
+        lrcFanIn += count;
+        start = steady_clock::now();
+        for (int it = 0; it < iterations / (int)K; ++it)
+            LRC::repair(lost, srcId, count, data);
+        lrcTime += duration_cast<duration<double>>(steady_clock::now() - start).count();
+    }
+    rsTime = rsTime * iterations / (iterations / K * K);
+    lrcTime = lrcTime * iterations / (iterations / K * K);
+    report(RS::desc(), K, (double)K * Len, Len, rsTime);
+    report(LRC::desc(), lrcFanIn / K, lrcFanIn / K * Len, Len, lrcTime);
+    return true;
+}
+
+/* CPU time of decoding one lost data fragment, with and without the decode table cache */
+template <unsigned K, unsigned P, unsigned Len>
+static bool benchDecodeCache()
+{
+    using RS = ReedSolomonCode<K, P, Len>;
+    const unsigned N = K + P;
+
+    mt19937 rng(K * 7 + P);
+    Stripe rs(N, Len), work(N, Len);
+    for (unsigned i = 0; i < K; ++i)
+        for (auto &c : rs.frag[i])
+            c = rng();
+    RS::encode(rs.ptr.data(), rs.ptr.data() + K);
+
+    bool alive[N];
+    int srcId[K];
+    uint8_t *data[N] = { nullptr };
+    for (unsigned i = 0; i < N; ++i)
+        alive[i] = (i != 0);
+    RS::selectSources(alive, srcId);
+    for (unsigned i = 0; i < K; ++i)
+        data[srcId[i]] = rs.ptr[srcId[i]];
+    data[0] = work.ptr[0];
+
+    double ns[2];
+    for (int cached = 0; cached < 2; ++cached) {
+        RS::setDecodeCache(cached);
+        RS::decode(srcId, data);
+        if (memcmp(data[0], rs.ptr[0], Len)) {
+            printf("  RS degraded decode mismatch\n");
+            return false;
+        }
+        auto start = steady_clock::now();
+        for (int it = 0; it < iterations; ++it)
+            RS::decode(srcId, data);
+        ns[cached] = duration_cast<duration<double>>(steady_clock::now() - start).count() * 1e9 / iterations;
+    }
+    RS::setDecodeCache(true);
+    printf("  %-40s uncached %9.1f ns, cached %9.1f ns (%.2fx)\n", RS::desc().c_str(), ns[0], ns[1],
+           ns[0] / ns[1]);
+    return true;
+}
+
+int main(int argc, char **argv)
+{
+    if (argc > 1)
+        iterations = atoi(argv[1]);
+    if (iterations <= 0) {
+        fprintf(stderr, "Usage: %s [iterations]\n", argv[0]);
+        return -1;
+    }
+
+    bool ok = true;
+    ok &= benchRepair<2, 1, 4096>();
+    ok &= benchRepair<4, 2, 4096>();
+    ok &= benchRepair<6, 3, 6912>();
+    ok &= benchRepair<8, 4, 4096>();
+    ok &= benchRepair<10, 4, 65536>();
+    ok &= benchLrc<4, 2, 1, 4096>();
+    ok &= benchLrc<6, 2, 2, 4096>();
+    ok &= benchLrc<12, 2, 2, 4096>();
+
+    printf("Degraded decode CPU time\n");
+    ok &= benchDecodeCache<4, 2, 4096>();
+    ok &= benchDecodeCache<6, 3, 4096>();
+    ok &= benchDecodeCache<10, 4, 4096>();
+    return ok ? 0 : -1;
+}
@@ -0,0 +1,101 @@
+/**
+ * Single-parity (P = 1) kernels: GB/s of each XOR kernel supported by this CPU, against
+ * the ISA-L GF path (`ec_encode_data` with the Cauchy parity row of ECAL_CAUCHY_PARITY builds),
+ * for fragment sizes 512 B - 64 KiB. Throughput counts the K source fragments read per call. Recovering the
+ * single erasure XORs K blocks as well, so decode runs the same kernels.
+ *
+ * Usage: ec_xor [K] [MiB per measurement]
+ */
+#include <cstdio>
+#include <cstdlib>
+#include <chrono>
+#include <random>
+#include <vector>
+
+#include <isa-l.h>
+#include <ec/xor.hpp>
+
+using namespace std;
+using namespace std::chrono;
+
+static int K = 2;
+static size_t volume = 256 << 20;
+
+template <typename Fn>
+static double measure(size_t len, Fn fn)
+{
+    size_t calls = std::max<size_t>(volume / (len * K), 16);
+    fn();
+    auto start = steady_clock::now();
+    for (size_t i = 0; i < calls; ++i)
+        fn();
+    double seconds = duration_cast<duration<double>>(steady_clock::now() - start).count();
+    return (double)calls * len * K / seconds / 1e9;
+}
+
+int main(int argc, char **argv)
+{
+    if (argc > 1)
+        K = atoi(argv[1]);
+    if (argc > 2)
+        volume = (size_t)atoi(argv[2]) << 20;
+    if (K < 2 || K > 32 || volume == 0) {
+        fprintf(stderr, "Usage: %s [K] [MiB per measurement]\n", argv[0]);
+        return -1;
+    }
+
+    const size_t maxLen = 64 << 10;
+    mt19937 rng(K);
+    vector<vector<uint8_t>> frag(K, vector<uint8_t>(maxLen));
+    vector<uint8_t *> src(K);
+    for (int i = 0; i < K; ++i) {
+        for (auto &c : frag[i])
+            c = rng();
+        src[i] = frag[i].data();
+    }
+    vector<uint8_t> expect(maxLen), out(maxLen);
+    xorScalar(src.data(), K, expect.data(), maxLen);
+
+    /* GF path of RS(K, 1) */
+    vector<uint8_t> matrix((K + 1) * K), gfTables(K * 32);
+    gf_gen_cauchy1_matrix(matrix.data(), K + 1, K);
+    ec_init_tables(K, 1, &matrix[K * K], gfTables.data());
+
+    printf("K = %d, dispatched kernel: %s\n", K, xorTierName(bestXorTier()));
+    printf("%-12s", "GB/s");
+    for (size_t len = 512; len <= maxLen; len <<= 1)
+        printf("%9zuB", len);
+    printf("\n");
+
+    int ret = 0;
+    for (int t = 0; t < static_cast<int>(XorTier::NTiers); ++t) {
+        XorTier tier = static_cast<XorTier>(t);
+        if (!xorTierSupported(tier))
+            continue;
+        XorKernel kernel = xorKernelOf(tier);
+
+        /* Odd length to cover the tail */
+        fill(out.begin(), out.end(), 0);
+        kernel(src.data(), K, out.data(), maxLen - 7);
+        if (!equal(out.begin(), out.end() - 7, expect.begin())) {
+            printf("%s kernel mismatch\n", xorTierName(tier));
+            ret = -1;
+            continue;
+        }
+
+        printf("%-12s", xorTierName(tier));
+        for (size_t len = 512; len <= maxLen; len <<= 1)
+            printf("%10.2f", measure(len, [&] { kernel(src.data(), K, out.data(), len); }));
+        printf("\n");
+    }
+
+    printf("%-12s", "isa-l gf");
+    for (size_t len = 512; len <= maxLen; len <<= 1) {
+        uint8_t *dst = out.data();
+        printf("%10.2f", measure(len, [&] {
+            ec_encode_data(len, K, 1, gfTables.data(), src.data(), &dst);
+        }));
+    }
+    printf("\n");
+    return ret;
+}
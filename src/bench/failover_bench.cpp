@@ -0,0 +1,93 @@
+/**
+ * Read tail latency across a node failure (HEARTBEAT_LEASE_US).
+ *
+ * Run on every node of the cluster at about the same time. Each node reads random pages
+ * with readBlock for `seconds`; the victim node exits abruptly after `failAt` seconds, as
+ * a crashed node would (without disconnecting). Survivors report the p50 / p99 / max read
+ * latency of every `window` ms, and of the whole run before the failure, in the window it
+ * happened, and after. Without the failure detector, reads of the victim's fragments wait
+ * for the RDMA transport timeout; with it, they are rebuilt from the rest of their stripes
+ * within about a lease.
+ *
+ * Usage: failover_bench [victim node (default: the last one)] [seconds (default 10)]
+ *                       [failAt (default 3)] [window ms (default 250)]
+ */
+#include <cstdio>
+#include <cstdlib>
+#include <unistd.h>
+#include <algorithm>
+#include <chrono>
+#include <random>
+#include <vector>
+
+#include <ecal.hpp>
+
+using namespace std;
+using namespace std::chrono;
+
+DEFINE_MAIN_INFO();
+
+static void report(const char *name, vector<double> &latencies)
+{
+    if (latencies.empty()) {
+        printf("%-12s no reads\n", name);
+        return;
+    }
+    sort(latencies.begin(), latencies.end());
+    uint64_t n = latencies.size();
+    printf("%-12s %8lu reads, p50 %9.2f us, p99 %9.2f us, max %9.2f us\n", name, n,
+           latencies[n / 2], latencies[n * 99 / 100], latencies[n - 1]);
+}
+
+int main(int argc, char **argv)
+{
+    COLLECT_MAIN_INFO();
+    cmdConf = new CmdLineConfig();
+    ECAL ecal;
+
+    int victim = argc > 1 ? atoi(argv[1]) : clusterConf->getClusterSize() - 1;
+    int seconds = argc > 2 ? atoi(argv[2]) : 10;
+    int failAt = argc > 3 ? atoi(argv[3]) : 3;
+    int windowMs = argc > 4 ? atoi(argv[4]) : 250;
+    if (victim < 0 || victim >= clusterConf->getClusterSize() || seconds <= 0 || failAt < 0 ||
+        failAt >= seconds || windowMs <= 0) {
+        fprintf(stderr, "Usage: %s [victim node] [seconds] [failAt] [window ms]\n", argv[0]);
+        return -1;
+    }
+    printf("%d nodes, %s, node %d fails at %ds, heartbeat lease %d us\n", clusterConf->getClusterSize(),
+           ECAL::CodeTy::desc().c_str(), victim, failAt, cmdConf->heartbeatLeaseUs);
+
+    mt19937_64 rng(myNodeConf->id);
+    uniform_int_distribution<uint64_t> indexDist(0, ecal.getClusterCapacity() - 1);
+    ECAL::Page page;
+    int nWindows = seconds * 1000 / windowMs, failWindow = failAt * 1000 / windowMs;
+    vector<vector<double>> windows(nWindows);
+    auto start = steady_clock::now(), end = start + std::chrono::seconds(seconds);
+    auto crash = start + std::chrono::seconds(failAt);
+
+    for (auto t = start; t < end; ) {
+        if (myNodeConf->id == victim && t >= crash) {
+            printf("crashing\n");
+            fflush(stdout);
+            _exit(0);
+        }
+        ecal.readBlock(indexDist(rng), page);
+        auto done = steady_clock::now();
+        int w = std::min<int>(duration_cast<milliseconds>(t - start).count() / windowMs, nWindows - 1);
+        windows[w].push_back(duration_cast<duration<double, micro>>(done - t).count());
+        t = done;
+    }
+
+    vector<double> before, during, after;
+    char name[32];
+    for (int w = 0; w < nWindows; ++w) {
+        snprintf(name, sizeof(name), "%6d ms", w * windowMs);
+        report(name, windows[w]);
+        auto &phase = w < failWindow ? before : w == failWindow ? during : after;
+        phase.insert(phase.end(), windows[w].begin(), windows[w].end());
+    }
+    report("before", before);
+    report("failure", during);
+    report("after", after);
+    return 0;
+}
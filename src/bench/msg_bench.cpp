@@ -0,0 +1,196 @@
+/**
+ * Two-sided RDMA message rate vs. messages in flight.
+ *
+ * Run on every node of the cluster. Each node first reports how long it took to create its
+ * RDMA socket, and to be connected to all peers (LAZY_CONNECT selects lazy connections).
+ *
+ * Then the node with the smallest ID pings all the others,
+ * keeping `window` messages in flight per peer, and the others echo them back.
+ * A window of 1 is what a single send/recv buffer per peer allows.
+ *
+ * Then reports the round-trip latency with the first peer at low load (pings far apart, so
+ * that both sides block for completions) and high load (back to back), for several spin
+ * budgets of completion polling, with the CPU time spent spinning.
+ *
+ * Usage: msg_bench [iterations per peer] [message size]
+ */
+#include <cstdio>
+#include <cstdlib>
+#include <chrono>
+#include <thread>
+#include <vector>
+#include <algorithm>
+
+#include <config.hpp>
+#include <network/rdma.hpp>
+
+using namespace std;
+using namespace std::chrono;
+
+DEFINE_MAIN_INFO();
+
+struct BenchMessage
+{
+    enum { PING, PONG, SPIN, DONE } kind;
+    uint32_t seq;
+    int32_t spinUs;                     /* SPIN: new spin budget */
+};
+
+static int iterations = 100000;
+static const int latencyRounds = 10000;
+static uint32_t msgSize = 64;
+
+static void echo(RDMASocket &socket)
+{
+    vector<uint8_t> buf(msgSize);
+    ibv_wc wc[2];
+    while (socket.pollRecvCompletion(wc)) {
+        int peerId = WRID_PEER(wc->wr_id);
+        BenchMessage msg = *reinterpret_cast<const BenchMessage *>(socket.getRecvMessage(wc));
+        socket.releaseReceive(wc);
+        if (msg.kind == BenchMessage::DONE)
+            break;
+        if (msg.kind == BenchMessage::SPIN) {
+            socket.setPollSpinBudget(msg.spinUs);
+            continue;
+        }
+
+        auto *pong = reinterpret_cast<BenchMessage *>(buf.data());
+        pong->kind = BenchMessage::PONG;
+        pong->seq = msg.seq;
+        socket.sendMessage(peerId, buf.data(), msgSize);
+    }
+}
+
+static void latency(RDMASocket &socket, int peerId, int spinUs, int gapUs)
+{
+    vector<uint8_t> buf(msgSize);
+    auto *msg = reinterpret_cast<BenchMessage *>(buf.data());
+    msg->kind = BenchMessage::SPIN;
+    msg->spinUs = spinUs;
+    socket.sendMessage(peerId, buf.data(), msgSize);
+    socket.setPollSpinBudget(spinUs);
+
+    const PollStats &stats = socket.getPollStats(CQ_RECV);
+    uint64_t waits = stats.waits, blocks = stats.blocks, spinNs = stats.spinNs;
+    vector<double> rtts;
+    ibv_wc wc[2];
+
+    msg->kind = BenchMessage::PING;
+    for (int i = 0; i < latencyRounds; ++i) {
+        if (gapUs)
+            this_thread::sleep_for(microseconds(gapUs));
+        msg->seq = i;
+        auto start = steady_clock::now();
+        socket.sendMessage(peerId, buf.data(), msgSize);
+        if (!socket.pollRecvCompletion(wc))
+            return;
+        socket.releaseReceive(wc);
+        rtts.push_back(duration_cast<duration<double, micro>>(steady_clock::now() - start).count());
+    }
+
+    sort(rtts.begin(), rtts.end());
+    double avg = 0;
+    for (double rtt : rtts)
+        avg += rtt / rtts.size();
+    waits = stats.waits - waits;
+    printf("spin %5d us, %s load: avg %7.2f us, p99 %7.2f us; %5.1f%% waits blocked, %7.2f us spun per wait\n",
+           spinUs, gapUs ? "low " : "high", avg, rtts[rtts.size() * 99 / 100],
+           100.0 * (stats.blocks - blocks) / waits, (stats.spinNs - spinNs) / 1e3 / waits);
+}
+
+static void drive(RDMASocket &socket, const vector<int> &peers)
+{
+    vector<uint8_t> buf(msgSize);
+    auto *ping = reinterpret_cast<BenchMessage *>(buf.data());
+    ping->kind = BenchMessage::PING;
+    ibv_wc wc[2];
+
+    printf("%lu peer(s), %u-byte messages, %d round trips per peer\n", peers.size(), msgSize, iterations);
+    for (int window = 1; window <= RDMAConnection::NMsgSlots; window *= 2) {
+        vector<int> inflight(clusterConf->getNodeIdBound()), sent(clusterConf->getNodeIdBound());
+        int64_t done = 0, total = (int64_t)iterations * peers.size();
+
+        auto start = steady_clock::now();
+        while (done < total) {
+            for (int peerId : peers)
+                while (inflight[peerId] < window && sent[peerId] < iterations) {
+                    ping->seq = sent[peerId]++;
+                    socket.sendMessage(peerId, buf.data(), msgSize);
+                    ++inflight[peerId];
+                }
+            if (!socket.pollRecvCompletion(wc))
+                return;
+            --inflight[WRID_PEER(wc->wr_id)];
+            socket.releaseReceive(wc);
+            ++done;
+        }
+        double seconds = duration_cast<duration<double>>(steady_clock::now() - start).count();
+        printf("window %2d: %10.0f round trips/s, %8.2f us per round trip per peer\n", window,
+               total / seconds, seconds * 1e6 / iterations / window);
+    }
+
+    printf("\n");
+    if (!peers.empty()) {
+        int spinUs = cmdConf->pollSpinUs;
+        for (int spin : { 0, spinUs, -1 })
+            for (int gapUs : { 200, 0 })
+                latency(socket, peers[0], spin, gapUs);
+        socket.setPollSpinBudget(spinUs);
+    }
+
+    ping->kind = BenchMessage::DONE;
+    for (int peerId : peers)
+        socket.sendMessage(peerId, buf.data(), msgSize);
+}
+
+int main(int argc, char **argv)
+{
+    COLLECT_MAIN_INFO();
+    if (argc > 1)
+        iterations = atoi(argv[1]);
+    if (argc > 2)
+        msgSize = atoi(argv[2]);
+    if (iterations <= 0 || msgSize < sizeof(BenchMessage) || msgSize > RDMA_BUF_SIZE) {
+        fprintf(stderr, "Usage: %s [iterations] [message size (%lu ~ %d)]\n", argv[0],
+                sizeof(BenchMessage), RDMA_BUF_SIZE);
+        return -1;
+    }
+
+    cmdConf = new CmdLineConfig();
+    memConf = new MemoryConfig(*cmdConf);
+    clusterConf = new ClusterConfig(cmdConf->clusterConfigFile);
+    auto myself = clusterConf->findMyself();
+    if (myself.id < 0) {
+        fprintf(stderr, "cannot find configuration of this node\n");
+        return -1;
+    }
+    myNodeConf = new NodeConfig(myself);
+
+    auto start = steady_clock::now();
+    RDMASocket socket;
+    double socketMs = duration_cast<duration<double, milli>>(steady_clock::now() - start).count();
+
+    vector<int> peers;
+    int driver = MAX_NODES;
+    for (int i = 0; i < clusterConf->getClusterSize(); ++i)
+        driver = min(driver, (*clusterConf)[i].id);
+    for (int i = 0; i < clusterConf->getClusterSize(); ++i)
+        if ((*clusterConf)[i].id != myNodeConf->id && !socket.isPeerConnected((*clusterConf)[i].id))
+            fprintf(stderr, "cannot connect to peer %d\n", (*clusterConf)[i].id);
+    double connectMs = duration_cast<duration<double, milli>>(steady_clock::now() - start).count();
+    printf("node %d (%s connections): socket ready in %.1f ms, all peers connected in %.1f ms\n",
+           myNodeConf->id, cmdConf->lazyConnect ? "lazy" : "eager", socketMs, connectMs);
+
+    for (int i = 0; i < clusterConf->getClusterSize(); ++i)
+        if ((*clusterConf)[i].id != driver)
+            peers.push_back((*clusterConf)[i].id);
+
+    if (myNodeConf->id == driver)
+        drive(socket, peers);
+    else
+        echo(socket);
+
+    socket.stopListenerAndJoin();
+    return 0;
+}
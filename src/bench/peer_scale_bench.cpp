@@ -0,0 +1,113 @@
+/**
+ * Peer tables at scale.
+ *
+ * Run on any node of the cluster: the cluster configuration is extended with simulated nodes
+ * (sparse IDs after the real ones, on unroutable addresses), and then
+ * - all lookups of the extended configuration are checked;
+ * - an RDMA socket is created with lazy connections, and the memory it takes is reported;
+ * - the real peers that are up are connected, with the memory each connection takes.
+ * Simulated nodes are never connected to, as with peers that a node does not talk to.
+ *
+ * Usage: peer_scale_bench [simulated nodes (default 128)]
+ */
+#include <cstdio>
+#include <cstdlib>
+#include <chrono>
+#include <fstream>
+
+#include <config.hpp>
+#include <network/rdma.hpp>
+
+using namespace std;
+using namespace std::chrono;
+
+DEFINE_MAIN_INFO();
+
+/* Resident memory in bytes */
+static uint64_t residentBytes()
+{
+    uint64_t pages = 0, resident = 0;
+    ifstream fin("/proc/self/statm");
+    fin >> pages >> resident;
+    return resident * sysconf(_SC_PAGESIZE);
+}
+
+int main(int argc, char **argv)
+{
+    COLLECT_MAIN_INFO();
+    int nSimulated = argc > 1 ? atoi(argv[1]) : 128;
+    if (nSimulated < 0) {
+        fprintf(stderr, "Usage: %s [simulated nodes]\n", argv[0]);
+        return -1;
+    }
+
+    cmdConf = new CmdLineConfig();
+    memConf = new MemoryConfig(*cmdConf);
+    clusterConf = new ClusterConfig(cmdConf->clusterConfigFile);
+    auto myself = clusterConf->findMyself();
+    if (myself.id < 0) {
+        fprintf(stderr, "cannot find configuration of this node\n");
+        return -1;
+    }
+    myNodeConf = new NodeConfig(myself);
+
+    /* Simulated nodes take every other ID, in 198.18.0.0/15 (benchmarking, never routed) */
+    string scaledConfigFile = cmdConf->clusterConfigFile + ".scaled";
+    {
+        ifstream fin(cmdConf->clusterConfigFile);
+        ofstream fout(scaledConfigFile);
+        fout << fin.rdbuf() << "\n";
+        int nextId = clusterConf->getNodeIdBound() + 1;
+        for (int i = 0; i < nSimulated; ++i, nextId += 2) {
+            string ip = "198.18." + to_string(i / 250) + "." + to_string(i % 250 + 1);
+            fout << nextId << " sim" << nextId << " " << ip << " " << ip << " DS\n";
+        }
+    }
+    int nReal = clusterConf->getClusterSize();
+    delete clusterConf;
+
+    auto start = steady_clock::now();
+    clusterConf = new ClusterConfig(scaledConfigFile);
+    double loadUs = duration_cast<duration<double, micro>>(steady_clock::now() - start).count();
+    remove(scaledConfigFile.c_str());
+
+    int errors = 0;
+    for (int i = 0; i < clusterConf->getClusterSize(); ++i) {
+        NodeConfig conf = (*clusterConf)[i];
+        if (clusterConf->findConfById(conf.id).hostname != conf.hostname ||
+            clusterConf->findConfByHostname(conf.hostname).id != conf.id ||
+            clusterConf->findConfByIPStr(conf.ipAddrStr).id != conf.id)
+            ++errors;
+    }
+    for (int id = 0; id < clusterConf->getNodeIdBound(); ++id) {
+        bool listed = clusterConf->getNodeIdSet().count(id);
+        if (listed != (clusterConf->findConfById(id).id == id))
+            ++errors;
+    }
+    printf("%d nodes (%d simulated), node IDs below %d: config loaded in %.1f us, %d lookup errors\n",
+           clusterConf->getClusterSize(), clusterConf->getClusterSize() - nReal,
+           clusterConf->getNodeIdBound(), loadUs, errors);
+
+    cmdConf->lazyConnect = true;
+    uint64_t rss = residentBytes();
+    start = steady_clock::now();
+    RDMASocket socket;
+    double socketMs = duration_cast<duration<double, milli>>(steady_clock::now() - start).count();
+    printf("socket ready in %.1f ms, %lu KiB (peer table: %lu B per node ID)\n", socketMs,
+           (residentBytes() - rss) >> 10, sizeof(RDMAConnection));
+
+    int connected = 0;
+    rss = residentBytes();
+    start = steady_clock::now();
+    for (int i = 0; i < nReal; ++i) {
+        int peerId = (*clusterConf)[i].id;
+        if (peerId != myNodeConf->id && socket.isPeerConnected(peerId))
+            ++connected;
+    }
+    double connectMs = duration_cast<duration<double, milli>>(steady_clock::now() - start).count();
+    printf("%d real peer(s) connected in %.1f ms, %lu KiB per connection\n", connected, connectMs,
+           connected ? ((residentBytes() - rss) >> 10) / connected : 0);
+
+    socket.stopListenerAndJoin();
+    return errors ? -1 : 0;
+}
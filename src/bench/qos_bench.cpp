@@ -0,0 +1,144 @@
+/**
+ * Rebuild time and client tail latency with and without foreground-aware QoS (QOS_P99_US).
+ *
+ * Run on every node of the cluster at about the same time. The rebuilding node first writes
+ * pages covering `rows` rows, then a client thread reads random pages of them at a steady
+ * `iops` rate (reads only: rebuild() does not lock rows, so writes racing with it may be
+ * lost; recovery locks them, see Rebuilder::catchUp), while the node:
+ *   1. does nothing, to get the baseline client latency;
+ *   2. rebuilds the rows with QoS off (REBUILD_MBPS still applies);
+ *   3. rebuilds them again with a foreground p99 target of `target` us (default: twice the
+ *      baseline p99).
+ * It reports the client p50 / p99 / max latency of each phase, and the time and throughput of
+ * both rebuilds. Other nodes only serve RDMA reads and writes for `serve` seconds.
+ *
+ * Usage: qos_bench [rebuilding node (default 0)] [rows (default 65536)] [iops (default 20000)]
+ *                  [target us (default 0: twice the baseline)] [serve (default 300)]
+ */
+#include <cstdio>
+#include <cstdlib>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <random>
+#include <thread>
+#include <vector>
+
+#include <rebuilder.hpp>
+
+using namespace std;
+using namespace std::chrono;
+
+DEFINE_MAIN_INFO();
+
+static const char *phaseNames[] = { "idle", "rebuild", "rebuild+qos" };
+static atomic<int> phase { 0 };
+static atomic<bool> clientRun { true };
+static vector<double> latencies[3];
+
+static void client(ECAL *ecal, uint64_t nPages, int iops)
+{
+    mt19937_64 rng(myNodeConf->id);
+    uniform_int_distribution<uint64_t> indexDist(0, nPages - 1);
+    ECAL::Page page;
+    auto interval = nanoseconds(1000000000L / iops);
+    auto next = steady_clock::now() + interval;
+    while (clientRun) {
+        auto start = steady_clock::now();
+        ecal->readBlock(indexDist(rng), page);
+        auto done = steady_clock::now();
+        latencies[phase].push_back(duration_cast<duration<double, micro>>(done - start).count());
+
+        /* Steady rate, without bursting to catch up after slow operations */
+        next += interval;
+        if (next > done)
+            this_thread::sleep_until(next);
+        else if (done - next > milliseconds(100))
+            next = done;
+    }
+}
+
+static double report(int p)
+{
+    auto &lat = latencies[p];
+    if (lat.empty()) {
+        printf("%-12s no client operations\n", phaseNames[p]);
+        return 0;
+    }
+    sort(lat.begin(), lat.end());
+    uint64_t n = lat.size();
+    printf("%-12s %8lu client ops, p50 %9.2f us, p99 %9.2f us, max %9.2f us\n", phaseNames[p], n, lat[n / 2],
+           lat[n * 99 / 100], lat[n - 1]);
+    return lat[n * 99 / 100];
+}
+
+int main(int argc, char **argv)
+{
+    COLLECT_MAIN_INFO();
+    int node = argc > 1 ? atoi(argv[1]) : 0;
+    long rows = argc > 2 ? atol(argv[2]) : 65536;
+    int iops = argc > 3 ? atoi(argv[3]) : 20000;
+    int targetUs = argc > 4 ? atoi(argv[4]) : 0;
+    int serve = argc > 5 ? atoi(argv[5]) : 300;
+    if (node < 0 || node >= ECAL::N || rows <= 0 || iops <= 0 || targetUs < 0 || serve <= 0) {
+        fprintf(stderr, "Usage: %s [rebuilding node, below %d] [rows] [iops] [target us] [serve seconds]\n",
+                argv[0], ECAL::N);
+        return -1;
+    }
+
+    cmdConf = new CmdLineConfig();
+    ECAL ecal;
+    if (myNodeConf->id != node) {
+        this_thread::sleep_for(seconds(serve));
+        return 0;
+    }
+    rows = min<long>(rows, ecal.getRowCount());
+    printf("%d nodes, %s, rebuilding %ld rows of node %d under %d client ops/s\n", clusterConf->getClusterSize(),
+           ECAL::CodeTy::desc().c_str(), rows, node, iops);
+
+    /* Pages of consecutive indexes fill rows one after the other */
+    uint64_t nPages = (uint64_t)rows * (clusterConf->getClusterSize() / ECAL::N);
+    nPages = min(nPages, ecal.getClusterCapacity());
+    vector<ECAL::Page> pages(ECAL::MaxWriteBatch);
+    vector<ECAL::Page *> pagePtrs;
+    for (auto &page : pages)
+        pagePtrs.push_back(&page);
+    for (uint64_t index = 0; index < nPages; index += ECAL::MaxWriteBatch) {
+        int batch = (int)min<uint64_t>(ECAL::MaxWriteBatch, nPages - index);
+        for (int i = 0; i < batch; ++i) {
+            pages[i].index = index + i;
+            memset(pages[i].page.data, (int)(index + i), Block4K::capacity);
+        }
+        ecal.writeBlocks(pagePtrs.data(), batch);
+    }
+
+    QoS *qos = ecal.getQoS();
+    qos->setTarget(0);
+    thread clientThread(client, &ecal, nPages, iops);
+    this_thread::sleep_for(seconds(3));
+    double baseline = report(0);
+
+    Rebuilder::Stats stats[2];
+    for (int p = 1; p <= 2; ++p) {
+        if (p == 2) {
+            uint64_t target = targetUs ? targetUs * 1000ULL : (uint64_t)(2 * baseline * 1000);
+            printf("foreground p99 target: %.1f us\n", target / 1e3);
+            qos->setTarget(target);
+        }
+        uint64_t backoffs = qos->getBackoffs();
+        phase = p;
+        Rebuilder rebuilder(&ecal, cmdConf->rebuildThreads, cmdConf->rebuildDepth);
+        rebuilder.rebuild(0, rows);
+        stats[p - 1] = rebuilder.getStats();
+        printf("%-12s rebuilt in %7.3f s, %6.3f GB/s, %lu failed rows, %lu backoffs\n", phaseNames[p],
+               stats[p - 1].seconds, stats[p - 1].gbPerSec, stats[p - 1].rowsFailed, qos->getBackoffs() - backoffs);
+    }
+    clientRun = false;
+    clientThread.join();
+
+    printf("\n");
+    for (int p = 0; p < 3; ++p)
+        report(p);
+    printf("rebuild with QoS took %.2fx as long as without\n", stats[1].seconds / stats[0].seconds);
+    return 0;
+}
@@ -0,0 +1,117 @@
+/**
+ * Overhead of the RDMA operation stats (RDMA_STATS).
+ *
+ * First times what the stats add to every operation on their own: a counter add when posting
+ * and when the completion is polled, and for timed operations (one in RDMA_STATS_SAMPLING), a
+ * TSC read at both and a histogram record.
+ * Then, if a peer is given, reads 4 KiB blocks from it, 16 in flight, for `rounds` rounds of
+ * `seconds`, alternately with the stats off and on, and reports the throughput of both, the
+ * overhead (which should stay below 2%), and the stats dump. The peer only has to run
+ * `rdma_stats_bench -1` (serving, as RDMA reads do not involve its CPU).
+ *
+ * Usage: rdma_stats_bench [peer ID, or -1 to serve] [seconds per round (default 2)] [rounds (default 5)]
+ */
+#include <cstdio>
+#include <cstdlib>
+#include <chrono>
+#include <thread>
+#include <vector>
+
+#include <network/rdma.hpp>
+
+using namespace std;
+using namespace std::chrono;
+
+DEFINE_MAIN_INFO();
+
+static const int Depth = 16;
+
+static void instrumentationCost()
+{
+    const int n = 10000000;
+    RDMAOpStats stats;
+    double nsPerTick = TscClock::nsPerTick();
+    uint32_t sink = 0;
+    auto start = steady_clock::now();
+    for (int i = 0; i < n; ++i) {
+        uint64_t seq = stats.posted.fetch_add(1, memory_order_relaxed);
+        uint32_t task = seq % RDMA_STATS_SAMPLING ? 0 : (uint32_t)(TscClock::now() >> 4) & ((1U << 27) - 1);
+        stats.completed.store(stats.completed.load(memory_order_relaxed) + 1, memory_order_relaxed);
+        if (seq % RDMA_STATS_SAMPLING == 0) {
+            uint32_t ticks = ((uint32_t)(TscClock::now() >> 4) - task) & ((1U << 27) - 1);
+            stats.latency.record((uint64_t)(ticks * 16 * nsPerTick));
+            sink += ticks;
+        }
+    }
+    double ns = duration_cast<duration<double, nano>>(steady_clock::now() - start).count() / n;
+    printf("stats cost %.1f ns per operation (TSC at %.3f GHz, sink %u)\n", ns, 1 / nsPerTick, sink & 1);
+}
+
+/* 4 KiB reads from the peer for `seconds`, Depth in flight; returns reads per second */
+static double readLoop(RDMASocket &rdma, int peerId, int seconds)
+{
+    uint8_t *buffers[Depth];
+    for (auto &buffer : buffers)
+        buffer = rdma.getReadRegion(peerId);
+    ibv_wc wc[Depth];
+    uint64_t n = 0;
+    auto start = steady_clock::now(), end = start + std::chrono::seconds(seconds);
+    while (steady_clock::now() < end) {
+        for (int i = 0; i < Depth; ++i)
+            rdma.postRead(peerId, i * Block4K::capacity, (uint64_t)buffers[i], Block4K::capacity);
+        rdma.pollSendCompletion(wc, Depth);
+        n += Depth;
+    }
+    for (auto *buffer : buffers)
+        rdma.freeReadRegion(peerId, buffer);
+    return n / duration_cast<duration<double>>(steady_clock::now() - start).count();
+}
+
+int main(int argc, char **argv)
+{
+    COLLECT_MAIN_INFO();
+    instrumentationCost();
+    if (argc < 2)
+        return 0;
+
+    int peerId = atoi(argv[1]);
+    int seconds = argc > 2 ? atoi(argv[2]) : 2;
+    int rounds = argc > 3 ? atoi(argv[3]) : 5;
+    if (seconds <= 0 || rounds <= 0) {
+        fprintf(stderr, "Usage: %s [peer ID, or -1 to serve] [seconds per round] [rounds]\n", argv[0]);
+        return -1;
+    }
+
+    cmdConf = new CmdLineConfig();
+    memConf = new MemoryConfig(*cmdConf);
+    clusterConf = new ClusterConfig(cmdConf->clusterConfigFile);
+    auto myself = clusterConf->findMyself();
+    if (myself.id < 0) {
+        fprintf(stderr, "cannot find configuration of this node\n");
+        return -1;
+    }
+    myNodeConf = new NodeConfig(myself);
+    RDMASocket rdma;
+
+    if (peerId < 0) {
+        this_thread::sleep_for(std::chrono::seconds(2 * seconds * rounds + 10));
+        return 0;
+    }
+    if (!rdma.isPeerConnected(peerId)) {
+        fprintf(stderr, "cannot connect to peer %d\n", peerId);
+        return -1;
+    }
+
+    double off = 0, on = 0;
+    readLoop(rdma, peerId, 1);                      /* Warm up */
+    for (int r = 0; r < rounds; ++r) {
+        rdma.setStatsEnabled(false);
+        off += readLoop(rdma, peerId, seconds) / rounds;
+        rdma.setStatsEnabled(true);
+        on += readLoop(rdma, peerId, seconds) / rounds;
+    }
+    printf("4 KiB reads from peer %d: stats off %.0f/s, on %.0f/s, overhead %.2f%%\n", peerId, off, on,
+           (off - on) / off * 100);
+    rdma.dumpStats(stdout);
+    return 0;
+}
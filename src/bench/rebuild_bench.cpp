@@ -0,0 +1,77 @@
+/**
+ * Throughput of the node rebuild engine (Rebuilder).
+ *
+ * Run on every node of the cluster at about the same time. The rebuilding node first writes
+ * pages covering `rows` rows, then rebuilds its fragments of these rows from the other nodes
+ * with 1 to 8 decoding threads and 4 to 64 chunks in flight, and reports the rebuild
+ * throughput (GB/s of rebuilt fragments) and the bandwidth read from survivors of each.
+ * A sample of the rows is scrubbed afterwards: rows found inconsistent were rebuilt wrong.
+ * Other nodes only serve RDMA reads for `serve` seconds.
+ *
+ * Usage: rebuild_bench [rebuilding node (default 0)] [rows (default 65536)] [serve (default 120)]
+ */
+#include <cstdio>
+#include <cstdlib>
+#include <chrono>
+#include <thread>
+#include <vector>
+
+#include <rebuilder.hpp>
+
+using namespace std;
+using namespace std::chrono;
+
+DEFINE_MAIN_INFO();
+
+int main(int argc, char **argv)
+{
+    COLLECT_MAIN_INFO();
+    int node = argc > 1 ? atoi(argv[1]) : 0;
+    long rows = argc > 2 ? atol(argv[2]) : 65536;
+    int serve = argc > 3 ? atoi(argv[3]) : 120;
+    if (node < 0 || node >= ECAL::N || rows <= 0 || serve <= 0) {
+        fprintf(stderr, "Usage: %s [rebuilding node, below %d] [rows] [serve seconds]\n", argv[0], ECAL::N);
+        return -1;
+    }
+
+    cmdConf = new CmdLineConfig();
+    ECAL ecal;
+    if (myNodeConf->id != node) {
+        this_thread::sleep_for(seconds(serve));
+        return 0;
+    }
+    rows = min<long>(rows, ecal.getRowCount());
+    printf("%d nodes, %s, rebuilding %ld rows of node %d\n", clusterConf->getClusterSize(),
+           ECAL::CodeTy::desc().c_str(), rows, node);
+
+    /* Pages of consecutive indexes fill rows one after the other */
+    uint64_t nPages = (uint64_t)rows * (clusterConf->getClusterSize() / ECAL::N);
+    nPages = min(nPages, ecal.getClusterCapacity());
+    vector<ECAL::Page> pages(ECAL::MaxWriteBatch);
+    vector<ECAL::Page *> pagePtrs;
+    for (auto &page : pages)
+        pagePtrs.push_back(&page);
+    for (uint64_t index = 0; index < nPages; index += ECAL::MaxWriteBatch) {
+        int batch = (int)min<uint64_t>(ECAL::MaxWriteBatch, nPages - index);
+        for (int i = 0; i < batch; ++i) {
+            pages[i].index = index + i;
+            memset(pages[i].page.data, (int)(index + i), Block4K::capacity);
+        }
+        ecal.writeBlocks(pagePtrs.data(), batch);
+    }
+
+    for (int threads : { 1, 2, 4, 8 })
+        for (int depth : { 4, 16, 64 }) {
+            Rebuilder rebuilder(&ecal, threads, depth);
+            rebuilder.rebuild(0, rows);
+            auto stats = rebuilder.getStats();
+            printf("%d threads, %2d chunks in flight: %6.3f GB/s rebuilt, %6.3f GB/s read, %lu failed rows\n",
+                   threads, depth, stats.gbPerSec, stats.bytesRead / stats.seconds / 1e9, stats.rowsFailed);
+        }
+
+    int bad = 0, sampled = 0, repaired;
+    for (long row = 0; row < rows; row += 97, ++sampled)
+        bad += ecal.scrubRow(row, repaired) != ECAL::ScrubResult::Clean;
+    printf("%d of %d sampled rows were inconsistent after rebuilding\n", bad, sampled);
+    return 0;
+}
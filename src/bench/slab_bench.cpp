@@ -0,0 +1,187 @@
+/**
+ * RDMA staging regions: per-peer allocations and MRs vs. the registered slab.
+ *
+ * Lays out the message rings and read/write regions of `peers` simulated peers as RDMASocket
+ * does, either with new[] and 4 MRs per peer (as before the slab), or carved out of a
+ * RegisteredSlab. Then reports the registration time, the MR count, and the time and dTLB
+ * misses of staging copies (a 4 KiB copy in and out of random slots of random peers).
+ * Only needs a local RDMA device (the first one).
+ *
+ * Usage: slab_bench [peers (default 64)] [copies (default 1000000)] [slab chunk MiB (default 64)]
+ */
+#include <cstdio>
+#include <cstdlib>
+#include <chrono>
+#include <random>
+#include <vector>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+#include <network/rdma.hpp>
+
+using namespace std;
+using namespace std::chrono;
+
+struct PeerRegions
+{
+    uint8_t *send, *recv, *write, *read;
+};
+
+static const size_t ringSize = RDMA_BUF_SIZE * RDMAConnection::NMsgSlots;
+static const size_t regionSize = Block4K::capacity * RDMAConnection::NConcurrency +
+                                 RDMAConnection::ExtentRegionSize;
+
+/* dTLB load + store misses of this thread, -1 if not permitted */
+class TLBMissCounter
+{
+public:
+    TLBMissCounter()
+    {
+        for (int i = 0; i < 2; ++i) {
+            perf_event_attr attr;
+            memset(&attr, 0, sizeof(attr));
+            attr.size = sizeof(attr);
+            attr.type = PERF_TYPE_HW_CACHE;
+            int op = i ? PERF_COUNT_HW_CACHE_OP_WRITE : PERF_COUNT_HW_CACHE_OP_READ;
+            attr.config = PERF_COUNT_HW_CACHE_DTLB | op << 8 | PERF_COUNT_HW_CACHE_RESULT_MISS << 16;
+            attr.disabled = 1;
+            attr.exclude_kernel = 1;
+            fd[i] = syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+        }
+    }
+    ~TLBMissCounter()
+    {
+        for (int i = 0; i < 2; ++i)
+            if (fd[i] >= 0)
+                close(fd[i]);
+    }
+    void start()
+    {
+        for (int i = 0; i < 2; ++i)
+            if (fd[i] >= 0) {
+                ioctl(fd[i], PERF_EVENT_IOC_RESET, 0);
+                ioctl(fd[i], PERF_EVENT_IOC_ENABLE, 0);
+            }
+    }
+    int64_t stop()
+    {
+        int64_t total = 0;
+        for (int i = 0; i < 2; ++i) {
+            uint64_t count = 0;
+            if (fd[i] < 0 || ioctl(fd[i], PERF_EVENT_IOC_DISABLE, 0) ||
+                read(fd[i], &count, sizeof(count)) != sizeof(count))
+                return -1;
+            total += count;
+        }
+        return total;
+    }
+
+private:
+    int fd[2];
+};
+
+static void copies(const char *name, const vector<PeerRegions> &regions, int n, int mrs, double regMs)
+{
+    static uint8_t src[Block4K::capacity], dst[Block4K::capacity];
+    mt19937 rng(1);
+    uniform_int_distribution<int> peerDist(0, regions.size() - 1);
+    uniform_int_distribution<int> slotDist(0, RDMAConnection::NConcurrency - 1);
+    TLBMissCounter tlb;
+
+    tlb.start();
+    auto start = steady_clock::now();
+    for (int i = 0; i < n; ++i) {
+        const auto &peer = regions[peerDist(rng)];
+        int slot = slotDist(rng);
+        memcpy(peer.write + slot * Block4K::capacity, src, Block4K::capacity);
+        memcpy(dst, peer.read + slot * Block4K::capacity, Block4K::capacity);
+        peer.send[(i % RDMAConnection::NMsgSlots) * RDMA_BUF_SIZE] = dst[0];
+    }
+    double ns = duration_cast<duration<double, nano>>(steady_clock::now() - start).count() / n;
+    int64_t misses = tlb.stop();
+
+    printf("%-16s %5d MRs, registered in %8.2f ms; copy %7.1f ns, ", name, mrs, regMs, ns);
+    if (misses >= 0)
+        printf("%6.3f dTLB misses per copy\n", (double)misses / n);
+    else
+        printf("dTLB misses n/a (perf_event_open not permitted)\n");
+}
+
+int main(int argc, char **argv)
+{
+    int nPeers = argc > 1 ? atoi(argv[1]) : 64;
+    int n = argc > 2 ? atoi(argv[2]) : 1000000;
+    size_t chunkMB = argc > 3 ? atoi(argv[3]) : 64;
+    if (nPeers <= 0 || n <= 0 || chunkMB < 2) {
+        fprintf(stderr, "Usage: %s [peers] [copies] [slab chunk MiB]\n", argv[0]);
+        return -1;
+    }
+
+    int nDevices;
+    ibv_device **devices = ibv_get_device_list(&nDevices);
+    if (!devices || !nDevices) {
+        fprintf(stderr, "no RDMA device\n");
+        return -1;
+    }
+    ibv_context *ctx = ibv_open_device(devices[0]);
+    ibv_pd *pd = ctx ? ibv_alloc_pd(ctx) : nullptr;
+    if (!pd) {
+        fprintf(stderr, "cannot open %s\n", ibv_get_device_name(devices[0]));
+        return -1;
+    }
+    printf("%s, %d peers, %lu KiB of regions per peer\n", ibv_get_device_name(devices[0]), nPeers,
+           (2 * ringSize + 2 * regionSize) >> 10);
+
+    /* Per-peer allocations and MRs */
+    {
+        vector<PeerRegions> regions(nPeers);
+        vector<ibv_mr *> mrs;
+        auto start = steady_clock::now();
+        for (auto &peer : regions) {
+            peer = { new uint8_t[ringSize](), new uint8_t[ringSize](), new uint8_t[regionSize](),
+                     new uint8_t[regionSize]() };
+            mrs.push_back(ibv_reg_mr(pd, peer.send, ringSize, 0));
+            mrs.push_back(ibv_reg_mr(pd, peer.recv, ringSize, IBV_ACCESS_LOCAL_WRITE));
+            mrs.push_back(ibv_reg_mr(pd, peer.write, regionSize, 0));
+            mrs.push_back(ibv_reg_mr(pd, peer.read, regionSize, IBV_ACCESS_LOCAL_WRITE));
+        }
+        double regMs = duration_cast<duration<double, milli>>(steady_clock::now() - start).count();
+        copies("per-peer MRs", regions, n, mrs.size(), regMs);
+
+        for (auto *mr : mrs)
+            if (mr)
+                ibv_dereg_mr(mr);
+        for (auto &peer : regions) {
+            delete[] peer.send;
+            delete[] peer.recv;
+            delete[] peer.write;
+            delete[] peer.read;
+        }
+    }
+
+    /* Registered slab */
+    {
+        vector<PeerRegions> regions(nPeers);
+        auto start = steady_clock::now();
+        RegisteredSlab slab(pd, chunkMB << 20, IBV_ACCESS_LOCAL_WRITE);
+        for (auto &peer : regions) {
+            auto block = slab.alloc(2 * ringSize + 2 * regionSize);
+            if (!block.addr)
+                return -1;
+            peer = { block.addr, block.addr + ringSize, block.addr + 2 * ringSize,
+                     block.addr + 2 * ringSize + regionSize };
+        }
+        double regMs = duration_cast<duration<double, milli>>(steady_clock::now() - start).count();
+        auto stats = slab.getStats();
+        copies("registered slab", regions, n, stats.chunks, regMs);
+        printf("slab: %lu MiB registered (%lu MiB on hugepages), %lu MiB used, NUMA node %d\n",
+               stats.registeredBytes >> 20, stats.hugepageBytes >> 20, stats.usedBytes >> 20, stats.numaNode);
+    }
+
+    ibv_dealloc_pd(pd);
+    ibv_close_device(ctx);
+    ibv_free_device_list(devices);
+    return 0;
+}
@@ -0,0 +1,90 @@
+/**
+ * Contention of staging slot allocation.
+ *
+ * Threads repeatedly take a slot, hold it for a while (as an RDMA operation would), and free
+ * it, with the former allocator (a 32-bit bitmap, yielding while it is empty) and with
+ * SlotPool of 32 and more slots. Reports slot operations per second, and for SlotPool how
+ * often callers had to park, refill their cache, or steal.
+ *
+ * Usage: slot_bench [max threads (default 16)] [operations per thread] [hold in ns]
+ */
+#include <cstdio>
+#include <cstdlib>
+#include <chrono>
+#include <thread>
+#include <vector>
+
+#include <bitmap.hpp>
+#include <slotpool.hpp>
+
+using namespace std;
+using namespace std::chrono;
+
+static int nOps = 200000;
+static int holdNs = 2000;
+
+static void hold()
+{
+    auto start = steady_clock::now();
+    while (duration_cast<nanoseconds>(steady_clock::now() - start).count() < holdNs);
+}
+
+template <typename Worker>
+static double run(int nThreads, Worker worker)
+{
+    vector<thread> threads;
+    auto start = steady_clock::now();
+    for (int i = 0; i < nThreads; ++i)
+        threads.emplace_back(worker);
+    for (auto &t : threads)
+        t.join();
+    double seconds = duration_cast<duration<double>>(steady_clock::now() - start).count();
+    return (double)nThreads * nOps / seconds / 1e6;
+}
+
+int main(int argc, char **argv)
+{
+    int maxThreads = argc > 1 ? atoi(argv[1]) : 16;
+    if (argc > 2)
+        nOps = atoi(argv[2]);
+    if (argc > 3)
+        holdNs = atoi(argv[3]);
+    if (maxThreads <= 0 || nOps <= 0 || holdNs < 0) {
+        fprintf(stderr, "Usage: %s [max threads] [operations per thread] [hold in ns]\n", argv[0]);
+        return -1;
+    }
+
+    printf("%d operations per thread, slots held for %d ns, %u cores\n", nOps, holdNs,
+           thread::hardware_concurrency());
+    for (int nThreads = 1; nThreads <= maxThreads; nThreads *= 2) {
+        Bitmap<32> bitmap;
+        double bitmapMops = run(nThreads, [&] {
+            for (int i = 0; i < nOps; ++i) {
+                int idx = bitmap.allocBit();
+                while (idx == -1) {
+                    this_thread::yield();
+                    idx = bitmap.allocBit();
+                }
+                hold();
+                bitmap.freeBit(idx);
+            }
+        });
+        printf("%2d thread(s): bitmap(32) %7.3f Mops/s", nThreads, bitmapMops);
+
+        for (int size : { 32, 128 }) {
+            SlotPool pool(size);
+            double poolMops = run(nThreads, [&] {
+                for (int i = 0; i < nOps; ++i) {
+                    int slot = pool.get();
+                    hold();
+                    pool.put(slot);
+                }
+            });
+            auto &stats = pool.getStats();
+            printf(" | pool(%d) %7.3f Mops/s, %lu parks, %lu refills, %lu steals", size, poolMops,
+                   (uint64_t)stats.parks, (uint64_t)stats.refills, (uint64_t)stats.steals);
+        }
+        printf("\n");
+    }
+    return 0;
+}
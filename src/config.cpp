@@ -63,9 +63,58 @@ CmdLineConfig::CmdLineConfig()
     if (_Thread > 16)
         _Thread = 16;
 
+    if ((env = getenv("READAHEAD")))
+        readaheadWindow = std::stoi(std::string(env));
+    else
+        readaheadWindow = 64;
+
+    if ((env = getenv("STRIPE_UNIT")))
+        stripeUnit = std::stoi(std::string(env));
+    else
+        stripeUnit = 4096;
+
+    if ((env = getenv("SCRUB_MBPS")))
+        scrubBandwidth = std::stoi(std::string(env));
+    else
+        scrubBandwidth = 0;
+
+    if ((env = getenv("SCRUB_IOPS")))
+        scrubIops = std::stoi(std::string(env));
+    else
+        scrubIops = 0;
+
+    if ((env = getenv("POLL_SPIN_US")))
+        pollSpinUs = std::stoi(std::string(env));
+    else
+        pollSpinUs = 50;
+
+    if ((env = getenv("SLAB_CHUNK_MB")))
+        slabChunkMB = std::max(std::stoi(std::string(env)), 2);
+    else
+        slabChunkMB = 64;
+
+    if ((env = getenv("STAGING_SLOTS")))
+        stagingSlots = std::min(std::max(std::stoi(std::string(env)), 32), MAX_STAGING_SLOTS);
+    else
+        stagingSlots = 32;
+
     udpPort = 31850;
 
     recover = ((env = getenv("RECOVER")) && strcmp(env, "OFF") && strcmp(env, "NO"));
+    recoverFull = (recover && !strcmp(env, "FULL"));
+    rebuildThreads = (env = getenv("REBUILD_THREADS")) ? std::max(std::stoi(std::string(env)), 1) : 4;
+    rebuildDepth = (env = getenv("REBUILD_DEPTH")) ? std::max(std::stoi(std::string(env)), 1) : 16;
+    rebuildBandwidth = (env = getenv("REBUILD_MBPS")) ? std::max(std::stoi(std::string(env)), 0) : 0;
+    qosP99Us = (env = getenv("QOS_P99_US")) ? std::max(std::stoi(std::string(env)), 0) : 0;
+    qosEpochMs = (env = getenv("QOS_EPOCH_MS")) ? std::max(std::stoi(std::string(env)), 1) : 50;
+    lazyConnect = ((env = getenv("LAZY_CONNECT")) && strcmp(env, "OFF") && strcmp(env, "NO"));
+    stripeLocks = !((env = getenv("STRIPE_LOCKS")) && (!strcmp(env, "OFF") || !strcmp(env, "NO")));
+    durableWrites = ((env = getenv("DURABLE_WRITES")) && strcmp(env, "OFF") && strcmp(env, "NO"));
+    dirtyMaps = !((env = getenv("DIRTY_MAPS")) && (!strcmp(env, "OFF") || !strcmp(env, "NO")));
+    rdmaStats = !((env = getenv("RDMA_STATS")) && (!strcmp(env, "OFF") || !strcmp(env, "NO")));
+    rdmaStatsDumpSec = (env = getenv("RDMA_STATS_DUMP")) ? std::max(std::stoi(std::string(env)), 0) : 0;
+    heartbeatUs = (env = getenv("HEARTBEAT_US")) ? std::max(std::stoi(std::string(env)), 1) : 100;
+    heartbeatLeaseUs = (env = getenv("HEARTBEAT_LEASE_US")) ? std::max(std::stoi(std::string(env)), 0) : 0;
 
     /* getenv results should NOT be freed, so it is left as is */
     d_info("pmem: %s", pmemDeviceName.c_str());
@@ -96,8 +145,8 @@ ClusterConfig::ClusterConfig(string filename)
     
     int i;
     for (i = 0; fin >> nodeId >> hostname >> ipAddrStr >> ibDevIPAddrStr >> nodeTypeStr; ++i) {
-        if (i >= MAX_NODES) {
-            d_err("there must be no more than %d nodes", MAX_NODES);
+        if (nodeId < 0 || nodeId >= MAX_NODES) {
+            d_err("node ID %d out of range [0, %d)", nodeId, MAX_NODES);
             exit(-1);
         }
 
@@ -107,21 +156,26 @@ ClusterConfig::ClusterConfig(string filename)
         }
 
         nodeIds.insert(nodeId);
-        nodeConf[nodeId].id = nodeId;
-        nodeConf[nodeId].hostname = hostname;
-        nodeConf[nodeId].ipAddrStr = ipAddrStr;
-        nodeConf[nodeId].ibDevIPAddrStr = ibDevIPAddrStr;
+        NodeConfig conf;
+        conf.id = nodeId;
+        conf.hostname = hostname;
+        conf.ipAddrStr = ipAddrStr;
+        conf.ibDevIPAddrStr = ibDevIPAddrStr;
         if (nodeTypeStr == "DMS")
-            nodeConf[nodeId].type = NODE_DMS;
+            conf.type = NODE_DMS;
         else if (nodeTypeStr == "FMS")
-            nodeConf[nodeId].type = NODE_FMS;
+            conf.type = NODE_FMS;
         else if (nodeTypeStr == "DS")
-            nodeConf[nodeId].type = NODE_CLIENT;        /* DSs are Clients */
+            conf.type = NODE_CLIENT;        /* DSs are Clients */
         else if (nodeTypeStr == "CLI")
-            nodeConf[nodeId].type = NODE_CLIENT;
+            conf.type = NODE_CLIENT;
         else
             d_err("unrecognized node type: %s", nodeTypeStr.c_str());
-        ip2id[nodeConf[nodeId].ipAddrStr] = nodeId;
+        nodeConf.push_back(conf);
+        if (nodeId >= (int)idIndex.size())
+            idIndex.resize(nodeId + 1, -1);
+        idIndex[nodeId] = i;
+        ip2id[ipAddrStr] = nodeId;
         host2id[hostname] = nodeId;
     }
     nodeCount = i;
@@ -130,8 +184,8 @@ ClusterConfig::ClusterConfig(string filename)
 
 NodeConfig ClusterConfig::findConfById(int id) const
 {
-    if (id >= 0 && id < nodeCount && nodeConf[id].id == id)
-        return nodeConf[id];
+    if (id >= 0 && id < (int)idIndex.size() && idIndex[id] >= 0)
+        return nodeConf[idIndex[id]];
     return NodeConfig();
 }
 
@@ -139,7 +193,7 @@ NodeConfig ClusterConfig::findConfByHostname(const string &hostname) const
 {
     auto it = host2id.find(hostname);
     if (it != host2id.end())
-        return nodeConf[it->second];
+        return findConfById(it->second);
     return NodeConfig();
 }
 
@@ -147,7 +201,7 @@ NodeConfig ClusterConfig::findConfByIPStr(const string &ipAddrStr) const
 {
     auto it = ip2id.find(ipAddrStr);
     if (it != ip2id.end())
-        return nodeConf[it->second];
+        return findConfById(it->second);
     return NodeConfig();
 }
 
@@ -1,4 +1,5 @@
 #include <ecal.hpp>
+#include <rebuilder.hpp>
 #include <debug.hpp>
 
 //#define USE_RPC
@@ -32,8 +33,18 @@ ECAL::ECAL()
         }
     }
 
-    allocTable = new BlockPool<BlockTy>();
+    allocTable = new BlockPool<BlockTy>(sizeof(uint32_t), true, N);
+    dirtyMap = new DirtyMap(allocTable->dirtyMapArea(), allocTable->getCapacity(), N);
     rdma = new RDMASocket();
+    failedPeers.assign(clusterConf->getNodeIdBound(), false);
+    qos = new QoS(cmdConf->qosP99Us * 1000ULL, cmdConf->qosEpochMs * 1000000ULL);
+    qos->setCeiling(TrafficClass::Rebuild, cmdConf->rebuildBandwidth * 1e6);
+    if (cmdConf->stripeLocks)
+        stripeLocks = new StripeLocks(rdma, allocTable->lockAt(0), allocTable->getLockShift(0));
+    rdma->setPeerDeathHandler([this](int) { prewarmDecodeTables(); });
+    rdma->setPeerAdmitHandler([this](int peerId, bool full) { return admitPeer(peerId, full); });
+    rdma->setP99Source([this] { return qos->getForegroundP99(); });
+    qos->setRemoteP99([this] { return rdma->getPeersP99(); });
 
     if (clusterConf->getClusterSize() % N != 0) {
         d_err("FIXME: clusterSize %% N != 0, exit");
@@ -44,136 +55,31 @@ ECAL::ECAL()
     int clusterNodeCount = clusterConf->getClusterSize();
     capacity = (clusterNodeCount / N * K * allocTable->getCapacity()) / (Block4K::capacity / BlockTy::size);
 
-    /* Initialize EC Matrices */
-    gf_gen_cauchy1_matrix(encodeMatrix, N, K);
-    ec_init_tables(K, P, &encodeMatrix[K * K], gfTables);
-
+    d_info("ECAL code: %s", CodeTy::desc().c_str());
     for (int i = 0; i < P; ++i)
         parity[i] = encodeBuffer + i * BlockTy::size;
+    extentParity = new uint8_t[P * MaxExtentPages * BlockTy::size];
 
-#if 0
-    /* Start recovery process if this is a recovery */
+    /* Rebuild fragments of this node from its peers if this is a recovery, while they fence it */
     if (cmdConf->recover) {
         d_warn("start data recovery...");
-
-        int peerId = -1;
-        for (int i = 0; i < clusterConf->getClusterSize(); ++i) {
-            peerId = (*clusterConf)[i].id;
-            if (rpcInterface->isPeerAlive(peerId))
-                break;
-        }
-        if (peerId == -1) {
-            d_err("cannot find a valid peer!");
-            return;
-        }
-
-        /* Get remote write buffer MR & size */
-        Message request, response;
-        request.type = Message::MESG_RECOVER_START;
-        rpcInterface->rpcCall(peerId, &request, &response);
-        int writeLogLen = response.data.size;
-        size_t writeLogSize = writeLogLen * sizeof(uint64_t);
-
-        /* Allocate local write log space */
-        std::vector<uint64_t> blkNos;
-        blkNos.resize(writeLogLen);
-        uint64_t *localDst = blkNos.data();
-        ibv_mr *localLogMR = rpcInterface->getRDMASocket()->allocMR(localDst, writeLogSize, IBV_ACCESS_LOCAL_WRITE);
-
-        /* Perform RDMA read */
-        ibv_send_wr wr;
-        ibv_sge sge;
-        ibv_wc wc[2];
-
-        memset(&sge, 0, sizeof(ibv_sge));
-        sge.addr = (uint64_t)localDst;
-        sge.length = writeLogSize;
-        sge.lkey = localLogMR->lkey;
-
-        memset(&wr, 0, sizeof(ibv_send_wr));
-        wr.wr_id = WRID(peerId, SP_REMOTE_WRLOG_READ);
-        wr.sg_list = &sge;
-        wr.num_sge = 1;
-        wr.opcode = IBV_WR_RDMA_READ;
-        wr.send_flags = IBV_SEND_SIGNALED;
-        wr.wr.rdma.remote_addr = (uint64_t)response.data.mr.addr;
-        wr.wr.rdma.rkey = response.data.mr.rkey;
-
-        rpcInterface->getRDMASocket()->postSpecialSend(peerId, &wr);
-        expectPositive(rpcInterface->getRDMASocket()->pollSendCompletion(wc));
-
-        /* Retrieve & Recover */
-        int pagePerRow = clusterConf->getClusterSize() / N;
-        uint8_t *recoverSrc[K];
-        int decodeIndex[K];
-        for (int i = 0; i < writeLogLen; ++i) {
-            uint64_t row = blkNos[i];
-            uint64_t blockShift = getBlockShift(row);
-            int startNodeId = (row % pagePerRow) * N;
-            int selfId = -1;
-            for (int i = 0, j = 0; i < K && j < N; ++j) {
-                int idx = (j + startNodeId) % N;
-                if (idx != myNodeConf->id && rpcInterface->isPeerAlive(peerId))
-                    decodeIndex[i++] = j;
-                else
-                    selfId = j;
-            }
-            int taskCnt = 0;
-            for (int i = 0; i < K; ++i) {
-                int idx = (decodeIndex[i] + startNodeId) % N;
-                uint8_t *base = rpcInterface->getRDMASocket()->getReadRegion(peerId);
-                rpcInterface->remoteReadFrom(idx, blockShift, (uint64_t)base, BlockTy::size, i);
-                recoverSrc[i] = base;
-                ++taskCnt;
-            }
-
-            ibv_wc wc[2];
-            while (taskCnt)
-                taskCnt -= rpcInterface->getRDMASocket()->pollSendCompletion(wc);
-            
-            uint8_t decodeMatrix[1 * K];
-            uint8_t invertMatrix[K * K];
-            uint8_t b[K * K];
-
-            for (int i = 0; i < K; ++i)
-                memcpy(&b[K * i], &encodeMatrix[K * decodeIndex[i]], K);
-            gf_invert_matrix(b, invertMatrix, K);
-            
-            if (selfId < K)
-                memcpy(decodeMatrix, &invertMatrix[K * selfId], K);
-            else
-                for (int i = 0; i < K; ++i) {
-                    int s = 0;
-                    for (int j = 0; j < K; ++j)
-                        s ^= gf_mul(invertMatrix[j * K + i], encodeMatrix[K * selfId + j]);
-                    decodeMatrix[i] = s;
-                }
-            
-            uint8_t gfTbls[K * P * 32];
-            uint8_t *recoverOutput[1] = { reinterpret_cast<uint8_t *>(allocTable->at(row)) };
-            ec_init_tables(K, 1, decodeMatrix, gfTbls);
-            ec_encode_data(BlockTy::size, K, 1, gfTbls, recoverSrc, recoverOutput);
-
-            for (int i = 0; i < K; ++i) {
-                int idx = (decodeIndex[i] + startNodeId) % N;
-                rpcInterface->getRDMASocket()->freeReadRegion(idx, recoverSrc[i]);
-            }
-
-        }
-
-        /* Local & remote cleanup */
-        ibv_dereg_mr(localLogMR);
-
-        request.type = Message::MESG_RECOVER_END;
-        rpcInterface->rpcCall(peerId, &request, &response);
-
+        Rebuilder rebuilder(this, cmdConf->rebuildThreads, cmdConf->rebuildDepth);
+        bool rebuilt = cmdConf->recoverFull ? rebuilder.rebuild(0, getRowCount()) : rebuilder.rebuildDirty();
+        rebuilt = rebuilt && rebuilder.catchUp();
+        if (!rebuilt)
+            d_err("some rows could not be rebuilt: this node stays fenced, and must be recovered again");
+        else
+            rdma->setPhase(NodePhase::Synced);
         d_warn("finished data recovery! ECAL start.");
     }
-#endif
 }
 
 ECAL::~ECAL()
 {
+    delete stripeLocks;
+    delete dirtyMap;
+    delete qos;
+    delete[] extentParity;
     if (memConf) {
         delete memConf;
         memConf = nullptr;
@@ -184,168 +90,821 @@ int readCount = 0, writeCount = 0;
 
 void ECAL::readBlock(uint64_t index, ECAL::Page &page)
 {
-#if 0
-    int decodeIndex[K], errIndex[K];
-    int cnt = 0, availMap = 0;
-    uint8_t *bases[N];
-    uint8_t *recoverSrc[N], *recoverOutput[N];
+    Page *pages[1] = { &page };
+    readBlocks(&index, pages, 1);
+}
 
-    page.index = index;
-    memset(page.page.data, 0, Block4K::capacity);
+/**
+ * Read a batch of pages.
+ * Fragment reads of up to `MaxReadBatch` pages are posted to all stripe nodes at once,
+ * and then polled together, so that the batch costs roughly one RDMA round trip.
+ */
+void ECAL::readBlocks(const uint64_t *indexes, ECAL::Page **pages, int count)
+{
+    uint64_t start = TscClock::now();
+    std::lock_guard<std::mutex> lock(ioMutex);
+    ForegroundIo io(this, start, (uint64_t)count * Block4K::capacity);
+
+    ReadTask tasks[MaxReadBatch];
+    ibv_wc wc[MaxReadBatch * K * 2];
+    for (int start = 0; start < count; start += MaxReadBatch) {
+        int batch = std::min(count - start, MaxReadBatch);
+        int taskCnt = 0;
+        std::fill(failedPeers.begin(), failedPeers.end(), false);
+        for (int i = 0; i < batch; ++i)
+            taskCnt += postReadTask(tasks[i], indexes[start + i], *pages[start + i]);
+        if (taskCnt)
+            pollReads(wc, taskCnt);
+        for (int i = 0; i < batch; ++i)
+            finishReadTask(tasks[i]);
+    }
+}
 
-    auto pos = getDataPos(index);
+/**
+ * Drop the summary bits of dirty map words that live peers have cleared after rebuilding
+ * their rows. Returns the rows still dirty for live peers.
+ */
+uint64_t ECAL::tidyDirtyMaps()
+{
+    std::lock_guard<std::mutex> lock(ioMutex);
+    uint64_t dirty = 0;
+    for (int node = 0; node < N; ++node)
+        if (node != myNodeConf->id && rdma->isPeerAlive(node))
+            dirty += dirtyMap->tidy(node);
+    return dirty;
+}
 
-    /* Read data blocks from remote (or self) */
-    uint64_t blockShift = getBlockShift(pos.row);
-    int taskCnt = K;
-    for (int i = 0; i < N; ++i) {
-        int peerId = (i + pos.startNodeId) % N;
-        if (peerId != myNodeConf->id) {
-            uint8_t *base = rdma->getReadRegion(peerId);
-            rdma->postRead(peerId, blockShift, (uint64_t)base, BlockTy::size, i);
-            bases[i] = base;
-        }
-        else {
-            recoverSrc[cnt] = reinterpret_cast<uint8_t *>(allocTable->at(pos.row));
-            decodeIndex[cnt++] = i;
-            availMap |= 1 << i;
-            --taskCnt;
-        }
+/**
+ * Agree to readmit a fenced peer: to writes, once the writes that skipped it are over (they
+ * marked its rows dirty, which it rebuilds as it catches up), and to reads too, if no row I
+ * wrote without it is left dirty. Without dirty maps, that cannot be told.
+ */
+bool ECAL::admitPeer(int peerId, bool full)
+{
+    std::lock_guard<std::mutex> lock(ioMutex);
+    if (!full)
+        return true;
+    if (!cmdConf->dirtyMaps) {
+        d_err("cannot tell whether node %d missed writes without DIRTY_MAPS", peerId);
+        return false;
     }
+    uint64_t dirty = dirtyMap->count(peerId);
+    if (dirty)
+        d_err("node %d reports it is in sync, but %lu rows I wrote without it are not rebuilt", peerId, dirty);
+    return !dirty;
+}
 
-    ibv_wc wc[MAX_NODES];
-    rdma->pollSendCompletion(wc, taskCnt);
-    for (int i = 0; i < taskCnt; ++i) {
-        int j = WRID_TASK(wc[i].wr_id);
-        recoverSrc[cnt] = bases[j];
-        decodeIndex[cnt++] = j;
-        availMap |= 1 << j;
+/** Build decode tables of the current failure pattern before degraded reads need them. */
+void ECAL::prewarmDecodeTables()
+{
+    int srcId[K];
+    bool alive[N];
+    for (int start = 0; start < N; ++start) {
+        for (int j = 0; j < N; ++j)
+            alive[j] = rdma->isPeerAlive((j + start) % N);
+        if (CodeTy::selectSources(alive, srcId))
+            CodeTy::prepareDecode(srcId);
     }
+}
 
-    int errs = 0;
-    for (int i = 0; i < N; ++i)
-        if ((availMap & (1 << i)) == 0)
-            recoverOutput[errs++] = page.page.data + i * BlockTy::size;
-
-    /* Copy intact data */
-    for (int i = 0; i < K; ++i)
-        if (decodeIndex[i] < K)
-            memcpy(page.page.data + decodeIndex[i] * BlockTy::size, recoverSrc[i], BlockTy::size);
-
-    if (errs == 0) {
-        for (int i = 0; i < N; ++i) {
-            int peerId = (i + pos.startNodeId) % N;
-            if (peerId != myNodeConf->id)
-                rdma->freeReadRegion(peerId, bases[i]);
-        }
-	return;
-    }
-#else
-    int decodeIndex[K], errIndex[K];
-    uint8_t *recoverSrc[N], *recoverOutput[N];
+/** Post fragment reads of a page, and return the number of posted RDMA reads. */
+int ECAL::postReadTask(ECAL::ReadTask &task, uint64_t index, ECAL::Page &page)
+{
+    task.page = &page;
+    task.pos = getDataPos(index);
+    task.corrupt = 0;
 
     page.index = index;
     memset(page.page.data, 0, Block4K::capacity);
+    return postFragmentReads(task);
+}
 
-    auto pos = getDataPos(index);
-    int errs = 0;
-    for (int i = 0, j = 0; i < K && j < N; ++j) {
-        int peerId = (j + pos.startNodeId) % N;
-        if (rdma->isPeerAlive(peerId)) 
-            decodeIndex[i++] = j;
-        else if (j < K) {
-            errIndex[errs] = j;
-            recoverOutput[errs++] = page.page.data + j * BlockTy::size;
-        }
+/**
+ * Pick K sources among live fragments not known to be corrupt, and post reads of them
+ * and of their checksums. Returns the number of posted RDMA reads.
+ */
+int ECAL::postFragmentReads(ECAL::ReadTask &task)
+{
+    task.errs = 0;
+
+    bool alive[N];
+    for (int j = 0; j < N; ++j)
+        alive[j] = !(task.corrupt >> j & 1) && rdma->isPeerAlive((j + task.pos.startNodeId) % N);
+    if (!CodeTy::selectSources(alive, task.decodeIndex)) {
+        d_err("too many lost fragments to read block %lu", task.page->index);
+        task.errs = -1;
+        return 0;
     }
+    for (int i = 0; i < K; ++i)
+        if (task.decodeIndex[i] >= K)
+            ++task.errs;
 
-    /* Read data blocks from remote (or self) */
-    uint64_t blockShift = getBlockShift(pos.row);
-    ibv_wc wc[2];
+    /* Read data blocks from remote (or self), each followed by its checksum */
+    uint64_t blockShift = getBlockShift(task.pos.row);
+    uint64_t checksumShift = getChecksumShift(task.pos.row);
+    int taskCnt = 0;
     for (int i = 0; i < K; ++i) {
-        int peerId = (decodeIndex[i] + pos.startNodeId) % N;
+        int peerId = (task.decodeIndex[i] + task.pos.startNodeId) % N;
         if (peerId != myNodeConf->id) {
             uint8_t *base = rdma->getReadRegion(peerId);
             rdma->postRead(peerId, blockShift, (uint64_t)base, BlockTy::size, i);
-	    rdma->pollSendCompletion(wc);
-            recoverSrc[i] = base;
+            rdma->postRead(peerId, checksumShift, (uint64_t)(base + BlockTy::size), sizeof(uint32_t), i);
+            task.recoverSrc[i] = base;
+            taskCnt += 2;
         }
         else
-            recoverSrc[i] = reinterpret_cast<uint8_t *>(allocTable->at(pos.row));
+            task.recoverSrc[i] = reinterpret_cast<uint8_t *>(allocTable->at(task.pos.row));
     }
+    return taskCnt;
+}
 
-    /* Copy intact data */
-    for (int i = 0; i < K; ++i)
-        if (decodeIndex[i] < K)
-            memcpy(page.page.data + decodeIndex[i] * BlockTy::size, recoverSrc[i], BlockTy::size);
+/**
+ * Wait for `count` fragment reads, and note the peers of failed ones (e.g. flushed as their
+ * peer was declared dead): what they fetched is garbage.
+ */
+void ECAL::pollReads(ibv_wc *wc, int count)
+{
+    rdma->pollSendCompletion(wc, count);
+    for (int i = 0; i < count; ++i)
+        if (wc[i].status != IBV_WC_SUCCESS)
+            failedPeers[WRID_PEER(wc[i].wr_id)] = true;
+}
 
-    if (errs == 0) {
-        for (int i = 0; i < K; ++i) {
-            int peerId = (decodeIndex[i] + pos.startNodeId) % N;
-            if (peerId != myNodeConf->id)
-                rdma->freeReadRegion(peerId, recoverSrc[i]);
+/**
+ * Fetch fragment `i` of a read task and its checksum again, and check them. A write racing
+ * the first fetch may have left them from different writes, which is not corruption.
+ */
+bool ECAL::refetchFragment(ECAL::ReadTask &task, int i)
+{
+    int peerId = (task.decodeIndex[i] + task.pos.startNodeId) % N;
+    if (peerId == myNodeConf->id)
+        return fragmentChecksum(task.recoverSrc[i], BlockTy::size) == *getLocalChecksum(task.pos.row);
+
+    uint8_t *base = task.recoverSrc[i];
+    rdma->postRead(peerId, getBlockShift(task.pos.row), (uint64_t)base, BlockTy::size, i);
+    rdma->postRead(peerId, getChecksumShift(task.pos.row), (uint64_t)(base + BlockTy::size), sizeof(uint32_t), i);
+    ibv_wc wc[2];
+    pollReads(wc, 2);
+    return !failedPeers[peerId] &&
+           fragmentChecksum(base, BlockTy::size) == *reinterpret_cast<uint32_t *>(base + BlockTy::size);
+}
+
+/**
+ * Check fetched fragments against their checksums, marking mismatching ones, and those
+ * whose reads failed, as corrupt. A mismatching fragment is fetched once more, and only
+ * counted as a checksum error if it still mismatches.
+ */
+bool ECAL::verifyReadTask(ECAL::ReadTask &task)
+{
+    bool intact = true;
+    for (int i = 0; i < K; ++i) {
+        int peerId = (task.decodeIndex[i] + task.pos.startNodeId) % N;
+        if (peerId != myNodeConf->id && failedPeers[peerId]) {
+            d_warn("read failure on fragment %d of block %lu (node %d), treated as lost",
+                   task.decodeIndex[i], task.page->index, peerId);
+            task.corrupt |= 1u << task.decodeIndex[i];
+            intact = false;
+            continue;
+        }
+        uint32_t expected = (peerId != myNodeConf->id)
+                                ? *reinterpret_cast<uint32_t *>(task.recoverSrc[i] + BlockTy::size)
+                                : *getLocalChecksum(task.pos.row);
+        if (fragmentChecksum(task.recoverSrc[i], BlockTy::size) != expected && !refetchFragment(task, i)) {
+            task.corrupt |= 1u << task.decodeIndex[i];
+            intact = false;
+            if (peerId != myNodeConf->id && failedPeers[peerId])
+                continue;
+            d_warn("checksum mismatch on fragment %d of block %lu (node %d), treated as lost",
+                   task.decodeIndex[i], task.page->index, peerId);
+            ++checksumErrors;
         }
-	return;
     }
-#endif
-    
-    /* Perform decode */
-    uint8_t decodeMatrix[N * K];
-    uint8_t invertMatrix[N * K];
-    uint8_t b[K * K];
+    return intact;
+}
 
-    for (int i = 0; i < K; ++i)
-        memcpy(&b[K * i], &encodeMatrix[K * decodeIndex[i]], K);
-    if (gf_invert_matrix(b, invertMatrix, K) < 0) {
-        d_err("cannot do matrix invert!");
-        return;
+void ECAL::releaseReadTask(ECAL::ReadTask &task)
+{
+    for (int i = 0; i < K; ++i) {
+        int peerId = (task.decodeIndex[i] + task.pos.startNodeId) % N;
+        if (peerId != myNodeConf->id)
+            rdma->freeReadRegion(peerId, task.recoverSrc[i]);
     }
-    for (int i = 0; i < errs; ++i)
-        memcpy(&decodeMatrix[K * i], &invertMatrix[K * errIndex[i]], K);
-    
-    uint8_t gfTbls[K * P * 32];
-    ec_init_tables(K, errs, decodeMatrix, gfTbls);
-    ec_encode_data(BlockTy::size, K, errs, gfTbls, recoverSrc, recoverOutput);
+}
+
+/** Assemble (and decode if degraded) a page whose fragment reads have completed. */
+void ECAL::finishReadTask(ECAL::ReadTask &task)
+{
+    /* Corrupt fragments are erasures: refetch the stripe from other sources (rare path) */
+    while (task.errs >= 0 && !verifyReadTask(task)) {
+        releaseReadTask(task);
+        int taskCnt = postFragmentReads(task);
+        if (taskCnt) {
+            ibv_wc wc[K * 2];
+            pollReads(wc, taskCnt);
+        }
+    }
+    if (task.errs < 0)
+        return;
 
+    /* Copy intact data, parity lines not fetched are left null (not decoded) */
+    uint8_t *data = task.page->page.data;
+    uint8_t *frags[N] = { nullptr };
+    for (int i = 0; i < K; ++i)
+        frags[i] = data + i * BlockTy::size;
     for (int i = 0; i < K; ++i) {
-        int peerId = (decodeIndex[i] + pos.startNodeId) % N;
-        if (peerId != myNodeConf->id)
-            rdma->freeReadRegion(peerId, recoverSrc[i]);
+        if (task.decodeIndex[i] < K)
+            memcpy(frags[task.decodeIndex[i]], task.recoverSrc[i], BlockTy::size);
+        else
+            frags[task.decodeIndex[i]] = task.recoverSrc[i];
+    }
+
+    if (task.errs) {
+        degradedIo = true;
+        if (!CodeTy::decode(task.decodeIndex, frags)) {
+            d_err("cannot decode block %lu from its fragments", task.page->index);
+            memset(data, 0, Block4K::capacity);
+            task.errs = -1;
+        }
     }
+
+    releaseReadTask(task);
 }
 
 void ECAL::writeBlock(ECAL::Page &page)
 {
-    static uint8_t *data[K];
+#ifndef USE_RPC
+    Page *pages[1] = { &page };
+    writeBlocks(pages, 1);
+#else
+    std::lock_guard<std::mutex> lock(ioMutex);
+    uint8_t *data[K];
     
     for (int i = 0; i < K; ++i)
         data[i] = page.page.data + i * BlockTy::size;
-    ec_encode_data(BlockTy::size, K, P, gfTables, data, parity);
+    CodeTy::encode(data, parity);
 
     DataPosition pos = getDataPos(page.index);
     uint64_t blockShift = getBlockShift(pos.row);
-    ibv_wc wc[2];
     for (int i = 0; i < N; ++i) {
         int peerId = (pos.startNodeId + i) % N;
         uint8_t *blk = (i < K ? data[i] : parity[i - K]);
         
         if (peerId == myNodeConf->id)
             memcpy(allocTable->at(pos.row), blk, BlockTy::size);
-        else if (rdma->isPeerAlive(peerId)) {
-#ifndef USE_RPC
-            uint8_t *base = rdma->getWriteRegion(peerId);
-            memcpy(base, blk, BlockTy::size);
-            rdma->postWrite(peerId, blockShift, (uint64_t)base, BlockTy::size);
-            rdma->pollSendCompletion(wc);
-            rdma->freeWriteRegion(peerId, base);
-            writeCount++;
-#else
+        else if (rdma->acceptsWrites(peerId)) {
             MemRequest req;
             PureValueResponse resp;
             req.addr = blockShift;
             memcpy(req.data, blk, BlockTy::size);
             netif->rpcCall(peerId, ErpcType::ERPC_MEMWRITE, req, resp);
+        }
+    }
 #endif
+}
+
+/**
+ * Write a batch of pages.
+ * Parities are encoded straight into their destinations (RDMA staging regions or the local
+ * pool), all fragments are checksummed in the same pass, and fragment writes of up to
+ * `MaxWriteBatch` pages are polled together.
+ */
+void ECAL::writeBlocks(ECAL::Page **pages, int count)
+{
+    uint64_t start = TscClock::now();
+    std::lock_guard<std::mutex> lock(ioMutex);
+    ForegroundIo io(this, start, (uint64_t)count * Block4K::capacity);
+
+    struct Staged
+    {
+        int peerId;
+        uint8_t *base;
+    } staged[MaxWriteBatch * N];
+    ibv_wc wc[MaxWriteBatch * N * 3];
+    uint64_t rows[MaxWriteBatch], held[MaxWriteBatch], fenceShifts[MaxWriteBatch * N];
+    int homes[MaxWriteBatch], fencePeers[MaxWriteBatch * N];
+    for (int start = 0; start < count; start += MaxWriteBatch) {
+        int batch = std::min(count - start, MaxWriteBatch);
+        int taskCnt = 0, wrCnt = 0, fenceCnt = 0;
+        for (int t = 0; t < batch; ++t)
+            rows[t] = getDataPos(pages[start + t]->index).row;
+        int nLocked = lockRows(rows, batch, homes, held);
+
+        for (int t = 0; t < batch; ++t) {
+            Page &page = *pages[start + t];
+            DataPosition pos = getDataPos(page.index);
+            uint64_t blockShift = getBlockShift(pos.row);
+            uint64_t checksumShift = getChecksumShift(pos.row);
+
+            /* Destination of each fragment: local pool, staging region, or none (dead peer) */
+            uint8_t *data[K], *dest[N], *out[P];
+            uint32_t checksums[N];
+            bool marked = false;
+            for (int i = 0; i < N; ++i) {
+                int peerId = (pos.startNodeId + i) % N;
+                if (peerId == myNodeConf->id)
+                    dest[i] = reinterpret_cast<uint8_t *>(allocTable->at(pos.row));
+                else if (rdma->acceptsWrites(peerId)) {
+                    dest[i] = rdma->getWriteRegion(peerId);
+                    staged[taskCnt++] = { peerId, dest[i] };
+                }
+                else {
+                    dest[i] = nullptr;
+                    degradedIo = true;
+                    marked |= cmdConf->dirtyMaps && dirtyMap->mark(peerId, pos.row);
+                }
+            }
+            /* The row must be known stale before any of its fragments changes */
+            if (marked)
+                DirtyMap::persist();
+
+            for (int i = 0; i < K; ++i)
+                data[i] = page.page.data + i * BlockTy::size;
+            for (int i = 0; i < P; ++i)
+                out[i] = dest[K + i] ? dest[K + i] : parity[i];
+            encodeChecksummed<CodeTy, K, P, BlockTy::size>(data, out, checksums);
+
+            /* Checksums are staged right after their fragments, and written after them */
+            for (int i = 0; i < N; ++i) {
+                int peerId = (pos.startNodeId + i) % N;
+                if (!dest[i])
+                    continue;
+                if (i < K)
+                    memcpy(dest[i], data[i], BlockTy::size);
+                if (peerId != myNodeConf->id) {
+                    uint8_t *checksum = dest[i] + BlockTy::size;
+                    memcpy(checksum, &checksums[i], sizeof(uint32_t));
+                    rdma->postWrite(peerId, blockShift, (uint64_t)dest[i], BlockTy::size);
+                    rdma->postWrite(peerId, checksumShift, (uint64_t)checksum, sizeof(uint32_t));
+                    wrCnt += 2;
+                    fencePeers[fenceCnt] = peerId;
+                    fenceShifts[fenceCnt++] = checksumShift;
+                }
+                else {
+                    *getLocalChecksum(pos.row) = checksums[i];
+                    if (cmdConf->durableWrites)
+                        persistLocal(pos.row);
+                }
+            }
+        }
+
+        wrCnt += postPersistFences(fencePeers, fenceShifts, fenceCnt);
+        if (wrCnt)
+            rdma->pollSendCompletion(wc, wrCnt);
+        unlockRows(rows, nLocked, homes, held);
+        for (int i = 0; i < taskCnt; ++i)
+            rdma->freeWriteRegion(staged[i].peerId, staged[i].base);
+        writeCount += taskCnt;
+    }
+}
+
+/**
+ * Write an extent: `count` pages with consecutive indexes, starting at pages[0]->index.
+ *
+ * The extent is striped as a whole over rows [row, row + count) of its stripe nodes: data
+ * node j holds the j-th stripe unit (count * BlockTy::size bytes) of the extent in these
+ * consecutive rows, so that each node is written with a single RDMA write (plus one for its
+ * checksums). Row r is still a regular stripe made of slices r of all stripe units, encoded
+ * and checksummed on its own, so that verification, degraded reads and scrubbing are per row.
+ */
+void ECAL::writeExtent(ECAL::Page **pages, int count)
+{
+    uint64_t start = TscClock::now();
+    std::lock_guard<std::mutex> lock(ioMutex);
+    ForegroundIo io(this, start, (uint64_t)count * Block4K::capacity);
+
+    DataPosition pos = getDataPos(pages[0]->index);
+    if (count < 1 || count > MaxExtentPages || pos.row + count > getRowCount()) {
+        d_err("invalid extent of %d pages at block %lu", count, pages[0]->index);
+        return;
+    }
+    const size_t unit = (size_t)count * BlockTy::size;
+
+    uint64_t rows[MaxExtentPages], held[MaxExtentPages];
+    int homes[MaxExtentPages];
+    for (int r = 0; r < count; ++r)
+        rows[r] = pos.row + r;
+    int nLocked = lockRows(rows, count, homes, held);
+
+    /* Destination of each stripe unit: local pool, extent staging region, or none (dead peer) */
+    uint8_t *dest[N];
+    bool marked = false;
+    for (int i = 0; i < N; ++i) {
+        int peerId = (pos.startNodeId + i) % N;
+        if (peerId == myNodeConf->id)
+            dest[i] = reinterpret_cast<uint8_t *>(allocTable->at(pos.row));
+        else if (rdma->acceptsWrites(peerId))
+            dest[i] = rdma->getExtentWriteRegion(peerId);
+        else {
+            dest[i] = nullptr;
+            degradedIo = true;
+            for (int r = 0; r < count && cmdConf->dirtyMaps; ++r)
+                marked |= dirtyMap->mark(peerId, pos.row + r);
+        }
+    }
+    if (marked)
+        DirtyMap::persist();
+
+    /* Encode, checksum and stage row by row, while each row is cache-hot */
+    for (int r = 0; r < count; ++r) {
+        uint8_t *data[K], *out[P];
+        uint32_t checksums[N];
+        for (int i = 0; i < K; ++i)
+            data[i] = extentAt(pages, i * unit + r * BlockTy::size);
+        for (int i = 0; i < P; ++i)
+            out[i] = (dest[K + i] ? dest[K + i] : extentParity + i * unit) + r * BlockTy::size;
+        encodeChecksummed<CodeTy, K, P, BlockTy::size>(data, out, checksums);
+
+        for (int i = 0; i < N; ++i) {
+            int peerId = (pos.startNodeId + i) % N;
+            if (!dest[i])
+                continue;
+            if (i < K)
+                memcpy(dest[i] + r * BlockTy::size, data[i], BlockTy::size);
+            if (peerId == myNodeConf->id)
+                *getLocalChecksum(pos.row + r) = checksums[i];
+            else
+                memcpy(dest[i] + unit + r * sizeof(uint32_t), &checksums[i], sizeof(uint32_t));
+        }
+    }
+
+    uint64_t blockShift = getBlockShift(pos.row);
+    uint64_t checksumShift = getChecksumShift(pos.row);
+    uint64_t fenceShifts[N];
+    int wrCnt = 0, fencePeers[N], fenceCnt = 0;
+    for (int i = 0; i < N; ++i) {
+        int peerId = (pos.startNodeId + i) % N;
+        if (!dest[i])
+            continue;
+        if (peerId == myNodeConf->id) {
+            if (cmdConf->durableWrites)
+                persistLocal(pos.row, count);
+            continue;
+        }
+        rdma->postWrite(peerId, blockShift, (uint64_t)dest[i], unit);
+        rdma->postWrite(peerId, checksumShift, (uint64_t)(dest[i] + unit), count * sizeof(uint32_t));
+        wrCnt += 2;
+        fencePeers[fenceCnt] = peerId;
+        fenceShifts[fenceCnt++] = checksumShift;
+    }
+    writeCount += wrCnt / 2;
+
+    wrCnt += postPersistFences(fencePeers, fenceShifts, fenceCnt);
+    ibv_wc wc[N * 3];
+    if (wrCnt)
+        rdma->pollSendCompletion(wc, wrCnt);
+    unlockRows(rows, nLocked, homes, held);
+}
+
+/**
+ * Read an extent written by `writeExtent` into `count` pages. Each of the K source nodes
+ * is read with a single RDMA read (plus one for its checksums), and degraded rows are
+ * decoded in place. Rows with a corrupt fragment are read again through the per-row path.
+ */
+void ECAL::readExtent(uint64_t index, ECAL::Page **pages, int count)
+{
+    uint64_t start = TscClock::now();
+    std::lock_guard<std::mutex> lock(ioMutex);
+    ForegroundIo io(this, start, (uint64_t)count * Block4K::capacity);
+
+    DataPosition pos = getDataPos(index);
+    for (int p = 0; p < count; ++p) {
+        pages[p]->index = index + p;
+        memset(pages[p]->page.data, 0, Block4K::capacity);
+    }
+    if (count < 1 || count > MaxExtentPages || pos.row + count > getRowCount()) {
+        d_err("invalid extent of %d pages at block %lu", count, index);
+        return;
+    }
+    const size_t unit = (size_t)count * BlockTy::size;
+
+    bool alive[N];
+    int srcId[K], errs = 0;
+    for (int j = 0; j < N; ++j)
+        alive[j] = rdma->isPeerAlive((j + pos.startNodeId) % N);
+    if (!CodeTy::selectSources(alive, srcId)) {
+        d_err("too many lost fragments to read extent %lu", index);
+        return;
+    }
+    for (int i = 0; i < K; ++i)
+        errs += (srcId[i] >= K);
+
+    uint64_t blockShift = getBlockShift(pos.row);
+    uint64_t checksumShift = getChecksumShift(pos.row);
+    uint8_t *units[K];
+    std::fill(failedPeers.begin(), failedPeers.end(), false);
+    bool local[K];
+    int taskCnt = 0;
+    for (int i = 0; i < K; ++i) {
+        int peerId = (srcId[i] + pos.startNodeId) % N;
+        local[i] = (peerId == myNodeConf->id);
+        if (local[i]) {
+            units[i] = reinterpret_cast<uint8_t *>(allocTable->at(pos.row));
+            continue;
+        }
+        units[i] = rdma->getExtentReadRegion(peerId);
+        rdma->postRead(peerId, blockShift, (uint64_t)units[i], unit, i);
+        rdma->postRead(peerId, checksumShift, (uint64_t)(units[i] + unit), count * sizeof(uint32_t), i);
+        taskCnt += 2;
+    }
+
+    ibv_wc wc[K * 2];
+    if (taskCnt)
+        pollReads(wc, taskCnt);
+
+    for (int r = 0; r < count; ++r) {
+        uint8_t *lines[N] = { nullptr };
+        for (int j = 0; j < K; ++j)
+            lines[j] = extentAt(pages, j * unit + r * BlockTy::size);
+
+        /* A mismatching row is read again through the per-row path, which counts the error */
+        uint32_t lost = 0;
+        bool mismatch = false;
+        for (int i = 0; i < K; ++i) {
+            if (!local[i] && failedPeers[(srcId[i] + pos.startNodeId) % N]) {
+                lost |= 1u << srcId[i];
+                continue;
+            }
+            uint32_t expected = local[i] ? *getLocalChecksum(pos.row + r)
+                                         : reinterpret_cast<uint32_t *>(units[i] + unit)[r];
+            mismatch |= (fragmentChecksum(units[i] + r * BlockTy::size, BlockTy::size) != expected);
+        }
+        if (lost || mismatch) {
+            readExtentRow(index + r, DataPosition(pos.row + r, pos.startNodeId), lost, lines);
+            continue;
+        }
+
+        for (int i = 0; i < K; ++i) {
+            if (srcId[i] < K)
+                memcpy(lines[srcId[i]], units[i] + r * BlockTy::size, BlockTy::size);
+            else
+                lines[srcId[i]] = units[i] + r * BlockTy::size;
+        }
+        if (errs && !CodeTy::decode(srcId, lines)) {
+            d_err("cannot decode block %lu from its fragments", index + r);
+            for (int j = 0; j < K; ++j)
+                memset(lines[j], 0, BlockTy::size);
+        }
+    }
+    degradedIo |= (errs > 0);
+}
+
+/** Read one row of an extent through the per-row path, avoiding fragments in `corrupt`. */
+void ECAL::readExtentRow(uint64_t index, const ECAL::DataPosition &pos, uint32_t corrupt, uint8_t **lines)
+{
+    Page page(index);
+    memset(page.page.data, 0, Block4K::capacity);
+
+    ReadTask task;
+    task.page = &page;
+    task.pos = pos;
+    task.corrupt = corrupt;
+    int taskCnt = postFragmentReads(task);
+    if (taskCnt) {
+        ibv_wc wc[K * 2];
+        pollReads(wc, taskCnt);
+    }
+    finishReadTask(task);
+
+    for (int j = 0; j < K; ++j)
+        memcpy(lines[j], page.page.data + j * BlockTy::size, BlockTy::size);
+}
+
+/**
+ * Scrub a row: fetch all N fragments, verify their checksums, and re-encode the parities
+ * from the data. Corrupt fragments are decoded from the intact ones, and parities that do
+ * not match the data (e.g. a torn stripe write, data is trusted) are re-encoded; both are
+ * written back with their checksums.
+ *
+ * @param repaired      Set to the number of rewritten fragments.
+ */
+ECAL::ScrubResult ECAL::scrubRow(uint64_t row, int &repaired)
+{
+    std::lock_guard<std::mutex> lock(ioMutex);
+
+    DataPosition pos(row, 0);                       /* Same placement as getDataPos */
+    uint8_t *frags[N];
+    uint32_t stored[N];
+    repaired = 0;
+    if (!fetchStripe(pos, frags, stored))
+        return ScrubResult::Skipped;
+
+    uint32_t corrupt = 0;
+    for (int i = 0; i < N; ++i)
+        if (fragmentChecksum(frags[i], BlockTy::size) != stored[i])
+            corrupt |= 1u << i;
+
+    /* Rebuild the whole stripe from the intact fragments */
+    uint8_t stripe[N * BlockTy::size];
+    uint8_t *lines[N];
+    uint32_t checksums[N];
+    for (int i = 0; i < N; ++i) {
+        lines[i] = stripe + i * BlockTy::size;
+        memcpy(lines[i], frags[i], BlockTy::size);
+    }
+    if (corrupt & ((1u << K) - 1)) {
+        bool alive[N];
+        int srcId[K];
+        for (int i = 0; i < N; ++i)
+            alive[i] = !(corrupt >> i & 1);
+        if (!CodeTy::selectSources(alive, srcId)) {
+            d_err("row %lu has too many corrupt fragments (mask %#x)", row, corrupt);
+            releaseStripe(pos, frags);
+            return ScrubResult::Unrepairable;
         }
+        if (!CodeTy::decode(srcId, lines)) {
+            d_err("row %lu cannot be decoded from its intact fragments", row);
+            releaseStripe(pos, frags);
+            return ScrubResult::Unrepairable;
+        }
+    }
+    encodeChecksummed<CodeTy, K, P, BlockTy::size>(lines, lines + K, checksums);
+
+    uint32_t stale = corrupt;
+    for (int i = K; i < N; ++i)
+        if (memcmp(lines[i], frags[i], BlockTy::size))
+            stale |= 1u << i;
+    if (!stale) {
+        releaseStripe(pos, frags);
+        return ScrubResult::Clean;
     }
+
+    /*
+     * A stripe written by another node meanwhile looks inconsistent: fetch again to confirm,
+     * under the stripe lock, so that no write can slip in before the repair
+     */
+    uint32_t seen[N], seenStored[N];
+    for (int i = 0; i < N; ++i)
+        seen[i] = fragmentChecksum(frags[i], BlockTy::size);
+    memcpy(seenStored, stored, sizeof(stored));
+    releaseStripe(pos, frags);
+
+    uint64_t lockRow = row, held;
+    int home;
+    int nLocked = lockRows(&lockRow, 1, &home, &held);
+    if (stripeLocks && !nLocked)
+        return ScrubResult::Skipped;
+    if (!fetchStripe(pos, frags, stored)) {
+        unlockRows(&lockRow, nLocked, &home, &held);
+        return ScrubResult::Skipped;
+    }
+    bool unchanged = !memcmp(seenStored, stored, sizeof(stored));
+    for (int i = 0; i < N && unchanged; ++i)
+        unchanged = (seen[i] == fragmentChecksum(frags[i], BlockTy::size));
+    releaseStripe(pos, frags);
+    if (!unchanged) {
+        unlockRows(&lockRow, nLocked, &home, &held);
+        return ScrubResult::Skipped;
+    }
+
+    d_warn("row %lu: rewriting fragments %#x (corrupt %#x)", row, stale, corrupt);
+    writeFragments(pos, lines, checksums, stale);
+    unlockRows(&lockRow, nLocked, &home, &held);
+    for (int i = 0; i < N; ++i)
+        repaired += stale >> i & 1;
+    return ScrubResult::Repaired;
+}
+
+/** Fetch all N fragments of a stripe and their checksums. False if a node is dead or a read fails. */
+bool ECAL::fetchStripe(const ECAL::DataPosition &pos, uint8_t **frags, uint32_t *checksums)
+{
+    for (int i = 0; i < N; ++i)
+        if (!rdma->isPeerAlive((pos.startNodeId + i) % N))
+            return false;
+
+    uint64_t blockShift = getBlockShift(pos.row);
+    uint64_t checksumShift = getChecksumShift(pos.row);
+    int taskCnt = 0;
+    for (int i = 0; i < N; ++i) {
+        int peerId = (pos.startNodeId + i) % N;
+        if (peerId != myNodeConf->id) {
+            frags[i] = rdma->getReadRegion(peerId);
+            rdma->postRead(peerId, blockShift, (uint64_t)frags[i], BlockTy::size, i);
+            rdma->postRead(peerId, checksumShift, (uint64_t)(frags[i] + BlockTy::size), sizeof(uint32_t), i);
+            taskCnt += 2;
+        }
+        else
+            frags[i] = reinterpret_cast<uint8_t *>(allocTable->at(pos.row));
+    }
+
+    ibv_wc wc[N * 2];
+    std::fill(failedPeers.begin(), failedPeers.end(), false);
+    if (taskCnt)
+        pollReads(wc, taskCnt);
+    if (std::find(failedPeers.begin(), failedPeers.end(), true) != failedPeers.end()) {
+        releaseStripe(pos, frags);
+        return false;
+    }
+    for (int i = 0; i < N; ++i) {
+        int peerId = (pos.startNodeId + i) % N;
+        checksums[i] = (peerId != myNodeConf->id) ? *reinterpret_cast<uint32_t *>(frags[i] + BlockTy::size)
+                                                  : *getLocalChecksum(pos.row);
+    }
+    return true;
+}
+
+void ECAL::releaseStripe(const ECAL::DataPosition &pos, uint8_t **frags)
+{
+    for (int i = 0; i < N; ++i) {
+        int peerId = (pos.startNodeId + i) % N;
+        if (peerId != myNodeConf->id)
+            rdma->freeReadRegion(peerId, frags[i]);
+    }
+}
+
+/** Write the fragments of a stripe in `mask` (and their checksums) to their nodes. */
+void ECAL::writeFragments(const ECAL::DataPosition &pos, uint8_t **lines, const uint32_t *checksums,
+                          uint32_t mask)
+{
+    uint64_t blockShift = getBlockShift(pos.row);
+    uint64_t checksumShift = getChecksumShift(pos.row);
+    uint8_t *staged[N] = { nullptr };
+    uint64_t fenceShifts[N];
+    int wrCnt = 0, fencePeers[N], fenceCnt = 0;
+    for (int i = 0; i < N; ++i) {
+        if (!(mask >> i & 1))
+            continue;
+        int peerId = (pos.startNodeId + i) % N;
+        if (peerId == myNodeConf->id) {
+            memcpy(allocTable->at(pos.row), lines[i], BlockTy::size);
+            *getLocalChecksum(pos.row) = checksums[i];
+            if (cmdConf->durableWrites)
+                persistLocal(pos.row);
+            continue;
+        }
+        staged[i] = rdma->getWriteRegion(peerId);
+        memcpy(staged[i], lines[i], BlockTy::size);
+        memcpy(staged[i] + BlockTy::size, &checksums[i], sizeof(uint32_t));
+        rdma->postWrite(peerId, blockShift, (uint64_t)staged[i], BlockTy::size);
+        rdma->postWrite(peerId, checksumShift, (uint64_t)(staged[i] + BlockTy::size), sizeof(uint32_t));
+        wrCnt += 2;
+        fencePeers[fenceCnt] = peerId;
+        fenceShifts[fenceCnt++] = checksumShift;
+    }
+
+    wrCnt += postPersistFences(fencePeers, fenceShifts, fenceCnt);
+    ibv_wc wc[N * 3];
+    if (wrCnt)
+        rdma->pollSendCompletion(wc, wrCnt);
+    for (int i = 0; i < N; ++i)
+        if (staged[i])
+            rdma->freeWriteRegion((pos.startNodeId + i) % N, staged[i]);
+}
+
+/**
+ * With DURABLE_WRITES, post a persistence fence to each distinct peer of `peerIds`, after all
+ * writes to them: a single fence per peer covers every write of the batch. `shifts` are
+ * written words to read the fences from. Returns the count of fences (completions) posted.
+ */
+int ECAL::postPersistFences(const int *peerIds, const uint64_t *shifts, int count)
+{
+    if (!cmdConf->durableWrites)
+        return 0;
+
+    int fenceCnt = 0;
+    for (int i = 0; i < count; ++i) {
+        if (std::find(peerIds, peerIds + i, peerIds[i]) != peerIds + i)
+            continue;
+        rdma->postPersistFence(peerIds[i], shifts[i]);
+        ++fenceCnt;
+    }
+    persistFences += fenceCnt;
+    return fenceCnt;
+}
+
+/**
+ * Stripe-lock the rows of a write, if stripe locks are on. `rows` are sorted and deduplicated
+ * in place. The lock word of a row lives on its (row % N)-th stripe node only, so that all
+ * writers agree on it whatever their views of the cluster. Rows whose home is unreachable are
+ * dropped from `rows` and left unlocked, as are rows whose lock CAS failed: writes still go
+ * ahead, as the home is one of their stripe nodes and is marked dirty, so its fragments get
+ * rebuilt; scrubs skip them. Returns the count of rows locked.
+ */
+int ECAL::lockRows(uint64_t *rows, int count, int *homes, uint64_t *held)
+{
+    if (!stripeLocks)
+        return 0;
+
+    std::sort(rows, rows + count);
+    count = std::unique(rows, rows + count) - rows;
+    int n = 0;
+    for (int i = 0; i < count; ++i) {
+        DataPosition pos(rows[i], 0);                   /* Same placement as getDataPos */
+        int home = (pos.startNodeId + pos.row % N) % N;
+        if (!rdma->isPeerConnected(home)) {
+            ++unlockedRows;
+            d_warn("row %lu: lock home (node %d) is unreachable, going on without the lock", rows[i], home);
+            continue;
+        }
+        rows[n] = rows[i];
+        homes[n++] = home;
+    }
+    int nLocked = stripeLocks->lock(rows, homes, n, held);
+    unlockedRows += n - nLocked;
+    return nLocked;
+}
+
+void ECAL::unlockRows(const uint64_t *rows, int count, const int *homes, const uint64_t *held)
+{
+    if (stripeLocks && count)
+        stripeLocks->unlock(rows, homes, count, held);
 }
@@ -0,0 +1,242 @@
+#include <fs/LocofsClient.h>
+#include <config.hpp>
+
+#include <fcntl.h>
+#include <chrono>
+
+extern long boost_cpu_time;
+extern long meta_rpc_time;
+extern long data_rdma_time_r, data_rdma_time_w;
+
+DEFINE_MAIN_INFO();
+
+void thptWorker(LocofsClient *cli, bool wl, int n = 100000)
+{
+    using namespace std::chrono;
+
+    std::string path = "/test/0001";
+    ECAL::Page page(0);
+    memset(page.page.data, 'a', 4096);
+
+    ECAL *ecal = cli->getECAL();
+    if (wl)
+        for (int i = 0; i < n; ++i) {
+            auto stt = steady_clock::now();
+            while (duration_cast<microseconds>(steady_clock::now() - stt).count() < 10);
+            ecal->writeBlock(page);
+        }
+    else
+        for (int i = 0; i < n; ++i) {
+            auto stt = steady_clock::now();
+            while (duration_cast<microseconds>(steady_clock::now() - stt).count() < 5);
+            ecal->readBlock(1, page);
+        }
+}
+
+int main(int argc, char **argv)
+{
+    using namespace std;
+    using namespace std::chrono;
+
+    COLLECT_MAIN_INFO();
+
+    cmdConf = new CmdLineConfig();
+    LocofsClient loco;
+
+    expectTrue(loco.mount(""));
+
+    printf("LocoFS Client mounted.\n");
+    fflush(stdout);
+    
+    string filename = "/test/0001";
+    expectTrue(loco.mkdir("/test", 0644));
+    expectTrue(loco.create(filename, 0644));
+    expectTrue(loco.open(filename, O_RDWR | O_CREAT));
+
+    const int N = cmdConf->_N;
+
+    srand(time(0));
+    const int M = cmdConf->_Size;
+    char buf[M];
+    for (int i = 0; i < M; ++i)
+        buf[i] = 'p';
+
+    d_info("start r/w...");
+
+    auto start = steady_clock::now();
+    for (int i = 0; i < N; ++i) {
+        expectTrue(loco.write(filename, buf, M, i * M));
+    }
+    auto end = steady_clock::now();
+    auto timespan = duration_cast<microseconds>(end - start).count();
+
+    printf("\n");
+    printf("Write %dKB: %.2lf us\n", M / 1024, (double)timespan / N);
+    //printf("Breakdown:\n");
+    //printf("- Boost CPU computation: %.2lf us\n", (double)boost_cpu_time / N);
+    //printf("- Metadata fetch RPC: %.2lf us\n", (double)meta_rpc_time / N);
+    printf("- Data RDMA: %.2lf us\n", (double)data_rdma_time_w / N);
+    //printf("\n");
+
+    /* Small-append throughput, with one size RPC per write vs. lazy size updates */
+    for (bool lazy : { false, true }) {
+        string appendFile = lazy ? "/test/append-lazy" : "/test/append-eager";
+        expectTrue(loco.open(appendFile, O_RDWR | O_CREAT));
+        loco.setLazySizeUpdate(lazy);
+        uint64_t rpcs = loco.getSizeUpdateCount();
+
+        start = steady_clock::now();
+        for (int i = 0; i < N; ++i)
+            expectTrue(loco.write(appendFile, buf, M, (int64_t)i * M));
+        expectTrue(loco.close(appendFile));
+        end = steady_clock::now();
+        timespan = duration_cast<microseconds>(end - start).count();
+
+        printf("Append %dB (%s size update): %.1lf ops/s, %lu size RPCs\n", M, lazy ? "lazy" : "eager",
+               1e6 * N / timespan, loco.getSizeUpdateCount() - rpcs);
+    }
+    printf("\n");
+
+    /* open(O_CREAT) + write + close latency, with one compound FMS RPC per open */
+    start = steady_clock::now();
+    for (int i = 0; i < N; ++i) {
+        string ocFile = "/test/oc-" + to_string(i);
+        expectTrue(loco.open(ocFile, O_RDWR | O_CREAT));
+        expectTrue(loco.write(ocFile, buf, M, 0));
+        expectTrue(loco.close(ocFile));
+    }
+    end = steady_clock::now();
+    timespan = duration_cast<microseconds>(end - start).count();
+    printf("Open + write %dB + close: %.2lf us\n\n", M, (double)timespan / N);
+
+    loco.testRoundTrip(0);
+   
+    boost_cpu_time = 0;
+    meta_rpc_time = 0;
+
+    start = steady_clock::now();
+    for (int i = 0; i < N; ++i) {
+        loco.read(filename, buf, M, i * M);
+        if (errno) {
+            printf("failed at %d\n", i);
+            for (int i = 0; i < clusterConf->getClusterSize(); ++i) {
+                auto peerNode = (*clusterConf)[i];
+                if (peerNode.id != myNodeConf->id)
+                    continue;
+                loco.getECAL()->getRDMASocket()->verboseQP(peerNode.id);
+            }
+            break;
+        }
+    }
+    //printf("\n");
+    end = steady_clock::now();
+    timespan = duration_cast<microseconds>(end - start).count();
+
+    printf("Read %dKB: %.2lf us\n\n", M / 1024, (double)timespan / N);
+
+    /* Streaming read throughput, without and with readahead */
+    const int raWindow = cmdConf->readaheadWindow;
+    for (int ra : { 0, raWindow }) {
+        loco.setReadaheadWindow(ra);
+        loco.close(filename);
+        uint64_t hits = loco.getReadaheadStats().hits, misses = loco.getReadaheadStats().misses;
+
+        start = steady_clock::now();
+        for (int i = 0; i < N; ++i)
+            loco.read(filename, buf, M, (int64_t)i * M);
+        end = steady_clock::now();
+        timespan = duration_cast<microseconds>(end - start).count();
+
+        hits = loco.getReadaheadStats().hits - hits;
+        misses = loco.getReadaheadStats().misses - misses;
+        printf("Streaming read (readahead %d blocks): %.2lf MB/s, hit rate %.1lf%%\n", ra,
+               (double)N * M / timespan, hits + misses ? 100.0 * hits / (hits + misses) : 0.0);
+    }
+    printf("- prefetched %lu blocks, %lu wasted\n\n", (uint64_t)loco.getReadaheadStats().prefetched,
+           loco.getReadaheadWasted());
+
+    /* Sequential throughput of files striped with different block sizes, in block-sized I/Os */
+    loco.setReadaheadWindow(0);
+    const int64_t seqBytes = 64 << 20;
+    for (int64_t su = 4096; su <= MAX_STRIPE_UNIT; su *= 4) {
+        string path = "/test/su" + to_string(su);
+        vector<char> data(su, 's');
+        expectTrue(loco.create(path, 0644, su));
+        expectTrue(loco.open(path, O_RDWR));
+
+        start = steady_clock::now();
+        for (int64_t off = 0; off < seqBytes; off += su)
+            loco.write(path, data.data(), su, off);
+        end = steady_clock::now();
+        double writeMBps = (double)seqBytes / duration_cast<microseconds>(end - start).count();
+
+        start = steady_clock::now();
+        for (int64_t off = 0; off < seqBytes; off += su)
+            loco.read(path, data.data(), su, off);
+        end = steady_clock::now();
+        double readMBps = (double)seqBytes / duration_cast<microseconds>(end - start).count();
+
+        loco.close(path);
+        printf("Stripe unit %4ldKB: write %.2lf MB/s, read %.2lf MB/s\n", su / 1024, writeMBps, readMBps);
+    }
+    loco.setReadaheadWindow(raWindow);
+    printf("\n");
+    //printf("Breakdown:\n");
+    //printf("- Boost CPU computation: %.2lf us\n", (double)boost_cpu_time / N);
+    //printf("- Metadata fetch RPC: %.2lf us\n", (double)meta_rpc_time / N);
+    //printf("- Data RDMA: %.2lf us\n", (double)data_rdma_time_r / N);
+    //printf("- Metadata update RPC: %.2lf us\n\n", (double)meta_upd_time_r / N);
+/*
+    const int thnum = cmdConf->_Thread;
+    if (thnum) {
+        std::thread ths[16];
+
+        start = steady_clock::now();
+        for (int i = 1; i <= thnum; ++i)
+            ths[i] = std::thread(thptWorker, &loco, true, 100000);
+        for (int i = 1; i <= thnum; ++i)
+            ths[i].join();
+        end = steady_clock::now();
+        timespan = duration_cast<milliseconds>(end - start).count();
+
+        double thpt = 1000 * 1.0 * thnum / timespan * 100000;
+        printf("%d thread(s): %.1lf\n\n", thnum, thpt);
+    }
+
+    // Test first-k read
+    auto stt = steady_clock::now();
+    decltype(stt) Begin, End;
+    std::vector<int> latw, latr;
+    size_t Cnt = 0;
+    int Trigger = 0;
+    ibv_wc wc[2];
+    
+    while (true) {
+        Begin = steady_clock::now();
+        int dur = duration_cast<seconds>(Begin - stt).count();
+
+        if (dur >= 20)
+            break;
+
+        ++Trigger;
+        if (Trigger == 10)
+            Trigger = 0;
+        
+        Begin = steady_clock::now();
+        loco.read(filename, buf, 4096, 0);
+        End = steady_clock::now();
+        //loco.getECAL()->getRDMASocket()->pollSendCompletion(wc);
+        if (!Trigger)
+            latr.push_back(duration_cast<microseconds>(End - Begin).count());
+    }
+
+    FILE *fout = fopen("log.txt", "w");
+    for (int i = 0; i < latr.size(); ++i)
+        fprintf(fout, "%d ", latr[i]);
+    fprintf(fout, "\n");
+    fclose(fout);
+*/
+    loco.stop();
+
+    return 0;
+}
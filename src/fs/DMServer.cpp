@@ -1,6 +1,7 @@
 #include <fs/DMStore.h>
 #include <config.hpp>
 #include <ecal.hpp>
+#include <scrubber.hpp>
 #include <debug.hpp>
 #include <network/netif.hpp>
 
@@ -130,11 +131,19 @@ int main(int argc, char **argv)
     netif = new NetworkInterface(reqFuncs);
     ecal.regNetif(netif);
 
+    Scrubber *scrubber = nullptr;
+    if (cmdConf->scrubBandwidth > 0) {
+        scrubber = new Scrubber(&ecal, cmdConf->scrubBandwidth, cmdConf->scrubIops);
+        scrubber->start();
+    }
+
     netif->startServer();
 
     printf("DMServer: Ctrl-C, stopListenerAndJoin\n");
     fflush(stdout);
 
+    delete scrubber;
+
     ecal.getRDMASocket()->stopListenerAndJoin();
 #else
     cmdConf = new CmdLineConfig;
@@ -1,5 +1,6 @@
 #include <signal.h>
 #include <ecal.hpp>
+#include <scrubber.hpp>
 
 std::mutex mut;
 std::condition_variable ctrlCCond;
@@ -22,6 +23,12 @@ int main(int argc, char **argv)
     cmdConf = new CmdLineConfig();
     ECAL ecal;
 
+    Scrubber *scrubber = nullptr;
+    if (cmdConf->scrubBandwidth > 0) {
+        scrubber = new Scrubber(&ecal, cmdConf->scrubBandwidth, cmdConf->scrubIops);
+        scrubber->start();
+    }
+
     printf("DataServer: main thread sleep.");
     
     while (!ctrlCPressed)
@@ -29,6 +36,8 @@ int main(int argc, char **argv)
 
     printf("DataServer: Ctrl-C");
 
+    delete scrubber;
+
     ecal.getRDMASocket()->stopListenerAndJoin();
 
     return 0;
@@ -1,6 +1,7 @@
 #include <fs/FMStore.h>
 #include <config.hpp>
 #include <ecal.hpp>
+#include <scrubber.hpp>
 #include <network/netif.hpp>
 
 #include <signal.h>
@@ -48,42 +49,57 @@ void fmHandleCsize(erpc::ReqHandle *reqHandle, void *context)
     resp->value = FMServer::getInstance()->csize(req->path, fci);
     sendResponse(reqHandle, context);
 }
+static void fillFileStat(const FileInode &fi, loco_file_stat &fileStat)
+{
+    fileStat.st.st_mode = S_IFREG | (fi.fa.mode & 07777);
+    fileStat.st.st_uid = fi.fa.uid;
+    fileStat.st.st_gid = fi.fa.gid;
+    fileStat.st.st_ctime = fi.fa.ctime;
+    fileStat.st.st_mtime = fi.fc.mtime;
+    fileStat.st.st_atime = fi.fc.mtime;
+    fileStat.st.st_size = fi.fc.size;
+    fileStat.sid = fi.fc.sid;
+    fileStat.suuid = fi.fc.suuid;
+    fileStat.block_size = fi.fc.block_size;
+}
 void fmHandleStat(erpc::ReqHandle *reqHandle, void *context)
 {
     auto *req = interpretRequest<ValueWithPathRequest>(reqHandle);
     auto *resp = allocateResponse<StatResponse>(reqHandle, context);
     FileInode fi, fi2;
     FMServer::getInstance()->getAttr(fi, req->path, fi2);
-    if ((resp->result = fi.error) == 0) {
-        resp->fileStat.st.st_mode = S_IFREG | 0744;
-        resp->fileStat.st.st_uid = fi.fa.uid;
-        resp->fileStat.st.st_gid = fi.fa.gid;
-        resp->fileStat.st.st_ctime = fi.fa.ctime;
-        resp->fileStat.st.st_mtime = fi.fc.mtime;
-        resp->fileStat.st.st_atime = fi.fc.mtime;
-        resp->fileStat.st.st_size = fi.fc.size;
-        resp->fileStat.sid = fi.fc.sid;
-        resp->fileStat.suuid = fi.fc.suuid;
-        resp->fileStat.block_size = fi.fc.block_size;
-    }
+    if ((resp->result = fi.error) == 0)
+        fillFileStat(fi, resp->fileStat);
     sendResponse(reqHandle, context);
 }
+/**
+ * Compound open: access check, create on miss if O_CREAT is set, and stat in one round trip.
+ * Request value is COMBINE_I32(flags, mode), of the file if created; uid and gid are the caller's.
+ */
 void fmHandleOpen(erpc::ReqHandle *reqHandle, void *context)
 {
-    auto *req = interpretRequest<ValueWithPathRequest>(reqHandle);
-    auto *resp = allocateResponse<InodeResponse>(reqHandle, context);
+    auto *req = interpretRequest<CreateRequest>(reqHandle);
+    auto *resp = allocateResponse<StatResponse>(reqHandle, context);
+    int flags = EXTRACT_X(req->value);
     FileAccessInode fai;
-    FMServer::getInstance()->open(resp->fi, req->path, fai);
+    fai.mode = EXTRACT_Y(req->value);
+    fai.uid = req->uid;
+    fai.gid = req->gid;
+    FileInode fi;
+    resp->result = FMServer::getInstance()->openOrCreate(fi, req->path, fai, flags, req->blockSize);
+    if (resp->result == 0)
+        fillFileStat(fi, resp->fileStat);
     sendResponse(reqHandle, context);
 }
 void fmHandleCreate(erpc::ReqHandle *reqHandle, void *context)
 {
-    auto *req = interpretRequest<ValueWithPathRequest>(reqHandle);
+    auto *req = interpretRequest<CreateRequest>(reqHandle);
     auto *resp = allocateResponse<PureValueResponse>(reqHandle, context);
     FileAccessInode fai;
     fai.mode = req->value;
-    fai.uid = fai.gid = 0777;
-    resp->value = FMServer::getInstance()->create(req->path, fai);
+    fai.uid = req->uid;
+    fai.gid = req->gid;
+    resp->value = FMServer::getInstance()->create(req->path, fai, req->blockSize);
     sendResponse(reqHandle, context);
 }
 void fmHandleRemove(erpc::ReqHandle *reqHandle, void *context)
@@ -138,11 +154,19 @@ int main(int argc, char **argv)
     netif = new NetworkInterface(reqFuncs);
     ecal.regNetif(netif);
     
+    Scrubber *scrubber = nullptr;
+    if (cmdConf->scrubBandwidth > 0) {
+        scrubber = new Scrubber(&ecal, cmdConf->scrubBandwidth, cmdConf->scrubIops);
+        scrubber->start();
+    }
+
     netif->startServer();
 
     printf("FMServer: Ctrl-C, stopListenerAndJoin\n");
     fflush(stdout);
 
+    delete scrubber;
+
     ecal.getRDMASocket()->stopListenerAndJoin();
 
     return 0;
@@ -1,5 +1,8 @@
 #include <fs/FMStore.h>
 
+#include <cerrno>
+#include <fcntl.h>
+
 #include <boost/algorithm/string.hpp>
 #include <boost/archive/text_iarchive.hpp>
 #include <boost/archive/text_oarchive.hpp>
@@ -83,9 +86,10 @@ int32_t FMStore::setValue(const std::string &Key, const FileInode &fi)
  * [FMStore::create description]
  * @param  path Key
  * @param  fa   [description]
+ * @param  blockSize    Block size (stripe unit) of the file's data, 4096 if invalid
  * @return      [description]
  */
-int32_t FMStore::create(const std::string &Key, const FileAccessInode &fa)
+int32_t FMStore::create(const std::string &Key, const FileAccessInode &fa, int64_t blockSize)
 {
     FileAccessInode faa;
     faa.mode = fa.mode;
@@ -93,7 +97,11 @@ int32_t FMStore::create(const std::string &Key, const FileAccessInode &fa)
     faa.uid = fa.uid;
     FileContentInode fcc;
     fcc.origin_name = Key;
-    fcc.block_size = 4096;
+    if (!isValidBlockSize(blockSize)) {
+        d_warn("invalid block size %ld of %s, using 4096", blockSize, Key.c_str());
+        blockSize = 4096;
+    }
+    fcc.block_size = blockSize;
     fcc.size = 0;
     fcc.suuid = suuid_counter++;
     fcc.sid = sid_num;
@@ -184,12 +192,19 @@ int32_t FMStore::remove(const std::string &Key, const FileAccessInode &fa)
 
     return 0;
 }
+/**
+ * Grow the file size to `fc.size`.
+ * Sizes are max-merged, so that lazily flushed (and reordered) updates never shrink a file,
+ * and an update that does not grow the file skips the write-back.
+ */
 int32_t FMStore::csize(const std::string &Key, const FileContentInode &fc)
 {
     FileContentInode fcc;
     if (getValue(Key, fcc) < 0)
         return -1;
     //LOG(INFO) << __FUNCTION__ << " Key: " << Key << " size: " << fc.size;
+    if (fc.size <= fcc.size)
+        return 0;
     fcc.size = fc.size;
     if (setValue(Key, fcc) < 0)
         return -1;
@@ -251,6 +266,35 @@ void FMStore::open(FileInode &_return, const std::string &Key, const FileAccessI
         _return.error = 0;
     }
 }
+/**
+ * Fetch the inode of a file for open(2) `flags`, creating the file first if it is missing and
+ * O_CREAT is set. Unlike getAttr, it does not write the inode back.
+ * @return  0, -ENOENT, -EEXIST if O_CREAT | O_EXCL and the file exists, or -EACCES if the mode
+ *          of the file denies the access mode of `flags` to the caller (`fa.uid`, `fa.gid`),
+ *          unless it is root
+ */
+int32_t FMStore::openOrCreate(FileInode &_return, const std::string &Key, const FileAccessInode &fa, int32_t flags,
+                              int64_t blockSize)
+{
+    if (getValue(Key, _return) == 0) {
+        if ((flags & O_CREAT) && (flags & O_EXCL))
+            return -EEXIST;
+        int32_t want = 0;
+        if ((flags & O_ACCMODE) != O_WRONLY)
+            want |= 04;
+        if ((flags & O_ACCMODE) != O_RDONLY || (flags & O_TRUNC))
+            want |= 02;
+        if (fa.uid == 0)
+            return 0;
+        int shift = (_return.fa.uid == fa.uid) ? 6 : (_return.fa.gid == fa.gid) ? 3 : 0;
+        return ((_return.fa.mode >> shift) & want) == want ? 0 : -EACCES;
+    }
+    if (!(flags & O_CREAT))
+        return -ENOENT;
+    if (create(Key, fa, blockSize) < 0 || getValue(Key, _return) < 0)
+        return -EIO;
+    return 0;
+}
 int32_t FMStore::rename(const std::string &old_path, const std::string &new_path)
 {
     /**
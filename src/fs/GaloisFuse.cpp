@@ -0,0 +1,471 @@
+/******************************************************************
+ * This file is part of Galois.                                   *
+ *                                                                *
+ * Galois: Highly-available NVM Distributed File System           *
+ * Copyright (c) 2020 Storage Research Group, Tsinghua University *
+ ******************************************************************/
+
+/*
+ * galoisfs: FUSE 3 low-level daemon over LocofsClient.
+ *
+ * Usage: sudo -E ./galoisfs <mountpoint> [FUSE options]
+ *
+ * Requests are served by a multi-threaded session loop. Data is moved with splice when the
+ * kernel supports it, and up to MAX_IO_SIZE bytes per request are handed to LocofsClient,
+ * which issues them to ECAL in batches of pages.
+ */
+
+#include <config.hpp>           /* Defines FUSE_USE_VERSION */
+#include <fuse3/fuse_lowlevel.h>
+
+#include <fs/LocofsClient.h>
+
+#define MAX_IO_SIZE             (1 << 20)       /* max_read & max_write */
+#define ATTR_TIMEOUT            1.0             /* Attribute & entry cache timeout in seconds */
+
+DEFINE_MAIN_INFO();
+
+/*
+ * A process can only hold one ECAL (and thus one LocofsClient), shared by the FUSE workers.
+ * Each worker sends its metadata RPCs on an eRPC endpoint of its own (see
+ * LocofsClient::Worker), so that they proceed in parallel; data I/O is serialized by ECAL.
+ */
+static LocofsClient *client = nullptr;
+
+/**
+ * Maps FUSE inode numbers to LocoFS paths.
+ * Inode numbers are never reused; FUSE_ROOT_ID (1) is "/".
+ */
+class InodeTable
+{
+public:
+    InodeTable()
+    {
+        ino2path[1] = { "/", true };
+        path2ino["/"] = 1;
+    }
+
+    fuse_ino_t assign(const std::string &path, bool isDir)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto it = path2ino.find(path);
+        if (it != path2ino.end()) {
+            ino2path[it->second].isDir = isDir;
+            return it->second;
+        }
+        fuse_ino_t ino = nextIno++;
+        path2ino[path] = ino;
+        ino2path[ino] = { path, isDir };
+        return ino;
+    }
+
+    bool find(fuse_ino_t ino, std::string &path, bool &isDir)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto it = ino2path.find(ino);
+        if (it == ino2path.end())
+            return false;
+        path = it->second.path;
+        isDir = it->second.isDir;
+        return true;
+    }
+
+    void remove(const std::string &path)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto it = path2ino.find(path);
+        if (it != path2ino.end()) {
+            ino2path.erase(it->second);
+            path2ino.erase(it);
+        }
+    }
+
+private:
+    struct Node
+    {
+        std::string path;
+        bool isDir;
+    };
+
+    std::unordered_map<fuse_ino_t, Node> ino2path;
+    std::unordered_map<std::string, fuse_ino_t> path2ino;
+    fuse_ino_t nextIno = 2;
+    std::mutex mutex;
+};
+
+static InodeTable inodes;
+
+static std::string childPath(const std::string &parent, const char *name)
+{
+    return parent == "/" ? parent + name : parent + "/" + name;
+}
+
+/** Stat a path (file first, then directory) */
+static bool statPath(const std::string &path, struct stat &st, bool &isDir)
+{
+    memset(&st, 0, sizeof(struct stat));
+    if (path != "/" && client->stat(path, st)) {
+        isDir = false;
+        st.st_mode = S_IFREG | (st.st_mode & 07777);
+    }
+    else if (client->statdir(path, st))
+        isDir = true;
+    else
+        return false;
+    st.st_nlink = isDir ? 2 : 1;
+    st.st_blksize = Block4K::size;
+    st.st_blocks = (st.st_size + 511) / 512;
+    return true;
+}
+
+static bool replyEntry(fuse_req_t req, const std::string &path)
+{
+    fuse_entry_param e;
+    memset(&e, 0, sizeof(fuse_entry_param));
+    bool isDir;
+    if (!statPath(path, e.attr, isDir))
+        return false;
+    e.ino = e.attr.st_ino = inodes.assign(path, isDir);
+    e.attr_timeout = e.entry_timeout = ATTR_TIMEOUT;
+    fuse_reply_entry(req, &e);
+    return true;
+}
+
+static void galoisInit(void *userdata, fuse_conn_info *conn)
+{
+    conn->max_write = MAX_IO_SIZE;
+    conn->max_readahead = MAX_IO_SIZE;
+    /* Splice request data from /dev/fuse, and reply data into it with page moving */
+    if (conn->capable & FUSE_CAP_SPLICE_READ)
+        conn->want |= FUSE_CAP_SPLICE_READ;
+    if (conn->capable & FUSE_CAP_SPLICE_WRITE)
+        conn->want |= FUSE_CAP_SPLICE_WRITE;
+    if (conn->capable & FUSE_CAP_SPLICE_MOVE)
+        conn->want |= FUSE_CAP_SPLICE_MOVE;
+}
+
+static void galoisLookup(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+    std::string path;
+    bool isDir;
+    if (!inodes.find(parent, path, isDir))
+        fuse_reply_err(req, ENOENT);
+    else if (!replyEntry(req, childPath(path, name)))
+        fuse_reply_err(req, ENOENT);
+}
+
+static void galoisGetattr(fuse_req_t req, fuse_ino_t ino, fuse_file_info *fi)
+{
+    std::string path;
+    bool isDir;
+    struct stat st;
+    if (!inodes.find(ino, path, isDir)) {
+        fuse_reply_err(req, ENOENT);
+        return;
+    }
+    if (!statPath(path, st, isDir)) {
+        fuse_reply_err(req, ENOENT);
+        return;
+    }
+    st.st_ino = ino;
+    fuse_reply_attr(req, &st, ATTR_TIMEOUT);
+}
+
+/*
+ * LocoFS has no truncate/chmod/utimens yet. A size change other than to the current size is
+ * refused, since the file would keep its old size; the other attributes are accepted and the
+ * current ones reported.
+ */
+static void galoisSetattr(fuse_req_t req, fuse_ino_t ino, struct stat *attr, int toSet, fuse_file_info *fi)
+{
+    std::string path;
+    bool isDir;
+    struct stat st;
+    if (!(toSet & FUSE_SET_ATTR_SIZE)) {
+        galoisGetattr(req, ino, fi);
+        return;
+    }
+    if (!inodes.find(ino, path, isDir) || !statPath(path, st, isDir)) {
+        fuse_reply_err(req, ENOENT);
+        return;
+    }
+    if (isDir || attr->st_size != st.st_size) {
+        fuse_reply_err(req, isDir ? EISDIR : EOPNOTSUPP);
+        return;
+    }
+    st.st_ino = ino;
+    fuse_reply_attr(req, &st, ATTR_TIMEOUT);
+}
+
+static void galoisMkdir(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode)
+{
+    std::string path;
+    bool isDir, ok;
+    if (!inodes.find(parent, path, isDir)) {
+        fuse_reply_err(req, ENOENT);
+        return;
+    }
+    path = childPath(path, name);
+    ok = client->mkdir(path, mode);
+    if (!ok || !replyEntry(req, path))
+        fuse_reply_err(req, EIO);
+}
+
+static void galoisUnlink(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+    std::string path;
+    bool isDir, ok;
+    if (!inodes.find(parent, path, isDir)) {
+        fuse_reply_err(req, ENOENT);
+        return;
+    }
+    path = childPath(path, name);
+    ok = client->unlink(path);
+    if (ok)
+        inodes.remove(path);
+    fuse_reply_err(req, ok ? 0 : ENOENT);
+}
+
+static void galoisRmdir(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+    std::string path;
+    bool isDir, ok;
+    if (!inodes.find(parent, path, isDir)) {
+        fuse_reply_err(req, ENOENT);
+        return;
+    }
+    path = childPath(path, name);
+    ok = client->rmdir(path);
+    if (ok)
+        inodes.remove(path);
+    fuse_reply_err(req, ok ? 0 : ENOTEMPTY);
+}
+
+static void galoisOpen(fuse_req_t req, fuse_ino_t ino, fuse_file_info *fi)
+{
+    std::string path;
+    bool isDir, ok;
+    int err;
+    if (!inodes.find(ino, path, isDir)) {
+        fuse_reply_err(req, ENOENT);
+        return;
+    }
+    const fuse_ctx *ctx = fuse_req_ctx(req);
+    ok = client->open(path, fi->flags, 0, ctx->uid, ctx->gid);
+    err = errno;
+    if (!ok)
+        fuse_reply_err(req, err);
+    else
+        fuse_reply_open(req, fi);
+}
+
+static void galoisCreate(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode, fuse_file_info *fi)
+{
+    std::string path;
+    bool isDir, ok;
+    int err;
+    if (!inodes.find(parent, path, isDir)) {
+        fuse_reply_err(req, ENOENT);
+        return;
+    }
+    path = childPath(path, name);
+
+    fuse_entry_param e;
+    memset(&e, 0, sizeof(fuse_entry_param));
+    const fuse_ctx *ctx = fuse_req_ctx(req);
+    ok = client->open(path, fi->flags | O_CREAT, mode & 07777, ctx->uid, ctx->gid);
+    err = errno;
+    if (ok && !statPath(path, e.attr, isDir))
+        ok = false, err = EIO;
+    if (!ok) {
+        fuse_reply_err(req, err);
+        return;
+    }
+    e.ino = e.attr.st_ino = inodes.assign(path, false);
+    e.attr_timeout = e.entry_timeout = ATTR_TIMEOUT;
+    fuse_reply_create(req, &e, fi);
+}
+
+static void galoisRead(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off, fuse_file_info *fi)
+{
+    static thread_local std::vector<char> buffer(MAX_IO_SIZE);
+    std::string path;
+    bool isDir;
+    int64_t n;
+    if (!inodes.find(ino, path, isDir)) {
+        fuse_reply_err(req, ENOENT);
+        return;
+    }
+    if (buffer.size() < size)
+        buffer.resize(size);
+    n = client->read(path, buffer.data(), size, off);
+    if (n < 0) {
+        fuse_reply_err(req, EIO);
+        return;
+    }
+
+    /* Reply from our buffer; libfuse vmsplices it into /dev/fuse when splice write is on */
+    fuse_bufvec bufv = FUSE_BUFVEC_INIT(static_cast<size_t>(n));
+    bufv.buf[0].mem = buffer.data();
+    fuse_reply_data(req, &bufv, FUSE_BUF_SPLICE_MOVE);
+}
+
+static void galoisWriteBuf(fuse_req_t req, fuse_ino_t ino, fuse_bufvec *in, off_t off, fuse_file_info *fi)
+{
+    static thread_local std::vector<char> buffer(MAX_IO_SIZE);
+    std::string path;
+    bool isDir, ok;
+    if (!inodes.find(ino, path, isDir)) {
+        fuse_reply_err(req, ENOENT);
+        return;
+    }
+
+    /* With splice read, `in` is a pipe: this is the only copy before ECAL encodes the pages */
+    size_t size = fuse_buf_size(in);
+    if (buffer.size() < size)
+        buffer.resize(size);
+    fuse_bufvec out = FUSE_BUFVEC_INIT(size);
+    out.buf[0].mem = buffer.data();
+    ssize_t copied = fuse_buf_copy(&out, in, FUSE_BUF_SPLICE_NONBLOCK);
+    if (copied < 0) {
+        fuse_reply_err(req, -copied);
+        return;
+    }
+    ok = client->write(path, buffer.data(), copied, off);
+    if (ok)
+        fuse_reply_write(req, copied);
+    else
+        fuse_reply_err(req, EIO);
+}
+
+static void galoisRelease(fuse_req_t req, fuse_ino_t ino, fuse_file_info *fi)
+{
+    std::string path;
+    bool isDir;
+    if (inodes.find(ino, path, isDir))
+        client->close(path);
+    fuse_reply_err(req, 0);
+}
+
+static void galoisFsync(fuse_req_t req, fuse_ino_t ino, int datasync, fuse_file_info *fi)
+{
+    bool ok;
+    ok = client->flushSizes();
+    fuse_reply_err(req, ok ? 0 : EIO);
+}
+
+static void galoisReaddir(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off, fuse_file_info *fi)
+{
+    std::string path;
+    bool isDir, ok;
+    std::vector<std::string> names;
+    if (!inodes.find(ino, path, isDir)) {
+        fuse_reply_err(req, ENOENT);
+        return;
+    }
+    ok = client->readdir(path, names);
+    if (!ok) {
+        fuse_reply_err(req, ENOTDIR);
+        return;
+    }
+    names.erase(std::remove(names.begin(), names.end(), std::string()), names.end());
+    names.insert(names.begin(), { ".", ".." });
+
+    /* Only st_ino and the type bits of st_mode are used by fuse_add_direntry */
+    std::vector<char> buf(size);
+    size_t used = 0;
+    struct stat st;
+    memset(&st, 0, sizeof(struct stat));
+    for (size_t i = off; i < names.size(); ++i) {
+        size_t len = fuse_add_direntry(req, buf.data() + used, size - used, names[i].c_str(), &st, i + 1);
+        if (len > size - used)
+            break;
+        used += len;
+    }
+    fuse_reply_buf(req, buf.data(), used);
+}
+
+static void galoisStatfs(fuse_req_t req, fuse_ino_t ino)
+{
+    struct statvfs st;
+    memset(&st, 0, sizeof(struct statvfs));
+    st.f_bsize = st.f_frsize = Block4K::size;
+    st.f_blocks = st.f_bfree = st.f_bavail = client->getECAL()->getClusterCapacity();
+    st.f_namemax = MAX_PATH_LEN;
+    fuse_reply_statfs(req, &st);
+}
+
+int main(int argc, char **argv)
+{
+    fuse_args args = FUSE_ARGS_INIT(argc, argv);
+    fuse_cmdline_opts opts;
+    fuse_loop_config config;
+
+    if (fuse_parse_cmdline(&args, &opts) != 0)
+        return 1;
+    if (opts.show_help) {
+        printf("usage: %s [options] <mountpoint>\n\n", argv[0]);
+        fuse_cmdline_help();
+        fuse_lowlevel_help();
+        return 0;
+    }
+    if (opts.mountpoint == nullptr) {
+        printf("usage: %s [options] <mountpoint>\n", argv[0]);
+        return 1;
+    }
+    fuse_opt_add_arg(&args, "-omax_read=1048576");
+
+    fuse_lowlevel_ops ops;
+    memset(&ops, 0, sizeof(fuse_lowlevel_ops));
+    ops.init = galoisInit;
+    ops.lookup = galoisLookup;
+    ops.getattr = galoisGetattr;
+    ops.setattr = galoisSetattr;
+    ops.mkdir = galoisMkdir;
+    ops.unlink = galoisUnlink;
+    ops.rmdir = galoisRmdir;
+    ops.open = galoisOpen;
+    ops.create = galoisCreate;
+    ops.read = galoisRead;
+    ops.write_buf = galoisWriteBuf;
+    ops.release = galoisRelease;
+    ops.fsync = galoisFsync;
+    ops.readdir = galoisReaddir;
+    ops.statfs = galoisStatfs;
+
+    int ret = 1;
+    fuse_session *se = fuse_session_new(&args, &ops, sizeof(ops), nullptr);
+    if (se == nullptr)
+        goto out_args;
+    if (fuse_set_signal_handlers(se) != 0)
+        goto out_session;
+    if (fuse_session_mount(se, opts.mountpoint) != 0)
+        goto out_signal;
+
+    /* RDMA resources do not survive fork, so connect to the cluster after daemonizing */
+    fuse_daemonize(opts.foreground);
+    COLLECT_MAIN_INFO();
+    cmdConf = new CmdLineConfig();
+    client = new LocofsClient();
+    expectTrue(client->mount(""));
+    d_info("galoisfs mounted at %s", opts.mountpoint);
+
+    if (opts.singlethread)
+        ret = fuse_session_loop(se);
+    else {
+        config.clone_fd = opts.clone_fd;
+        config.max_idle_threads = opts.max_idle_threads;
+        ret = fuse_session_loop_mt(se, &config);
+    }
+
+    client->stop();
+    fuse_session_unmount(se);
+out_signal:
+    fuse_remove_signal_handlers(se);
+out_session:
+    fuse_session_destroy(se);
+out_args:
+    free(opts.mountpoint);
+    fuse_opt_free_args(&args);
+    return ret;
+}
@@ -2,6 +2,7 @@
 #include <config.hpp>
 #include <network/msg.hpp>
 
+#include <cerrno>
 #include <fcntl.h>
 #include <pthread.h>
 #include <ctime>
@@ -37,15 +38,74 @@ inline uint64_t hashObj(struct loco_file_stat st, int blkid)
     return ret;
 }
 
+/* Tag of the blocks of a file in the page cache; a collision only drops more pages */
+inline uint64_t fileTag(const struct loco_file_stat &st)
+{
+    return hashObj(st, -1);
+}
+
 
 bool LocofsClient::mount(const std::string &conf)
 {
     parseConfig();
     UCache.init(5000);
     ecal.regNetif(&netif);
+
+    raMaxWindow = cmdConf->readaheadWindow;
+    stripeUnit = cmdConf->stripeUnit;
+    raRunning = true;
+    prefetcher = std::thread(&LocofsClient::prefetchWorker, this);
     return true;
 }
 
+void LocofsClient::stop()
+{
+    flushSizes();
+    {
+        std::lock_guard<std::mutex> lock(raMutex);
+        raRunning = false;
+    }
+    raCond.notify_all();
+    if (prefetcher.joinable())
+        prefetcher.join();
+
+    ecal.getRDMASocket()->stopListenerAndJoin();
+}
+
+LocofsClient::Worker &LocofsClient::worker()
+{
+    static thread_local std::unique_ptr<Worker> local;
+    if (std::this_thread::get_id() == owner)
+        return mainWorker;
+    if (local)
+        return *local;
+
+    local.reset(new Worker);
+    local->client = this;
+    {
+        std::lock_guard<std::mutex> lock(stateMutex);
+        if (!freeRpcIds.empty()) {
+            local->rpcId = freeRpcIds.back();
+            freeRpcIds.pop_back();
+        }
+        else
+            local->rpcId = nextRpcId++;
+    }
+    expectTrue(local->rpcId <= erpc::kMaxRpcId);
+    local->ownNetif.reset(new NetworkInterface(netif, local->rpcId));
+    local->netif = local->ownNetif.get();
+    return *local;
+}
+
+LocofsClient::Worker::~Worker()
+{
+    if (!rpcId)
+        return;
+    ownNetif.reset();
+    std::lock_guard<std::mutex> lock(client->stateMutex);
+    client->freeRpcIds.push_back(rpcId);
+}
+
 bool LocofsClient::write(const std::string &path, const char *buf, int64_t len, int64_t off)
 {
     //LOG(WARNING)<< " <<< File Write Begin >>> "<< path << " lenth="<<len<< " offset=" << off;
@@ -67,7 +127,8 @@ bool LocofsClient::write(const std::string &path, const char *buf, int64_t len,
 
     //auto stt = steady_clock::now();
     struct loco_file_stat loco_st;
-    if (_get_file_stat(path, loco_st) == false) {
+    std::string Key_File;
+    if (_get_file_stat(path, loco_st, &Key_File) == false) {
         return false;
     }
     //auto edt = steady_clock::now();
@@ -83,7 +144,17 @@ bool LocofsClient::write(const std::string &path, const char *buf, int64_t len,
     int64_t offset = off, length = len;
     int64_t start = 0;
 
+    /*
+     * Full pages are written in batches of ECAL::MaxWriteBatch; partial pages need a read.
+     * Blocks of more than a page are written as ECAL extents, one at a time.
+     */
+    int pagesPerBlock = block_size / Block4K::size;
     ECAL::Page page;
+    std::vector<ECAL::Page *> batch;
+    auto &writePages = worker().writePages;
+    if (writePages.size() < (size_t)std::max(ECAL::MaxWriteBatch, pagesPerBlock))
+        writePages.resize(std::max(ECAL::MaxWriteBatch, pagesPerBlock));
+
     stt = steady_clock::now();
     while (len > 0) {
         int64_t block_num = offset / block_size;            // # of data block
@@ -91,8 +162,10 @@ bool LocofsClient::write(const std::string &path, const char *buf, int64_t len,
         int64_t block_len = block_size - block_off;         
         block_len = len > block_len ? block_len : len;      // length in the current block
 
-        uint64_t blkno = hashObj(loco_st, block_num) % ecal.getClusterCapacity();
-        if (block_off || block_off + block_len < Block4K::size) {
+        uint64_t blkno = _block_index(loco_st, block_num);
+        if (pagesPerBlock > 1)
+            _write_extent(blkno, pagesPerBlock, buf + start, block_off, block_len);
+        else if (block_off || block_off + block_len < Block4K::size) {
             /* Needs a read; TODO: remove read */
             ecal.readBlock(blkno, page);
             memcpy(page.page.data + block_off, buf + start, block_len);
@@ -100,53 +173,146 @@ bool LocofsClient::write(const std::string &path, const char *buf, int64_t len,
         }
         else {
             /* Full page */
-            memcpy(page.page.data, buf + start, block_len);
-            ecal.writeBlock(page);
+            ECAL::Page *full = &writePages[batch.size()];
+            full->index = blkno;
+            memcpy(full->page.data, buf + start, block_len);
+            batch.push_back(full);
+            if (batch.size() == ECAL::MaxWriteBatch) {
+                ecal.writeBlocks(batch.data(), batch.size());
+                batch.clear();
+            }
         }
+        for (int p = 0; p < pagesPerBlock; ++p)
+            pageCache.invalidate(blkno + p);
         
         start += block_len;
         len -= block_len;
         offset += block_len;
     }
+    if (!batch.empty())
+        ecal.writeBlocks(batch.data(), batch.size());
     edt = steady_clock::now();
     data_rdma_time_w += duration_cast<microseconds>(edt - stt).count();
 
     //d_info("EC & RDMA succ");
 
     /**
-     *  Get Key_FileInode
+     *  Update file size lazily: only when the file grows, coalesced per file. The size is
+     *  sent to the FMS asynchronously by the first write that finds it pending for more than
+     *  SIZE_FLUSH_INTERVAL_MS, by the prefetcher if no write comes (see prefetchWorker), or at
+     *  stat, fsync (flushSizes), close or stop.
      */
-    std::string Key_File;
-    //stt = steady_clock::now();
-    if (_get_file_key(path, Key_File) == false)
-        return false;
-    //edt = steady_clock::now();
-    //meta_rpc_time += duration_cast<microseconds>(edt - stt).count();
-    
-    //d_info("_get_file_key succ");
+    if (off + length <= (int64_t)loco_st.st.st_size)
+        return true;
 
-    /**
-     *  Update FileContentInode
-     */
-    FileContentInode fci;
-    _set_ContentInode(loco_st, fci);
-    fci.size = fci.size > (off + length) ? fci.size : (off + length);
-    
-    //stt = steady_clock::now();
+    bool due;
+    {
+        std::lock_guard<std::mutex> lock(stateMutex);
+        auto it = pendingSizes.find(path);
+        if (it == pendingSizes.end()) {
+            it = pendingSizes.emplace(path, PendingSize()).first;
+            it->second.key = Key_File;
+            it->second.since = steady_clock::now();
+        }
+        it->second.size = std::max<int64_t>(it->second.size, off + length);
+
+        auto file = openFiles.find(path);
+        if (file != openFiles.end())
+            file->second.stat.st.st_size = it->second.size;
+
+        due = !lazySize ||
+              duration_cast<std::chrono::milliseconds>(steady_clock::now() - it->second.since).count() >= SIZE_FLUSH_INTERVAL_MS;
+    }
+    return due ? _flush_size(path, lazySize) : true;
+}
+
+/** ECAL index of the first page of a file block, aligned to the block's page count. */
+uint64_t LocofsClient::_block_index(const struct loco_file_stat &loco_st, int64_t block_num)
+{
+    uint64_t pages = loco_st.block_size / Block4K::size;
+    return hashObj(loco_st, block_num) % (ecal.getClusterCapacity() / pages) * pages;
+}
+
+/** Write [off, off + len) of the extent of `count` pages at `index`, reading it first if partial. */
+void LocofsClient::_write_extent(uint64_t index, int count, const char *buf, int64_t off, int64_t len)
+{
+    auto &writePages = worker().writePages;
+    std::vector<ECAL::Page *> pages;
+    for (int p = 0; p < count; ++p) {
+        writePages[p].index = index + p;
+        pages.push_back(&writePages[p]);
+    }
+    if (off || len < (int64_t)count * Block4K::size)
+        ecal.readExtent(index, pages.data(), count);
+
+    for (int64_t done = 0; done < len; ) {
+        int64_t pos = off + done;
+        int64_t n = std::min<int64_t>(len - done, Block4K::size - pos % Block4K::size);
+        memcpy(pages[pos / Block4K::size]->page.data + pos % Block4K::size, buf + done, n);
+        done += n;
+    }
+    ecal.writeExtent(pages.data(), count);
+}
+
+/**
+ * Send the pending size of a file to its FMS.
+ * Asynchronous flushes fall back to a synchronous RPC if no locker is free.
+ */
+bool LocofsClient::_flush_size(const std::string &path, bool async)
+{
     ValueWithPathRequest request;
+    int server;
     {
-        request.value = fci.size;
-        strncpy(request.path, Key_File.c_str(), MAX_PATH_LEN);
+        std::lock_guard<std::mutex> lock(stateMutex);
+        auto it = pendingSizes.find(path);
+        if (it == pendingSizes.end())
+            return true;
+
+        request.value = it->second.size;
+        strncpy(request.path, it->second.key.c_str(), MAX_PATH_LEN);
         request.path[MAX_PATH_LEN] = 0;
+        server = SERVER(file_trans, it->second.key);
+        pendingSizes.erase(it);
     }
+    ++sizeUpdates;
+
+    if (async && endpoint().rpcCallAsync(server, ErpcType::ERPC_CSIZE, request))
+        return true;
+    
     PureValueResponse response;
-    netif.rpcCall(SERVER(file_trans, Key_File), ErpcType::ERPC_CSIZE, request, response);
-    //edt = steady_clock::now();
-    //meta_upd_time_w += duration_cast<microseconds>(edt - stt).count();
+    endpoint().rpcCall(server, ErpcType::ERPC_CSIZE, request, response);
+    return (response.value == 0);
+}
 
-    //d_info("csize rpc succ");
+/** Send the sizes pending for SIZE_FLUSH_INTERVAL_MS or more. */
+void LocofsClient::_flush_due_sizes()
+{
+    auto due = std::chrono::steady_clock::now() - std::chrono::milliseconds(SIZE_FLUSH_INTERVAL_MS);
+    std::vector<std::string> paths;
+    {
+        std::lock_guard<std::mutex> lock(stateMutex);
+        for (auto &pending : pendingSizes)
+            if (pending.second.since <= due)
+                paths.push_back(pending.first);
+    }
+    for (auto &path : paths)
+        _flush_size(path, false);
+}
 
-    return (response.value == 0);
+/** Send all pending sizes, and wait for the asynchronous updates of this thread. */
+bool LocofsClient::flushSizes()
+{
+    std::vector<std::string> paths;
+    {
+        std::lock_guard<std::mutex> lock(stateMutex);
+        for (auto &pending : pendingSizes)
+            paths.push_back(pending.first);
+    }
+    bool ok = true;
+    for (auto &path : paths)
+        ok &= _flush_size(path, false);
+    endpoint().drainAsync();
+    return ok;
 }
 
 int64_t LocofsClient::read(const std::string &path, char *buf, int64_t len, int64_t off)
@@ -165,7 +331,7 @@ int64_t LocofsClient::read(const std::string &path, char *buf, int64_t len, int6
     //auto stt = steady_clock::now();
     struct loco_file_stat loco_st;
     if (_get_file_stat(path, loco_st) == false)
-        return false;
+        return -1;
     //auto edt = steady_clock::now();
     //meta_rpc_time += duration_cast<microseconds>(edt - stt).count();
 
@@ -174,29 +340,84 @@ int64_t LocofsClient::read(const std::string &path, char *buf, int64_t len, int6
      */
     int64_t block_size = loco_st.block_size;
     int64_t size = loco_st.st.st_size;
-    len = size < len ? size : len;
     int64_t offset = off;
     int64_t start = 0;
-    if (off + len > size) {
-        //LOG(ERROR) << path << " read failed, read size is large than file size";
+    if (off < 0)
         return -1;
-    }
+    /* Short read at EOF */
+    len = size - off < len ? size - off : len;
+    if (len <= 0)
+        return 0;
+
+    /* Serve cached pages, and collect the missing ones */
+    struct Miss
+    {
+        uint64_t blkno;
+        uint64_t extent;                                    // first page of the block
+        int64_t start, page_off, page_len;
+    };
+    std::vector<Miss> misses;
+    int64_t first = offset / block_size;
+    int64_t last = (offset + len - 1) / block_size;
+    int pagesPerBlock = block_size / Block4K::size;
+    int64_t pieces = 0;
 
-    ECAL::Page page;
     //stt = steady_clock::now();
     while (len > 0) {
         int64_t block_num = offset / block_size;            // # of data block
         int64_t block_off = offset % block_size;            // offset in the current block
-        int64_t block_len = block_size - block_off;
-        block_len = len > block_len ? block_len : len;      // length in the current block
-
-        uint64_t blkno = hashObj(loco_st, block_num) % ecal.getClusterCapacity();
-        ecal.readBlock(blkno, page);
-        memcpy(buf + start, page.page.data + block_off,  block_len);
+        int64_t page_off = block_off % Block4K::size;       // offset in the current page
+        int64_t page_len = Block4K::size - page_off;
+        page_len = len > page_len ? page_len : len;         // length in the current page
+
+        uint64_t extent = _block_index(loco_st, block_num);
+        uint64_t blkno = extent + block_off / Block4K::size;
+        if (!pageCache.read(blkno, buf + start, page_off, page_len))
+            misses.push_back({ blkno, extent, start, page_off, page_len });
+        ++pieces;
         
-        start += block_len;
-        len -= block_len;
-        offset += block_len;
+        start += page_len;
+        len -= page_len;
+        offset += page_len;
+    }
+    raStats.hits += pieces - misses.size();
+    raStats.misses += misses.size();
+
+    /*
+     * Queue the prefetch before the synchronous reads. They do not overlap (ECAL serializes
+     * both on its ioMutex), but the prefetcher takes over as soon as these reads are done,
+     * without waiting for the next read of the application.
+     */
+    _readahead(path, loco_st, first, last);
+
+    auto &missPages = worker().missPages;
+    if (!misses.empty() && pagesPerBlock == 1) {
+        std::vector<uint64_t> blknos;
+        std::vector<ECAL::Page *> pages;
+        if (missPages.size() < misses.size())
+            missPages.resize(misses.size());
+        for (size_t i = 0; i < misses.size(); ++i) {
+            blknos.push_back(misses[i].blkno);
+            pages.push_back(&missPages[i]);
+        }
+        ecal.readBlocks(blknos.data(), pages.data(), misses.size());
+
+        for (size_t i = 0; i < misses.size(); ++i)
+            memcpy(buf + misses[i].start, missPages[i].page.data + misses[i].page_off, misses[i].page_len);
+    }
+    else if (!misses.empty()) {
+        /* Whole blocks are read as extents; misses of a block are adjacent */
+        std::vector<ECAL::Page *> pages;
+        if (missPages.size() < (size_t)pagesPerBlock)
+            missPages.resize(pagesPerBlock);
+        for (int p = 0; p < pagesPerBlock; ++p)
+            pages.push_back(&missPages[p]);
+        for (size_t i = 0; i < misses.size(); ++i) {
+            if (!i || misses[i].extent != misses[i - 1].extent)
+                ecal.readExtent(misses[i].extent, pages.data(), pagesPerBlock);
+            auto &page = missPages[misses[i].blkno - misses[i].extent];
+            memcpy(buf + misses[i].start, page.page.data + misses[i].page_off, misses[i].page_len);
+        }
     }
     //edt = steady_clock::now();
     //data_rdma_time_r += duration_cast<microseconds>(edt - stt).count();
@@ -217,19 +438,129 @@ bool LocofsClient::mkdir(const std::string &path, int32_t mode)
         request.path[MAX_PATH_LEN] = 0;
     }
     PureValueResponse response;
-    netif.rpcCall(directory_trans, ErpcType::ERPC_MKDIR, request, response);
+    endpoint().rpcCall(directory_trans, ErpcType::ERPC_MKDIR, request, response);
     return (response.value == 0);
 }
 
+/**
+ * Detect sequential reads of a file, and hand the blocks of an adaptive window after
+ * [first, last] to the prefetcher. The window starts at RA_INIT_WINDOW blocks and doubles
+ * on every sequential read up to `raMaxWindow` pages; a non-sequential read resets it.
+ * Like Linux, the window is refilled only when less than half of it is left in flight.
+ */
+void LocofsClient::_readahead(const std::string &path, const struct loco_file_stat &loco_st,
+                              int64_t first, int64_t last)
+{
+    if (raMaxWindow <= 0)
+        return;
+
+    std::lock_guard<std::mutex> state(stateMutex);
+    ReadaheadState &ra = raState[path];
+    if (first != ra.nextBlock) {
+        ra.window = 0;
+        ra.nextBlock = ra.prefetchedUpTo = last + 1;
+        return;
+    }
+
+    int pagesPerBlock = loco_st.block_size / Block4K::size;
+    int64_t maxWindow = std::max(raMaxWindow / pagesPerBlock, 1);
+    ra.window = ra.window ? std::min<int64_t>(ra.window * 2, maxWindow)
+                          : std::min<int64_t>(RA_INIT_WINDOW, maxWindow);
+    ra.nextBlock = last + 1;
+    ra.prefetchedUpTo = std::max(ra.prefetchedUpTo, last + 1);
+    if (ra.prefetchedUpTo - (last + 1) > ra.window / 2)
+        return;
+
+    int64_t block_size = loco_st.block_size;
+    int64_t nblocks = (loco_st.st.st_size + block_size - 1) / block_size;
+    int64_t target = std::min(last + 1 + ra.window, nblocks);
+    if (ra.prefetchedUpTo >= target)
+        return;
+
+    {
+        std::lock_guard<std::mutex> lock(raMutex);
+        for (int64_t block_num = ra.prefetchedUpTo; block_num < target; ++block_num) {
+            uint64_t blkno = _block_index(loco_st, block_num);
+            bool reserved = false;
+            for (int p = 0; p < pagesPerBlock; ++p)
+                reserved |= pageCache.reserve(blkno + p, fileTag(loco_st));
+            if (reserved)
+                raQueue.push_back({ blkno, pagesPerBlock });
+        }
+    }
+    ra.prefetchedUpTo = target;
+    raCond.notify_one();
+}
+
+/**
+ * Background thread reading reserved pages in batches posted to all stripe nodes at once,
+ * and reserved extents one at a time. Every SIZE_FLUSH_INTERVAL_MS, it also sends the sizes
+ * left pending that long, e.g. of files no longer written but still open.
+ */
+void LocofsClient::prefetchWorker()
+{
+    using std::chrono::steady_clock;
+    const auto interval = std::chrono::milliseconds(SIZE_FLUSH_INTERVAL_MS);
+    std::vector<uint64_t> blknos;
+    std::vector<ECAL::Page> pages(std::max(ECAL::MaxReadBatch, ECAL::MaxExtentPages));
+    std::vector<ECAL::Page *> pagePtrs;
+    for (auto &page : pages)
+        pagePtrs.push_back(&page);
+
+    auto nextFlush = steady_clock::now() + interval;
+    while (true) {
+        PrefetchItem extent = { 0, 0 };
+        {
+            std::unique_lock<std::mutex> lock(raMutex);
+            raCond.wait_until(lock, nextFlush, [this] { return !raQueue.empty() || !raRunning; });
+            if (!raRunning)
+                break;
+            blknos.clear();
+            if (raQueue.front().count > 1) {
+                extent = raQueue.front();
+                raQueue.pop_front();
+            }
+            while (!extent.count && !raQueue.empty() && raQueue.front().count == 1 &&
+                   blknos.size() < (size_t)ECAL::MaxReadBatch) {
+                blknos.push_back(raQueue.front().index);
+                raQueue.pop_front();
+            }
+        }
+        if (steady_clock::now() >= nextFlush) {
+            _flush_due_sizes();
+            nextFlush = steady_clock::now() + interval;
+        }
+
+        if (extent.count) {
+            ecal.readExtent(extent.index, pagePtrs.data(), extent.count);
+            for (int p = 0; p < extent.count; ++p)
+                pageCache.fill(extent.index + p, pages[p]);
+            raStats.prefetched += extent.count;
+            continue;
+        }
+        if (blknos.empty())
+            continue;
+        ecal.readBlocks(blknos.data(), pagePtrs.data(), blknos.size());
+        for (size_t i = 0; i < blknos.size(); ++i)
+            pageCache.fill(blknos[i], pages[i]);
+        raStats.prefetched += blknos.size();
+    }
+}
+
 bool LocofsClient::opendir(const std::string &path, int32_t mode)
 {
     return false;
 }
 
 /**
- * if file does not exist, create one: FileInode, EntryList
+ * if file does not exist and O_CREAT is set, create one with `mode`: FileInode, EntryList
+ * Access check, creation and stat are done by a single compound ERPC_OPEN, and the stat
+ * is kept until close, so that read/write of an open file need no FMS round trip. Pages
+ * of the file cached before are dropped (close-to-open consistency).
+ * Access is checked, and a created file owned, for `uid` and `gid`.
+ * On failure errno is set: ENOENT, EEXIST (O_CREAT | O_EXCL), EACCES or EIO.
  */
-bool LocofsClient::open(const std::string &path, int32_t flags)
+bool LocofsClient::open(const std::string &path, int32_t flags, int32_t mode, uid_t uid, gid_t gid)
 {
     /**
      *  base on file dir path,
@@ -239,23 +570,46 @@ bool LocofsClient::open(const std::string &path, int32_t flags)
      */
     std::string Key_File;
     if (_get_file_key(path, Key_File) == false) {
+        errno = ENOENT;
         return false;
     }
 
-    ValueWithPathRequest request;
+    CreateRequest request;
     {
+        request.value = COMBINE_I32(flags, mode);
+        request.blockSize = stripeUnit;
+        request.uid = uid;
+        request.gid = gid;
         strncpy(request.path, Key_File.c_str(), MAX_PATH_LEN);
         request.path[MAX_PATH_LEN] = 0;
     }
-    PureValueResponse response;
-    netif.rpcCall(SERVER(file_trans, Key_File), ErpcType::ERPC_ACCESS, request, response);
-    
-    if (response.value == 0)
-        return true;
+    StatResponse response;
+    endpoint().rpcCall(SERVER(file_trans, Key_File), ErpcType::ERPC_OPEN, request, response);
+    if (response.result != 0) {
+        errno = -response.result;
+        return false;
+    }
     
-    request.value = 0777;
-    netif.rpcCall(SERVER(file_trans, Key_File), ErpcType::ERPC_CREATE, request, response);
-    return response.value == 0;
+    pageCache.invalidateFile(fileTag(response.fileStat));
+
+    std::lock_guard<std::mutex> lock(stateMutex);
+    OpenFile &file = openFiles[path];
+    file.key = Key_File;
+    memcpy(&file.stat, &response.fileStat, sizeof(loco_file_stat));
+    return true;
+}
+
+/**
+ * Forget the access pattern of a file, and publish its size (close-to-open consistency).
+ */
+bool LocofsClient::close(const std::string &path)
+{
+    {
+        std::lock_guard<std::mutex> lock(stateMutex);
+        raState.erase(path);
+        openFiles.erase(path);
+    }
+    return _flush_size(path, false);
 }
 
 /**
@@ -272,7 +626,7 @@ bool LocofsClient::rmdir(const std::string &path)
         request.path[MAX_PATH_LEN] = 0;
     }
     PureValueResponse response;
-    netif.rpcCall(directory_trans, ErpcType::ERPC_RMDIR, request, response);
+    endpoint().rpcCall(directory_trans, ErpcType::ERPC_RMDIR, request, response);
 
     if (response.value == 0) {
         UCache.remove(p);
@@ -283,6 +637,13 @@ bool LocofsClient::rmdir(const std::string &path)
 
 bool LocofsClient::unlink(const std::string &path)
 {
+    {
+        std::lock_guard<std::mutex> lock(stateMutex);
+        raState.erase(path);
+        openFiles.erase(path);
+        pendingSizes.erase(path);
+    }
+
     std::string Key_File;
     if (_get_file_key(path, Key_File) == false)
         return false;
@@ -293,31 +654,22 @@ bool LocofsClient::unlink(const std::string &path)
         request.path[MAX_PATH_LEN] = 0;
     }
     PureValueResponse response;
-    netif.rpcCall(SERVER(file_trans, Key_File), ErpcType::ERPC_REMOVE, request, response);
+    endpoint().rpcCall(SERVER(file_trans, Key_File), ErpcType::ERPC_REMOVE, request, response);
     return (response.value == 0);
 }
 
 /**
+ * Sends the pending size of the file first, so that the FMS reports it to other clients too.
  * @param  buf  linux stat struct
  */
 bool LocofsClient::stat(const std::string &path, struct stat &buf)
 {
-    std::string Key_File;
-    if (_get_file_key(path, Key_File) == false)
-        return false;
-
-    ValueWithPathRequest request;
-    {
-        strncpy(request.path, Key_File.c_str(), MAX_PATH_LEN);
-        request.path[MAX_PATH_LEN] = 0;
-    }
-    StatResponse response;
-    netif.rpcCall(SERVER(file_trans, Key_File), ErpcType::ERPC_FILESTAT, request, response);
-
-    if (response.result < 0)
+    _flush_size(path, false);
+    struct loco_file_stat loco_st;
+    if (_get_file_stat(path, loco_st) == false)
         return false;
     
-    memcpy(&buf, &response.fileStat.st, sizeof(struct stat));
+    memcpy(&buf, &loco_st.st, sizeof(struct stat));
     return true;
 }
 
@@ -335,7 +687,7 @@ bool LocofsClient::statdir(const std::string &path, struct stat &buf)
         request.path[MAX_PATH_LEN] = 0;
     }
     StatResponse response;
-    netif.rpcCall(directory_trans, ErpcType::ERPC_DIRSTAT, request, response);
+    endpoint().rpcCall(directory_trans, ErpcType::ERPC_DIRSTAT, request, response);
 
     if (response.result < 0)
         return false;
@@ -360,7 +712,7 @@ bool LocofsClient::readdir(const std::string &path, std::vector<std::string> &bu
         request.path[MAX_PATH_LEN] = 0;
     }
     RawResponse response;
-    netif.rpcCall(directory_trans, ErpcType::ERPC_READDIR, request, response);
+    endpoint().rpcCall(directory_trans, ErpcType::ERPC_READDIR, request, response);
 
     std::string vbuf(response.raw, response.len);
     boost::split(buf, vbuf, boost::is_any_of("\t"), boost::token_compress_on);
@@ -381,7 +733,7 @@ bool LocofsClient::readdir(const std::string &path, std::vector<std::string> &bu
     for (int i = 0; i < file_trans.size(); i++) {
         std::vector<std::string> temp;
 
-        netif.rpcCall(file_trans[i], ErpcType::ERPC_READDIR, req2, response);
+        endpoint().rpcCall(file_trans[i], ErpcType::ERPC_READDIR, req2, response);
         vbuf = std::string(response.raw, response.len);
         boost::split(temp, vbuf, boost::is_any_of("\t"), boost::token_compress_on);
 
@@ -391,22 +743,36 @@ bool LocofsClient::readdir(const std::string &path, std::vector<std::string> &bu
     return true;
 }
 
-bool LocofsClient::create(const std::string &path, int32_t mode)
+/**
+ * Create a file whose data is stored in blocks of `blockSize` bytes (0: the client's
+ * stripe unit). Large blocks suit large sequential files, as each is a single ECAL extent.
+ */
+bool LocofsClient::create(const std::string &path, int32_t mode, int64_t blockSize)
 {
     std::string p;
     std::string Key_File;
     _check_path(path, p);
 
+    if (blockSize == 0)
+        blockSize = stripeUnit;
+    if (!isValidBlockSize(blockSize)) {
+        d_err("invalid block size: %ld", blockSize);
+        return false;
+    }
     if (_get_file_key(p, Key_File) == false)
         return false;
     
-    ValueWithPathRequest request;
+    CreateRequest request;
     {
+        request.value = mode;
+        request.blockSize = blockSize;
+        request.uid = getuid();
+        request.gid = getgid();
         strncpy(request.path, Key_File.c_str(), MAX_PATH_LEN);
         request.path[MAX_PATH_LEN] = 0;
     }
     PureValueResponse response;
-    netif.rpcCall(SERVER(file_trans, Key_File), ErpcType::ERPC_CREATE, request, response);
+    endpoint().rpcCall(SERVER(file_trans, Key_File), ErpcType::ERPC_CREATE, request, response);
     return (response.value == 0);
 }
 
@@ -454,7 +820,7 @@ bool LocofsClient::_get_uuid(const std::string &path, uint64_t &uuid, const bool
         request.path[MAX_PATH_LEN] = 0;
     }
     StatResponse response;
-    netif.rpcCall(directory_trans, ErpcType::ERPC_DIRSTAT, request, response);
+    endpoint().rpcCall(directory_trans, ErpcType::ERPC_DIRSTAT, request, response);
 
     if (response.result < 0)
         return false;
@@ -492,10 +858,28 @@ bool LocofsClient::_get_file_key(const std::string &path, std::string &Key_File)
     return true;
 }
 
-bool LocofsClient::_get_file_stat(const std::string &path, loco_file_stat &loco_st)
+/**
+ * Fetch file stat from the open-file table, or from FMS if the file is not open.
+ * The size is overlaid with the pending size of this client, so that it reads its own writes.
+ */
+bool LocofsClient::_get_file_stat(const std::string &path, loco_file_stat &loco_st, std::string *Key_File_Out)
 {
+    {
+        std::lock_guard<std::mutex> lock(stateMutex);
+        auto file = openFiles.find(path);
+        if (file != openFiles.end()) {
+            memcpy(&loco_st, &file->second.stat, sizeof(loco_file_stat));
+            if (Key_File_Out)
+                *Key_File_Out = file->second.key;
+            return true;
+        }
+    }
+
     std::string Key_File;
-    _get_file_key(path, Key_File);
+    if (_get_file_key(path, Key_File) == false)
+        return false;
+    if (Key_File_Out)
+        *Key_File_Out = Key_File;
 
     //auto stt = std::chrono::steady_clock::now();
     ValueWithPathRequest request;
@@ -504,11 +888,16 @@ bool LocofsClient::_get_file_stat(const std::string &path, loco_file_stat &loco_
         request.path[MAX_PATH_LEN] = 0;
     }
     StatResponse response;
-    netif.rpcCall(SERVER(file_trans, Key_File), ErpcType::ERPC_FILESTAT, request, response);
+    endpoint().rpcCall(SERVER(file_trans, Key_File), ErpcType::ERPC_FILESTAT, request, response);
     //auto edt = std::chrono::steady_clock::now();
     //meta_rpc_time += std::chrono::duration_cast<std::chrono::microseconds>(edt - stt).count();
 
     memcpy(&loco_st, &response.fileStat, sizeof(loco_file_stat));
+
+    std::lock_guard<std::mutex> lock(stateMutex);
+    auto it = pendingSizes.find(path);
+    if (it != pendingSizes.end() && it->second.size > loco_st.st.st_size)
+        loco_st.st.st_size = it->second.size;
     return (response.result == 0);
 }
 
@@ -562,166 +951,8 @@ uint64_t LocofsClient::testRoundTrip(int peerId)
 
     PureValueRequest request;
     PureValueResponse response;
-    netif.rpcCall(peerId, ErpcType::ERPC_TEST, request, response);
+    endpoint().rpcCall(peerId, ErpcType::ERPC_TEST, request, response);
 
     auto edt = std::chrono::steady_clock::now();
     return std::chrono::duration_cast<std::chrono::microseconds>(edt - stt).count();
 }
-
-
-/* Main function part */
-#include <chrono>
-
-DEFINE_MAIN_INFO();
-
-void thptWorker(LocofsClient *cli, bool wl, int n = 100000)
-{
-    using namespace std::chrono;
-
-    std::string path = "/test/0001";
-    ECAL::Page page(0);
-    memset(page.page.data, 'a', 4096);
-
-    ECAL *ecal = cli->getECAL();
-    if (wl)
-        for (int i = 0; i < n; ++i) {
-            auto stt = steady_clock::now();
-            while (duration_cast<microseconds>(steady_clock::now() - stt).count() < 10);
-            ecal->writeBlock(page);
-        }
-    else
-        for (int i = 0; i < n; ++i) {
-            auto stt = steady_clock::now();
-            while (duration_cast<microseconds>(steady_clock::now() - stt).count() < 5);
-            ecal->readBlock(1, page);
-        }
-}
-
-int main(int argc, char **argv)
-{
-    using namespace std;
-    using namespace std::chrono;
-
-    COLLECT_MAIN_INFO();
-
-    cmdConf = new CmdLineConfig();
-    LocofsClient loco;
-
-    expectTrue(loco.mount(""));
-
-    printf("LocoFS Client mounted.\n");
-    fflush(stdout);
-    
-    string filename = "/test/0001";
-    expectTrue(loco.mkdir("/test", 0644));
-    expectTrue(loco.create(filename, 0644));
-    expectTrue(loco.open(filename, O_RDWR | O_CREAT));
-
-    const int N = cmdConf->_N;
-
-    srand(time(0));
-    const int M = cmdConf->_Size;
-    char buf[M];
-    for (int i = 0; i < M; ++i)
-        buf[i] = 'p';
-
-    d_info("start r/w...");
-
-    auto start = steady_clock::now();
-    for (int i = 0; i < N; ++i) {
-        expectTrue(loco.write(filename, buf, M, i * M));
-    }
-    auto end = steady_clock::now();
-    auto timespan = duration_cast<microseconds>(end - start).count();
-
-    printf("\n");
-    printf("Write %dKB: %.2lf us\n", M / 1024, (double)timespan / N);
-    //printf("Breakdown:\n");
-    //printf("- Boost CPU computation: %.2lf us\n", (double)boost_cpu_time / N);
-    //printf("- Metadata fetch RPC: %.2lf us\n", (double)meta_rpc_time / N);
-    printf("- Data RDMA: %.2lf us\n", (double)data_rdma_time_w / N);
-    //printf("\n");
-
-    loco.testRoundTrip(0);
-   
-    boost_cpu_time = 0;
-    meta_rpc_time = 0;
-
-    start = steady_clock::now();
-    for (int i = 0; i < N; ++i) {
-        loco.read(filename, buf, M, i * M);
-        if (errno) {
-            printf("failed at %d\n", i);
-            for (int i = 0; i < clusterConf->getClusterSize(); ++i) {
-                auto peerNode = (*clusterConf)[i];
-                if (peerNode.id != myNodeConf->id)
-                    continue;
-                loco.getECAL()->getRDMASocket()->verboseQP(peerNode.id);
-            }
-            break;
-        }
-    }
-    //printf("\n");
-    end = steady_clock::now();
-    timespan = duration_cast<microseconds>(end - start).count();
-
-    printf("Read %dKB: %.2lf us\n\n", M / 1024, (double)timespan / N);
-    //printf("Breakdown:\n");
-    //printf("- Boost CPU computation: %.2lf us\n", (double)boost_cpu_time / N);
-    //printf("- Metadata fetch RPC: %.2lf us\n", (double)meta_rpc_time / N);
-    //printf("- Data RDMA: %.2lf us\n", (double)data_rdma_time_r / N);
-    //printf("- Metadata update RPC: %.2lf us\n\n", (double)meta_upd_time_r / N);
-/*
-    const int thnum = cmdConf->_Thread;
-    if (thnum) {
-        std::thread ths[16];
-
-        start = steady_clock::now();
-        for (int i = 1; i <= thnum; ++i)
-            ths[i] = std::thread(thptWorker, &loco, true, 100000);
-        for (int i = 1; i <= thnum; ++i)
-            ths[i].join();
-        end = steady_clock::now();
-        timespan = duration_cast<milliseconds>(end - start).count();
-
-        double thpt = 1000 * 1.0 * thnum / timespan * 100000;
-        printf("%d thread(s): %.1lf\n\n", thnum, thpt);
-    }
-
-    // Test first-k read
-    auto stt = steady_clock::now();
-    decltype(stt) Begin, End;
-    std::vector<int> latw, latr;
-    size_t Cnt = 0;
-    int Trigger = 0;
-    ibv_wc wc[2];
-    
-    while (true) {
-        Begin = steady_clock::now();
-        int dur = duration_cast<seconds>(Begin - stt).count();
-
-        if (dur >= 20)
-            break;
-
-        ++Trigger;
-        if (Trigger == 10)
-            Trigger = 0;
-        
-        Begin = steady_clock::now();
-        loco.read(filename, buf, 4096, 0);
-        End = steady_clock::now();
-        //loco.getECAL()->getRDMASocket()->pollSendCompletion(wc);
-        if (!Trigger)
-            latr.push_back(duration_cast<microseconds>(End - Begin).count());
-    }
-
-    FILE *fout = fopen("log.txt", "w");
-    for (int i = 0; i < latr.size(); ++i)
-        fprintf(fout, "%d ", latr[i]);
-    fprintf(fout, "\n");
-    fclose(fout);
-*/
-    loco.stop();
-
-    return 0;
-}
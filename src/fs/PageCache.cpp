@@ -0,0 +1,133 @@
+#include <fs/PageCache.h>
+
+/**
+ * Copy [off, off + len) of a cached page to `dst`.
+ * Waits if the page is being prefetched.
+ * @return false if the page is not cached (or was dropped while waiting).
+ */
+bool PageCache::read(uint64_t blkno, char *dst, int64_t off, int64_t len)
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    auto it = entries.find(blkno);
+    while (it != entries.end() && !it->second.ready) {
+        filled.wait(lock);
+        it = entries.find(blkno);
+    }
+    if (it == entries.end())
+        return false;
+
+    Entry &entry = it->second;
+    memcpy(dst, entry.page.page.data + off, len);
+    entry.referenced = true;
+    lru.splice(lru.begin(), lru, entry.lruPos);
+    return true;
+}
+
+/**
+ * Insert a pending entry for a block of the file tagged `file` that is about to be prefetched.
+ * @return false if the block is already cached or pending.
+ */
+bool PageCache::reserve(uint64_t blkno, uint64_t file)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    if (entries.find(blkno) != entries.end())
+        return false;
+    if (entries.size() >= capacity)
+        evict();
+
+    Entry &entry = entries[blkno];
+    entry.file = file;
+    lru.push_front(blkno);
+    entry.lruPos = lru.begin();
+    return true;
+}
+
+/** Complete a pending entry and wake up its waiters. */
+void PageCache::fill(uint64_t blkno, const ECAL::Page &page)
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto it = entries.find(blkno);
+        if (it != entries.end()) {
+            if (it->second.stale) {
+                ++wasted;
+                erase(it);
+            }
+            else {
+                it->second.page = page;
+                it->second.ready = true;
+            }
+        }
+    }
+    filled.notify_all();
+}
+
+/** Drop a block after this client has written it. */
+void PageCache::invalidate(uint64_t blkno)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    auto it = entries.find(blkno);
+    if (it == entries.end())
+        return;
+    if (!it->second.ready)
+        it->second.stale = true;
+    else {
+        if (!it->second.referenced)
+            ++wasted;
+        erase(it);
+    }
+}
+
+/**
+ * Drop the blocks of a file, e.g. when it is opened again, since other clients may have
+ * written it meanwhile. Pending entries are dropped when they are filled.
+ */
+void PageCache::invalidateFile(uint64_t file)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    for (auto it = entries.begin(); it != entries.end(); ) {
+        auto cur = it++;
+        if (cur->second.file != file)
+            continue;
+        if (!cur->second.ready)
+            cur->second.stale = true;
+        else {
+            if (!cur->second.referenced)
+                ++wasted;
+            erase(cur);
+        }
+    }
+}
+
+/** Drop all ready entries. Pending entries are dropped when they are filled. */
+void PageCache::clear()
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    for (auto it = entries.begin(); it != entries.end(); ) {
+        auto cur = it++;
+        if (cur->second.ready)
+            erase(cur);
+        else
+            cur->second.stale = true;
+    }
+}
+
+/** Evict the least recently used ready entry, if any. Caller holds `mutex`. */
+void PageCache::evict()
+{
+    for (auto pos = lru.rbegin(); pos != lru.rend(); ++pos) {
+        auto it = entries.find(*pos);
+        if (it->second.ready) {
+            if (!it->second.referenced)
+                ++wasted;
+            erase(it);
+            return;
+        }
+    }
+}
+
+void PageCache::erase(std::unordered_map<uint64_t, Entry>::iterator it)
+{
+    lru.erase(it->second.lruPos);
+    entries.erase(it);
+}
@@ -29,7 +29,16 @@ void contFunc(void *context, void *tag)
 
     //d_info("contFunc triggered, response from %d", static_cast<int>(idx));
 
-    netif->locks[idx].complete();
+    auto &locker = netif->locks[idx];
+    if (locker.async) {
+        if (reinterpret_cast<PureValueResponse *>(locker.respBuf.buf)->value != 0)
+            d_warn("asynchronous RPC (locker %d) failed", static_cast<int>(idx));
+        netif->rpc->free_msg_buffer(locker.reqBuf);
+        locker.async = false;
+        --netif->asyncInflight;
+        netif->bitmap.freeBit(idx);
+    }
+    locker.complete();
 }
 
 void dummyContFunc(void *, void *)
@@ -86,4 +95,5 @@ void sendResponse(erpc::ReqHandle *reqHandle, void *context)
 {
     auto *netif = reinterpret_cast<NetworkInterface *>(context);
     netif->getRPC()->enqueue_response(reqHandle, &reqHandle->pre_resp_msgbuf);
+    netif->onResponse();
 }
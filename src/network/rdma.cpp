@@ -1,6 +1,7 @@
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
+#include <random>
 #include <unistd.h>
 #include <sys/poll.h>
 #include <rdma/rdma_verbs.h>
@@ -9,7 +10,19 @@
 #include <debug.hpp>
 #include <network/rdma.hpp>
 
-RDMASocket::RDMASocket()
+/**
+ * Start listening, and connecting to peers in the background.
+ * Peers are connected to in parallel, and nothing waits for them: the first use of a peer
+ * (isPeerAlive, sendMessage) waits for its connection, and starts it if there was none yet.
+ * Unless LAZY_CONNECT is set, connections to all peers with a smaller ID are started right away.
+ * Peers that failed are reconnected to in the background: nobody waits for them.
+ * My heartbeat counter is bumped whatever HEARTBEAT_LEASE_US, so that peers with a lease
+ * never declare me dead for lack of one. With HEARTBEAT_LEASE_US, peers are also declared
+ * dead when their heartbeat stops.
+ * A peer is only admitted to reads and writes at once on its first connection. One whose
+ * connection is lost has missed writes, and is fenced until it is rebuilt (see PeerAdmission).
+ */
+RDMASocket::RDMASocket() : peers(clusterConf ? clusterConf->getNodeIdBound() : 0)
 {
     if (!cmdConf || !clusterConf || !memConf || !myNodeConf) {
         d_err("all configurations should be initialized!");
@@ -17,23 +30,37 @@ RDMASocket::RDMASocket()
     }
 
     shouldRun = true;
-    nodeIDBuf = myNodeConf->id;
-
+    setPollSpinBudget(cmdConf->pollSpinUs);
+    statsEnabled = cmdConf->rdmaStats;
+    nsPerTick = TscClock::nsPerTick();
+    nextDump = std::chrono::steady_clock::now() + std::chrono::seconds(cmdConf->rdmaStatsDumpSec);
+    stagingSlots = cmdConf->stagingSlots;
+    regionSize = Block4K::capacity * stagingSlots + RDMAConnection::ExtentRegionSize;
+
+    /* Bind to the IB device, so that resources can be built before any connection */
     sockaddr_in addr;
     memset(&addr, 0, sizeof(sockaddr));
     addr.sin_family = AF_INET;
     addr.sin_port = htons(cmdConf->tcpPort);
+    expectTrue(inet_pton(AF_INET, myNodeConf->ibDevIPAddrStr.c_str(), &addr.sin_addr) == 1);
 
-    for (int i = 0; i < MAX_NODES; ++i) {
+    for (int i = 0; i < (int)peers.size(); ++i) {
+        peers[i].peerId = i;
+        peers[i].state = PeerState::Idle;
         peers[i].cmId = nullptr;
         peers[i].qp = nullptr;
-        peers[i].sendMR = nullptr;
-        peers[i].recvMR = nullptr;
-        peers[i].writeMR = nullptr;
-        peers[i].readMR = nullptr;
+        peers[i].forcedConnStat = 0;
+        peers[i].regionMR = nullptr;
         peers[i].sendRegion = nullptr;
         peers[i].recvRegion = nullptr;
-        peers[i].connected = false;
+        peers[i].writeRegion = nullptr;
+        peers[i].readRegion = nullptr;
+        peers[i].retrying = false;
+        peers[i].inflight = 1ULL << 48;
+        peers[i].wordReads = 0;
+        peers[i].admission = PeerAdmission::Fenced;
+        peers[i].fencedIncarnation = 0;
+        peers[i].missedWrites = false;
     }
 
     expectNonZero(ec = rdma_create_event_channel());
@@ -46,76 +73,45 @@ RDMASocket::RDMASocket()
 
     expectZero(rdma_create_id(ec, &listener, nullptr, RDMA_PS_TCP));
     expectZero(rdma_bind_addr(listener, reinterpret_cast<sockaddr *>(&addr)));
-    expectZero(rdma_listen(listener, MAX_NODES));
+    expectZero(rdma_listen(listener, clusterConf->getClusterSize()));
+    buildResources(listener->verbs);
+
+    /* Tells my restarts apart, so that peers know whether I was rebuilt since they fenced me */
+    std::random_device rd;
+    myIncarnation = (((uint64_t)rd() << 32 | rd()) ^ TscClock::now()) & ~PhaseMask;
+    if (!myIncarnation)
+        myIncarnation = PhaseMask + 1;
+    setPhase(cmdConf->recover ? NodePhase::Recovering : NodePhase::Synced);
 
     int port = ntohs(rdma_get_src_port(listener));
     expectTrue(port == cmdConf->tcpPort);
     d_info("listening on port: %d", port);
 
-    char portStr[16];
-    snprintf(portStr, 16, "%d", port);
-
-    /* Connect to all peers with id < myId, or all other nodes if recovering */
-    for (int i = 0; i < clusterConf->getClusterSize(); ++i) {
-        auto peerNode = (*clusterConf)[i];
-        if (!cmdConf->recover && peerNode.id >= myNodeConf->id)
-            continue;
-
-        addrinfo *ai;
-        getaddrinfo(peerNode.ibDevIPAddrStr.c_str(), portStr, nullptr, &ai);
-
-        expectZero(rdma_create_id(ec, &peers[i].cmId, nullptr, RDMA_PS_TCP));
-        cm2id[(uint64_t)peers[i].cmId] = i;
-        expectZero(rdma_resolve_addr(peers[i].cmId, nullptr, ai->ai_addr, ADDR_RESOLVE_TIMEOUT));
-
-        freeaddrinfo(ai);
-    }
-
     ecPoller = std::thread(&RDMASocket::listenRDMAEvents, this);
+    heartbeater = std::thread(&RDMASocket::runHeartbeats, this);
 
-    d_info("start waiting...");
-    int expectedConns = clusterConf->getClusterSize() - 1;
-    
-    std::unique_lock<std::mutex> lock(stopSpinMutex);
-    //ssmCondVar.wait(lock, [&, this](){ return this->incomingConns > expectedConns; });
-    while (incomingConns < expectedConns) {
-        ssmCondVar.wait(lock);
-        d_info("ctor waken up, connections %d/%d", incomingConns, expectedConns);
-    }
-
-    writeLog.resize(WRITE_LOG_SIZE);
-    d_info("successfully created RDMASocket!");
-
-    for (int i = 0; i < clusterConf->getClusterSize(); ++i) {
-        int peerId = (*clusterConf)[i].id;
-        if (peerId == myNodeConf->id)
-            continue;
-        verboseQP(peerId);
-
-        memset(peers[peerId].writeRegion, 'A', 4096);
-        postWrite(peerId, 0, (uintptr_t)peers[peerId].writeRegion, 4096);
-    }
-
-    ibv_wc wc[2];
-    for (int i = 0; i < clusterConf->getClusterSize(); ++i) {
-        int peerId = (*clusterConf)[i].id;
-        if (peerId == myNodeConf->id)
-            continue;
-        pollSendCompletion(wc);
-        d_info("tested remote write with peer %d", peerId);
+    /* Connect to all peers with id < myId, or all other nodes if recovering */
+    if (!cmdConf->lazyConnect) {
+        std::lock_guard<std::mutex> lock(connMutex);
+        for (int i = 0; i < clusterConf->getClusterSize(); ++i) {
+            int peerId = (*clusterConf)[i].id;
+            if (peerId != myNodeConf->id && (cmdConf->recover || peerId < myNodeConf->id))
+                connect(peerId);
+        }
     }
-    d_info("written char = %d", *(reinterpret_cast<char *>(memConf->getMemory())));
 
     initialized = true;
+    d_info("successfully created RDMASocket!");
 }
 
 RDMASocket::~RDMASocket()
 {
     stopListenerAndJoin();
 
-    for (int i = 0; i < MAX_NODES; ++i)
-        if (peers[i].cmId)
-            destroyConnection(peers[i].cmId);
+    for (int i = 0; i < (int)peers.size(); ++i)
+        destroyConnection(i);
+    for (auto *cmId : doomedIds)
+        rdma_destroy_id(cmId);
     for (int i = 0; i < MAX_CQS; ++i) {
         if (cq[i])
             ibv_destroy_cq(cq[i]);
@@ -125,6 +121,16 @@ RDMASocket::~RDMASocket()
     
     if (mr)
         ibv_dereg_mr(mr);
+    slab.reset();
+    if (creditMR)
+        ibv_dereg_mr(creditMR);
+    delete[] creditArea;
+    if (heartbeatMR)
+        ibv_dereg_mr(heartbeatMR);
+    delete[] heartbeatArea;
+    if (peerWordsMR)
+        ibv_dereg_mr(peerWordsMR);
+    delete[] peerWords;
     if (pd)
         ibv_dealloc_pd(pd);
     if (listener)
@@ -147,6 +153,8 @@ void RDMASocket::stopListenerAndJoin()
         return;
 
     shouldRun = false;
+    if (heartbeater.joinable())
+        heartbeater.join();
     /*
     if (ecPoller.joinable())
         ecPoller.join();
@@ -170,6 +178,11 @@ void RDMASocket::listenRDMAEvents()
     handlers[RDMA_CM_EVENT_CONNECT_REQUEST] = &RDMASocket::onConnectionRequest;
     handlers[RDMA_CM_EVENT_ESTABLISHED] = &RDMASocket::onConnectionEstablished;
     handlers[RDMA_CM_EVENT_DISCONNECTED] = &RDMASocket::onDisconnected;
+    handlers[RDMA_CM_EVENT_ADDR_ERROR] = &RDMASocket::onConnectionFailed;
+    handlers[RDMA_CM_EVENT_ROUTE_ERROR] = &RDMASocket::onConnectionFailed;
+    handlers[RDMA_CM_EVENT_CONNECT_ERROR] = &RDMASocket::onConnectionFailed;
+    handlers[RDMA_CM_EVENT_UNREACHABLE] = &RDMASocket::onConnectionFailed;
+    handlers[RDMA_CM_EVENT_REJECTED] = &RDMASocket::onConnectionFailed;
 
     rdma_cm_event *event;
     struct pollfd pfd = {
@@ -181,6 +194,10 @@ void RDMASocket::listenRDMAEvents()
         int ret = 0;
         do { 
             ret = poll(&pfd, 1, EC_POLL_TIMEOUT); 
+            if (cmdConf->rdmaStatsDumpSec > 0 && std::chrono::steady_clock::now() >= nextDump) {
+                dumpStats(stdout);
+                nextDump += std::chrono::seconds(cmdConf->rdmaStatsDumpSec);
+            }
         } while (shouldRun && ret == 0);
         if (!shouldRun)
             break;
@@ -192,14 +209,97 @@ void RDMASocket::listenRDMAEvents()
         else
             d_warn("RDMA CM event type %d not handled", (int)event->event);
         rdma_ack_cm_event(event);
+
+        /* IDs cannot be destroyed while one of their events is not acked */
+        for (auto *cmId : doomedIds)
+            rdma_destroy_id(cmId);
+        doomedIds.clear();
     }
 
     d_info("RDMASocket has stopped listening EC events.");
 }
 
+/**
+ * Start connecting to a peer, as a client.
+ * @note connMutex must be held.
+ */
+void RDMASocket::connect(int peerId)
+{
+    auto *peer = &peers[peerId];
+    if (peer->state == PeerState::Connecting || peer->state == PeerState::Connected)
+        return;
+    if (peer->state == PeerState::Failed)
+        peer->retrying = true;
+
+    NodeConfig conf = clusterConf->findConfById(peerId);
+    char portStr[16];
+    snprintf(portStr, 16, "%d", cmdConf->tcpPort);
+    addrinfo *ai;
+    if (getaddrinfo(conf.ibDevIPAddrStr.c_str(), portStr, nullptr, &ai)) {
+        d_err("cannot resolve peer %d (%s)", peerId, conf.ibDevIPAddrStr.c_str());
+        peer->state = PeerState::Failed;
+        peer->retryAt = std::chrono::steady_clock::now() + std::chrono::milliseconds(CONNECT_RETRY_INTERVAL);
+        return;
+    }
+
+    rdma_cm_id *cmId;
+    expectZero(rdma_create_id(ec, &cmId, peer, RDMA_PS_TCP));
+    peer->cmId = cmId;
+    peer->outgoing = true;
+    peer->state = PeerState::Connecting;
+    expectZero(rdma_resolve_addr(cmId, nullptr, ai->ai_addr, ADDR_RESOLVE_TIMEOUT));
+    freeaddrinfo(ai);
+}
+
+/**
+ * Wait for the connection with a peer, starting it if needed.
+ * Does not wait in the CM event thread (e.g. peer death handlers), which completes connections.
+ */
+bool RDMASocket::ensureConnected(int peerId)
+{
+    auto *peer = &peers[peerId];
+    if (Likely(peer->state == PeerState::Connected))
+        return true;
+    if (std::this_thread::get_id() == ecPoller.get_id())
+        return false;
+
+    std::unique_lock<std::mutex> lock(connMutex);
+    if (peer->state == PeerState::Idle ||
+        (peer->state == PeerState::Failed && std::chrono::steady_clock::now() >= peer->retryAt))
+        connect(peerId);
+    if (peer->retrying)
+        return false;
+    connCondVar.wait_for(lock, std::chrono::milliseconds(CONNECT_TIMEOUT),
+                         [peer] { return peer->state != PeerState::Connecting; });
+    return peer->state == PeerState::Connected;
+}
+
+/**
+ * Peer of a CM ID, from its context, or -1 if it is stale (its connection attempt was
+ * abandoned, so that the peer has moved on to another ID).
+ */
+int RDMASocket::findPeer(rdma_cm_id *cmId)
+{
+    auto *peer = reinterpret_cast<RDMAConnection *>(cmId->context);
+    if (!peer || peer->cmId != cmId)
+        return -1;
+    return peer->peerId;
+}
+
+/** Forget a CM ID whose connection attempt was abandoned, on one of its events */
+void RDMASocket::dropStaleId(rdma_cm_id *cmId)
+{
+    doomedIds.push_back(cmId);
+}
+
 /** As a client, handle when remote address is resolved */
 void RDMASocket::onAddrResolved(rdma_cm_event *event)
 {
+    std::lock_guard<std::mutex> lock(connMutex);
+    if (findPeer(event->id) < 0) {
+        dropStaleId(event->id);
+        return;
+    }
     buildConnection(event->id);
     expectZero(rdma_resolve_route(event->id, ADDR_RESOLVE_TIMEOUT));
 }
@@ -207,87 +307,296 @@ void RDMASocket::onAddrResolved(rdma_cm_event *event)
 /** As a client, handle when connection route is resolved */
 void RDMASocket::onRouteResolved(rdma_cm_event *event)
 {
+    std::lock_guard<std::mutex> lock(connMutex);
+    int peerId = findPeer(event->id);
+    if (peerId < 0) {
+        dropStaleId(event->id);
+        return;
+    }
+
     rdma_conn_param param;
-    buildConnParam(&param);
+    ConnPrivateData data;
+    buildConnParam(&param, &data, peerId);
     expectZero(rdma_connect(event->id, &param));
 }
 
-/** As a server, handle when an incoming connection request appears */
+/**
+ * As a server, handle when an incoming connection request appears.
+ * If both nodes are connecting to each other, the connection started by the smaller ID wins.
+ */
 void RDMASocket::onConnectionRequest(rdma_cm_event *event)
 {
-    auto *nodeIdBuf = reinterpret_cast<const uint32_t *>(event->param.conn.private_data);
-    cm2id[(uint64_t)event->id] = nodeIdBuf[0];
+    auto *data = reinterpret_cast<const ConnPrivateData *>(event->param.conn.private_data);
+    if (!data || event->param.conn.private_data_len < sizeof(ConnPrivateData) || data->nodeId >= peers.size()) {
+        d_err("connection request without valid private data");
+        rdma_reject(event->id, nullptr, 0);
+        doomedIds.push_back(event->id);
+        return;
+    }
+    int peerId = data->nodeId;
+    auto *peer = &peers[peerId];
+
+    std::lock_guard<std::mutex> lock(connMutex);
+    if (peer->state == PeerState::Connecting && peer->outgoing) {
+        if (myNodeConf->id < peerId) {
+            d_info("rejected connection from peer %d, which I am connecting to", peerId);
+            rdma_reject(event->id, nullptr, 0);
+            doomedIds.push_back(event->id);
+            return;
+        }
+        abandonConnection(peerId);
+    }
+    else if (peer->cmId) {
+        /* The peer has restarted before its disconnection was noticed */
+        fencePeer(peerId);
+        abandonConnection(peerId);
+    }
+
+    event->id->context = peer;
+    peer->cmId = event->id;
+    peer->outgoing = false;
+    peer->state = PeerState::Connecting;
     buildConnection(event->id);
+    setRemote(peerId, data);
 
     rdma_conn_param param;
-    buildConnParam(&param);
-
+    ConnPrivateData myData;
+    buildConnParam(&param, &myData, peerId);
     expectZero(rdma_accept(event->id, &param));
 }
 
 /* As a server or client, handle when a connection is established */
 void RDMASocket::onConnectionEstablished(rdma_cm_event *event)
 {
-    RDMAConnection *peer = peers + cm2id[(uint64_t)event->id];
-    expectTrue(peer == reinterpret_cast<RDMAConnection *>(event->id->context));
-
-    /* Send MR to peer */
-    auto *mrMsg = reinterpret_cast<Message *>(peer->sendRegion);
-    mrMsg->type = Message::MESG_REMOTE_MR;
-    memcpy(&mrMsg->data.mr, mr, sizeof(ibv_mr));
-    postSend(peer->peerId, sizeof(Message));
-
-    /*
-     * If I am already initialized, then this must be an incoming connection from another node.
-     * Therefore, I won't race for this MR with RPC listener process.
-     */
-    if (initialized)
+    std::unique_lock<std::mutex> lock(connMutex);
+    int peerId = findPeer(event->id);
+    if (peerId < 0) {
+        rdma_disconnect(event->id);
         return;
+    }
 
-    /*
-     * Immediately (and blockingly) poll this RDMA recv.
-     * Because the connection is already established, we expect not blocking very long.
-     * 
-     * Note that here, the RPCInterface has not started, so this poll will not race with it.
-     */
-    ibv_wc wc[2];
-    expectPositive(pollRecvCompletion(wc));
-    
-    if (wc->status != IBV_WC_SUCCESS) {
-        d_err("wc->status = %d", (int)wc->status);
-        exit(-1);
+    auto *peer = &peers[peerId];
+    if (peer->outgoing)
+        setRemote(peerId, reinterpret_cast<const ConnPrivateData *>(event->param.conn.private_data));
+    peer->retrying = false;
+    peer->state = PeerState::Connected;
+    d_info("successfully connected with peer: %d (%p, rkey = %u)",
+        peerId, (void *)peer->peerMR.addr, peer->peerMR.rkey);
+
+    /* Later connections, or peers that missed writes, wait for the failure detector to admit them */
+    uint64_t status = peerWords[peerId * PeerWords + HbStatus];
+    if (peer->admission == PeerAdmission::Fenced && !peer->fencedIncarnation && !peer->missedWrites &&
+        (status & PhaseMask) == (uint64_t)NodePhase::Synced) {
+        peer->admission = PeerAdmission::Admitted;
+        heartbeatArea[HbWords + peerId] = status & ~PhaseMask;
     }
 
-    auto *msg = reinterpret_cast<Message *>(peer->recvRegion);
-    if (msg->type == Message::MESG_REMOTE_MR) {
-        memcpy(&peer->peerMR, &msg->data.mr, sizeof(ibv_mr));
-        peer->connected = true;
-        d_info("successfully connected with peer: %d (%p, rkey = %u)",
-            peer->peerId, (void *)peer->peerMR.addr, peer->peerMR.rkey);
+    lock.unlock();
+    connCondVar.notify_all();
+}
 
-        ++incomingConns;
-        {
-            std::unique_lock<std::mutex> lock(stopSpinMutex);
-            ssmCondVar.notify_one();
-        }
-    }
-    else {
-        d_err("RDMA recv intended for MR received some other thing");
-        exit(-1);
+/** As a client, handle when a connection attempt fails or is rejected */
+void RDMASocket::onConnectionFailed(rdma_cm_event *event)
+{
+    std::unique_lock<std::mutex> lock(connMutex);
+    int peerId = findPeer(event->id);
+    if (peerId < 0) {
+        /* Abandoned attempt, e.g. rejected in favour of the peer's own connection */
+        dropStaleId(event->id);
+        return;
     }
+
+    d_warn("cannot connect to peer %d (CM event %d)", peerId, (int)event->event);
+    destroyConnection(peerId);
+    peers[peerId].state = PeerState::Failed;
+    peers[peerId].retryAt = std::chrono::steady_clock::now() + std::chrono::milliseconds(CONNECT_RETRY_INTERVAL);
+
+    lock.unlock();
+    connCondVar.notify_all();
 }
 
 /** As a server or client, handle when a connection is lost */
 void RDMASocket::onDisconnected(rdma_cm_event *event)
 {
-    int peerId = cm2id[(uint64_t)event->id];
+    std::unique_lock<std::mutex> lock(connMutex);
+    int peerId = findPeer(event->id);
+    if (peerId < 0) {
+        dropStaleId(event->id);
+        return;
+    }
     d_warn("peer %d has disconnected!", peerId);
 
-    if (degraded++ == 0) {
-        d_info("write log clear");
-        writeLog.clear();
+    fencePeer(peerId);
+    flushPeer(peerId);
+    destroyConnection(peerId);
+    peers[peerId].state = PeerState::Failed;
+    peers[peerId].retryAt = std::chrono::steady_clock::now() + std::chrono::milliseconds(CONNECT_RETRY_INTERVAL);
+
+    lock.unlock();
+    connCondVar.notify_all();
+    if (onPeerDeath)
+        onPeerDeath(peerId);
+}
+
+/**
+ * Declare a connected peer dead, e.g. as it missed its heartbeat lease: it is fenced, one-sided
+ * operations in flight to it complete with flush errors at once, and the connection is torn
+ * down. It is reconnected later, in the background, but stays fenced until it is rebuilt: a
+ * peer that was only slow must be restarted with RECOVER too.
+ */
+void RDMASocket::declareDead(int peerId)
+{
+    std::unique_lock<std::mutex> lock(connMutex);
+    auto *peer = &peers[peerId];
+    if (peer->state != PeerState::Connected)
+        return;
+    d_warn("peer %d is declared dead", peerId);
+
+    /* Its DISCONNECTED event is then stale, and only destroys the CM ID */
+    fencePeer(peerId);
+    abandonConnection(peerId);
+    peer->state = PeerState::Failed;
+    peer->retryAt = std::chrono::steady_clock::now() + std::chrono::milliseconds(CONNECT_RETRY_INTERVAL);
+
+    lock.unlock();
+    connCondVar.notify_all();
+    if (onPeerDeath)
+        onPeerDeath(peerId);
+}
+
+/**
+ * Failure detector: bumps my heartbeat counter every HEARTBEAT_US, and reads the heartbeat
+ * words of connected peers with one-sided reads, at most one round in flight per peer: of
+ * all of them with a lease, else of those not admitted, or while I am not in sync.
+ * With a lease, a peer whose counter has not moved for HEARTBEAT_LEASE_US is declared dead,
+ * even if its QP looks fine (e.g. its node hangs, or its NIC still answers while its CPU does
+ * not). Rounds this thread itself was late for are not held against peers. Leases should
+ * be a few HEARTBEAT_US at least: peers only slow (e.g. descheduled) are declared dead too.
+ * Without a lease, peers are only found dead when their connection breaks, which may take the
+ * whole RDMA transport timeout.
+ * Fenced peers are admitted to writes once they catch up, and to reads once they are in sync,
+ * if they were rebuilt since they were fenced. Meanwhile, my foreground p99 is published to
+ * them, for their rebuild to back off on.
+ */
+void RDMASocket::runHeartbeats()
+{
+    using namespace std::chrono;
+    auto interval = microseconds(cmdConf->heartbeatUs), lease = microseconds(cmdConf->heartbeatLeaseUs);
+    std::vector<uint64_t> lastBeat(peers.size(), 0);
+    std::vector<steady_clock::time_point> lastProgress(peers.size(), steady_clock::now());
+    std::vector<int> dead;
+    std::vector<Admission> admits;
+    auto lastRound = steady_clock::now();
+    bool reading = false;
+
+    while (shouldRun) {
+        std::this_thread::sleep_for(interval);
+        auto now = steady_clock::now();
+        bool late = now - lastRound > lease / 2;
+        lastRound = now;
+        ++heartbeatArea[HbBeat];
+        /* Completions of heartbeat reads may sit there if nobody else polls */
+        if (reading)
+            drainSendCQ();
+        NodePhase phase = getPhase();
+
+        std::unique_lock<std::mutex> lock(connMutex);
+        bool unadmitted = false;
+        reading = false;
+        for (auto &peer : peers) {
+            int id = peer.peerId;
+            if (id == myNodeConf->id || peer.state != PeerState::Connected || peer.forcedConnStat) {
+                lastProgress[id] = now;
+                peer.wordReads = 0;
+                continue;
+            }
+            uint64_t *words = peerWords + id * PeerWords;
+            if (lease.count() > 0) {
+                uint64_t beat = __atomic_load_n(words + HbBeat, __ATOMIC_RELAXED);
+                if (beat != lastBeat[id] || late) {
+                    lastBeat[id] = beat;
+                    lastProgress[id] = now;
+                }
+                else if (now - lastProgress[id] > lease) {
+                    dead.push_back(id);
+                    continue;
+                }
+            }
+            else if (phase == NodePhase::Synced && peer.admission == PeerAdmission::Admitted)
+                continue;
+
+            if (peer.admission != PeerAdmission::Admitted) {
+                unadmitted = true;
+                uint64_t status = __atomic_load_n(words + HbStatus, __ATOMIC_RELAXED);
+                uint64_t incarnation = status & ~PhaseMask;
+                bool catchingUp = (status & PhaseMask) == (uint64_t)NodePhase::CatchingUp &&
+                                  peer.admission == PeerAdmission::Fenced;
+                bool synced = (status & PhaseMask) == (uint64_t)NodePhase::Synced &&
+                              (incarnation != peer.fencedIncarnation || peer.admission == PeerAdmission::WritesOnly);
+                if (catchingUp || synced) {
+                    /* Written to first, so that no write skips it once the admit handler returns */
+                    peer.admission = PeerAdmission::WritesOnly;
+                    admits.push_back({ id, incarnation, synced });
+                }
+            }
+
+            reading = true;
+            if (peer.wordReads > 0)
+                continue;
+            ++peer.wordReads;
+            if (rdma_post_read(peer.cmId, reinterpret_cast<void *>(WRID(id, SP_HEARTBEAT_READ)),
+                               words, HbWords * sizeof(uint64_t), peerWordsMR, 0,
+                               peer.heartbeatAddr, peer.heartbeatRkey))
+                --peer.wordReads;
+            if (phase != NodePhase::CatchingUp)
+                continue;
+            ++peer.wordReads;
+            if (rdma_post_read(peer.cmId, reinterpret_cast<void *>(WRID(id, SP_HEARTBEAT_READ)),
+                               words + HbWords, sizeof(uint64_t), peerWordsMR, 0,
+                               peer.heartbeatAddr + (HbWords + myNodeConf->id) * sizeof(uint64_t), peer.heartbeatRkey))
+                --peer.wordReads;
+        }
+        lock.unlock();
+
+        for (int id : dead) {
+            d_warn("peer %d missed its heartbeat lease (%ld us)", id, (long)lease.count());
+            declareDead(id);
+        }
+        dead.clear();
+        admitPeers(admits);
+        admits.clear();
+        uint64_t p99 = (unadmitted && p99Source) ? p99Source() : 0;
+        __atomic_store_n(heartbeatArea + HbP99, p99, __ATOMIC_RELAXED);
+    }
+}
+
+/**
+ * Admit peers to reads and writes (`full`) or to writes only, once the admit handler agrees,
+ * unless they were fenced again meanwhile. Peers learn that I write to them only then, after
+ * the writes that skipped them.
+ */
+void RDMASocket::admitPeers(const std::vector<Admission> &admits)
+{
+    for (auto &admit : admits) {
+        bool agreed = !onPeerAdmit || onPeerAdmit(admit.peerId, admit.full);
+        std::lock_guard<std::mutex> lock(connMutex);
+        auto *peer = &peers[admit.peerId];
+        uint64_t status = peerWords[admit.peerId * PeerWords + HbStatus];
+        if (peer->state != PeerState::Connected || peer->admission != PeerAdmission::WritesOnly ||
+            (status & ~PhaseMask) != admit.incarnation)
+            continue;
+        if (!agreed) {
+            d_warn("peer %d stays fenced until it is rebuilt (restarted with RECOVER)", admit.peerId);
+            peer->fencedIncarnation = admit.incarnation;
+            peer->admission = PeerAdmission::Fenced;
+            heartbeatArea[HbWords + admit.peerId] = 0;
+            continue;
+        }
+        heartbeatArea[HbWords + admit.peerId] = admit.incarnation;
+        if (admit.full)
+            peer->admission = PeerAdmission::Admitted;
+        d_info("peer %d is admitted to %s", admit.peerId, admit.full ? "reads and writes" : "writes");
     }
-    destroyConnection(event->id);
 }
 
 void RDMASocket::buildResources(ibv_context *ctx)
@@ -303,16 +612,49 @@ void RDMASocket::buildResources(ibv_context *ctx)
     this->ctx = ctx;
     expectNonZero(pd = ibv_alloc_pd(this->ctx));
     for (int i = 0; i < MAX_CQS; ++i) {
-        //expectNonZero(compChannel[i] = ibv_create_comp_channel(this->ctx));
-        cq[i] = ibv_create_cq(this->ctx, MAX_QP_DEPTH, nullptr, nullptr, 0);
-        //expectZero(ibv_req_notify_cq(cq[i], 0));
+        /* Channels are polled with a timeout, so that waits can notice shouldRun=false */
+        expectNonZero(compChannel[i] = ibv_create_comp_channel(this->ctx));
+        int flags = fcntl(compChannel[i]->fd, F_GETFL);
+        if (fcntl(compChannel[i]->fd, F_SETFL, flags | O_NONBLOCK) < 0)
+            d_err("cannot change completion channel fd to non-blocking");
+        cq[i] = ibv_create_cq(this->ctx, MAX_QP_DEPTH, nullptr, compChannel[i], 0);
     }
     
-    int mrFlags = IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_REMOTE_READ | IBV_ACCESS_REMOTE_WRITE;
+    int mrFlags = IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_REMOTE_READ | IBV_ACCESS_REMOTE_WRITE |
+                  IBV_ACCESS_REMOTE_ATOMIC;
     expectNonZero(mr = ibv_reg_mr(pd, memConf->getMemory(), memConf->getCapacity(), mrFlags));
     d_info("Major MR: len = %lu, rkey = %u", mr->length, mr->rkey);
+    slab = std::make_unique<RegisteredSlab>(pd, (size_t)cmdConf->slabChunkMB << 20, IBV_ACCESS_LOCAL_WRITE);
+    auto block = slab->alloc(RDMA_ATOMIC_RESULTS * sizeof(uint64_t));
+    atomicResults = reinterpret_cast<uint64_t *>(block.addr);
+    atomicMR = block.mr;
+    block = slab->alloc(sizeof(uint64_t));
+    fenceSink = reinterpret_cast<uint64_t *>(block.addr);
+    fenceMR = block.mr;
+
+    ibv_device_attr attr;
+    expectZero(ibv_query_device(this->ctx, &attr));
+    globalAtomics = (attr.atomic_cap == IBV_ATOMIC_GLOB);
+    if (attr.atomic_cap == IBV_ATOMIC_NONE)
+        d_warn("device %s does not support RDMA atomics", ctx->device->name);
+
+    creditArea = new uint64_t[2 * peers.size()]();
+    int creditFlags = IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_REMOTE_WRITE;
+    expectNonZero(creditMR = ibv_reg_mr(pd, creditArea, 2 * peers.size() * sizeof(uint64_t), creditFlags));
+
+    heartbeatArea = new uint64_t[HbWords + peers.size()]();
+    int heartbeatFlags = IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_REMOTE_READ;
+    expectNonZero(heartbeatMR = ibv_reg_mr(pd, heartbeatArea, (HbWords + peers.size()) * sizeof(uint64_t), heartbeatFlags));
+    peerWords = new uint64_t[PeerWords * peers.size()]();
+    expectNonZero(peerWordsMR = ibv_reg_mr(pd, peerWords, PeerWords * peers.size() * sizeof(uint64_t), IBV_ACCESS_LOCAL_WRITE));
 }
 
+/**
+ * Build the QP of a connection (attempt) with a peer.
+ * Message and staging regions are carved out of the slab once per peer, and reused by later
+ * connections.
+ * @note connMutex must be held.
+ */
 void RDMASocket::buildConnection(rdma_cm_id *cmId)
 {
     buildResources(cmId->verbs);
@@ -330,60 +672,104 @@ void RDMASocket::buildConnection(rdma_cm_id *cmId)
 
     expectZero(rdma_create_qp(cmId, pd, &qp_init_attr));
 
-    int peerId = cm2id[(uint64_t)cmId];
-    RDMAConnection *peer = peers + peerId;
-    peer->peerId = peerId;
-    peer->cmId = cmId;
+    auto *peer = reinterpret_cast<RDMAConnection *>(cmId->context);
+    int peerId = peer->peerId;
     peer->qp = cmId->qp;
-    peer->connected = false;
     peer->forcedConnStat = 0;
-    peer->sendRegion = new uint8_t[RDMA_BUF_SIZE];
-    peer->recvRegion = new uint8_t[RDMA_BUF_SIZE];
-    peer->writeRegion = new uint8_t[Block4K::capacity * RDMAConnection::NConcurrency];
-    peer->readRegion = new uint8_t[Block4K::capacity * RDMAConnection::NConcurrency];
-
-    expectNonZero(peer->sendMR = ibv_reg_mr(pd, peer->sendRegion, RDMA_BUF_SIZE, 0));
-    expectNonZero(peer->recvMR = ibv_reg_mr(pd, peer->recvRegion, RDMA_BUF_SIZE, IBV_ACCESS_LOCAL_WRITE));
-    expectNonZero(peer->writeMR = ibv_reg_mr(pd, peer->writeRegion, Block4K::capacity * RDMAConnection::NConcurrency, 0));
-    expectNonZero(peer->readMR = ibv_reg_mr(pd, peer->readRegion, Block4K::capacity * RDMAConnection::NConcurrency, IBV_ACCESS_LOCAL_WRITE));
-
-    cmId->context = reinterpret_cast<void *>(peers + peerId);
+    if (!peer->sendRegion) {
+        size_t ringSize = RDMA_BUF_SIZE * RDMAConnection::NMsgSlots;
+        auto block = slab->alloc(2 * ringSize + 2 * regionSize);
+        expectNonZero(block.addr);
+        peer->regionMR = block.mr;
+        peer->sendRegion = block.addr;
+        peer->recvRegion = peer->sendRegion + ringSize;
+        peer->writeRegion = peer->recvRegion + ringSize;
+        peer->readRegion = peer->writeRegion + regionSize;
+        peer->writeSlots = std::make_unique<SlotPool>(stagingSlots);
+        peer->readSlots = std::make_unique<SlotPool>(stagingSlots);
+    }
 
-    /* Wait for remote MR */
-    postReceive(peerId, RDMA_BUF_SIZE);
+    /* Credits start over with every connection */
+    peer->sendSeq = 0;
+    creditArea[peerId] = 0;
+    peer->peerReleased = creditArea + peerId;
+    peer->recvReleased = peer->recvReported = 0;
+    for (int slot = 0; slot < RDMAConnection::NMsgSlots; ++slot)
+        postReceive(peerId, slot);
 }
 
-void RDMASocket::buildConnParam(rdma_conn_param *param)
+/** Connection parameters, with my MRs in the private data */
+void RDMASocket::buildConnParam(rdma_conn_param *param, ConnPrivateData *data, int peerId)
 {
+    data->nodeId = myNodeConf->id;
+    data->addr = reinterpret_cast<uint64_t>(mr->addr);
+    data->rkey = mr->rkey;
+    data->creditAddr = reinterpret_cast<uint64_t>(creditArea + peerId);
+    data->creditRkey = creditMR->rkey;
+    data->heartbeatAddr = reinterpret_cast<uint64_t>(heartbeatArea);
+    data->heartbeatRkey = heartbeatMR->rkey;
+    data->status = __atomic_load_n(heartbeatArea + HbStatus, __ATOMIC_RELAXED);
+
     memset(param, 0, sizeof(rdma_conn_param));
     param->initiator_depth = MAX_REQS;
     param->responder_resources = MAX_REQS;
     param->rnr_retry_count = 7;             /* infinite retry */
-    param->private_data = reinterpret_cast<const void *>(&nodeIDBuf);
-    param->private_data_len = sizeof(uint32_t);
+    param->private_data = data;
+    param->private_data_len = sizeof(ConnPrivateData);
 }
 
-void RDMASocket::destroyConnection(rdma_cm_id *cmId)
+/** Record the MRs of a peer, from its connection private data */
+void RDMASocket::setRemote(int peerId, const ConnPrivateData *data)
 {
-    int peerId = cm2id[(uint64_t)cmId];
-    peers[peerId].connected = false;
-    peers[peerId].qp = nullptr;
-    peers[peerId].cmId = nullptr;
-    
-    ibv_dereg_mr(peers[peerId].sendMR);
-    ibv_dereg_mr(peers[peerId].recvMR);
-    ibv_dereg_mr(peers[peerId].writeMR);
-    ibv_dereg_mr(peers[peerId].readMR);
-
-    delete[] peers[peerId].sendRegion;
-    delete[] peers[peerId].recvRegion;
-    delete[] peers[peerId].writeRegion;
-    delete[] peers[peerId].readRegion;
+    auto *peer = &peers[peerId];
+    memset(&peer->peerMR, 0, sizeof(ibv_mr));
+    peer->peerMR.addr = reinterpret_cast<void *>(data->addr);
+    peer->peerMR.rkey = data->rkey;
+    peer->creditAddr = data->creditAddr;
+    peer->creditRkey = data->creditRkey;
+    peer->heartbeatAddr = data->heartbeatAddr;
+    peer->heartbeatRkey = data->heartbeatRkey;
+    uint64_t *words = peerWords + peerId * PeerWords;
+    words[HbBeat] = 0;
+    words[HbStatus] = data->status;
+    words[HbWords] = 0;
+}
 
-    cm2id.erase((uint64_t)cmId);
+/**
+ * Drop the connection (attempt) with a peer in favour of a new one. Later events of its
+ * CM ID are ignored, and the ID is destroyed on its last one.
+ * @note connMutex must be held.
+ */
+void RDMASocket::abandonConnection(int peerId)
+{
+    auto *peer = &peers[peerId];
+    flushPeer(peerId);
+    if (peer->qp)
+        rdma_destroy_qp(peer->cmId);
+    rdma_disconnect(peer->cmId);
+    peer->qp = nullptr;
+    peer->cmId = nullptr;
+    peer->state = PeerState::Idle;
+}
 
-    rdma_destroy_qp(cmId);
-    rdma_destroy_id(cmId);
+/**
+ * Destroy the QP and CM ID of the connection with a peer. Called from CM event handlers,
+ * the CM ID is destroyed once the event is acked.
+ */
+void RDMASocket::destroyConnection(int peerId)
+{
+    auto *peer = &peers[peerId];
+    if (peer->cmId) {
+        if (peer->qp)
+            rdma_destroy_qp(peer->cmId);
+        if (initialized && shouldRun)
+            doomedIds.push_back(peer->cmId);
+        else
+            rdma_destroy_id(peer->cmId);
+    }
+    peer->qp = nullptr;
+    peer->cmId = nullptr;
+    /* Regions are kept for later connections, and freed with the slab */
 }
 
 /** Show the QP status with the designated peer. */
@@ -410,71 +796,159 @@ void RDMASocket::verboseQP(int peerId)
 #undef CHECK
 }
 
-/** Check whether a peer is still alive (connected). */
+/** Check whether a peer is connected and admitted, connecting to it on first use. */
 bool RDMASocket::isPeerAlive(int peerId)
+{
+    if (peerId == myNodeConf->id)
+        return getPhase() == NodePhase::Synced;
+    if (peers[peerId].forcedConnStat)
+        return peers[peerId].forcedConnStat > 0;
+    return ensureConnected(peerId) && peers[peerId].admission == PeerAdmission::Admitted;
+}
+
+/** Check whether writes must go to a peer, i.e. it is connected and not fenced. */
+bool RDMASocket::acceptsWrites(int peerId)
+{
+    auto *peer = &peers[peerId];
+    if (peerId == myNodeConf->id)
+        return true;
+    if (peer->forcedConnStat)
+        return peer->forcedConnStat > 0;
+    if (ensureConnected(peerId) && peer->admission != PeerAdmission::Fenced)
+        return true;
+    peer->missedWrites = true;
+    return false;
+}
+
+/** Check whether a peer is connected, whether or not it is admitted. */
+bool RDMASocket::isPeerConnected(int peerId)
 {
     if (peerId == myNodeConf->id)
         return true;
     if (peers[peerId].forcedConnStat)
         return peers[peerId].forcedConnStat > 0;
-    return peers[peerId].connected;
+    return ensureConnected(peerId);
 }
 
-/** Issue a send request to the designated peer, and return a unique task ID. */
-void RDMASocket::postSend(int peerId, uint64_t length)
+void RDMASocket::setPhase(NodePhase phase)
+{
+    __atomic_store_n(heartbeatArea + HbStatus, myIncarnation | (uint64_t)phase, __ATOMIC_RELEASE);
+}
+
+/** Check whether every connected peer has admitted my writes, as last read by the failure detector. */
+bool RDMASocket::isWrittenByPeers()
+{
+    std::lock_guard<std::mutex> lock(connMutex);
+    for (auto &peer : peers)
+        if (peer.peerId != myNodeConf->id && peer.state == PeerState::Connected && !peer.forcedConnStat &&
+            __atomic_load_n(peerWords + peer.peerId * PeerWords + HbWords, __ATOMIC_RELAXED) != myIncarnation)
+            return false;
+    return true;
+}
+
+uint64_t RDMASocket::getPeersP99()
+{
+    if (getPhase() == NodePhase::Synced)
+        return 0;
+    uint64_t p99 = 0;
+    for (auto &peer : peers)
+        if (peer.peerId != myNodeConf->id && peer.state == PeerState::Connected)
+            p99 = std::max(p99, __atomic_load_n(peerWords + peer.peerId * PeerWords + HbP99, __ATOMIC_RELAXED));
+    return p99;
+}
+
+/**
+ * Take a peer out of the I/O path, as it misses writes from now on. Unless it was catching up,
+ * it is only admitted again with another incarnation, i.e. once restarted.
+ * @note connMutex must be held.
+ */
+void RDMASocket::fencePeer(int peerId)
+{
+    auto *peer = &peers[peerId];
+    if (peer->admission != PeerAdmission::Fenced) {
+        peer->fencedIncarnation = peerWords[peerId * PeerWords + HbStatus] & ~PhaseMask;
+        d_warn("peer %d is fenced until it is rebuilt (restarted with RECOVER)", peerId);
+    }
+    peer->admission = PeerAdmission::Fenced;
+    heartbeatArea[HbWords + peerId] = 0;
+}
+
+/**
+ * Send a message of at most RDMA_BUF_SIZE bytes to the designated peer.
+ * Blocks while the peer has no receive posted for it (no credit left).
+ * @return false if the socket has stopped or the peer has disconnected.
+ */
+bool RDMASocket::sendMessage(int peerId, const void *msg, uint32_t length)
 {
     if (!shouldRun) {
         d_err("send request after shouldRun=false is ignored");
-        return;
+        return false;
+    }
+    if (length > RDMA_BUF_SIZE) {
+        d_err("message of %u bytes exceeds RDMA_BUF_SIZE", length);
+        return false;
     }
-    /*
-    ibv_send_wr wr, *badWr = nullptr;
-    ibv_sge sge;
-
-    memset(&sge, 0, sizeof(ibv_sge));
-    sge.addr = ((uint64_t)(peers[peerId].sendRegion));
-    sge.length = length;
-    sge.lkey = peers[peerId].sendMR->lkey;
 
-    memset(&wr, 0, sizeof(ibv_send_wr));
-    wr.wr_id = WRID(peerId, 0);
-    wr.sg_list = &sge;
-    wr.num_sge = 1;
-    wr.imm_data = myNodeConf->id;
-    wr.opcode = IBV_WR_SEND_WITH_IMM;
+    auto *peer = &peers[peerId];
+    if (!ensureConnected(peerId))
+        return false;
+    std::lock_guard<std::mutex> lock(peer->sendMutex);
+    while (peer->sendSeq - *peer->peerReleased >= RDMAConnection::NMsgSlots) {
+        if (!shouldRun || peer->state != PeerState::Connected)
+            return false;
+        drainSendCQ();
+        std::this_thread::yield();
+    }
 
-    expectZero(ibv_post_send(peers[peerId].qp, &wr, &badWr));
-    */
-    auto *peer = peers + peerId;
-    rdma_post_send(peer->cmId, nullptr, peer->sendRegion, length, peer->sendMR, 0);
+    uint8_t *buf = peer->sendRegion + peer->sendSeq % RDMAConnection::NMsgSlots * RDMA_BUF_SIZE;
+    memcpy(buf, msg, length);
+    ++peer->sendSeq;
+    rdma_post_send(peer->cmId, reinterpret_cast<void *>(WRID(peerId, SP_MESSAGE_SEND)), buf, length,
+                   peer->regionMR, 0);
+    if (++pendingMessageWCs >= MAX_QP_DEPTH / 4)
+        drainSendCQ();
+    return true;
 }
 
-/** Issue a receive request to the designated peer. DOES NOT ALLOCATE HASHTABLE ID. */
-void RDMASocket::postReceive(int peerId, uint64_t length, int specialTaskId)
+/** Post the receive of a message into a buffer of the recv ring. */
+void RDMASocket::postReceive(int peerId, int slot)
 {
     if (!shouldRun) {
         d_err("recv request after shouldRun=false is ignored");
         return;
     }
-    /*
-    ibv_recv_wr wr, *badWr = nullptr;
-    ibv_sge sge;
+    auto *peer = &peers[peerId];
+    rdma_post_recv(peer->cmId, reinterpret_cast<void *>(WRID(peerId, slot)),
+                   peer->recvRegion + slot * RDMA_BUF_SIZE, RDMA_BUF_SIZE, peer->regionMR);
+}
 
-    memset(&sge, 0, sizeof(ibv_sge));
-    sge.addr = (uint64_t)(peers[peerId].recvRegion);
-    sge.length = length;
-    sge.lkey = peers[peerId].recvMR->lkey;
+/**
+ * Repost the buffer of a received message, returning its credit to the sender.
+ * Credits are returned in batches of half the ring, so that a sender never starves.
+ * @note Should be called by the thread polling receives.
+ */
+void RDMASocket::releaseReceive(const ibv_wc *wc)
+{
+    int peerId = WRID_PEER(wc->wr_id);
+    auto *peer = &peers[peerId];
 
-    memset(&wr, 0, sizeof(ibv_recv_wr));
-    wr.wr_id = WRID(peerId, specialTaskId);
-    wr.sg_list = &sge;
-    wr.num_sge = 1;
-    wr.next = nullptr;
+    postReceive(peerId, WRID_TASK(wc->wr_id));
+    if (++peer->recvReleased - peer->recvReported >= RDMAConnection::NMsgSlots / 2)
+        returnCredits(peerId);
+}
 
-    expectZero(ibv_post_recv(peers[peerId].qp, &wr, &badWr));
-    */
-    auto *peer = peers + peerId;
-    rdma_post_recv(peer->cmId, nullptr, peer->recvRegion, length, peer->recvMR);
+/** Write the count of released messages to the peer's credit word. */
+void RDMASocket::returnCredits(int peerId)
+{
+    auto *peer = &peers[peerId];
+    uint64_t *released = creditArea + peers.size() + peerId;
+
+    *released = peer->recvReleased;
+    peer->recvReported = peer->recvReleased;
+    rdma_post_write(peer->cmId, reinterpret_cast<void *>(WRID(peerId, SP_CREDIT_WRITE)), released,
+                    sizeof(uint64_t), creditMR, 0, peer->creditAddr, peer->creditRkey);
+    if (++pendingMessageWCs >= MAX_QP_DEPTH / 4)
+        drainSendCQ();
 }
 
 /** Issue a write request to the designated peer, and return a unique task ID. */
@@ -492,7 +966,7 @@ void RDMASocket::postWrite(int peerId, uint64_t remoteDstShift, uint64_t localSr
     memset(&sge, 0, sizeof(ibv_sge));
     sge.addr = localSrc;
     sge.length = length;
-    sge.lkey = peers[peerId].writeMR->lkey;
+    sge.lkey = peers[peerId].regionMR->lkey;
 
     memset(&wr, 0, sizeof(ibv_send_wr));
     wr.wr_id = WRID(peerId, 0);
@@ -510,10 +984,58 @@ void RDMASocket::postWrite(int peerId, uint64_t remoteDstShift, uint64_t localSr
 
     ibv_post_send(peers[peerId].qp, &wr, &badWr);
     */
-    auto *peer = peers + peerId;
+    auto *peer = &peers[peerId];
     auto remoteDst = reinterpret_cast<uint64_t>(peer->peerMR.addr) + remoteDstShift;
-    rdma_post_write(peer->cmId, nullptr, reinterpret_cast<void *>(localSrc), length,
-                    peer->writeMR, 0, remoteDst, peer->peerMR.rkey);
+    uint64_t wrId = startOp(peerId, RDMAOp::Write);
+    if (rdma_post_write(peer->cmId, reinterpret_cast<void *>(wrId),
+                        reinterpret_cast<void *>(localSrc), length, peer->regionMR, 0, remoteDst,
+                        peer->peerMR.rkey))
+        failOp(peerId, RDMAOp::Write, wrId);
+}
+
+/**
+ * Issue an RDMA compare-and-swap of an 8-byte aligned word of the peer's major MR.
+ * The old value is stored to `result`, one of getAtomicResults().
+ */
+void RDMASocket::postCompareSwap(int peerId, uint64_t remoteShift, uint64_t *result, uint64_t expected,
+                                 uint64_t desired)
+{
+    auto *peer = &peers[peerId];
+    ibv_sge sge;
+    sge.addr = reinterpret_cast<uint64_t>(result);
+    sge.length = sizeof(uint64_t);
+    sge.lkey = atomicMR->lkey;
+
+    ibv_send_wr wr, *badWr = nullptr;
+    memset(&wr, 0, sizeof(ibv_send_wr));
+    wr.wr_id = startOp(peerId, RDMAOp::Atomic);
+    wr.sg_list = &sge;
+    wr.num_sge = 1;
+    wr.opcode = IBV_WR_ATOMIC_CMP_AND_SWP;
+    wr.send_flags = IBV_SEND_SIGNALED;
+    wr.wr.atomic.remote_addr = reinterpret_cast<uint64_t>(peer->peerMR.addr) + remoteShift;
+    wr.wr.atomic.compare_add = expected;
+    wr.wr.atomic.swap = desired;
+    wr.wr.atomic.rkey = peer->peerMR.rkey;
+    if ((errno = ibv_post_send(peer->qp, &wr, &badWr)))
+        failOp(peerId, RDMAOp::Atomic, wr.wr_id);
+}
+
+/**
+ * Issue a persistence fence to the peer: an 8-byte RDMA read at `remoteShift` of its major MR,
+ * whose completion means that all writes posted to the peer before it have left its NIC for
+ * its memory. They are then persistent if the peer's NVM is in the ADR domain and DDIO is off
+ * for the NIC (else they may sit in its LLC), or if the platform has eADR. One fence covers all
+ * prior writes, however many; the value read is discarded.
+ */
+void RDMASocket::postPersistFence(int peerId, uint64_t remoteShift)
+{
+    auto *peer = &peers[peerId];
+    auto remoteSrc = reinterpret_cast<uint64_t>(peer->peerMR.addr) + remoteShift;
+    uint64_t wrId = startOp(peerId, RDMAOp::Fence);
+    if (rdma_post_read(peer->cmId, reinterpret_cast<void *>(wrId), fenceSink,
+                       sizeof(uint64_t), fenceMR, 0, remoteSrc, peer->peerMR.rkey))
+        failOp(peerId, RDMAOp::Fence, wrId);
 }
 
 /** Issue a read request from the designated peer, with a designated task ID. */
@@ -530,7 +1052,7 @@ void RDMASocket::postRead(int peerId, uint64_t remoteSrcShift, uint64_t localDst
     memset(&sge, 0, sizeof(ibv_sge));
     sge.addr = localDst;
     sge.length = length;
-    sge.lkey = peers[peerId].readMR->lkey;
+    sge.lkey = peers[peerId].regionMR->lkey;
 
     memset(&wr, 0, sizeof(ibv_send_wr));
     wr.wr_id = WRID(peerId, taskId);
@@ -543,10 +1065,21 @@ void RDMASocket::postRead(int peerId, uint64_t remoteSrcShift, uint64_t localDst
 
     ibv_post_send(peers[peerId].qp, &wr, &badWr);
     */
-    auto *peer = peers + peerId;
+    postRead(peerId, remoteSrcShift, reinterpret_cast<void *>(localDst), length, peers[peerId].regionMR);
+}
+
+void RDMASocket::postRead(int peerId, uint64_t remoteSrcShift, void *localDst, uint64_t length, ibv_mr *localMR)
+{
+    if (!shouldRun) {
+        d_err("read request after shouldRun=false is ignored");
+        return;
+    }
+    auto *peer = &peers[peerId];
     auto remoteSrc = reinterpret_cast<uint64_t>(peer->peerMR.addr) + remoteSrcShift;
-    rdma_post_read(peer->cmId, nullptr, reinterpret_cast<void *>(localDst), length,
-                    peer->readMR, 0, remoteSrc, peer->peerMR.rkey);
+    uint64_t wrId = startOp(peerId, RDMAOp::Read);
+    if (rdma_post_read(peer->cmId, reinterpret_cast<void *>(wrId), localDst, length, localMR, 0, remoteSrc,
+                       peer->peerMR.rkey))
+        failOp(peerId, RDMAOp::Read, wrId);
 }
 
 /**
@@ -566,22 +1099,267 @@ void RDMASocket::postSpecialReceive(int peerId, ibv_recv_wr *wr)
     expectZero(ibv_post_recv(peers[peerId].qp, wr, &badWr));
 }
 
-/** Poll for next CQE in send CQ (RDMA read). */
-int RDMASocket::pollSendCompletion(ibv_wc *wc)
+/** Handle the completion of a message send, credit return or heartbeat read. */
+void RDMASocket::onSendCompletion(ibv_wc *wc)
 {
-    while (shouldRun) {
-        int ret = ibv_poll_cq(cq[CQ_SEND], 1, wc);
-        if (ret)
+    if (WRID_TASK(wc->wr_id) == SP_HEARTBEAT_READ) {
+        auto &reads = peers[WRID_PEER(wc->wr_id)].wordReads;
+        if (reads.fetch_sub(1) <= 0)
+            reads = 0;              /* Flushed with a former connection */
+        return;
+    }
+    --pendingMessageWCs;
+    if (wc->status != IBV_WC_SUCCESS)
+        d_err("message to peer %u failed: %s", WRID_PEER(wc->wr_id), ibv_wc_status_str(wc->status));
+}
+
+static inline bool isInternalWC(const ibv_wc *wc)
+{
+    uint32_t task = WRID_TASK(wc->wr_id);
+    return task == SP_MESSAGE_SEND || task == SP_CREDIT_WRITE || task == SP_HEARTBEAT_READ;
+}
+
+/*
+ * Task IDs of counted one-sided WRs: [31] counted | [30..28] RDMAOp | [27] timed | [26..0] TSC / 16
+ * when posted, if timed. The TSC field wraps every 2^31 ticks (0.7 s at 3 GHz), and a wrap
+ * cannot be told from the tag alone: latencies are known modulo this, so a completion polled
+ * later than that (e.g. by a descheduled poller) is recorded as a short one. Successful one-
+ * sided operations complete in microseconds, so this only skews pathological samples. Only one
+ * operation in RDMA_STATS_SAMPLING is timed, as reading the TSC twice would cost more than all
+ * counters.
+ */
+static const uint32_t CountedTask = 1U << 31;
+static const uint32_t TimedTask = 1U << 27;
+static const uint32_t TimedTscMask = TimedTask - 1;
+
+/**
+ * Count an operation as in flight, and return the ID of its WR: tagged with the generation
+ * of the peer's connection, and with its stats task (0 if RDMA_STATS is off).
+ */
+uint64_t RDMASocket::startOp(int peerId, RDMAOp op)
+{
+    auto *peer = &peers[peerId];
+    uint64_t word = peer->inflight.fetch_add(1, std::memory_order_relaxed);
+    uint32_t task = 0;
+    if (statsEnabled) {
+        uint64_t seq = peer->opStats[(int)op].posted.fetch_add(1, std::memory_order_relaxed);
+        task = CountedTask | (uint32_t)op << 28;
+        if (seq % RDMA_STATS_SAMPLING == 0)
+            task |= TimedTask | ((uint32_t)(TscClock::now() >> 4) & TimedTscMask);
+    }
+    return WRID_GEN(peerId, word >> 48, task);
+}
+
+/** Handle a failed post: its WR completes at once with a flush error, unless already flushed. */
+void RDMASocket::failOp(int peerId, RDMAOp op, uint64_t wrId)
+{
+    d_err("cannot post %s to peer %d: %s", rdmaOpName(op), peerId, strerror(errno));
+    auto *peer = &peers[peerId];
+    auto &stats = peer->opStats[(int)op];
+    ++stats.postErrors;
+    if (WRID_TASK(wrId) & CountedTask)
+        --stats.posted;
+
+    std::lock_guard<std::mutex> lock(sendCQMutex);
+    if (WRID_GENERATION(wrId) != peer->inflight >> 48)
+        return;
+    --peer->inflight;
+    ibv_wc wc;
+    memset(&wc, 0, sizeof(ibv_wc));
+    wc.wr_id = WRID_GEN(peerId, WRID_GENERATION(wrId), 0);
+    wc.status = IBV_WC_WR_FLUSH_ERR;
+    stashedWCs.push_back(wc);
+}
+
+/**
+ * Whether a polled completion of a one-sided WR is to be returned. Those of a flushed
+ * generation are not, as flushPeer already made up for them.
+ * @note sendCQMutex must be held.
+ */
+bool RDMASocket::acceptCompletion(const ibv_wc *wc)
+{
+    uint32_t gen = WRID_GENERATION(wc->wr_id);
+    if (!gen)
+        return true;                        /* Special WRs, not counted */
+    auto &inflight = peers[WRID_PEER(wc->wr_id)].inflight;
+    if (gen != inflight >> 48)
+        return false;
+    --inflight;
+    return true;
+}
+
+/**
+ * Complete all one-sided WRs in flight to a peer at once, with flush errors, rather than
+ * when the QP is flushed, which may take the whole transport timeout. Their real
+ * completions, if any, are dropped later by their generation.
+ */
+void RDMASocket::flushPeer(int peerId)
+{
+    std::lock_guard<std::mutex> lock(sendCQMutex);
+    auto &inflight = peers[peerId].inflight;
+    uint64_t word = inflight, next;
+    do {
+        uint64_t gen = (word >> 48) + 1;
+        next = (gen & 0xFFFF ? gen : 1) << 48;
+    } while (!inflight.compare_exchange_weak(word, next));
+
+    uint64_t n = word & ((1ULL << 48) - 1);
+    ibv_wc wc;
+    memset(&wc, 0, sizeof(ibv_wc));
+    wc.wr_id = WRID_GEN(peerId, word >> 48, 0);
+    wc.status = IBV_WC_WR_FLUSH_ERR;
+    for (uint64_t i = 0; i < n; ++i)
+        stashedWCs.push_back(wc);
+    if (n)
+        d_warn("flushed %lu operations in flight to peer %d", n, peerId);
+}
+
+/** Account the completion of a counted WR when it is polled. @note sendCQMutex must be held. */
+void RDMASocket::recordCompletion(const ibv_wc *wc)
+{
+    uint32_t task = WRID_TASK(wc->wr_id);
+    if (!(task & CountedTask))
+        return;
+
+    auto &stats = peers[WRID_PEER(wc->wr_id)].opStats[task >> 28 & 7];
+    stats.completed.store(stats.completed.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+    if (wc->status != IBV_WC_SUCCESS) {
+        ++stats.errors;
+        return;
+    }
+    if (!(task & TimedTask))
+        return;
+    uint32_t ticks = ((uint32_t)(TscClock::now() >> 4) - task) & TimedTscMask;
+    stats.latency.record((uint64_t)(ticks * 16 * nsPerTick));
+}
+
+/** Print the latencies and counters of operations with all peers that had some. */
+void RDMASocket::dumpStats(FILE *out)
+{
+    for (auto &peer : peers)
+        for (int op = 0; op < (int)RDMAOp::Count; ++op) {
+            auto &stats = peer.opStats[op];
+            if (!stats.posted && !stats.postErrors)
+                continue;
+            auto &latency = stats.latency;
+            fprintf(out, "rdma peer %3d %-6s: %10lu done, %4lu outstanding, %4lu errors, %4lu failed posts; "
+                    "latency avg %7.2f, p50 %7.2f, p99 %7.2f, p99.9 %7.2f us\n", peer.peerId,
+                    rdmaOpName((RDMAOp)op), (uint64_t)stats.completed, stats.outstanding(),
+                    (uint64_t)stats.errors, (uint64_t)stats.postErrors, latency.mean() / 1e3, latency.percentile(50) / 1e3,
+                    latency.percentile(99) / 1e3, latency.percentile(99.9) / 1e3);
+        }
+    fflush(out);
+}
+
+/**
+ * Poll at most `numEntries` CQEs of the send CQ, except those of messages, which are
+ * handled here. CQEs stashed by drainSendCQ are returned first.
+ */
+int RDMASocket::pollSendCQ(ibv_wc *wc, int numEntries)
+{
+    std::lock_guard<std::mutex> lock(sendCQMutex);
+    int ret = 0;
+    while (ret < numEntries && !stashedWCs.empty()) {
+        wc[ret++] = stashedWCs.front();
+        stashedWCs.pop_front();
+    }
+    if (ret == numEntries)
+        return ret;
+
+    int polled = ibv_poll_cq(cq[CQ_SEND], numEntries - ret, wc + ret);
+    if (polled < 0)
+        return ret ? ret : polled;
+    for (int i = ret; i < ret + polled; ++i) {
+        if (isInternalWC(wc + i))
+            onSendCompletion(wc + i);
+        else {
+            recordCompletion(wc + i);
+            if (acceptCompletion(wc + i))
+                wc[ret++] = wc[i];
+        }
+    }
+    return ret;
+}
+
+/**
+ * Poll message CQEs out of the send CQ, so that it cannot overflow when nobody else polls it.
+ * Other CQEs are stashed for pollSendCompletion.
+ */
+void RDMASocket::drainSendCQ()
+{
+    ibv_wc wc[16];
+    std::lock_guard<std::mutex> lock(sendCQMutex);
+    int ret;
+    while ((ret = ibv_poll_cq(cq[CQ_SEND], 16, wc)) > 0)
+        for (int i = 0; i < ret; ++i) {
+            if (isInternalWC(wc + i))
+                onSendCompletion(wc + i);
+            else {
+                recordCompletion(wc + i);
+                if (acceptCompletion(wc + i))
+                    stashedWCs.push_back(wc[i]);
+            }
+        }
+}
+
+/**
+ * Wait until `poll` returns non-zero: spin on it for the spin budget, then arm the CQ and
+ * block on its completion channel, which costs a wakeup (several us) but no CPU.
+ * @return the result of `poll`, or 0 if the socket has stopped.
+ */
+template <typename PollFn>
+int RDMASocket::hybridPoll(int cqIndex, PollFn poll)
+{
+    using namespace std::chrono;
+    auto &stats = pollStats[cqIndex];
+    auto start = steady_clock::now(), now = start;
+    int ret = 0;
+
+    ++stats.waits;
+    for (int i = 0; shouldRun; ++i) {
+        if ((ret = poll())) {
+            ++stats.spinHits;
+            stats.spinNs += duration_cast<nanoseconds>(steady_clock::now() - start).count();
             return ret;
+        }
+        /* Reading the clock costs more than polling an empty CQ */
+        if (spinBudget.count() >= 0 && i % 64 == 0 && (now = steady_clock::now()) - start >= spinBudget)
+            break;
     }
-    return 0;
+    stats.spinNs += duration_cast<nanoseconds>(now - start).count();
+
+    ++stats.blocks;
+    while (shouldRun) {
+        /* Poll after arming, or a CQE that came in between would not wake us up */
+        ibv_req_notify_cq(cq[cqIndex], 0);
+        if ((ret = poll()))
+            break;
+
+        pollfd pfd = { compChannel[cqIndex]->fd, POLLIN, 0 };
+        if (::poll(&pfd, 1, EC_POLL_TIMEOUT) > 0) {
+            ibv_cq *eventCQ;
+            void *eventContext;
+            if (ibv_get_cq_event(compChannel[cqIndex], &eventCQ, &eventContext) == 0)
+                ibv_ack_cq_events(eventCQ, 1);
+        }
+        if ((ret = poll()))
+            break;
+    }
+    stats.blockNs += duration_cast<nanoseconds>(steady_clock::now() - now).count();
+    return shouldRun ? ret : 0;
+}
+
+/** Poll for next CQE in send CQ (RDMA read). */
+int RDMASocket::pollSendCompletion(ibv_wc *wc)
+{
+    return hybridPoll(CQ_SEND, [&] { return pollSendCQ(wc, 1); });
 }
 
 int RDMASocket::pollSendCompletion(ibv_wc *wc, int numEntries)
 {
-    while (shouldRun && numEntries) {
-        int ret = ibv_poll_cq(cq[CQ_SEND], numEntries, wc);
-        if (ret < 0)
+    while (numEntries) {
+        int ret = hybridPoll(CQ_SEND, [&] { return pollSendCQ(wc, numEntries); });
+        if (ret <= 0)
             return ret;
         wc += ret;
         numEntries -= ret;
@@ -589,16 +1367,22 @@ int RDMASocket::pollSendCompletion(ibv_wc *wc, int numEntries)
     return 0;
 }
 
+/** Wait for at least one CQE of the send CQ, and return up to `maxEntries` of them. */
+int RDMASocket::pollSendCompletionAny(ibv_wc *wc, int maxEntries)
+{
+    return hybridPoll(CQ_SEND, [&] { return pollSendCQ(wc, maxEntries); });
+}
+
 /**
  * Poll for next CQE in recv CQ (RDMA recv).
  */
 int RDMASocket::pollRecvCompletion(ibv_wc *wc)
 {
     while (shouldRun) {
-        int ret = ibv_poll_cq(cq[CQ_RECV], 1, wc);
+        int ret = hybridPoll(CQ_RECV, [&] { return ibv_poll_cq(cq[CQ_RECV], 1, wc); });
         if (ret) {
             int peerId = WRID_PEER(wc->wr_id);
-            auto *peer = peers + peerId;
+            auto *peer = &peers[peerId];
 #if 0   
             auto *msg = reinterpret_cast<Message *>(peer->recvRegion); 
             if (Unlikely(initialized && WRID_TASK(wc->wr_id) == SP_REMOTE_MR_RECV)) {
@@ -612,27 +1396,10 @@ int RDMASocket::pollRecvCompletion(ibv_wc *wc)
                     d_err("RDMA recv intended for MR received some other thing");
                 continue;
             }
-            if (Unlikely(initialized && msg->type == Message::MESG_RECOVER_START)) {
-                /* Remote recover start. Register MR, send back MR and size */
-                uint64_t *wrLog = writeLog.data();
-                size_t wrLogSize = writeLog.size();
-                ibv_mr *wrLogMR = ibv_reg_mr(pd, wrLog, wrLogSize * sizeof(uint64_t), 0);
-                logMR[peerId] = wrLogMR;
-
-                auto *response = reinterpret_cast<Message *>(getSendRegion(peerId));
-                response->type = Message::MESG_RECOVER_RESPONSE;
-                memcpy(&response->data.mr, wrLogMR, sizeof(ibv_mr));
-                response->data.size = writeLog.size();
-                postSend(peerId, sizeof(Message));
-
-                postReceive(peerId, sizeof(Message));
-                continue;
-            }
 #endif
             if (initialized && wc->opcode == IBV_WC_RECV_RDMA_WITH_IMM) {
-                /* Transparently processes it, post another recv and retry. */
-                processRecvWriteWithImm(wc);
-                postReceive(peerId, RDMA_BUF_SIZE);
+                /* Carries no message: post another recv and retry. No credit is returned. */
+                postReceive(peerId, WRID_TASK(wc->wr_id));
                 continue;
             }
             return ret;
@@ -640,17 +1407,3 @@ int RDMASocket::pollRecvCompletion(ibv_wc *wc)
     }
     return 0;
 }
-
-/** Process RDMA write-with-imm's to this node */
-void RDMASocket::processRecvWriteWithImm(ibv_wc *wc)
-{
-    if (degraded) {
-        uint64_t blkno = wc->imm_data;
-        d_warn("EC group is degraded, record write to block %lu", blkno);
-        if (writeLog.size() == writeLog.capacity()) {
-            d_err("write log is already full!!  this write will not be logged.");
-            return;
-        }
-        writeLog.push_back(blkno);
-    }
-}
@@ -25,7 +25,7 @@ RPCInterface::RPCInterface()
         }
     }
 
-    memset(peerAliveStatus, 0, sizeof(peerAliveStatus));
+    peerAliveStatus.assign(clusterConf->getNodeIdBound(), 0);
     socket = new RDMASocket();
 
     shouldRun.store(true);
@@ -73,29 +73,28 @@ bool RPCInterface::isPeerAlive(int peerId)
 void RPCInterface::syncAmongPeers()
 {
     ibv_wc wc[2];
+    Message msg;
 
     for (int i = 0; i < myNodeConf->id; ++i) {
-        auto *msg = reinterpret_cast<Message *>(socket->peers[i].sendRegion);
-        msg->type = Message::MESG_SYNC_REQUEST;
-        socket->postSend(i, sizeof(Message));
+        msg.type = Message::MESG_SYNC_REQUEST;
+        socket->sendMessage(i, &msg, sizeof(Message));
 
-        socket->postReceive(i, sizeof(Message), SP_SYNC_RECV);
         expectPositive(socket->pollRecvCompletion(wc));
-        expectTrue(WRID_PEER(wc->wr_id) == i && WRID_TASK(wc->wr_id) == SP_SYNC_RECV);
-        auto *resp = reinterpret_cast<Message *>(socket->peers[i].recvRegion);
+        expectTrue(WRID_PEER(wc->wr_id) == i);
+        auto *resp = reinterpret_cast<const Message *>(socket->getRecvMessage(wc));
         expectTrue(resp->type == Message::MESG_SYNC_RESPONSE);
+        socket->releaseReceive(wc);
     }
 
     for (int i = myNodeConf->id + 1; i < clusterConf->getClusterSize(); ++i) {
-        socket->postReceive(i, sizeof(Message), SP_SYNC_RECV);
         expectPositive(socket->pollRecvCompletion(wc));
-        expectTrue(WRID_PEER(wc->wr_id) == i && WRID_TASK(wc->wr_id) == SP_SYNC_RECV);
-        auto *msg = reinterpret_cast<Message *>(socket->peers[i].recvRegion);
-        expectTrue(msg->type == Message::MESG_SYNC_REQUEST);
+        expectTrue(WRID_PEER(wc->wr_id) == i);
+        auto *req = reinterpret_cast<const Message *>(socket->getRecvMessage(wc));
+        expectTrue(req->type == Message::MESG_SYNC_REQUEST);
+        socket->releaseReceive(wc);
 
-        auto *resp = reinterpret_cast<Message *>(socket->peers[i].sendRegion);
-        resp->type = Message::MESG_SYNC_RESPONSE;
-        socket->postSend(i, sizeof(Message));
+        msg.type = Message::MESG_SYNC_RESPONSE;
+        socket->sendMessage(i, &msg, sizeof(Message));
     }
 }
 
@@ -139,8 +138,7 @@ void RPCInterface::rdmaListen()
             d_info("pollRecvCompletion returned 0, indicating RDMASocket has stopped.");
             break;
         }
-        int peerId = WRID_PEER(wc->wr_id);
-        auto *msg = reinterpret_cast<Message *>(socket->getRecvRegion(peerId));
+        auto *msg = reinterpret_cast<const Message *>(socket->getRecvMessage(wc));
 
         /* Here comes extra data copies. TODO: Consider the tradeoffs. */
         ReqBuf rbuf(wc[0], msg);
@@ -151,7 +149,7 @@ void RPCInterface::rdmaListen()
         else
             while (!oq.push(rbuf));
         
-        socket->postReceive(peerId, sizeof(Message));
+        socket->releaseReceive(wc);
     }
     
     d_info("rdmaListen has safely exited.");
@@ -174,8 +172,7 @@ void RPCInterface::rpcListen()
         int peerId = WRID_PEER(rbuf.wc.wr_id);
         if (rpcProcessor)
             rpcProcessor(&rbuf.msg.data.rpc, &response.data.rpc);
-        memcpy(socket->getSendRegion(peerId), &response, sizeof(Message));
-        socket->postSend(peerId, sizeof(Message));
+        socket->sendMessage(peerId, &response, sizeof(Message));
     }
 
     d_info("rpcListen has safely exited.");
@@ -185,8 +182,7 @@ void RPCInterface::rpcListen()
 void RPCInterface::rpcCall(int peerId, const Message *request, Message *response)
 {
     //d_info("RPC call to %d, type %d", peerId, (int)request->data.rpc.type);
-    memcpy(socket->getSendRegion(peerId), request, sizeof(Message));
-    socket->postSend(peerId, sizeof(Message));
+    socket->sendMessage(peerId, request, sizeof(Message));
 
     ReqBuf rbuf;
     if (request->type == Message::MESG_RPC_CALL)
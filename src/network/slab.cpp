@@ -0,0 +1,116 @@
+#include <fstream>
+#include <sys/mman.h>
+#include <linux/mman.h>
+#include <numa.h>
+
+#include <debug.hpp>
+#include <network/slab.hpp>
+
+/* Hugepage sizes tried for chunks, largest first, with their mmap flags */
+static const struct { size_t size; int flags; } hugepageSizes[] = {
+    { 1UL << 30, MAP_HUGETLB | MAP_HUGE_1GB },
+    { 2UL << 20, MAP_HUGETLB | MAP_HUGE_2MB },
+};
+
+static inline size_t roundUp(size_t x, size_t align)
+{
+    return (x + align - 1) / align * align;
+}
+
+/** NUMA node of the NIC of `pd`, from sysfs, or -1 */
+static int deviceNumaNode(ibv_pd *pd)
+{
+    int node = -1;
+    std::ifstream fin(std::string(pd->context->device->ibdev_path) + "/device/numa_node");
+    if (!(fin >> node) || node < 0 || numa_available() < 0)
+        return -1;
+    return node;
+}
+
+RegisteredSlab::RegisteredSlab(ibv_pd *pd, size_t chunkBytes, int access)
+    : pd(pd), chunkBytes(chunkBytes), access(access)
+{
+    numaNode = deviceNumaNode(pd);
+    d_info("registered slab: %lu MiB chunks on NUMA node %d", chunkBytes >> 20, numaNode);
+}
+
+RegisteredSlab::~RegisteredSlab()
+{
+    for (auto &chunk : chunks) {
+        ibv_dereg_mr(chunk.mr);
+        munmap(chunk.base, chunk.length);
+    }
+}
+
+RegisteredSlab::Block RegisteredSlab::alloc(size_t length)
+{
+    length = roundUp(length, 4096);
+
+    std::lock_guard<std::mutex> lock(mutex);
+    if (chunks.empty() || chunks.back().used + length > chunks.back().length) {
+        if (!addChunk(std::max(length, chunkBytes)))
+            return { nullptr, nullptr };
+    }
+
+    auto &chunk = chunks.back();
+    Block block = { chunk.base + chunk.used, chunk.mr };
+    chunk.used += length;
+    usedBytes += length;
+    return block;
+}
+
+/**
+ * Map a chunk on the largest hugepages that do not more than double it, bind it to the NUMA
+ * node of the NIC before it is touched, and register it (which faults it in).
+ */
+bool RegisteredSlab::addChunk(size_t length)
+{
+    Chunk chunk = { nullptr, 0, 0, 0, nullptr };
+    for (auto &hp : hugepageSizes) {
+        if (length < hp.size / 2)
+            continue;
+        size_t mapped = roundUp(length, hp.size);
+        void *addr = mmap(nullptr, mapped, PROT_READ | PROT_WRITE,
+                          MAP_PRIVATE | MAP_ANONYMOUS | hp.flags, -1, 0);
+        if (addr != MAP_FAILED) {
+            chunk = { reinterpret_cast<uint8_t *>(addr), mapped, 0, hp.size, nullptr };
+            break;
+        }
+    }
+    if (!chunk.base) {
+        size_t mapped = roundUp(length, 2UL << 20);
+        void *addr = mmap(nullptr, mapped, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (addr == MAP_FAILED) {
+            d_err("cannot map %lu bytes for registered slab: %s", mapped, strerror(errno));
+            return false;
+        }
+        madvise(addr, mapped, MADV_HUGEPAGE);
+        chunk = { reinterpret_cast<uint8_t *>(addr), mapped, 0, 4096, nullptr };
+    }
+
+    if (numaNode >= 0)
+        numa_tonode_memory(chunk.base, chunk.length, numaNode);
+    chunk.mr = ibv_reg_mr(pd, chunk.base, chunk.length, access);
+    if (!chunk.mr) {
+        d_err("cannot register %lu bytes of registered slab: %s", chunk.length, strerror(errno));
+        munmap(chunk.base, chunk.length);
+        return false;
+    }
+
+    d_info("registered slab: chunk #%lu of %lu MiB on %lu KiB pages", chunks.size(),
+           chunk.length >> 20, chunk.pageSize >> 10);
+    chunks.push_back(chunk);
+    return true;
+}
+
+RegisteredSlab::Stats RegisteredSlab::getStats()
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    Stats stats = { chunks.size(), 0, 0, usedBytes, numaNode };
+    for (auto &chunk : chunks) {
+        stats.registeredBytes += chunk.length;
+        if (chunk.pageSize > 4096)
+            stats.hugepageBytes += chunk.length;
+    }
+    return stats;
+}
@@ -0,0 +1,149 @@
+#include <qos.hpp>
+#include <debug.hpp>
+
+using namespace std::chrono;
+
+QoS::QoS(uint64_t targetP99Ns, uint64_t epochNs) : targetP99Ns(targetP99Ns), epoch(std::max<uint64_t>(epochNs, 1))
+{
+    epochStart = steady_clock::now();
+    for (auto &bucket : buckets)
+        bucket.last = epochStart;
+}
+
+void QoS::setCeiling(TrafficClass cls, double bytesPerSec)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    Bucket &bucket = buckets[(int)cls];
+    bucket.ceiling = bucket.rate = bytesPerSec > 0 ? bytesPerSec : Unlimited;
+    bucket.tokens = 0;
+    bucket.last = steady_clock::now();
+}
+
+void QoS::setTarget(uint64_t targetP99Ns)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    this->targetP99Ns = targetP99Ns;
+    for (auto &bucket : buckets)
+        bucket.rate = bucket.ceiling;
+    epochLatency.reset();
+    epochStart = steady_clock::now();
+}
+
+void QoS::setRemoteP99(std::function<uint64_t()> source)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    remoteP99 = source;
+}
+
+uint64_t QoS::getForegroundP99()
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    adjust(steady_clock::now());
+    return foregroundP99Ns;
+}
+
+bool QoS::throttles(TrafficClass cls) const
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    return targetP99Ns || buckets[(int)cls].ceiling != Unlimited;
+}
+
+void QoS::record(TrafficClass cls, uint64_t start, uint64_t bytes)
+{
+    uint64_t ns = (TscClock::now() - start) * TscClock::nsPerTick();
+    std::lock_guard<std::mutex> lock(mutex);
+    latency[(int)cls].record(ns);
+    if (cls == TrafficClass::Foreground)
+        epochLatency.record(ns);
+    ++buckets[(int)cls].ops;
+    buckets[(int)cls].bytes += bytes;
+}
+
+/**
+ * The bucket may go into debt, so that the I/O of a reservation is never split: its caller
+ * waits until the debt is paid back, and the next reservation waits for both.
+ */
+steady_clock::time_point QoS::reserve(TrafficClass cls, uint64_t bytes)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    auto now = steady_clock::now();
+    adjust(now);
+
+    Bucket &bucket = buckets[(int)cls];
+    ++bucket.ops;
+    bucket.bytes += bytes;
+    bucket.epochBytes += bytes;
+    double elapsed = duration_cast<duration<double>>(now - bucket.last).count();
+    bucket.last = now;
+    if (bucket.rate == Unlimited) {
+        bucket.tokens = 0;
+        return now;
+    }
+
+    double burst = bucket.rate * duration_cast<duration<double>>(epoch).count();
+    bucket.tokens = std::min(burst, bucket.tokens + elapsed * bucket.rate) - bytes;
+    if (bucket.tokens >= 0)
+        return now;
+    double wait = -bucket.tokens / bucket.rate;
+    bucket.throttledSec += wait;
+    return now + duration_cast<nanoseconds>(duration<double>(wait));
+}
+
+/**
+ * Adjust the rates of background classes if an epoch has passed, on the max of the foreground
+ * p99 of this node and of its peers. Called with the mutex held.
+ */
+void QoS::adjust(steady_clock::time_point now)
+{
+    if (now - epochStart < epoch)
+        return;
+    double seconds = duration_cast<duration<double>>(now - epochStart).count();
+    bool stale = (now - epochStart > 4 * epoch);    /* No background I/O for a while */
+    uint64_t count = epochLatency.getCount(), p99 = count ? epochLatency.percentile(99) : 0;
+    epochLatency.reset();
+    epochStart = now;
+    foregroundP99Ns = p99;
+    if (!targetP99Ns || stale) {
+        for (auto &bucket : buckets)
+            bucket.epochBytes = 0;
+        return;
+    }
+
+    uint64_t remote = remoteP99 ? remoteP99() : 0;
+    p99 = lastP99Ns = std::max(p99, remote);
+    bool over = (p99 > targetP99Ns), busy = false;
+    for (int c = (int)TrafficClass::Rebuild; c < (int)TrafficClass::Count; ++c) {
+        Bucket &bucket = buckets[c];
+        double used = bucket.epochBytes / seconds;
+        bucket.epochBytes = 0;
+        busy |= (used > 0);
+        if (over) {
+            if (used > 0)
+                bucket.rate = std::max(MinRate, std::min(bucket.rate, used) / 2);
+        }
+        else
+            bucket.rate = std::min(bucket.ceiling, std::max(MinRate, bucket.rate * (count || remote ? 1.25 : 2)));
+    }
+    /* Epochs may also end on getForegroundP99(), without background I/O to back off */
+    over &= busy;
+    backoffs += over;
+    if (over && !backingOff)
+        d_info("qos: foreground p99 %.1f us over %.1f us, rebuild at %.1f MB/s, scrub at %.1f MB/s", p99 / 1e3,
+               targetP99Ns / 1e3, buckets[(int)TrafficClass::Rebuild].rate / 1e6,
+               buckets[(int)TrafficClass::Scrub].rate / 1e6);
+    backingOff = over;
+}
+
+QoS::ClassStats QoS::getStats(TrafficClass cls) const
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    const Bucket &bucket = buckets[(int)cls];
+    ClassStats stats;
+    stats.ops = bucket.ops;
+    stats.bytes = bucket.bytes;
+    stats.p50Ns = latency[(int)cls].percentile(50);
+    stats.p99Ns = latency[(int)cls].percentile(99);
+    stats.rate = bucket.rate;
+    stats.throttledSec = bucket.throttledSec;
+    return stats;
+}
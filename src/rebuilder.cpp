@@ -0,0 +1,661 @@
+#include <rebuilder.hpp>
+#include <debug.hpp>
+
+using namespace std::chrono;
+
+/**
+ * Chunks in flight are bounded so that their reads (2 per source) leave half of the send CQ
+ * to others. Fragments are placed on nodes [0, N) (see ECAL::getDataPos), so other nodes
+ * have nothing to rebuild.
+ */
+Rebuilder::Rebuilder(ECAL *ecal, int threads, int depth)
+    : ecal(ecal), threads(std::max(threads, 1))
+{
+    self = myNodeConf->id < N ? myNodeConf->id : -1;
+    depth = std::min(std::max(depth, 1), MAX_QP_DEPTH / (4 * K));
+
+    const size_t fragBytes = ChunkRows * BlockTy::size, chunkBytes = fragBytes + ChunkRows * sizeof(uint32_t);
+    size_t size = (size_t)depth * K * chunkBytes;
+    expectZero(posix_memalign(reinterpret_cast<void **>(&buffer), 4096, size));
+    expectNonZero(bufferMR = ecal->rdma->allocMR(buffer, size, IBV_ACCESS_LOCAL_WRITE));
+
+    chunks.resize(depth);
+    for (int c = 0; c < depth; ++c)
+        for (int i = 0; i < K; ++i) {
+            uint8_t *base = buffer + ((size_t)c * K + i) * chunkBytes;
+            chunks[c].frags[i] = base;
+            chunks[c].checksums[i] = reinterpret_cast<uint32_t *>(base + fragBytes);
+        }
+}
+
+Rebuilder::~Rebuilder()
+{
+    if (bufferMR)
+        ibv_dereg_mr(bufferMR);
+    if (dirtyMR)
+        ibv_dereg_mr(dirtyMR);
+    free(buffer);
+    free(dirtyBuffer);
+}
+
+Rebuilder::Stats Rebuilder::getStats() const
+{
+    Stats stats;
+    stats.rowsRebuilt = rowsRebuilt;
+    stats.rowsFailed = rowsFailed;
+    stats.chunksRetried = chunksRetried;
+    stats.bytesRead = bytesRead;
+    stats.bytesWritten = stats.rowsRebuilt * BlockTy::size;
+    stats.seconds = duration_cast<duration<double>>(endTime - startTime).count();
+    stats.gbPerSec = stats.seconds > 0 ? stats.bytesWritten / stats.seconds / 1e9 : 0;
+    return stats;
+}
+
+bool Rebuilder::rebuild(uint64_t first, uint64_t count)
+{
+    if (self < 0) {
+        d_info("rebuild: node %d holds no fragments", myNodeConf->id);
+        return true;
+    }
+    uint64_t end = std::min(first + count, ecal->getRowCount());
+    d_info("rebuild: rows [%lu, %lu) with %d threads, %lu chunks of %d rows in flight", first, end,
+           threads, chunks.size(), ChunkRows);
+
+    begin();
+    uint64_t next = first;
+    run([&](uint64_t &row, int &rows) {
+        if (next >= end)
+            return false;
+        row = next;
+        rows = (int)std::min<uint64_t>(ChunkRows, end - next);
+        next += rows;
+        return true;
+    });
+    return report();
+}
+
+/**
+ * Rebuild the rows that live nodes wrote while this node was dead, as their dirty maps tell,
+ * in chunks holding at least one of them. Their bits are cleared first, so that rows marked
+ * while they are rebuilt stay dirty, and those that fail are marked again. Rounds go on while
+ * rows are marked meanwhile, by writes that were already skipping this node when it came back.
+ */
+bool Rebuilder::rebuildDirty()
+{
+    if (self < 0) {
+        d_info("rebuild: node %d holds no fragments", myNodeConf->id);
+        return true;
+    }
+    if (!ecal->rdma->hasGlobalAtomics())
+        d_warn("rebuild: device atomics are not atomic with CPU ones, rows marked while clearing may be lost");
+
+    begin();
+    uint64_t nChunks = (ecal->getRowCount() + ChunkRows - 1) / ChunkRows;
+    std::vector<uint64_t> merged(DirtyMap::leafWords(ecal->getRowCount()));
+    for (int round = 0; round < MaxRounds; ++round) {
+        std::fill(merged.begin(), merged.end(), 0);
+        uint64_t dirty = fetchDirty(merged.data());
+        d_info("rebuild: round %d, %lu dirty rows from %lu dirty map words", round, dirty, dirtyWords.size());
+        if (!dirty)
+            break;
+        clearDirty(merged.data());
+
+        /* ChunkRows divides 64: a chunk is a slice of a leaf word */
+        static_assert(64 % ChunkRows == 0, "chunks straddle dirty map words");
+        const uint64_t chunkMask = (ChunkRows == 64) ? ~0ULL : (1ULL << ChunkRows) - 1;
+        uint64_t c = 0;
+        run([&](uint64_t &row, int &rows) {
+            while (c < nChunks && !(merged[c * ChunkRows / 64] >> (c * ChunkRows % 64) & chunkMask))
+                ++c;
+            if (c == nChunks)
+                return false;
+            row = c++ * ChunkRows;
+            rows = (int)std::min<uint64_t>(ChunkRows, ecal->getRowCount() - row);
+            return true;
+        });
+        remarkFailed();
+    }
+    return report();
+}
+
+/**
+ * Catch up with the writes that skipped this node while it was fenced, once peers write to it
+ * again (as it reports it is catching up). Rows are rebuilt one chunk at a time, with their
+ * stripe locks held, so that no write of theirs lands between the read of their sources and
+ * the store of the rebuilt fragment. Needs stripe locks and dirty maps on every node.
+ */
+bool Rebuilder::catchUp()
+{
+    if (self < 0)
+        return true;
+    if (!ecal->stripeLocks) {
+        d_err("rebuild: cannot catch up with writes without STRIPE_LOCKS");
+        return false;
+    }
+
+    auto *rdma = ecal->rdma;
+    rdma->setPhase(NodePhase::CatchingUp);
+    auto deadline = steady_clock::now() + milliseconds(AdmitTimeoutMs);
+    while (!rdma->isWrittenByPeers()) {
+        if (steady_clock::now() > deadline) {
+            d_err("rebuild: peers did not admit writes to this node within %d ms", AdmitTimeoutMs);
+            return false;
+        }
+        std::this_thread::sleep_for(milliseconds(1));
+    }
+
+    begin();
+    std::vector<uint8_t> scratch(N * BlockTy::size);
+    std::vector<uint64_t> merged(DirtyMap::leafWords(ecal->getRowCount()));
+    const uint64_t chunkMask = (ChunkRows == 64) ? ~0ULL : (1ULL << ChunkRows) - 1;
+    Chunk &chunk = chunks[0];
+    uint64_t dirty = 0;
+    for (int round = 0; round < MaxRounds; ++round) {
+        std::fill(merged.begin(), merged.end(), 0);
+        dirty = fetchDirty(merged.data());
+        d_info("rebuild: catch-up round %d, %lu dirty rows", round, dirty);
+        if (!dirty)
+            break;
+        clearDirty(merged.data());
+
+        failedRows.clear();
+        for (uint64_t c = 0; c * ChunkRows < ecal->getRowCount(); ++c) {
+            chunk.row = c * ChunkRows;
+            chunk.rows = (int)std::min<uint64_t>(ChunkRows, ecal->getRowCount() - chunk.row);
+            if (merged[chunk.row / 64] >> (chunk.row % 64) & chunkMask)
+                catchUpChunk(chunk, scratch.data());
+        }
+        remarkFailed();
+    }
+    return report() && !dirty;
+}
+
+/** Fetch and rebuild a chunk in the calling thread, its stripe locks held. */
+void Rebuilder::catchUpChunk(Chunk &chunk, uint8_t *scratch)
+{
+    auto *rdma = ecal->rdma;
+    uint64_t bytes = (uint64_t)K * chunk.rows * (BlockTy::size + sizeof(uint32_t));
+    if (ecal->qos->throttles(TrafficClass::Rebuild))
+        std::this_thread::sleep_until(ecal->qos->reserve(TrafficClass::Rebuild, bytes));
+
+    std::lock_guard<std::mutex> ioLock(ecal->ioMutex);
+    uint64_t rows[ChunkRows], held[ChunkRows];
+    int homes[ChunkRows];
+    for (int r = 0; r < chunk.rows; ++r)
+        rows[r] = chunk.row + r;
+    int nLocked = ecal->lockRows(rows, chunk.rows, homes, held);
+    if (nLocked < chunk.rows) {
+        d_err("rebuild: cannot lock rows [%lu, %lu)", chunk.row, chunk.row + chunk.rows);
+        failRows(chunk.row, chunk.rows);
+        ecal->unlockRows(rows, nLocked, homes, held);
+        return;
+    }
+
+    ibv_wc wc[2 * K];
+    bool fetched = false;
+    for (chunk.attempts = 0; !fetched && chunk.attempts < MaxAttempts; ++chunk.attempts) {
+        if (!postChunk(chunk)) {
+            d_err("rebuild: too many lost fragments to rebuild rows [%lu, %lu)", chunk.row, chunk.row + chunk.rows);
+            break;
+        }
+        if (rdma->pollSendCompletion(wc, 2 * K) == 0)
+            for (int k = 0; k < 2 * K; ++k)
+                chunk.failed |= (wc[k].status != IBV_WC_SUCCESS);
+        else
+            chunk.failed = true;
+        fetched = !chunk.failed;
+        chunksRetried += chunk.failed;
+    }
+    if (fetched)
+        finishChunk(chunk, scratch);
+    else
+        failRows(chunk.row, chunk.rows);
+    ecal->unlockRows(rows, nLocked, homes, held);
+}
+
+void Rebuilder::begin()
+{
+    startTime = steady_clock::now();
+    rowsRebuilt = rowsFailed = chunksRetried = bytesRead = mapsLost = 0;
+}
+
+void Rebuilder::failRows(uint64_t row, int rows)
+{
+    rowsFailed += rows;
+    std::lock_guard<std::mutex> lock(failedMutex);
+    for (int r = 0; r < rows; ++r)
+        failedRows.push_back(row + r);
+}
+
+bool Rebuilder::report()
+{
+    endTime = steady_clock::now();
+    auto stats = getStats();
+    d_info("rebuild: %lu rows (%.2f GB) rebuilt in %.2f s, %.2f GB/s, %lu failed, %lu chunks retried",
+           stats.rowsRebuilt, stats.bytesWritten / 1e9, stats.seconds, stats.gbPerSec, stats.rowsFailed,
+           stats.chunksRetried);
+    return stats.rowsFailed == 0 && mapsLost == 0;
+}
+
+/**
+ * The calling thread posts the reads of the chunks `nextChunk` gives while it has free
+ * buffers, and polls their completions. Completions of a peer come in the order of its reads
+ * (one QP per peer), so each one is matched with the oldest chunk read from that peer.
+ * Fetched chunks are handed to the workers, which return their buffers once stored.
+ *
+ * If QoS throttles the rebuild, chunks are fetched in slices of up to `depth` chunks, each
+ * ending early when the rebuild bucket runs into debt. ioMutex is released between slices,
+ * for foreground I/O to get in, until the debt is paid back.
+ */
+void Rebuilder::run(const std::function<bool(uint64_t &, int &)> &nextChunk)
+{
+    auto *rdma = ecal->rdma;
+    bool sliced = ecal->qos->throttles(TrafficClass::Rebuild), sliceDone = false;
+    size_t sliceChunks = 0;
+    steady_clock::time_point resume;
+    finished = false;
+    failedRows.clear();
+    freeChunks.clear();
+    for (auto &chunk : chunks)
+        freeChunks.push_back(&chunk);
+    for (int t = 0; t < threads; ++t)
+        workers.emplace_back(&Rebuilder::work, this);
+
+    std::deque<Chunk *> posted[N], retries;
+    std::vector<ibv_wc> wc(chunks.size() * K * 2);
+    uint64_t row;
+    int rows, inflight = 0;
+    bool more = true;
+    std::unique_lock<std::mutex> ioLock(ecal->ioMutex);
+    while (true) {
+        /* Keep all free buffers busy */
+        while (!sliceDone && (more || !retries.empty())) {
+            Chunk *chunk;
+            if (!retries.empty()) {
+                chunk = retries.front();
+                retries.pop_front();
+            }
+            else {
+                std::unique_lock<std::mutex> lock(queueMutex);
+                if (freeChunks.empty() && inflight)
+                    break;
+                freeCondVar.wait(lock, [this] { return !freeChunks.empty(); });
+                lock.unlock();
+                if (!(more = nextChunk(row, rows)))
+                    break;
+                lock.lock();
+                chunk = freeChunks.back();
+                freeChunks.pop_back();
+                lock.unlock();
+
+                chunk->row = row;
+                chunk->rows = rows;
+                chunk->attempts = 0;
+                if (sliced) {
+                    resume = ecal->qos->reserve(TrafficClass::Rebuild,
+                                                (uint64_t)K * rows * (BlockTy::size + sizeof(uint32_t)));
+                    sliceDone = (++sliceChunks == chunks.size() || resume > steady_clock::now());
+                }
+            }
+            if (!postChunk(*chunk)) {
+                d_err("rebuild: too many lost fragments to rebuild rows [%lu, %lu)", chunk->row,
+                      chunk->row + chunk->rows);
+                failRows(chunk->row, chunk->rows);
+                std::lock_guard<std::mutex> lock(queueMutex);
+                freeChunks.push_back(chunk);
+                continue;
+            }
+            for (int i = 0; i < K; ++i) {
+                posted[chunk->srcId[i]].push_back(chunk);
+                posted[chunk->srcId[i]].push_back(chunk);
+            }
+            inflight += 2 * K;
+        }
+        if (!inflight) {
+            if (!sliceDone)
+                break;
+            ioLock.unlock();
+            std::this_thread::sleep_until(resume);
+            std::this_thread::yield();
+            ioLock.lock();
+            sliceDone = false;
+            sliceChunks = 0;
+            continue;
+        }
+
+        int n = rdma->pollSendCompletionAny(wc.data(), inflight);
+        if (n <= 0) {
+            d_err("rebuild: stopped with %d reads in flight", inflight);
+            break;
+        }
+        for (int k = 0; k < n; ++k) {
+            int peerId = WRID_PEER(wc[k].wr_id);
+            if (peerId >= N || posted[peerId].empty()) {
+                d_err("rebuild: unexpected completion from peer %d", peerId);
+                continue;
+            }
+            Chunk *chunk = posted[peerId].front();
+            posted[peerId].pop_front();
+            --inflight;
+            chunk->failed |= (wc[k].status != IBV_WC_SUCCESS);
+            if (--chunk->pending)
+                continue;
+
+            if (!chunk->failed) {
+                std::lock_guard<std::mutex> lock(queueMutex);
+                readyChunks.push_back(chunk);
+                readyCondVar.notify_one();
+            }
+            else if (++chunk->attempts < MaxAttempts) {
+                ++chunksRetried;
+                retries.push_back(chunk);
+            }
+            else {
+                d_err("rebuild: cannot fetch rows [%lu, %lu)", chunk->row, chunk->row + chunk->rows);
+                failRows(chunk->row, chunk->rows);
+                std::lock_guard<std::mutex> lock(queueMutex);
+                freeChunks.push_back(chunk);
+            }
+        }
+    }
+
+    ioLock.unlock();
+    {
+        std::lock_guard<std::mutex> lock(queueMutex);
+        finished = true;
+    }
+    readyCondVar.notify_all();
+    for (auto &worker : workers)
+        worker.join();
+    workers.clear();
+}
+
+/**
+ * Fetch the maps that live nodes keep of this node: their summaries, then the leaf words under
+ * set summary bits (a read per run of them), and OR the leaves into `merged`. Nonzero leaf
+ * words are remembered for clearDirty(). Returns the number of dirty rows merged.
+ */
+uint64_t Rebuilder::fetchDirty(uint64_t *merged)
+{
+    std::lock_guard<std::mutex> ioLock(ecal->ioMutex);
+    auto *rdma = ecal->rdma;
+    const uint64_t rows = ecal->getRowCount();
+    const uint64_t summaryWords = DirtyMap::summaryWords(rows), mapWords = DirtyMap::mapWords(rows);
+    const int nodes = clusterConf->getClusterSize();
+    if (!dirtyBuffer) {
+        size_t size = (size_t)nodes * mapWords * sizeof(uint64_t);
+        expectZero(posix_memalign(reinterpret_cast<void **>(&dirtyBuffer), 4096, size));
+        expectNonZero(dirtyMR = rdma->allocMR(dirtyBuffer, size, IBV_ACCESS_LOCAL_WRITE));
+    }
+    uint64_t mapShift = ecal->allocTable->getShift(ecal->dirtyMap->mapOf(self));
+    std::vector<ibv_wc> wc(DirtyBatch);
+    std::vector<char> asked(nodes), fetched(nodes);
+    int posted = 0;
+    auto drain = [&] {
+        if (posted && rdma->pollSendCompletion(wc.data(), posted) == 0)
+            for (int k = 0; k < posted; ++k)
+                if (wc[k].status != IBV_WC_SUCCESS)
+                    fetched[WRID_PEER(wc[k].wr_id)] = false;
+        posted = 0;
+    };
+
+    for (int p = 0; p < nodes; ++p) {
+        asked[p] = fetched[p] = (p != myNodeConf->id && rdma->isPeerAlive(p));
+        if (asked[p]) {
+            rdma->postRead(p, mapShift, dirtyBuffer + p * mapWords, summaryWords * sizeof(uint64_t), dirtyMR);
+            if (++posted == DirtyBatch)
+                drain();
+        }
+    }
+    drain();
+
+    for (int p = 0; p < nodes; ++p) {
+        const uint64_t *summary = dirtyBuffer + p * mapWords;
+        for (uint64_t w = 0, end = 0; fetched[p] && w < summaryWords * 64; w = end) {
+            /* Next run of set summary bits */
+            while (w < summaryWords * 64 && !(summary[w / 64] >> w % 64 & 1))
+                ++w;
+            for (end = w; end < summaryWords * 64 && summary[end / 64] >> end % 64 & 1; )
+                ++end;
+            end = std::min(end, DirtyMap::leafWords(rows));
+            if (w >= end)
+                break;
+            rdma->postRead(p, mapShift + (summaryWords + w) * sizeof(uint64_t),
+                           dirtyBuffer + p * mapWords + summaryWords + w, (end - w) * sizeof(uint64_t), dirtyMR);
+            if (++posted == DirtyBatch)
+                drain();
+        }
+    }
+    drain();
+
+    uint64_t dirty = 0;
+    dirtyWords.clear();
+    for (int p = 0; p < nodes; ++p) {
+        if (!asked[p])
+            continue;
+        if (!fetched[p]) {
+            d_err("rebuild: cannot fetch the dirty map of node %d, its rows are not rebuilt", p);
+            ++mapsLost;
+            continue;
+        }
+        const uint64_t *summary = dirtyBuffer + p * mapWords, *leaf = summary + summaryWords;
+        for (uint64_t s = 0; s < summaryWords; ++s)
+            for (uint64_t bits = summary[s]; bits; bits &= bits - 1) {
+                uint64_t w = s * 64 + __builtin_ctzll(bits);
+                if (leaf[w]) {
+                    merged[w] |= leaf[w];
+                    dirtyWords.push_back({ p, w, leaf[w] });
+                }
+            }
+    }
+    for (uint64_t w = 0; w < DirtyMap::leafWords(rows); ++w)
+        dirty += __builtin_popcountll(merged[w]);
+    return dirty;
+}
+
+/**
+ * Clear the leaf words fetched by the last fetchDirty() in the maps of their nodes, before
+ * their rows are rebuilt. RDMA has no swap: words are cleared with CASes from the values read,
+ * retried from the values found, whose new bits are merged into `merged` to be rebuilt too.
+ * The values cleared are kept, to mark the rows that fail again. Words that cannot be cleared
+ * stay dirty.
+ */
+void Rebuilder::clearDirty(uint64_t *merged)
+{
+    std::lock_guard<std::mutex> ioLock(ecal->ioMutex);
+    auto *rdma = ecal->rdma;
+    const uint64_t summaryWords = DirtyMap::summaryWords(ecal->getRowCount());
+    uint64_t mapShift = ecal->allocTable->getShift(ecal->dirtyMap->mapOf(self));
+    uint64_t *results = rdma->getAtomicResults();
+    std::vector<ibv_wc> wc(DirtyBatch);
+    std::vector<size_t> pending(dirtyWords.size()), changed;
+    for (size_t i = 0; i < pending.size(); ++i)
+        pending[i] = i;
+    uint64_t retries = 0;
+    while (!pending.empty()) {
+        changed.clear();
+        for (size_t first = 0; first < pending.size(); first += DirtyBatch) {
+            int n = (int)std::min<size_t>(DirtyBatch, pending.size() - first);
+            for (int k = 0; k < n; ++k) {
+                auto &word = dirtyWords[pending[first + k]];
+                rdma->postCompareSwap(word.node, mapShift + (summaryWords + word.index) * sizeof(uint64_t),
+                                      results + k, word.value, 0);
+            }
+            rdma->pollSendCompletion(wc.data(), n);
+            for (int k = 0; k < n; ++k) {
+                auto &word = dirtyWords[pending[first + k]];
+                if (wc[k].status != IBV_WC_SUCCESS)
+                    word.value = 0;
+                else if (results[k] != word.value) {
+                    word.value = results[k];
+                    merged[word.index] |= results[k];
+                    changed.push_back(pending[first + k]);
+                }
+            }
+        }
+        retries += changed.size();
+        pending.swap(changed);
+    }
+    if (retries)
+        d_info("rebuild: %lu dirty map words changed while clearing", retries);
+}
+
+/**
+ * Mark the rows that the last run() failed to rebuild again, in the maps that clearDirty()
+ * cleared them from: leaf bits first, then their summary bits (see DirtyMap).
+ */
+void Rebuilder::remarkFailed()
+{
+    if (failedRows.empty())
+        return;
+    std::sort(failedRows.begin(), failedRows.end());
+    const uint64_t summaryWords = DirtyMap::summaryWords(ecal->getRowCount());
+    uint64_t mapShift = ecal->allocTable->getShift(ecal->dirtyMap->mapOf(self));
+    std::vector<WordOr> leaves, summaries;
+    for (auto &word : dirtyWords) {
+        auto it = std::lower_bound(failedRows.begin(), failedRows.end(), word.index * 64);
+        uint64_t bits = 0;
+        for (; it != failedRows.end() && *it < (word.index + 1) * 64; ++it)
+            bits |= 1ULL << *it % 64;
+        if (!(bits &= word.value))
+            continue;
+        leaves.push_back({ word.node, mapShift + (summaryWords + word.index) * sizeof(uint64_t), bits, 0 });
+        summaries.push_back({ word.node, mapShift + word.index / 64 * sizeof(uint64_t), 1ULL << word.index % 64, 0 });
+    }
+    orWords(leaves);
+    orWords(summaries);
+    d_info("rebuild: %lu failed rows marked dirty again", failedRows.size());
+}
+
+/** Set bits in words of peers, with CASes retried from the values found until they are set. */
+void Rebuilder::orWords(std::vector<WordOr> &ors)
+{
+    std::lock_guard<std::mutex> ioLock(ecal->ioMutex);
+    auto *rdma = ecal->rdma;
+    uint64_t *results = rdma->getAtomicResults();
+    std::vector<ibv_wc> wc(DirtyBatch);
+    std::vector<WordOr> changed;
+    while (!ors.empty()) {
+        changed.clear();
+        for (size_t first = 0; first < ors.size(); first += DirtyBatch) {
+            int n = (int)std::min<size_t>(DirtyBatch, ors.size() - first);
+            for (int k = 0; k < n; ++k) {
+                auto &word = ors[first + k];
+                rdma->postCompareSwap(word.node, word.shift, results + k, word.expected, word.expected | word.bits);
+            }
+            rdma->pollSendCompletion(wc.data(), n);
+            for (int k = 0; k < n; ++k) {
+                auto &word = ors[first + k];
+                if (wc[k].status != IBV_WC_SUCCESS)
+                    d_err("rebuild: cannot mark rows dirty again on node %d", word.node);
+                else if (results[k] != word.expected && (results[k] & word.bits) != word.bits) {
+                    word.expected = results[k];
+                    changed.push_back(word);
+                }
+            }
+        }
+        ors.swap(changed);
+    }
+}
+
+/** Pick K live sources, and post the reads of their fragments and checksums of a chunk. */
+bool Rebuilder::postChunk(Chunk &chunk)
+{
+    bool alive[N];
+    for (int j = 0; j < N; ++j)
+        alive[j] = (j != self && ecal->rdma->isPeerAlive(j));
+    if (!ECAL::CodeTy::selectSources(alive, chunk.srcId))
+        return false;
+
+    uint64_t blockShift = ecal->getBlockShift(chunk.row);
+    uint64_t checksumShift = ecal->getChecksumShift(chunk.row);
+    for (int i = 0; i < K; ++i) {
+        ecal->rdma->postRead(chunk.srcId[i], blockShift, chunk.frags[i], chunk.rows * BlockTy::size, bufferMR);
+        ecal->rdma->postRead(chunk.srcId[i], checksumShift, chunk.checksums[i], chunk.rows * sizeof(uint32_t),
+                             bufferMR);
+    }
+    chunk.pending = 2 * K;
+    chunk.failed = false;
+    bytesRead += (uint64_t)K * chunk.rows * (BlockTy::size + sizeof(uint32_t));
+    return true;
+}
+
+/**
+ * Verify the sources of each row of a fetched chunk, decode the lost data fragments from them
+ * (re-encoding the parities if this node holds one), and stream this node's fragment and its
+ * checksum into the pool.
+ *
+ * @param scratch       N fragments of the worker.
+ */
+void Rebuilder::finishChunk(Chunk &chunk, uint8_t *scratch)
+{
+    const size_t size = BlockTy::size;
+    int failed = 0;
+    for (int r = 0; r < chunk.rows; ++r) {
+        uint64_t row = chunk.row + r;
+        uint8_t *lines[N] = { nullptr };
+        bool intact = true;
+        for (int i = 0; i < K; ++i) {
+            lines[chunk.srcId[i]] = chunk.frags[i] + r * size;
+            if (fragmentChecksum(lines[chunk.srcId[i]], size) != chunk.checksums[i][r]) {
+                d_warn("rebuild: checksum mismatch on fragment %d of row %lu", chunk.srcId[i], row);
+                intact = false;
+            }
+        }
+        if (!intact) {
+            ++failed;
+            failRows(row, 1);
+            continue;
+        }
+
+        bool dataLost = false;
+        for (int j = 0; j < K; ++j)
+            if (!lines[j]) {
+                lines[j] = scratch + j * size;
+                dataLost = true;
+            }
+        if (dataLost && !ECAL::CodeTy::decode(chunk.srcId, lines)) {
+            d_warn("rebuild: cannot decode row %lu", row);
+            ++failed;
+            failRows(row, 1);
+            continue;
+        }
+
+        uint8_t *out = lines[self];
+        if (self >= K) {
+            uint8_t *parity[N - K];
+            for (int j = 0; j < N - K; ++j)
+                parity[j] = scratch + (K + j) * size;
+            ECAL::CodeTy::encode(lines, parity);
+            out = parity[self - K];
+        }
+        *ecal->getLocalChecksum(row) = fragmentChecksum(out, size);
+        streamCopy(ecal->allocTable->at(row), out, size);
+    }
+    /* Orders the streamed fragments too */
+    persistRange(ecal->getLocalChecksum(chunk.row), chunk.rows * sizeof(uint32_t));
+
+    rowsRebuilt += chunk.rows - failed;
+}
+
+void Rebuilder::work()
+{
+    std::vector<uint8_t> scratch(N * BlockTy::size);
+    while (true) {
+        Chunk *chunk;
+        {
+            std::unique_lock<std::mutex> lock(queueMutex);
+            readyCondVar.wait(lock, [this] { return !readyChunks.empty() || finished; });
+            if (readyChunks.empty())
+                return;
+            chunk = readyChunks.front();
+            readyChunks.pop_front();
+        }
+        finishChunk(*chunk, scratch.data());
+        {
+            std::lock_guard<std::mutex> lock(queueMutex);
+            freeChunks.push_back(chunk);
+        }
+        freeCondVar.notify_one();
+    }
+}
@@ -0,0 +1,129 @@
+#include <scrubber.hpp>
+#include <debug.hpp>
+
+using namespace std::chrono;
+
+/**
+ * Each row costs N fragment reads of ECAL::BlockTy::size bytes. The budgets are the ceiling of
+ * the scrub class of QoS, which paces the scrubber, and may slow it down further.
+ */
+Scrubber::Scrubber(ECAL *ecal, int mbps, int iops) : ecal(ecal)
+{
+    budget = std::max(mbps, 1) * 1e6;
+    if (iops > 0)
+        budget = std::min(budget, (double)iops * ECAL::BlockTy::size);
+    ecal->getQoS()->setCeiling(TrafficClass::Scrub, budget);
+
+    uint64_t rows = ecal->getRowCount();
+    uint64_t self = myNodeConf->id % ECAL::N;
+    passRows = rows > self ? (rows - self + ECAL::N - 1) / ECAL::N : 0;
+}
+
+Scrubber::~Scrubber()
+{
+    stop();
+}
+
+void Scrubber::start()
+{
+    if (shouldRun)
+        return;
+    d_info("scrubber: %lu rows per pass, up to %.1f MB/s", passRows, budget / 1e6);
+    shouldRun = true;
+    startTime = steady_clock::now();
+    worker = std::thread(&Scrubber::run, this);
+}
+
+void Scrubber::stop()
+{
+    {
+        std::lock_guard<std::mutex> lock(stopMutex);
+        shouldRun = false;
+    }
+    stopCondVar.notify_all();
+    if (worker.joinable())
+        worker.join();
+}
+
+Scrubber::Stats Scrubber::getStats() const
+{
+    Stats stats;
+    stats.passes = passes;
+    stats.passProgress = passProgress;
+    stats.passRows = passRows;
+    stats.rowsScrubbed = rowsScrubbed;
+    stats.rowsRepaired = rowsRepaired;
+    stats.rowsUnrepairable = rowsUnrepairable;
+    stats.rowsSkipped = rowsSkipped;
+    stats.fragmentsRepaired = fragmentsRepaired;
+    stats.bytesRead = bytesRead;
+
+    double seconds = duration_cast<duration<double>>(steady_clock::now() - startTime).count();
+    stats.rowsPerSec = seconds > 0 ? stats.rowsScrubbed / seconds : 0;
+    stats.mbPerSec = seconds > 0 ? stats.bytesRead / seconds / 1e6 : 0;
+    return stats;
+}
+
+void Scrubber::run()
+{
+    uint64_t rows = ecal->getRowCount();
+    uint64_t self = myNodeConf->id % ECAL::N;
+    const uint64_t rowBytes = (uint64_t)ECAL::N * ECAL::BlockTy::size;
+
+    while (shouldRun) {
+        passProgress = 0;
+        for (uint64_t row = self; row < rows && shouldRun; row += ECAL::N) {
+            auto next = ecal->getQoS()->reserve(TrafficClass::Scrub, rowBytes);
+            if (next > steady_clock::now()) {
+                std::unique_lock<std::mutex> lock(stopMutex);
+                stopCondVar.wait_until(lock, next, [this] { return !shouldRun; });
+                if (!shouldRun)
+                    break;
+            }
+            scrub(row);
+            ++passProgress;
+        }
+        if (!shouldRun)
+            break;
+
+        ++passes;
+        /* Drop summary bits of dirty rows that recovered peers have rebuilt since */
+        uint64_t dirty = ecal->tidyDirtyMaps();
+        if (dirty)
+            d_info("scrubber: %lu rows still dirty for live peers", dirty);
+        auto stats = getStats();
+        d_info("scrubber: pass %lu done, %lu rows repaired (%lu fragments), %lu unrepairable, "
+               "%lu skipped, %.1f rows/s, %.2f MB/s", stats.passes, stats.rowsRepaired,
+               stats.fragmentsRepaired, stats.rowsUnrepairable, stats.rowsSkipped, stats.rowsPerSec,
+               stats.mbPerSec);
+        if (!passRows) {
+            std::unique_lock<std::mutex> lock(stopMutex);
+            stopCondVar.wait_for(lock, seconds(1), [this] { return !shouldRun; });
+        }
+    }
+}
+
+void Scrubber::scrub(uint64_t row)
+{
+    int repaired = 0;
+    auto result = ecal->scrubRow(row, repaired);
+
+    ++rowsScrubbed;
+    switch (result) {
+    case ECAL::ScrubResult::Repaired:
+        ++rowsRepaired;
+        fragmentsRepaired += repaired;
+        bytesRead += 2 * ECAL::N * ECAL::BlockTy::size;     /* Fetched again to confirm */
+        break;
+    case ECAL::ScrubResult::Unrepairable:
+        ++rowsUnrepairable;
+        bytesRead += ECAL::N * ECAL::BlockTy::size;
+        break;
+    case ECAL::ScrubResult::Skipped:
+        ++rowsSkipped;
+        break;
+    default:
+        bytesRead += ECAL::N * ECAL::BlockTy::size;
+        break;
+    }
+}
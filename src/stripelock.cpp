@@ -0,0 +1,244 @@
+#include <stripelock.hpp>
+#include <debug.hpp>
+
+#include <algorithm>
+
+using namespace std::chrono;
+
+StripeLocks::StripeLocks(RDMASocket *rdma, uint64_t *localWords, uint64_t wordShift)
+    : rdma(rdma), localWords(localWords), wordShift(wordShift)
+{
+    if (!rdma->hasGlobalAtomics())
+        d_warn("stripe locks: device atomics are not atomic with CPU ones, local lock words may race");
+}
+
+/**
+ * One round of CASes on rows idx[0 .. n), all in flight together. `old` gets the words found,
+ * and `ok` whether each CAS completed: a failed one may or may not have swapped its word.
+ */
+void StripeLocks::compareSwap(const uint64_t *rows, const int *homes, const int *idx, int n,
+                              const uint64_t *expected, const uint64_t *desired, uint64_t *old, bool *ok)
+{
+    uint64_t *results = rdma->getAtomicResults();
+    int wrCnt = 0;
+    for (int k = 0; k < n; ++k) {
+        int i = idx[k];
+        ok[k] = true;
+        if (homes[i] == myNodeConf->id) {
+            old[k] = expected[k];
+            __atomic_compare_exchange_n(localWords + rows[i], &old[k], desired[k], false,
+                                        __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+        }
+        else {
+            rdma->postCompareSwap(homes[i], wordShift + rows[i] * sizeof(uint64_t), results + k,
+                                  expected[k], desired[k]);
+            ++wrCnt;
+        }
+    }
+    if (!wrCnt) {
+        ++stats.rounds;
+        return;
+    }
+
+    /* Completions only name their peer: all CASes homed on a peer with a failed one fail */
+    ibv_wc wc[MaxBatch];
+    int failedHomes[MaxBatch], nFailed = 0;
+    rdma->pollSendCompletion(wc, wrCnt);
+    for (int j = 0; j < wrCnt; ++j) {
+        int peerId = WRID_PEER(wc[j].wr_id);
+        if (wc[j].status != IBV_WC_SUCCESS &&
+            std::find(failedHomes, failedHomes + nFailed, peerId) == failedHomes + nFailed) {
+            d_warn("stripe lock CAS on node %d failed: %s", peerId, ibv_wc_status_str(wc[j].status));
+            failedHomes[nFailed++] = peerId;
+        }
+    }
+    for (int k = 0; k < n; ++k) {
+        int home = homes[idx[k]];
+        if (home == myNodeConf->id)
+            continue;
+        ok[k] = std::find(failedHomes, failedHomes + nFailed, home) == failedHomes + nFailed;
+        old[k] = results[k];
+    }
+    stats.failedCas += std::count(ok, ok + n, false);
+    ++stats.rounds;
+}
+
+/**
+ * Each round CASes every row not held yet against the word it is expected to have: the
+ * hinted word at first, then the word found by the last CAS, or the word the holder will
+ * leave if it was locked. Locks above the first row still missing are then dropped, and the
+ * caller backs off (spinning, up to 100us) if that row is locked by a live node. Rows whose
+ * CAS fails are given up: the word may be left locked by this node, which releases it once
+ * its home is reachable again, or breaks it when it locks the row again.
+ */
+int StripeLocks::lock(uint64_t *rows, int *homes, int count, uint64_t *held)
+{
+    if (count > MaxBatch) {
+        d_err("cannot lock %d rows at once", count);
+        return 0;
+    }
+    if (!unreleased.empty())
+        releaseLeftovers();
+
+    const int me = myNodeConf->id;
+    uint64_t expected[MaxBatch], desired[MaxBatch], old[MaxBatch];
+    int idx[MaxBatch];
+    bool locked[MaxBatch], failed[MaxBatch], busy[MaxBatch], ok[MaxBatch];
+    for (int i = 0; i < count; ++i) {
+        held[i] = hints[rows[i] % NHints];
+        locked[i] = failed[i] = false;
+    }
+
+    auto backoff = nanoseconds(500);
+    int first = 0;
+    while (first < count) {
+        int n = 0;
+        for (int i = first; i < count; ++i) {
+            if (locked[i] || failed[i])
+                continue;
+            idx[n] = i;
+            expected[n] = held[i];
+            desired[n] = nextWord(held[i], me);
+            ++n;
+        }
+        compareSwap(rows, homes, idx, n, expected, desired, old, ok);
+
+        for (int k = 0; k < n; ++k) {
+            int i = idx[k];
+            busy[i] = false;
+            if (!ok[k]) {
+                failed[i] = true;
+                leave(rows, homes, i, desired[k]);
+            }
+            else if (old[k] == expected[k]) {
+                locked[i] = true;
+                held[i] = desired[k];
+                stats.broken += isLocked(expected[k]);
+            }
+            else if (!isLocked(old[k])) {
+                ++stats.staleVersions;
+                held[i] = old[k];
+            }
+            else if (holderOf(old[k]) == me || !rdma->isPeerConnected(holderOf(old[k]))) {
+                d_warn("breaking stripe lock of row %lu held by dead node %d", rows[i], holderOf(old[k]));
+                held[i] = old[k];
+            }
+            else {
+                ++stats.conflicts;
+                busy[i] = true;
+                held[i] = nextWord(old[k], -1);
+            }
+        }
+
+        int f = first;
+        while (f < count && (locked[f] || failed[f]))
+            ++f;
+        if (f == count)
+            break;
+
+        /* Only wait for a row while holding smaller ones */
+        n = 0;
+        for (int i = f + 1; i < count; ++i) {
+            if (!locked[i])
+                continue;
+            idx[n] = i;
+            expected[n] = held[i];
+            desired[n] = nextWord(held[i], -1);
+            ++n;
+        }
+        if (n) {
+            compareSwap(rows, homes, idx, n, expected, desired, old, ok);
+            for (int k = 0; k < n; ++k) {
+                int i = idx[k];
+                locked[i] = false;
+                held[i] = desired[k];
+                if (!ok[k]) {
+                    failed[i] = true;
+                    leave(rows, homes, i, expected[k]);
+                }
+            }
+        }
+
+        if (busy[f]) {
+            auto until = steady_clock::now() + backoff;
+            while (steady_clock::now() < until);
+            stats.waitNs += backoff.count();
+            backoff = std::min(backoff * 2, duration_cast<nanoseconds>(microseconds(100)));
+        }
+        first = f;
+    }
+
+    int n = 0;
+    for (int i = 0; i < count; ++i) {
+        if (failed[i])
+            continue;
+        rows[n] = rows[i];
+        homes[n] = homes[i];
+        held[n++] = held[i];
+    }
+    stats.acquired += n;
+    return n;
+}
+
+/** Remember that the word of row `i` may be left locked by this node, to release it later */
+void StripeLocks::leave(const uint64_t *rows, const int *homes, int i, uint64_t word)
+{
+    if (unreleased.size() < MaxBatch)
+        unreleased.push_back({ rows[i], homes[i], word });
+}
+
+/**
+ * Release the words maybe left locked by a failed CAS, once their homes are reachable again:
+ * other writers wait for them as long as this node is alive. Kept for later if it fails again.
+ */
+void StripeLocks::releaseLeftovers()
+{
+    uint64_t rows[MaxBatch], expected[MaxBatch], desired[MaxBatch], old[MaxBatch];
+    int homes[MaxBatch], idx[MaxBatch], n = 0;
+    bool ok[MaxBatch];
+    for (auto it = unreleased.begin(); it != unreleased.end();) {
+        if (!rdma->isPeerConnected(it->home)) {
+            ++it;
+            continue;
+        }
+        rows[n] = it->row;
+        homes[n] = it->home;
+        idx[n] = n;
+        expected[n] = it->word;
+        desired[n] = nextWord(it->word, -1);
+        ++n;
+        it = unreleased.erase(it);
+    }
+    if (!n)
+        return;
+
+    compareSwap(rows, homes, idx, n, expected, desired, old, ok);
+    for (int k = 0; k < n; ++k) {
+        if (!ok[k])
+            leave(rows, homes, k, expected[k]);
+        else if (old[k] == expected[k])
+            hints[rows[k] % NHints] = desired[k];
+    }
+}
+
+void StripeLocks::unlock(const uint64_t *rows, const int *homes, int count, const uint64_t *held)
+{
+    uint64_t desired[MaxBatch], old[MaxBatch];
+    int idx[MaxBatch];
+    bool ok[MaxBatch];
+    for (int i = 0; i < count; ++i) {
+        idx[i] = i;
+        desired[i] = nextWord(held[i], -1);
+    }
+    compareSwap(rows, homes, idx, count, held, desired, old, ok);
+
+    for (int i = 0; i < count; ++i) {
+        if (!ok[i]) {
+            leave(rows, homes, i, held[i]);
+            continue;
+        }
+        if (old[i] != held[i])
+            d_warn("stripe lock of row %lu was broken while held", rows[i]);
+        hints[rows[i] % NHints] = desired[i];
+    }
+}